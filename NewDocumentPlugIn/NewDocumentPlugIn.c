@@ -35,10 +35,54 @@
 	OTHER DEALINGS IN THE SOFTWARE.
 */
 
+#include <AvailabilityMacros.h>
 #include <CoreFoundation/CoreFoundation.h>
 #include <ApplicationServices/ApplicationServices.h>
 #include <Carbon/Carbon.h>
 #include <CoreFoundation/CFPlugInCOM.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/xattr.h>
+#include <sys/mman.h>
+#include <sys/event.h>
+#include <sys/file.h>
+#include <math.h>
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 1050
+#include <copyfile.h>
+#endif
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 101200
+#include <sys/clonefile.h>
+#endif
+#if !defined(__ATOMIC_SEQ_CST)
+#include <libkern/OSAtomic.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// Mac OS X 10.4 has no calls relative to a directory descriptor: the system
+// compatibility functions emulate them with paths there
+#if !defined(AT_FDCWD)
+#define AT_FDCWD -2
+#define AT_SYMLINK_NOFOLLOW 0x0020
+#define AT_REMOVEDIR 0x0080
+#endif
+#if !defined(O_DIRECTORY)
+#define O_DIRECTORY 0
+#endif
 
 #include "NewDocumentPlugIn.h"
 
@@ -49,10 +93,133 @@
 
 // Cached reference to self bundle - use GetSelfBundle() to retrieve it.
 static CFBundleRef gSelfBundle;
+static pthread_once_t gSelfBundleOnce = PTHREAD_ONCE_INIT;
+
+// Number of live instances of the plugin : the shared state is torn down with
+// the last one. Only used by the host thread.
+static UInt32 gInstancesCount;
+
+// Time spent loading the plugin (in microseconds), whether the cold start
+// budget has been checked, and whether the warm-up thread has been started.
+// Only used by the host thread.
+static SInt64 gLoadTime;
+static Boolean gColdStartChecked;
+static Boolean gWarmUpStarted;
+
+// Background threads (warm-up, spool service, templates synchronization and
+// metrics exporter), joined when the last instance goes away, and whether
+// they must stop. A byte written to the stop pipe wakes them up then. Only
+// changed by the host thread.
+static pthread_t gBackgroundThreads[kNewDocumentPlugInBackgroundThreads];
+static int gBackgroundThreadsCount;
+static volatile Boolean gBackgroundThreadsStopping;
+static int gBackgroundStopPipe[2] = { -1, -1 };
 
 // Cached reference to the global scripting component - use GetScriptingComponent to
 // retrieve it.
 static ComponentInstance gScriptingComponent;
+static CFAbsoluteTime gScriptingComponentLastUse;
+
+// Templates manifest, and the names of the templates it lists. Protected by
+// gTemplatesManifestMutex.
+static CFDictionaryRef gTemplatesManifest;
+static CFArrayRef gTemplatesNames;
+static CFAbsoluteTime gTemplatesManifestCheckDate;
+static CFStringRef gTemplatesPath;
+static pthread_mutex_t gTemplatesManifestMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// State of the manifest rebuilds : whether a thread is rebuilding it, the
+// number of rebuilds so far, and whether the warm-up thread refreshes it and
+// has been asked to. Signaled by gTemplatesManifestCondition when it changes.
+// Protected by gTemplatesManifestMutex.
+static Boolean gTemplatesManifestBuilding;
+static UInt32 gTemplatesManifestBuilds;
+static Boolean gTemplatesManifestRefresherRunning;
+static Boolean gTemplatesManifestRefreshRequested;
+static pthread_cond_t gTemplatesManifestCondition = PTHREAD_COND_INITIALIZER;
+
+// Templates descriptor table built from gTemplatesManifest, and the date it
+// was last used. Protected by gTemplatesManifestMutex.
+static TemplateTable *gTemplateTable;
+static CFAbsoluteTime gTemplatesLastUse;
+
+// Timer trimming the caches while the host is idle.
+static CFRunLoopTimerRef gCachesTrimmingTimer;
+
+// Mapped usage statistics of the templates, or NULL if they can't be mapped.
+static TemplateUsageFile *gTemplateUsage;
+static pthread_once_t gTemplateUsageOnce = PTHREAD_ONCE_INIT;
+
+// Templates content cache, most recently used entry first.
+static TemplateCacheEntry *gTemplateCacheHead;
+static TemplateCacheEntry *gTemplateCacheTail;
+static CFIndex gTemplateCacheSize;
+static TemplateCacheStats gTemplateCacheStats;
+static pthread_mutex_t gTemplateCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Whether the templates synchronization has been started. Only used by the
+// host thread.
+static Boolean gTemplatesSyncStarted;
+
+// Path of the blob store, or an empty string if it can't be used. Set once.
+static char gTemplateBlobsPath[PATH_MAX];
+static pthread_once_t gTemplateBlobsOnce = PTHREAD_ONCE_INIT;
+
+// Used names indexes, most recently used first, protected by gOccupancyMutex.
+static OccupancyIndex *gOccupancyIndexes;
+static pthread_mutex_t gOccupancyMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Creation executor state. The queues are protected by gCreationMutex; the
+// creation threads wait on gCreationCondition for pending requests. Pending
+// and running requests are queued by lane.
+static pthread_mutex_t gCreationMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gCreationCondition = PTHREAD_COND_INITIALIZER;
+static CreationQueue gPendingCreations[kNewDocumentPlugInLanes];
+static CreationQueue gRunningCreations[kNewDocumentPlugInLanes];
+static CreationQueue gCompletedCreations;
+static UInt32 gLastCreationRequestID;
+
+// Creation threads, joined when the executor stops, and whether it is
+// stopping. Protected by gCreationMutex.
+static pthread_t gCreationThreads[kNewDocumentPlugInCreationThreads];
+static int gCreationThreadsCount;
+static Boolean gCreationExecutorStopping;
+
+// Run loop source used to hand completed creations back to the host thread.
+static CFRunLoopRef gHostRunLoop;
+static CFRunLoopSourceRef gCompletionSource;
+
+// Whether the spool service has been started. Only used by the host thread.
+static Boolean gSpoolServiceStarted;
+
+// Created documents waiting for the post-creation hooks, in creation order,
+// and the timer that runs the hooks. Only accessed from the host thread.
+static HookItem *gHookItemsHead;
+static HookItem *gHookItemsTail;
+static UInt32 gHookItemsCount;
+static CFRunLoopTimerRef gHookTimer;
+
+// Plugin metrics, only updated with atomic operations. The exporter thread is
+// started once, from the host thread.
+static PlugInMetrics gMetrics;
+static Boolean gMetricsExporterStarted;
+
+// Trace file and its path, when the workload is recorded, and date of the
+// last recorded event. Only used by the host thread.
+static FILE *gTraceFile;
+static char gTracePath[PATH_MAX];
+static Boolean gTraceFileChecked;
+static CFAbsoluteTime gTraceLastEventDate;
+
+#ifdef DEBUG
+// Simulated behavior of each file system call, loaded once from the preferences.
+static SimulatedFileSystemCall gSimulatedFileSystem[kNewDocumentPlugInFileSystemCalls];
+static pthread_once_t gSimulatedFileSystemOnce = PTHREAD_ONCE_INIT;
+
+// Trace being replayed, started once from the host thread.
+static TraceReplay *gTraceReplay;
+static Boolean gTraceReplayStarted;
+#endif
 
 
 // -----------------------------------------------------------------------------
@@ -155,6 +322,7 @@ static NewDocumentPlugInType* AllocNewDocumentPlugInType(CFUUIDRef inFactoryID)
 	// for each factory.
 	theNewInstance->factoryID = CFRetain(inFactoryID);
 	CFPlugInAddInstanceForFactory(inFactoryID);
+	gInstancesCount++;
 
 	// This function returns the IUnknown interface
 	// so set the refCount to one.
@@ -166,18 +334,21 @@ static NewDocumentPlugInType* AllocNewDocumentPlugInType(CFUUIDRef inFactoryID)
  * DeallocNewDocumentPlugInType
  *
  * Utility function that deallocates the instance when
- * the refCount goes to zero.
+ * the refCount goes to zero. The last instance stops the background threads,
+ * then the creation executor.
  */
 static void DeallocNewDocumentPlugInType(NewDocumentPlugInType* thisInstance)
 {
 	CFUUIDRef theFactoryID = thisInstance->factoryID;
 	
 	free(thisInstance);
+	if (--gInstancesCount == 0) {
+		StopBackgroundThreads();
+		StopCreationExecutor();
+	}
 	if (theFactoryID) {
 		CFPlugInRemoveInstanceForFactory(theFactoryID);
-		// Release the global caches
-		CFRelease(gSelfBundle);
-		// Release the factory
+		// Release the factory (the bundle is not retained by GetSelfBundle)
 		CFRelease(theFactoryID);
 	}
 }
@@ -193,7 +364,15 @@ void* NewDocumentPlugInFactory(CFAllocatorRef allocator, CFUUIDRef typeID)
 	// instance of NewDocumentPlugInType and return the IUnknown interface.
 	if (CFEqual(typeID, kContextualMenuTypeID)) {
 		NewDocumentPlugInType *result;
+		CFAbsoluteTime startDate = CFAbsoluteTimeGetCurrent();
 		result = AllocNewDocumentPlugInType(kNewDocumentPlugInFactoryID);
+		StartWarmUp();
+		StartSpoolService();
+		StartTemplatesSync();
+		gLoadTime += GetElapsedMicroseconds(startDate);
+#ifdef DEBUG
+		StartTraceReplay();
+#endif
 		return result;
 	}
 	else {
@@ -202,6 +381,186 @@ void* NewDocumentPlugInFactory(CFAllocatorRef allocator, CFUUIDRef typeID)
 	}
 }
 
+/*
+ * StartWarmUp
+ *
+ * Start a thread performing the initialization phases that don't need the
+ * host thread, so that the first menu finds them done, and then keeping the
+ * templates manifest up to date (see RefreshTemplatesManifest). Does nothing
+ * if the "WarmUp" preference is false, or if the thread has already been
+ * started.
+ */
+static void StartWarmUp()
+{
+	Boolean valid, enabled;
+	
+	if (gWarmUpStarted)
+		return;
+	gWarmUpStarted = true;
+	
+	enabled = CFPreferencesGetAppBooleanValue(CFSTR("WarmUp"), CFSTR(kNewDocumentPlugInBundle), &valid);
+	if (valid && !enabled)
+		return;
+	
+	if (!StartBackgroundThread(WarmUpThreadMain, NULL))
+		printf("NewDocumentPlugIn: Error: cannot start the warm-up thread.\n");
+}
+
+/*
+ * WarmUpThreadMain
+ *
+ * Main function of the warm-up thread. Its I/O is throttled, not to slow the
+ * host down while it starts. The scripting component is left to the first
+ * creation, as it must be opened by the host thread. Stops between two phases
+ * when the background threads are stopped. Once warmed up, rebuilds the
+ * templates manifest when RequestTemplatesManifestRefresh asks for it.
+ */
+static void* WarmUpThreadMain(void *unused)
+{
+	TemplateTable *table;
+	
+	SetThreadIOThrottled(true);
+	
+	GetSelfBundle();
+	
+	// Loads the manifest too
+	table = gBackgroundThreadsStopping ? NULL : CopyTemplateTable();
+	if (table != NULL) {
+		if (!gBackgroundThreadsStopping)
+			CollectTemplateBlobs(table->manifest);
+		ReleaseTemplateTable(table);
+	}
+	
+	if (!gBackgroundThreadsStopping)
+		GetTemplateUsageFile();
+	
+	// Then keep the manifest up to date when asked to, so that the menus
+	// don't build it
+	pthread_mutex_lock(&gTemplatesManifestMutex);
+	gTemplatesManifestRefresherRunning = true;
+	while (!gBackgroundThreadsStopping) {
+		if (gTemplatesManifestRefreshRequested) {
+			gTemplatesManifestRefreshRequested = false;
+			pthread_mutex_unlock(&gTemplatesManifestMutex);
+			RefreshTemplatesManifest(true);
+			pthread_mutex_lock(&gTemplatesManifestMutex);
+		}
+		else
+			pthread_cond_wait(&gTemplatesManifestCondition, &gTemplatesManifestMutex);
+	}
+	gTemplatesManifestRefresherRunning = false;
+	gTemplatesManifestRefreshRequested = false;
+	pthread_cond_broadcast(&gTemplatesManifestCondition);
+	pthread_mutex_unlock(&gTemplatesManifestMutex);
+	
+	return NULL;
+}
+
+/*
+ * StartBackgroundThread
+ *
+ * Start a background thread, joined by StopBackgroundThreads. Must be called
+ * from the host thread. Returns false if the thread cannot be started.
+ */
+static Boolean StartBackgroundThread(void* (*threadMain)(void*), void *argument)
+{
+	if (gBackgroundThreadsCount == kNewDocumentPlugInBackgroundThreads
+		|| (gBackgroundStopPipe[0] < 0 && pipe(gBackgroundStopPipe) != 0)
+		|| pthread_create(&gBackgroundThreads[gBackgroundThreadsCount], NULL, threadMain, argument) != 0)
+		return false;
+	
+	gBackgroundThreadsCount++;
+	return true;
+}
+
+/*
+ * StopBackgroundThreads
+ *
+ * Ask the background threads to stop, wake them up, and wait until they have
+ * stopped. The next instance of the plugin starts them again. Must be called
+ * from the host thread.
+ */
+static void StopBackgroundThreads()
+{
+	int i;
+	
+	if (gBackgroundStopPipe[0] >= 0) {
+		gBackgroundThreadsStopping = true;
+		write(gBackgroundStopPipe[1], "", 1);
+		
+		// The warm-up thread waits for manifest refreshes, not on the pipe
+		pthread_mutex_lock(&gTemplatesManifestMutex);
+		pthread_cond_broadcast(&gTemplatesManifestCondition);
+		pthread_mutex_unlock(&gTemplatesManifestMutex);
+		
+		for (i = 0; i < gBackgroundThreadsCount; i++)
+			pthread_join(gBackgroundThreads[i], NULL);
+		
+		close(gBackgroundStopPipe[0]);
+		close(gBackgroundStopPipe[1]);
+		gBackgroundStopPipe[0] = gBackgroundStopPipe[1] = -1;
+	}
+	
+	gBackgroundThreadsCount = 0;
+	gBackgroundThreadsStopping = false;
+	gWarmUpStarted = false;
+	gSpoolServiceStarted = false;
+	gTemplatesSyncStarted = false;
+	gMetricsExporterStarted = false;
+}
+
+/*
+ * WaitForBackgroundThreadsStop
+ *
+ * Wait on a background thread for at most a delay (in seconds), or until the
+ * background threads are stopped. Returns true if the thread must stop.
+ */
+static Boolean WaitForBackgroundThreadsStop(double delay)
+{
+	fd_set readable;
+	struct timeval timeout;
+	
+	timeout.tv_sec = (long)delay;
+	timeout.tv_usec = (long)((delay - timeout.tv_sec) * 1000000.0);
+	FD_ZERO(&readable);
+	FD_SET(gBackgroundStopPipe[0], &readable);
+	select(gBackgroundStopPipe[0] + 1, &readable, NULL, NULL, &timeout);
+	
+	return gBackgroundThreadsStopping;
+}
+
+/*
+ * RecordPhaseTime
+ *
+ * Record the time spent in an initialization phase started at startDate.
+ */
+static void RecordPhaseTime(int phase, CFAbsoluteTime startDate)
+{
+	RecordHistogramValue(&gMetrics.phaseTime[phase], GetElapsedMicroseconds(startDate));
+}
+
+/*
+ * CheckColdStartBudget
+ *
+ * Called after each menu started at menuStartDate. For the first one, record
+ * the cold start time, and log it if it exceeds the budget.
+ */
+static void CheckColdStartBudget(CFAbsoluteTime menuStartDate)
+{
+	SInt64 coldStartTime;
+	
+	if (gColdStartChecked)
+		return;
+	gColdStartChecked = true;
+	
+	coldStartTime = gLoadTime + GetElapsedMicroseconds(menuStartDate);
+	AddToMetric(&gMetrics.coldStartTime, coldStartTime);
+	
+	if (coldStartTime > kNewDocumentPlugInColdStartBudget * 1000000)
+		printf("NewDocumentPlugIn : Cold start took %lld ms, over the budget of %d ms\n",
+			   (long long)coldStartTime / 1000, (int)(kNewDocumentPlugInColdStartBudget * 1000));
+}
+
 
 // -----------------------------------------------------------------------------
 //  Context Menu Manager entry points 
@@ -216,21 +575,29 @@ void* NewDocumentPlugInFactory(CFAllocatorRef allocator, CFUUIDRef typeID)
  */
 static OSStatus NewDocumentPlugInExamineContext(void* thisInstance, const AEDesc* inContext, AEDescList* outCommandPairs)
 {
-	CFURLRef selectionURL = CopyFileURLFromAEDescList(inContext);
+	CFAbsoluteTime startDate = CFAbsoluteTimeGetCurrent();
+	CFArrayRef selectionURLs = CopyFileURLsFromAEDescList(inContext);
+	CFIndex i, count;
+	Boolean allDirs = true;
 	
+	RecordHistogramValue(&gMetrics.contextParseTime, GetElapsedMicroseconds(startDate));
 	
-	if (selectionURL != NULL) {
-		 
-		// Convert the fileURL to a FSRef
-		FSRef file;
-		CFURLGetFSRef(selectionURL, &file);
+	if (selectionURLs != NULL) {
+		
+		RecordTraceEvent(kNewDocumentPlugInExamineEvent, NULL, selectionURLs);
 		
-		// We are in a directory : let's add our submenu
-		if (FSIsDir(&file)) {
+		// Every selected item must be a directory
+		count = CFArrayGetCount(selectionURLs);
+		for (i = 0; i < count && allDirs; i++) {
+			allDirs = IsDirectoryURL(CFArrayGetValueAtIndex(selectionURLs, i));
+		}
+		
+		// We are in one or more directories : let's add our submenu
+		if (count > 0 && allDirs) {
 			AddNewDocumentMenu(outCommandPairs);
 		}
 		
-		CFRelease(selectionURL);
+		CFRelease(selectionURLs);
 	}
 	
 	return noErr;
@@ -241,61 +608,71 @@ static OSStatus NewDocumentPlugInExamineContext(void* thisInstance, const AEDesc
  *
  * This function is called by the Context Menu Manager when one
  * of our custom menu items has been selected. We then create
- * a new document of the requested type.
+ * a new document of the requested type in each selected directory.
  */
 static OSStatus NewDocumentPlugInHandleSelection(void* thisInstance, AEDesc* inContext, SInt32 inCommandID)
 {
 	OSStatus err;
-	CFArrayRef templates;
-	CFURLRef destURL, templateURL;
-	CFStringRef templateName, newDocumentPath;
-	CFMutableStringRef newDocumentName;
-	CFBundleRef theBundle;
-	FSRef selectionPathFS, templateFilenameFS;
+	CFArrayRef destURLs;
+	CFIndex i, count;
+	CreationBatch *batch;
+	TemplateTable *table;
+	CFStringRef templateName = NULL;
+	int lane;
+	CFAbsoluteTime startDate;
 	
-	// Retrieve the templates list and the destination directory
-	templates = CopyTemplatesFilenames();
-	destURL = CopyFileURLFromAEDescList(inContext);
-	
-	if (destURL != NULL && templates != NULL) {
-		
-		// Retrieve the URL of the selected template
-		templateName = CFArrayGetValueAtIndex(templates, inCommandID);
-		theBundle = GetPlugInBundleRef(CFSTR(kNewDocumentPlugInBundle));
-		templateURL = CFBundleCopyResourceURL(theBundle, templateName, NULL, CFSTR(kNewDocumentPlugInTemplatesSubdir));
-		
-		// Define the name of the new document
-		newDocumentName = CopyLocalizedTemplateName(templateName, false);
-		newDocumentPath = CFURLCopyFileSystemPath(destURL, kCFURLPOSIXPathStyle);
-		IncrementDocumentName(newDocumentPath, newDocumentName);
-		
-		// Convert URLs to FSRefs
-		CFURLGetFSRef(templateURL, &templateFilenameFS);
-		CFURLGetFSRef(destURL, &selectionPathFS);
-		
-		// schedule an async copy
-		FSFileOperationRef fo = FSFileOperationCreate(NULL);
-		FSFileOperationScheduleWithRunLoop(fo, CFRunLoopGetCurrent(), kCFRunLoopCommonModes);
-		err = FSCopyObjectAsync(fo,
-								&templateFilenameFS,
-								&selectionPathFS,
-								newDocumentName,
-								kFSFileOperationDefaultOptions,
-								TemplateCopyCallback,
-								1,
-								NULL
-								);
-		if (err != noErr)
-			printf("NewDocumentPlugIn : File copy error (%d)\n", err);
+	// Count the use once per selection, whatever the number of directories
+	table = CopyTemplateTable();
+	if (table != NULL) {
+		if (inCommandID >= 0 && inCommandID < table->count) {
+			RecordTemplateUse(table, inCommandID);
+			templateName = CopyTemplateTableName(table, inCommandID);
+		}
+		ReleaseTemplateTable(table);
+	}
+	
+	// Retrieve the destination directories
+	startDate = CFAbsoluteTimeGetCurrent();
+	destURLs = CopyFileURLsFromAEDescList(inContext);
+	RecordHistogramValue(&gMetrics.contextParseTime, GetElapsedMicroseconds(startDate));
+	
+	if (destURLs != NULL) {
 		
-		CFRelease(newDocumentName);
-		CFRelease(newDocumentPath);
-		CFRelease(fo);
-		CFRelease(templateURL);
-		CFRelease(destURL);
-		CFRelease(templates);
+		if (templateName != NULL)
+			RecordTraceEvent(kNewDocumentPlugInSelectEvent, templateName, destURLs);
+		
+		count = CFArrayGetCount(destURLs);
+		batch = (CreationBatch*) calloc(1, sizeof(CreationBatch));
+		
+		if (batch != NULL) {
+			
+			// The creations themselves are performed by the creation threads,
+			// so that the host never waits for the file system. A document
+			// in each of several directories is bulk work : it yields to the
+			// other creations and to the disk.
+			batch->total = count;
+			lane = (count > 1) ? kNewDocumentPlugInBulkLane : kNewDocumentPlugInInteractiveLane;
+			for (i = 0; i < count; i++) {
+				err = SubmitCreationRequest(inCommandID, CFArrayGetValueAtIndex(destURLs, i), lane, batch, NULL);
+				if (err == noErr)
+					batch->remaining++;
+				else {
+					batch->failed++;
+					printf("NewDocumentPlugIn : Cannot schedule the document creation (%d)\n", err);
+				}
+			}
+			
+			// Nothing was scheduled : the batch won't be completed by the threads
+			if (batch->remaining == 0)
+				free(batch);
+		}
+		
+		CFRelease(destURLs);
 	}
 	
+	if (templateName != NULL)
+		CFRelease(templateName);
+	
 	return noErr;
 }
 
@@ -303,16 +680,20 @@ static OSStatus NewDocumentPlugInHandleSelection(void* thisInstance, AEDesc* inC
  * NewDocumentPlugInPostMenuCleanup
  *
  * This function is called by the Context Menu Manager when our attached
- * context menu closes. We have a chance to do some cleanup — but it isn't
- * required here.
+ * context menu closes. We have a chance to do some cleanup : the caches are
+ * trimmed, here and then periodically, as the host process lives long.
  */
 static void NewDocumentPlugInPostMenuCleanup(void *thisInstance)
 {
-	// No need to clean up.  We are a tidy folk.
+#ifdef DEBUG
+	LogTemplateCacheStats();
+#endif
+	
+	TrimPlugInCaches(CFAbsoluteTimeGetCurrent() - kNewDocumentPlugInIdleDelay);
+	StartCachesTrimming();
 	
-	// (We could eventually release the globally cached references — the script component
-	// or our own bundle, for instance — but all instances of the plugin
-	// share the same, so we'll free them when unloading the plugin)
+	// (Our own bundle is kept : all instances of the plugin share the same,
+	// so we'll free it when unloading the plugin)
 }
 
 
@@ -328,14 +709,16 @@ static void NewDocumentPlugInPostMenuCleanup(void *thisInstance)
 static OSErr AddNewDocumentMenu(AEDescList* ioCommandList)
 {
 	OSErr err;
-	CFArrayRef templates;
-	int i, count;
-	CFStringRef POSIXpath;
+	TemplateTable *table;
+	CFIndex *order, frequent[kNewDocumentPlugInFrequentItems], frequentCount, i;
 	CFMutableStringRef cleanName;
+	CFAbsoluteTime startDate = CFAbsoluteTimeGetCurrent(), orderDate;
 	
-	templates = CopyTemplatesFilenames();
+	StartMetricsExporter();
 	
-	if (templates != NULL && (count = CFArrayGetCount(templates)) > 0) {
+	table = CopyTemplateTable();
+	
+	if (table != NULL && table->count > 0) {
 		
 		// Create submenu
 		AEDescList submenu;
@@ -343,18 +726,23 @@ static OSErr AddNewDocumentMenu(AEDescList* ioCommandList)
 		
 		if (err == noErr) {
 			
-			// enumerate templates
-			for(i = 0; i < count; i++) {
-				POSIXpath = CFArrayGetValueAtIndex(templates, i);
-				cleanName = CopyLocalizedTemplateName(POSIXpath, true);
-				RemoveLastExtension(cleanName);
-				
-				// Add an entry in the menu
-				AddMenuItemToAEDescList(cleanName, kTextEncodingMacRoman, typeChar, i, 0, 0, &submenu);
-				
-				// clean-up
-				CFRelease(cleanName);
+			orderDate = CFAbsoluteTimeGetCurrent();
+			order = CreateTemplatesMenuOrder(table, frequent, &frequentCount);
+			RecordHistogramValue(&gMetrics.menuOrderTime, GetElapsedMicroseconds(orderDate));
+			
+			// the most frequent templates come first, whatever their category
+			if (frequentCount > 0) {
+				for (i = 0; i < frequentCount; i++) {
+					cleanName = CopyTemplateLabel(table, frequent[i], true);
+					AddMenuItemToAEDescList(cleanName, kTextEncodingMacRoman, typeChar, frequent[i], 0, 0, &submenu);
+					CFRelease(cleanName);
+				}
+				AddMenuItemToAEDescList(CFSTR("-"), kTextEncodingMacRoman, typeChar, 0, kMenuItemAttrSeparator, 0, &submenu);
 			}
+			
+			// enumerate templates, starting with the uncategorized ones
+			AddTemplatesToSubmenu(table, order, 0, NULL, 0, &submenu);
+			free(order);
 		}
 		
 		// Close submenu
@@ -362,16 +750,90 @@ static OSErr AddNewDocumentMenu(AEDescList* ioCommandList)
 		StickSubmenuInParent(&submenu, ioCommandList, submenuTitle, kTextEncodingMacRoman);
 		CFRelease(submenuTitle);
 		
+		AddToMetric(&gMetrics.menuBuilds, 1);
+		AddToMetric(&gMetrics.templatesListed, table->count);
+		RecordHistogramValue(&gMetrics.menuBuildTime, GetElapsedMicroseconds(startDate));
+		
 	} else {
 		err = -1;
 	}
 	
-	if (templates != NULL)
-		CFRelease(templates);
+	CheckColdStartBudget(startDate);
+	
+	if (table != NULL)
+		ReleaseTemplateTable(table);
 	
 	return err;
 }
 
+/*
+ * AddTemplatesToSubmenu
+ *
+ * Add the templates of a category to a submenu, starting at index first of the
+ * templates order (see CreateTemplatesMenuOrder). Subcategories are added as
+ * nested submenus. Returns the position in order of the first template that
+ * doesn't belong to the category.
+ * As the Contextual Menu Manager can't populate submenus on demand, the whole
+ * menu is built at once, but each submenu is limited to
+ * kNewDocumentPlugInMaxMenuItems items. If submenu is NULL, the templates
+ * of the category are skipped.
+ */
+static CFIndex AddTemplatesToSubmenu(const TemplateTable *table, const CFIndex *order, CFIndex first, const UniChar *category, CFIndex categoryLength, AEDescList* submenu)
+{
+	CFIndex i = first, itemsCount = 0, templateCategoryLength, start, end;
+	const UniChar *name;
+	CFStringRef subcategoryName, subcategoryTitle;
+	CFMutableStringRef cleanName;
+	AEDescList childMenu, *childMenuPtr;
+	Boolean inCategory = true;
+	
+	while (i < table->count && inCategory) {
+		name = table->strings + table->nameOffsets[order[i]];
+		templateCategoryLength = table->categoryLengths[order[i]];
+		
+		if (templateCategoryLength == categoryLength
+			&& memcmp(name, category, categoryLength * sizeof(UniChar)) == 0) {
+			// A template of this category : add an entry in the menu
+			if (submenu != NULL && itemsCount++ < kNewDocumentPlugInMaxMenuItems) {
+				cleanName = CopyTemplateLabel(table, order[i], true);
+				AddMenuItemToAEDescList(cleanName, kTextEncodingMacRoman, typeChar, order[i], 0, 0, submenu);
+				CFRelease(cleanName);
+			}
+			i++;
+		}
+		else if (templateCategoryLength > categoryLength
+				 && (categoryLength == 0
+					 || (memcmp(name, category, categoryLength * sizeof(UniChar)) == 0
+						 && name[categoryLength] == '/'))) {
+			// The first template of a subcategory : add a nested submenu
+			start = (categoryLength > 0) ? categoryLength + 1 : 0;
+			for (end = start; end < templateCategoryLength && name[end] != '/'; end++)
+				;
+			
+			childMenuPtr = NULL;
+			if (submenu != NULL && itemsCount++ < kNewDocumentPlugInMaxMenuItems && CreateSubmenu(&childMenu) == noErr)
+				childMenuPtr = &childMenu;
+			
+			i = AddTemplatesToSubmenu(table, order, i, name, end, childMenuPtr);
+			
+			// Categories names can be localized like templates names
+			if (childMenuPtr != NULL) {
+				subcategoryName = CFStringCreateWithCharacters(NULL, name + start, end - start);
+				subcategoryTitle = CFCopyLocalizedStringWithDefaultValue(subcategoryName, NULL, GetSelfBundle(), subcategoryName, "");
+				StickSubmenuInParent(childMenuPtr, submenu, subcategoryTitle, kTextEncodingMacRoman);
+				CFRelease(subcategoryTitle);
+				CFRelease(subcategoryName);
+			}
+		}
+		else {
+			// Not in this category anymore
+			inCategory = false;
+		}
+	}
+	
+	return i;
+}
+
 /*
  * AddMenuItemToAEDescList
  *
@@ -650,66 +1112,54 @@ static CFBundleRef GetPlugInBundleRef(CFStringRef bundleIdentifier)
  *
  * Retrieve a reference to the plugin own bundle object (from the
  * kNewDocumentPlugInBundle constant), or NULL if an error occurs.
+ * Safe to call from any thread.
  */
 static CFBundleRef GetSelfBundle()
 {
-	if (gSelfBundle == NULL)
-		gSelfBundle = GetPlugInBundleRef(CFSTR(kNewDocumentPlugInBundle));
-	
+	pthread_once(&gSelfBundleOnce, InitSelfBundle);
 	return gSelfBundle;
 }
 
 /*
- * FSFileExists
+ * InitSelfBundle
  *
- * Indicates wether a POSIX-style path points to an existing file
- * or not. "isDir" indicates wether the path is expected to point to
- * a directory or not.
+ * Resolve the plugin own bundle, once for all threads.
  */
-static bool FSFileExists(CFStringRef filename, bool isDir)
+static void InitSelfBundle()
 {
-	bool result;
-	CFURLRef tmpURL;
-	FSRef tmpFSRef;
-	
-	tmpURL = CFURLCreateWithFileSystemPath(NULL,
-										   filename,
-										   kCFURLPOSIXPathStyle,
-										   false);
-	result = CFURLGetFSRef(tmpURL, &tmpFSRef);
-	
-	CFRelease(tmpURL);
+	CFAbsoluteTime startDate = CFAbsoluteTimeGetCurrent();
 	
-	return result;
+	gSelfBundle = GetPlugInBundleRef(CFSTR(kNewDocumentPlugInBundle));
+	RecordPhaseTime(kNewDocumentPlugInBundlePhase, startDate);
 }
 
 /*
- * FSIsDir
+ * IsDirectoryURL
  *
- * Indicates wether an FSRef points to a directory.
+ * Indicates wether a file URL points to a directory.
  */
-static bool FSIsDir(const FSRef *ref)
+static Boolean IsDirectoryURL(CFURLRef url)
 {
-	FSCatalogInfo fileInfo;
-	OSErr err;
+	char path[PATH_MAX];
+	struct stat info;
 	
-	err = FSGetCatalogInfo(ref, kFSCatInfoNodeFlags, &fileInfo, NULL, NULL, NULL);
-	if (err == noErr && (fileInfo.nodeFlags & kFSNodeIsDirectoryMask))
-		return true;
-	else
+	if (!CFURLGetFileSystemRepresentation(url, true, (UInt8*)path, sizeof(path))
+		|| SimulateFileSystemCallIfNeeded(kNewDocumentPlugInCatalogInfoCall) != 0)
 		return false;
+	
+	return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
 }
 
 /*
- * CopyFileURLFromAEDescList
+ * CopyFileURLsFromAEDescList
  *
- * Extract the first item of argument list in inContext, as a CFURL.
- * If inContext is null, not a list, or cannot be coerced to a file
- * URL, returns NULL.
+ * Extract the items of argument list in inContext, as an array of CFURLs.
+ * If inContext is null, not a list, or if one of its items cannot be coerced
+ * to a file URL, returns NULL.
  */
-static CFURLRef CopyFileURLFromAEDescList(const AEDesc* inContext)
+static CFArrayRef CopyFileURLsFromAEDescList(const AEDesc* inContext)
 {
-	CFURLRef result = NULL;
+	CFMutableArrayRef result = NULL;
 	
 	// Make sure the descriptor isn't null
 	if (inContext != NULL)
@@ -717,17 +1167,19 @@ static CFURLRef CopyFileURLFromAEDescList(const AEDesc* inContext)
 		// Examine list
 		if (inContext->descriptorType == typeAEList) {
 			
-			long count = 0;
+			long i, count = 0;
 			AEDesc value;
+			CFURLRef itemURL;
 			OSErr err;
 			
 			AECountItems(inContext, &count);
+			result = CFArrayCreateMutable(NULL, count, &kCFTypeArrayCallBacks);
 			
-			
-			if (count == 1) {
+			for (i = 1; i <= count && result != NULL; i++) {
 				
-				// Get first (and unique) list item, and coerce it to an FSRef
-				err = AEGetNthDesc(inContext, 1, typeFileURL, NULL, &value);
+				// Get the list item, and coerce it to a file URL
+				err = AEGetNthDesc(inContext, i, typeFileURL, NULL, &value);
+				itemURL = NULL;
 				
 				if (err == noErr) {
 					
@@ -737,14 +1189,22 @@ static CFURLRef CopyFileURLFromAEDescList(const AEDesc* inContext)
 					AEGetDescData(&value, buffer, dataSize);
 					
 					// Create a file URL with the data
-					result = CFURLCreateWithBytes(NULL, buffer, dataSize, kCFStringEncodingUTF8, NULL);
+					itemURL = CFURLCreateWithBytes(NULL, buffer, dataSize, kCFStringEncodingUTF8, NULL);
 					
 					// Clean-up
 					free(buffer);
 					AEDisposeDesc(&value);
 				}
+				
+				if (itemURL != NULL) {
+					CFArrayAppendValue(result, itemURL);
+					CFRelease(itemURL);
+				}
+				else {
+					CFRelease(result);
+					result = NULL;
+				}
 			}
-			 
 		}
 	}
 	
@@ -752,182 +1212,646 @@ static CFURLRef CopyFileURLFromAEDescList(const AEDesc* inContext)
 }
 
 /*
- * IncrementDocumentName
+ * ResolveDocumentName
  *
- * Increment a document name until the document doesn't already exists at the
- * given location. The increment is inserted just before the templates' extensions
- * (i.e. before the first dot in the document name).
+ * Find a name for a new document that doesn't already exists in the given
+ * directory : "<baseName><extensions>", or "<baseName> N<extensions>" with
+ * the first free number. The chosen number is reserved in the occupancy index
+ * of the directory, so that concurrent creations get different names.
+ * directoryFd is an open descriptor of the directory, so that the directory is
+ * only looked up once per creation.
+ * All names are file system representations. Doesn't allocate memory once the
+ * occupancy index of the directory exists. Returns false if no name is free.
+ * The reserved number is returned in outSuffix : once the document is created,
+ * or has failed, the reservation must be ended by NoteDocumentCreated or
+ * ReleaseDocumentName.
  */
-static void IncrementDocumentName(CFStringRef documentPath, CFMutableStringRef documentName)
+static Boolean ResolveDocumentName(const char *directory, int directoryFd, const char *baseName, const char *extensions, char *outName, size_t outSize, int *outSuffix)
 {
-	int i, maxCount = 1000;
-	bool fileExists;
-	CFStringRef filename, extensions, loopFilename, docWithoutExtensions, filenameWithoutExtensions;
-	CFRange firstDot;
+	OccupancyIndex *index;
+	int suffix = 0;
+	CFAbsoluteTime startDate = CFAbsoluteTimeGetCurrent();
+	Boolean resolved;
 	
-	// Format a complete filename from path and name
-	filename = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@/%@"), documentPath, documentName);
+	// Find the first number not used yet by a document of the same name
+	pthread_mutex_lock(&gOccupancyMutex);
+	index = GetOccupancyIndex(directory, directoryFd, baseName, extensions);
+	if (index != NULL)
+		suffix = ReserveDocumentSuffix(index);
+	pthread_mutex_unlock(&gOccupancyMutex);
 	
-	// If initial file does not exists, no need to go further
-	if (!FSFileExists(filename, false)) {
-		CFRelease(filename);
-		return;
+	AddToMetric(&gMetrics.nameResolutions, 1);
+	
+	// if all numbers are used…
+	if (suffix == 0) {
+		AddToMetric(&gMetrics.nameResolutionFailures, 1);
+		RecordHistogramValue(&gMetrics.namingTime, GetElapsedMicroseconds(startDate));
+		printf("NewDocumentPlugin: Error: cannot find a suitable filename for document.\n");
+		return false;
 	}
 	
-	// Extract extensions
-	firstDot = CFStringFind(documentName, CFSTR("."), 0);
-	if (firstDot.location != kCFNotFound) {
-		// separate extensions from the file name
-		extensions = CFStringCreateWithSubstring(NULL,
-												 documentName,
-												 CFRangeMake(firstDot.location,
-															 CFStringGetLength(documentName) - firstDot.location));
-		docWithoutExtensions = CFStringCreateWithSubstring(NULL,
-														   documentName,
-														   CFRangeMake(0, firstDot.location));
-		filenameWithoutExtensions = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@/%@"), documentPath, docWithoutExtensions);
+	RecordHistogramValue(&gMetrics.collisionDepth, suffix);
+	
+	resolved = FormatDocumentName(baseName, suffix, extensions, outName, outSize);
+	RecordHistogramValue(&gMetrics.namingTime, GetElapsedMicroseconds(startDate));
+	
+	if (resolved)
+		*outSuffix = suffix;
+	else
+		ReleaseDocumentName(directory, baseName, extensions, suffix, false);
+	
+	return resolved;
+}
+
+/*
+ * FormatDocumentName
+ *
+ * Write "<baseName> N<extensions>" into outName, inserting the number just
+ * before the extensions. A suffix of 1 stands for the name without number.
+ * Returns false if the buffer is too small.
+ */
+static Boolean FormatDocumentName(const char *baseName, int suffix, const char *extensions, char *outName, size_t outSize)
+{
+	char digits[12];
+	size_t baseLength, extensionsLength, digitsLength = 0, length;
+	
+	// Format the number backwards
+	if (suffix > 1) {
+		while (suffix > 0) {
+			digits[sizeof(digits) - 1 - digitsLength++] = '0' + suffix % 10;
+			suffix /= 10;
+		}
+		digits[sizeof(digits) - 1 - digitsLength++] = ' ';
 	}
-	else {
-		// file name doesn't have any extensions
-		extensions = CFSTR("");
-		filenameWithoutExtensions = documentName;
-	}
-	
-	// Try to find a suitable filename by appending a number between the document
-	// name and the extensions
-	for (i = 2; i < maxCount; i++) {
-		loopFilename = CFStringCreateWithFormat(NULL,
-												NULL,
-												CFSTR("%@ %i%@"),
-												filenameWithoutExtensions, i, extensions);
-		fileExists = FSFileExists(loopFilename, false);
-		CFRelease(loopFilename);
-		if (!fileExists)
+	
+	baseLength = strlen(baseName);
+	extensionsLength = strlen(extensions);
+	length = baseLength + digitsLength + extensionsLength;
+	if (length >= outSize)
+		return false;
+	
+	memcpy(outName, baseName, baseLength);
+	memcpy(outName + baseLength, digits + sizeof(digits) - digitsLength, digitsLength);
+	memcpy(outName + baseLength + digitsLength, extensions, extensionsLength);
+	outName[length] = '\0';
+	
+	return true;
+}
+
+/*
+ * GetOccupancyIndex
+ *
+ * Return the occupancy index of a document name in a directory, creating or
+ * rebuilding it if the directory changed since it was last read. Returns NULL
+ * if the directory doesn't exist. The caller must hold gOccupancyMutex.
+ */
+static OccupancyIndex* GetOccupancyIndex(const char *directory, int directoryFd, const char *baseName, const char *extensions)
+{
+	OccupancyIndex *index, *previous = NULL, *last, *unused;
+	char folded[NAME_MAX * 3 + 1];
+	struct stat info;
+	int count;
+	
+	if (SimulateFileSystemCallIfNeeded(kNewDocumentPlugInStatCall) != 0
+		|| fstat(directoryFd, &info) != 0 || !S_ISDIR(info.st_mode))
+		return NULL;
+	
+	// Look for an existing index
+	for (index = gOccupancyIndexes; index != NULL; previous = index, index = index->next) {
+		if (strcmp(index->directory, directory) == 0
+			&& strcmp(index->baseName, baseName) == 0
+			&& strcmp(index->extensions, extensions) == 0)
 			break;
 	}
 	
-	// if we reached maxcount without finding a suitable filename…
-	if (i == maxCount)
-		printf("NewDocumentPlugin: Error: cannot find a suitable filename for document.\n");
+	if (index != NULL) {
+		// Move the index at the head of the list
+		if (previous != NULL) {
+			previous->next = index->next;
+			index->next = gOccupancyIndexes;
+			gOccupancyIndexes = index;
+		}
+	}
 	else {
-		CFStringRef newDocumentName = CFStringCreateWithFormat(NULL,
-															   NULL,
-															   CFSTR("%@ %i%@"),
-															   docWithoutExtensions,
-															   i,
-															   extensions);
-		CFStringReplaceAll(documentName, newDocumentName);
-		CFRelease(newDocumentName);
+		index = (OccupancyIndex*) calloc(1, sizeof(OccupancyIndex));
+		if (index == NULL)
+			return NULL;
+		index->directory = strdup(directory);
+		index->baseName = strdup(baseName);
+		index->extensions = strdup(extensions);
+		index->foldedBaseName = strdup(FoldFileName(baseName, folded, sizeof(folded)) ? folded : baseName);
+		index->foldedExtensions = strdup(FoldFileName(extensions, folded, sizeof(folded)) ? folded : extensions);
+		index->next = gOccupancyIndexes;
+		gOccupancyIndexes = index;
+		AddToMetric(&gMetrics.cacheBytes[kNewDocumentPlugInOccupancyCache], GetOccupancyIndexSize(index));
+		
+		// Forget the least recently used indexes, but those with numbers
+		// still reserved by creations in progress
+		for (last = gOccupancyIndexes, count = 1; last->next != NULL; last = last->next, count++) {
+			if (count == kNewDocumentPlugInMaxOccupancyIndexes) {
+				while (last->next != NULL) {
+					unused = last->next;
+					if (HasReservedDocumentSuffixes(unused)) {
+						last = unused;
+						continue;
+					}
+					last->next = unused->next;
+					FreeOccupancyIndex(unused);
+				}
+				break;
+			}
+		}
 	}
 	
-	CFRelease(filenameWithoutExtensions);
-	CFRelease(docWithoutExtensions);
-	CFRelease(extensions);
-	CFRelease(filename);
+	index->lastUse = CFAbsoluteTimeGetCurrent();
+	
+	// Read the directory again if it changed
+	if (!index->valid || index->inode != info.st_ino || index->mtime != GetModificationTime(&info)) {
+		index->inode = info.st_ino;
+		index->mtime = GetModificationTime(&info);
+		RebuildOccupancyIndex(index, directoryFd);
+	}
+	
+	return index;
 }
 
 /*
- * TemplateCopyCallback
+ * RebuildOccupancyIndex
  *
- * Called during the various stages of an asynchronous copy operation.
- * Used here mainly to trigger a script when the copy is finished, and to
- * set the extension of the file as hidden by default.
+ * Enumerate the directory of an index once, and mark the numbers used by the
+ * documents named "<baseName> N<extensions>", and the numbers reserved by
+ * creations in progress. As file systems usually are case-insensitive and
+ * don't distinguish composed and decomposed spellings, names are compared on
+ * their folded forms.
  */
-void TemplateCopyCallback(FSFileOperationRef fileOp,
-						  const FSRef *currentItem,
-						  FSFileOperationStage stage,
-						  OSStatus error,
-						  CFDictionaryRef statusDictionary,
-						  void *info)
+static void RebuildOccupancyIndex(OccupancyIndex *index, int directoryFd)
 {
-	// do stuff only when everything is done
-	if (stage == kFSOperationStageComplete && error == noErr) {
+	DIR *dir = NULL;
+	struct dirent *entry;
+	char name[NAME_MAX * 3 + 1];
+	size_t baseLength, extensionsLength, nameLength;
+	const char *suffix, *suffixEnd;
+	char *numberEnd;
+	long number;
+	SInt64 entriesCount = 0;
+	
+	memcpy(index->used, index->reserved, sizeof(index->used));
+	
+	// A descriptor of its own, so that the directory is read from its start
+	if (SimulateFileSystemCallIfNeeded(kNewDocumentPlugInReadDirCall) == 0)
+		dir = OpenDirectoryAt(directoryFd, ".", 0);
+	index->valid = (dir != NULL);
+	if (dir == NULL)
+		return;
+	
+	baseLength = strlen(index->foldedBaseName);
+	extensionsLength = strlen(index->foldedExtensions);
+	
+	while ((entry = readdir(dir)) != NULL) {
+		entriesCount++;
+		if (!FoldFileName(entry->d_name, name, sizeof(name)))
+			continue;
 		
-		CFURLRef url;
-		CFStringRef item;
-		OSErr err;
+		nameLength = strlen(name);
+		if (nameLength < baseLength + extensionsLength
+			|| memcmp(name, index->foldedBaseName, baseLength) != 0
+			|| memcmp(name + nameLength - extensionsLength, index->foldedExtensions, extensionsLength) != 0)
+			continue;
 		
-		// Hide the extension of the item (which will not be shown,
-		// except if the Finder is configured to show all extensions anyway)
-		LSSetExtensionHiddenForRef(currentItem, true);
+		// Parse the number between the name and the extensions, if any
+		suffix = name + baseLength;
+		suffixEnd = name + nameLength - extensionsLength;
+		if (suffix == suffixEnd)
+			number = 1;
+		else if (suffix[0] == ' ' && suffix[1] >= '1' && suffix[1] <= '9') {
+			number = strtol(suffix + 1, &numberEnd, 10);
+			if (numberEnd != suffixEnd)
+				continue;
+		}
+		else
+			continue;
 		
-		// Retrieve item name
-		url = CFURLCreateFromFSRef(NULL, currentItem);
-		item = CFURLCopyLastPathComponent(url);
+		if (number >= 1 && number <= kNewDocumentPlugInMaxDocumentSuffix)
+			index->used[number / 32] |= (1U << (number % 32));
+	}
+	
+	closedir(dir);
+	
+	AddToMetric(&gMetrics.directoryScans, 1);
+	AddToMetric(&gMetrics.directoryEntriesScanned, entriesCount);
+}
+
+/*
+ * ReserveDocumentSuffix
+ *
+ * Return the first number not used yet in an index, and mark it as used and
+ * reserved. 1 stands for the name without number. Returns 0 if every number
+ * is used. The caller must hold gOccupancyMutex.
+ */
+static int ReserveDocumentSuffix(OccupancyIndex *index)
+{
+	int word, bit, suffix;
+	
+	for (word = 0; word < sizeof(index->used) / sizeof(index->used[0]); word++) {
+		if (index->used[word] == 0xFFFFFFFF)
+			continue;
 		
-		// tell the Finder to select the item
-		err = EditFinderItem(item);
-		if (err != noErr) {
-			printf("NewDocumentPlugIn: Error while executing the script (%d).\n", err);
+		for (bit = 0; bit < 32; bit++) {
+			suffix = word * 32 + bit;
+			if (suffix >= 1 && suffix <= kNewDocumentPlugInMaxDocumentSuffix
+				&& !(index->used[word] & (1U << bit))) {
+				index->used[word] |= (1U << bit);
+				index->reserved[word] |= (1U << bit);
+				return suffix;
+			}
 		}
-		
-		CFRelease(item);
-		CFRelease(url);
 	}
+	
+	return 0;
 }
 
 /*
- * CopyTemplatesFilenames
+ * NoteDocumentCreated
  *
- * Returns a array that contains the POSIX filenames to the templates.
+ * Called after a document has been created in a directory under the number
+ * suffix reserved by ResolveDocumentName, previousDate being the modification
+ * date of the directory just before the creation. The number is now used by
+ * the document itself, and no longer reserved.
+ * The indexes of the directory stay valid if they were up to date before the
+ * creation : their modification date is advanced to avoid reading the
+ * directory again. Otherwise the directory also changed in another way, and
+ * they are rebuilt on next use. (A change made during the creation itself
+ * goes unnoticed : the next creation then finds its name taken and resolves
+ * it again, or a freed number is only reused after the next rebuild.)
  */
-static CFArrayRef CopyTemplatesFilenames()
+static void NoteDocumentCreated(const char *directory, int directoryFd, const char *baseName, const char *extensions, int suffix, SInt64 previousDate)
 {
-	CFMutableArrayRef templatesURL = CFArrayCreateMutable(NULL, 5, &kCFTypeArrayCallBacks);
+	OccupancyIndex *index;
+	struct stat info;
+	Boolean known;
 	
-	// Retrieve our own plugin bundle
-	CFBundleRef theBundle = (CFBundleRef)CFRetain( GetPlugInBundleRef(CFSTR(kNewDocumentPlugInBundle)) );
+	known = (SimulateFileSystemCallIfNeeded(kNewDocumentPlugInStatCall) == 0 && fstat(directoryFd, &info) == 0);
 	
-	if (theBundle != NULL) {
+	pthread_mutex_lock(&gOccupancyMutex);
+	for (index = gOccupancyIndexes; index != NULL; index = index->next) {
+		if (strcmp(index->directory, directory) != 0)
+			continue;
 		
-		CFArrayRef docTemplates;
-		CFURLRef templateURL;
-		CFStringRef POSIXFilename;
-		CFIndex i, count;
+		if (suffix > 0 && strcmp(index->baseName, baseName) == 0 && strcmp(index->extensions, extensions) == 0)
+			index->reserved[suffix / 32] &= ~(1U << (suffix % 32));
 		
-		// Retrieve templates from bundle resources
-		docTemplates = CFBundleCopyResourceURLsOfType(theBundle, NULL, CFSTR(kNewDocumentPlugInTemplatesSubdir));
-		count = CFArrayGetCount(docTemplates);
-		
-		// Enumerate docTemplates in plugin resources
-		for (i = 0; i < count; i++) {
-			templateURL = (CFURLRef)CFArrayGetValueAtIndex(docTemplates, i);
-			POSIXFilename = CFURLCopyFileSystemPath(templateURL, kCFURLPOSIXPathStyle);
-			
-			// Add a new entry to the dictionary
-			CFArrayAppendValue(templatesURL, POSIXFilename);
-			
-			CFRelease(POSIXFilename);
+		if (known && index->valid && index->mtime == previousDate) {
+			index->inode = info.st_ino;
+			index->mtime = GetModificationTime(&info);
 		}
-		
-		CFRelease(docTemplates);
-		CFRelease(theBundle);
-	}
-	else {
-		printf("NewDocumentPlugIn: Error : cannot retrieve plugin bundle.");
-		return NULL;
 	}
-	
-	return templatesURL;
+	pthread_mutex_unlock(&gOccupancyMutex);
 }
 
 /*
- * CopyLocalizedTemplateName
+ * ReleaseDocumentName
  *
- * Return a localized version of the template filename.
- * The returned string is mutable, as it will typically be manipulated again.
+ * Called when a document couldn't be created under the number suffix reserved
+ * by ResolveDocumentName. The number is no longer reserved; it is free again,
+ * unless the name was taken by another document meanwhile.
  */
-static CFMutableStringRef CopyLocalizedTemplateName(CFStringRef templateFilename, bool localizeForMenu)
+static void ReleaseDocumentName(const char *directory, const char *baseName, const char *extensions, int suffix, Boolean taken)
 {
-	CFStringRef localized, templateName, templateExtensions, tmpStr;
-	CFMutableStringRef filename;
-	CFRange dotPosition;
+	OccupancyIndex *index;
 	
-	// Get localized format string for the template name
-	if (localizeForMenu)
-		localized = CFCopyLocalizedStringFromTableInBundle(CFSTR("templateMenuName"),
-														   NULL,
-														   GetSelfBundle(),
+	if (suffix <= 0)
+		return;
+	
+	pthread_mutex_lock(&gOccupancyMutex);
+	for (index = gOccupancyIndexes; index != NULL; index = index->next) {
+		if (strcmp(index->directory, directory) == 0
+			&& strcmp(index->baseName, baseName) == 0
+			&& strcmp(index->extensions, extensions) == 0) {
+			index->reserved[suffix / 32] &= ~(1U << (suffix % 32));
+			if (!taken)
+				index->used[suffix / 32] &= ~(1U << (suffix % 32));
+			break;
+		}
+	}
+	pthread_mutex_unlock(&gOccupancyMutex);
+}
+
+/*
+ * HasReservedDocumentSuffixes
+ *
+ * Indicates wether numbers of an occupancy index are reserved by creations
+ * that haven't ended yet : the index must not be freed until they end. The
+ * caller must hold gOccupancyMutex.
+ */
+static Boolean HasReservedDocumentSuffixes(const OccupancyIndex *index)
+{
+	size_t i;
+	
+	for (i = 0; i < sizeof(index->reserved) / sizeof(index->reserved[0]); i++) {
+		if (index->reserved[i] != 0)
+			return true;
+	}
+	
+	return false;
+}
+
+/*
+ * FreeOccupancyIndex
+ *
+ * Release an occupancy index.
+ */
+static void FreeOccupancyIndex(OccupancyIndex *index)
+{
+	AddToMetric(&gMetrics.cacheBytes[kNewDocumentPlugInOccupancyCache], -GetOccupancyIndexSize(index));
+	
+	free(index->directory);
+	free(index->baseName);
+	free(index->extensions);
+	free(index->foldedBaseName);
+	free(index->foldedExtensions);
+	free(index);
+}
+
+/*
+ * GetOccupancyIndexSize
+ *
+ * Return the memory used by an occupancy index, in bytes.
+ */
+static SInt64 GetOccupancyIndexSize(const OccupancyIndex *index)
+{
+	return sizeof(OccupancyIndex)
+		+ strlen(index->directory) + strlen(index->baseName) + strlen(index->extensions)
+		+ strlen(index->foldedBaseName) + strlen(index->foldedExtensions) + 5;
+}
+
+/*
+ * FoldFileName
+ *
+ * Write the folded form of a file name (UTF-8) into outFolded : decomposed,
+ * and case-folded. Two names designating the same file on a case-insensitive
+ * volume have the same folded form. Returns false if the buffer is too small.
+ */
+static Boolean FoldFileName(const char *name, char *outFolded, size_t outSize)
+{
+	size_t length = strlen(name);
+	
+	// Most names are plain ASCII, and only need their case folded
+	if (length < outSize && FoldASCIIFileName(name, length, outFolded))
+		return true;
+	
+	return FoldUnicodeFileName(name, outFolded, outSize);
+}
+
+/*
+ * FoldASCIIFileName
+ *
+ * Fast path of FoldFileName for ASCII names : convert upper case letters to
+ * lower case, 16 bytes at a time where SSE2 or AArch64 NEON is available
+ * (vmaxvq_u8 doesn't exist on 32-bit ARM). outFolded
+ * must hold length + 1 bytes. Returns false if the name isn't plain ASCII.
+ */
+static Boolean FoldASCIIFileName(const char *name, size_t length, char *outFolded)
+{
+	size_t i = 0;
+	
+#if defined(__SSE2__)
+	const __m128i beforeA = _mm_set1_epi8('A' - 1), afterZ = _mm_set1_epi8('Z' + 1), caseBit = _mm_set1_epi8(0x20);
+	__m128i chunk, upper;
+	
+	for (; i + 16 <= length; i += 16) {
+		chunk = _mm_loadu_si128((const __m128i*)(name + i));
+		if (_mm_movemask_epi8(chunk) != 0)
+			return false;
+		upper = _mm_and_si128(_mm_cmpgt_epi8(chunk, beforeA), _mm_cmplt_epi8(chunk, afterZ));
+		_mm_storeu_si128((__m128i*)(outFolded + i), _mm_or_si128(chunk, _mm_and_si128(upper, caseBit)));
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	const uint8x16_t letterA = vdupq_n_u8('A'), lettersCount = vdupq_n_u8(26), caseBit = vdupq_n_u8(0x20);
+	uint8x16_t chunk, upper;
+	
+	for (; i + 16 <= length; i += 16) {
+		chunk = vld1q_u8((const uint8_t*)(name + i));
+		if (vmaxvq_u8(chunk) >= 0x80)
+			return false;
+		upper = vcltq_u8(vsubq_u8(chunk, letterA), lettersCount);
+		vst1q_u8((uint8_t*)(outFolded + i), vorrq_u8(chunk, vandq_u8(upper, caseBit)));
+	}
+#endif
+	
+	for (; i < length; i++) {
+		if ((unsigned char)name[i] >= 0x80)
+			return false;
+		outFolded[i] = (name[i] >= 'A' && name[i] <= 'Z') ? name[i] | 0x20 : name[i];
+	}
+	outFolded[length] = '\0';
+	
+	return true;
+}
+
+/*
+ * FoldUnicodeFileName
+ *
+ * Fallback of FoldFileName for non-ASCII names, using CoreFoundation to
+ * decompose the name and fold its case.
+ */
+static Boolean FoldUnicodeFileName(const char *name, char *outFolded, size_t outSize)
+{
+	CFStringRef string;
+	CFMutableStringRef folded;
+	Boolean result = false;
+	
+	string = CFStringCreateWithBytes(NULL, (const UInt8*)name, strlen(name), kCFStringEncodingUTF8, false);
+	if (string == NULL)
+		return false;
+	
+	folded = CFStringCreateMutableCopy(NULL, 0, string);
+	if (folded != NULL) {
+		CFStringFold(folded, kCFCompareCaseInsensitive, NULL);
+		CFStringNormalize(folded, kCFStringNormalizationFormD);
+		result = CFStringGetCString(folded, outFolded, outSize, kCFStringEncodingUTF8);
+		CFRelease(folded);
+	}
+	
+	CFRelease(string);
+	
+	return result;
+}
+
+/*
+ * CopyTemplatesFilenames
+ *
+ * Returns a array that contains the POSIX filenames to the templates, relative
+ * to the templates directory. Templates within categories are prefixed by their
+ * category path ("Category/Template.ext"). The templates of a category always
+ * come before the templates of its subcategories.
+ * The list comes from the templates manifest, so the templates directories are
+ * only enumerated when they change.
+ */
+static CFArrayRef CopyTemplatesFilenames()
+{
+	CFDictionaryRef manifest;
+	CFArrayRef result = NULL;
+	
+	manifest = CopyTemplatesManifest();
+	
+	if (manifest != NULL) {
+		pthread_mutex_lock(&gTemplatesManifestMutex);
+		if (gTemplatesNames != NULL)
+			result = CFRetain(gTemplatesNames);
+		pthread_mutex_unlock(&gTemplatesManifestMutex);
+		CFRelease(manifest);
+	}
+	else {
+		printf("NewDocumentPlugIn: Error : cannot retrieve templates list.");
+	}
+	
+	return result;
+}
+
+/*
+ * AppendTemplatesFilenames
+ *
+ * Append the templates of a category (the empty string for the templates
+ * directory itself) to an array, then the templates of its subcategories.
+ * Subdirectories without extension are categories; others are packages.
+ * Hidden items are skipped.
+ * If directories isn't NULL, the modification date of each category directory
+ * is recorded in it, keyed by category, before the directory is enumerated :
+ * a modification during the enumeration then shows in the recorded date.
+ */
+static void AppendTemplatesFilenames(CFStringRef templatesPath, CFStringRef category, CFMutableArrayRef templates, CFMutableDictionaryRef directories)
+{
+	CFMutableArrayRef subcategories;
+	CFStringRef directoryPath, POSIXFilename, templateName;
+	CFNumberRef number;
+	CFIndex i, count;
+	DIR *dir = NULL;
+	struct dirent *dirEntry;
+	struct stat info;
+	char path[PATH_MAX], childPath[PATH_MAX];
+	SInt64 date;
+	
+	if (directories != NULL && GetDirectoryModificationDate(templatesPath, category, &date)) {
+		number = CFNumberCreate(NULL, kCFNumberSInt64Type, &date);
+		CFDictionarySetValue(directories, category, number);
+		CFRelease(number);
+	}
+	
+	if (CFStringGetLength(category) > 0)
+		directoryPath = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@/%@"), templatesPath, category);
+	else
+		directoryPath = CFRetain(templatesPath);
+	if (CFStringGetFileSystemRepresentation(directoryPath, path, sizeof(path)))
+		dir = opendir(path);
+	CFRelease(directoryPath);
+	if (dir == NULL)
+		return;
+	subcategories = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+	
+	// Enumerate the templates directory, without the hidden items
+	while ((dirEntry = readdir(dir)) != NULL) {
+		if (dirEntry->d_name[0] == '.'
+			|| snprintf(childPath, sizeof(childPath), "%s/%s", path, dirEntry->d_name) >= sizeof(childPath)
+			|| stat(childPath, &info) != 0)
+			continue;
+		POSIXFilename = CFStringCreateWithFileSystemRepresentation(NULL, dirEntry->d_name);
+		
+		if (CFStringGetLength(category) > 0)
+			templateName = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@/%@"), category, POSIXFilename);
+		else
+			templateName = CFRetain(POSIXFilename);
+		
+		// Add a new entry to the array, or keep the category for later
+		if (S_ISDIR(info.st_mode)
+			&& CFStringFind(POSIXFilename, CFSTR("."), 0).location == kCFNotFound)
+			CFArrayAppendValue(subcategories, templateName);
+		else
+			CFArrayAppendValue(templates, templateName);
+		
+		CFRelease(templateName);
+		CFRelease(POSIXFilename);
+	}
+	closedir(dir);
+	
+	// Then enumerate the subcategories
+	count = CFArrayGetCount(subcategories);
+	for (i = 0; i < count; i++)
+		AppendTemplatesFilenames(templatesPath, CFArrayGetValueAtIndex(subcategories, i), templates, directories);
+	
+	CFRelease(subcategories);
+}
+
+/*
+ * CopyTemplateURL
+ *
+ * Return the URL of a template from its name, as returned by
+ * CopyTemplatesFilenames, or NULL if it doesn't exist.
+ */
+static CFURLRef CopyTemplateURL(CFStringRef templateName)
+{
+	CFURLRef result = NULL;
+	CFStringRef templatesPath, templatePath;
+	char path[PATH_MAX];
+	struct stat info;
+	
+	templatesPath = CopyTemplatesDirectoryPath();
+	if (templatesPath == NULL)
+		return NULL;
+	
+	templatePath = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@/%@"), templatesPath, templateName);
+	if (CFStringGetFileSystemRepresentation(templatePath, path, sizeof(path)) && stat(path, &info) == 0)
+		result = CFURLCreateWithFileSystemPath(NULL, templatePath, kCFURLPOSIXPathStyle, S_ISDIR(info.st_mode));
+	
+	CFRelease(templatePath);
+	CFRelease(templatesPath);
+	
+	return result;
+}
+
+/*
+ * CopyTemplateCategory
+ *
+ * Return the category path of a template name (i.e. everything before the
+ * last slash), or an empty string for uncategorized templates.
+ */
+static CFStringRef CopyTemplateCategory(CFStringRef templateName)
+{
+	CFRange slash = CFStringFind(templateName, CFSTR("/"), kCFCompareBackwards);
+	
+	if (slash.location == kCFNotFound)
+		return CFSTR("");
+	
+	return CFStringCreateWithSubstring(NULL, templateName, CFRangeMake(0, slash.location));
+}
+
+/*
+ * CopyLocalizedTemplateName
+ *
+ * Return a localized version of the template filename.
+ * The category of the template, if any, is not part of the result.
+ * The returned string is mutable, as it will typically be manipulated again.
+ */
+static CFMutableStringRef CopyLocalizedTemplateName(CFStringRef templatePath, bool localizeForMenu)
+{
+	CFStringRef localized, templateFilename, templateName, templateExtensions, tmpStr;
+	CFMutableStringRef filename;
+	CFRange dotPosition, slashPosition;
+	
+	// Drop the category of the template
+	slashPosition = CFStringFind(templatePath, CFSTR("/"), kCFCompareBackwards);
+	if (slashPosition.location != kCFNotFound)
+		templateFilename = CFStringCreateWithSubstring(NULL,
+													   templatePath,
+													   CFRangeMake(slashPosition.location + 1,
+																   CFStringGetLength(templatePath) - slashPosition.location - 1));
+	else
+		templateFilename = CFRetain(templatePath);
+	
+	// Get localized format string for the template name
+	if (localizeForMenu)
+		localized = CFCopyLocalizedStringFromTableInBundle(CFSTR("templateMenuName"),
+														   NULL,
+														   GetSelfBundle(),
 														   CFSTR("Name of templates as displayed in menus"));
 	else
 		localized = CFCopyLocalizedStringFromTableInBundle(CFSTR("templateDocumentName"),
@@ -950,48 +1874,5443 @@ static CFMutableStringRef CopyLocalizedTemplateName(CFStringRef templateFilename
 		templateExtensions = CFSTR("");
 	}
 	
-	// Check if there is a specific override for this template
-	tmpStr = CFCopyLocalizedStringWithDefaultValue(templateName, NULL, GetSelfBundle(), templateName, "");
-	CFRelease(templateName);  // Release the original (and immutable) templateName…
-	templateName = tmpStr;    // …and replace it by the overriden one. 
+	// Check if there is a specific override for this template
+	tmpStr = CFCopyLocalizedStringWithDefaultValue(templateName, NULL, GetSelfBundle(), templateName, "");
+	CFRelease(templateName);  // Release the original (and immutable) templateName…
+	templateName = tmpStr;    // …and replace it by the overriden one. 
+	
+	// Localize the template name, then append the extensions
+	filename = CFStringCreateMutable(NULL, 0);
+	CFStringAppendFormat(filename,
+						 NULL,
+						 localized,
+						 templateName);
+	CFStringAppend(filename, templateExtensions);
+	
+	// Clean-up
+	CFRelease(localized);
+	CFRelease(templateName);
+	CFRelease(templateExtensions);
+	CFRelease(templateFilename);
+	
+	return filename;
+}
+
+/*
+ * RemoveLastExtension
+ *
+ * Return a localized version of the template filename.
+ */
+static void RemoveLastExtension(CFMutableStringRef filename)
+{
+	CFArrayRef dotResults;
+	
+	// Remove the last of remaining extensions, if any
+	dotResults = CFStringCreateArrayWithFindResults(NULL,
+													filename,
+													CFSTR("."), 
+													CFRangeMake(0, CFStringGetLength(filename)),
+													0);
+	if (dotResults != NULL && CFArrayGetCount(dotResults) > 0) {
+		CFRange* dotRange = (CFRange*)CFArrayGetValueAtIndex(dotResults, CFArrayGetCount(dotResults) - 1);
+		CFStringDelete(filename, CFRangeMake(dotRange->location, CFStringGetLength(filename) - dotRange->location));
+	}
+	
+	CFRelease(dotResults);
+}
+
+
+// -----------------------------------------------------------------------------
+//	Templates manifest
+// -----------------------------------------------------------------------------
+
+/*
+ * CopyTemplatesManifest
+ *
+ * Return the templates manifest, a dictionary describing every template :
+ *   - "Version" : the manifest format version,
+ *   - "Root" : the path of the templates directory,
+ *   - "RootInode" : the inode of the templates directory, which changes when
+ *     a synchronized catalog replaces it (see SyncTemplates),
+ *   - "Directories" : the modification date of the templates directory and of
+ *     each category directory, keyed by category,
+ *   - "Templates" : an array of templates descriptions, in the order of
+ *     CopyTemplatesFilenames (see CreateTemplateDescription).
+ * The manifest is kept in memory and in the user caches folder. Its
+ * directories are checked at most every kNewDocumentPlugInManifestCheckInterval
+ * seconds; the template files are then checked by the warm-up thread, in the
+ * background. The manifest itself is built by RefreshTemplatesManifest on the
+ * warm-up thread : the calling thread waits for it only when there is no valid
+ * manifest in memory, and only builds it when the warm-up thread isn't
+ * running. Can be called from any thread.
+ */
+static CFDictionaryRef CopyTemplatesManifest()
+{
+	CFDictionaryRef result = NULL;
+	CFStringRef templatesPath;
+	CFAbsoluteTime now;
+	UInt32 builds;
+	Boolean refreshed = false;
+	
+	templatesPath = CopyTemplatesDirectoryPath();
+	if (templatesPath == NULL)
+		return NULL;
+	
+	pthread_mutex_lock(&gTemplatesManifestMutex);
+	
+	while (result == NULL && !refreshed) {
+		
+		// Fast path : the manifest in memory has been checked recently, or its
+		// directories haven't changed. Without warm-up thread, its files are
+		// compared here too.
+		now = CFAbsoluteTimeGetCurrent();
+		if (gTemplatesManifest != NULL) {
+			if (now - gTemplatesManifestCheckDate < kNewDocumentPlugInManifestCheckInterval)
+				result = CFRetain(gTemplatesManifest);
+			else if (!IsTemplatesManifestStale(gTemplatesManifest, templatesPath)
+					 && (gTemplatesManifestRefresherRunning || !AreTemplateFilesModified(gTemplatesManifest, templatesPath))) {
+				result = CFRetain(gTemplatesManifest);
+				gTemplatesManifestCheckDate = now;
+				RequestTemplatesManifestRefresh();
+			}
+		}
+		if (result != NULL)
+			break;
+		
+		if (gTemplatesManifestBuilding || gTemplatesManifestRefresherRunning) {
+			// Wait for the manifest being built, or for the warm-up thread
+			if (!gTemplatesManifestBuilding)
+				RequestTemplatesManifestRefresh();
+			builds = gTemplatesManifestBuilds;
+			while (builds == gTemplatesManifestBuilds
+				   && (gTemplatesManifestBuilding || gTemplatesManifestRefresherRunning))
+				pthread_cond_wait(&gTemplatesManifestCondition, &gTemplatesManifestMutex);
+			refreshed = (builds != gTemplatesManifestBuilds);
+		}
+		else {
+			pthread_mutex_unlock(&gTemplatesManifestMutex);
+			RefreshTemplatesManifest(false);
+			pthread_mutex_lock(&gTemplatesManifestMutex);
+			refreshed = true;
+		}
+		
+		// A manifest that got stale again meanwhile is still the latest one
+		if (refreshed && gTemplatesManifest != NULL)
+			result = CFRetain(gTemplatesManifest);
+	}
+	
+	pthread_mutex_unlock(&gTemplatesManifestMutex);
+	
+	CFRelease(templatesPath);
+	
+	return result;
+}
+
+/*
+ * RefreshTemplatesManifest
+ *
+ * Rebuild the templates manifest in memory if it is missing or stale : load
+ * the one stored by a previous run, or build a new one, reusing the hashes of
+ * the unmodified files. With checkFiles, the template files of a manifest
+ * whose directories haven't changed are compared too, as editing a file
+ * doesn't modify its directory. Enumerates and hashes without holding
+ * gTemplatesManifestMutex; one thread at a time rebuilds the manifest, and the
+ * threads waiting for it are woken up once done.
+ */
+static void RefreshTemplatesManifest(Boolean checkFiles)
+{
+	CFDictionaryRef current = NULL, manifest = NULL, previous = NULL;
+	CFMutableArrayRef names = NULL;
+	CFArrayRef templates;
+	CFStringRef templatesPath;
+	CFURLRef manifestURL;
+	CFIndex i, count;
+	CFAbsoluteTime startDate;
+	
+	pthread_mutex_lock(&gTemplatesManifestMutex);
+	while (gTemplatesManifestBuilding)
+		pthread_cond_wait(&gTemplatesManifestCondition, &gTemplatesManifestMutex);
+	gTemplatesManifestBuilding = true;
+	if (gTemplatesManifest != NULL)
+		current = CFRetain(gTemplatesManifest);
+	pthread_mutex_unlock(&gTemplatesManifestMutex);
+	
+	startDate = CFAbsoluteTimeGetCurrent();
+	templatesPath = CopyTemplatesDirectoryPath();
+	if (templatesPath != NULL
+		&& (current == NULL
+			|| IsTemplatesManifestStale(current, templatesPath)
+			|| (checkFiles && AreTemplateFilesModified(current, templatesPath)))) {
+		
+		// Load the manifest stored by a previous run, or build a new one
+		manifestURL = CopyTemplatesManifestURL();
+		manifest = (manifestURL != NULL) ? CopyTemplatesManifestFromFile(manifestURL) : NULL;
+		
+		if (manifest != NULL
+			&& (IsTemplatesManifestStale(manifest, templatesPath) || AreTemplateFilesModified(manifest, templatesPath))) {
+			previous = manifest;
+			manifest = NULL;
+		}
+		
+		if (manifest == NULL) {
+			manifest = CreateTemplatesManifest(templatesPath, (previous != NULL) ? previous : current);
+			if (manifest != NULL && manifestURL != NULL)
+				WriteTemplatesManifestToFile(manifest, manifestURL);
+		}
+		if (previous != NULL)
+			CFRelease(previous);
+		
+		if (manifest != NULL) {
+			// Keep the templates names at hand
+			templates = CFDictionaryGetValue(manifest, CFSTR("Templates"));
+			count = CFArrayGetCount(templates);
+			names = CFArrayCreateMutable(NULL, count, &kCFTypeArrayCallBacks);
+			for (i = 0; i < count; i++)
+				CFArrayAppendValue(names, CFDictionaryGetValue(CFArrayGetValueAtIndex(templates, i), CFSTR("Name")));
+		}
+		
+		if (manifestURL != NULL)
+			CFRelease(manifestURL);
+		
+		RecordPhaseTime(kNewDocumentPlugInManifestPhase, startDate);
+	}
+	
+	pthread_mutex_lock(&gTemplatesManifestMutex);
+	if (manifest != NULL) {
+		if (gTemplatesManifest != NULL)
+			CFRelease(gTemplatesManifest);
+		if (gTemplatesNames != NULL)
+			CFRelease(gTemplatesNames);
+		gTemplatesManifest = manifest;
+		gTemplatesNames = names;
+	}
+	if (gTemplatesManifest != NULL)
+		gTemplatesManifestCheckDate = startDate;
+	gTemplatesManifestBuilding = false;
+	gTemplatesManifestBuilds++;
+	pthread_cond_broadcast(&gTemplatesManifestCondition);
+	pthread_mutex_unlock(&gTemplatesManifestMutex);
+	
+	if (current != NULL)
+		CFRelease(current);
+	if (templatesPath != NULL)
+		CFRelease(templatesPath);
+}
+
+/*
+ * RequestTemplatesManifestRefresh
+ *
+ * Ask the warm-up thread to check the manifest in memory, files included, and
+ * to rebuild it if needed. Does nothing if the warm-up thread isn't running.
+ * The caller must hold gTemplatesManifestMutex.
+ */
+static void RequestTemplatesManifestRefresh()
+{
+	if (gTemplatesManifestRefresherRunning) {
+		gTemplatesManifestRefreshRequested = true;
+		pthread_cond_broadcast(&gTemplatesManifestCondition);
+	}
+}
+
+/*
+ * CreateTemplatesManifest
+ *
+ * Enumerate the templates directories, and build a new templates manifest.
+ * The hashes of the files that haven't changed since the previous manifest
+ * (if not NULL) are reused.
+ */
+static CFDictionaryRef CreateTemplatesManifest(CFStringRef templatesPath, CFDictionaryRef previous)
+{
+	CFMutableDictionaryRef manifest, directories, knownFiles;
+	CFMutableArrayRef names, templates;
+	CFDictionaryRef description;
+	CFNumberRef number;
+	CFIndex i, count;
+	SInt32 version = kNewDocumentPlugInManifestVersion;
+	SInt64 rootInode = 0;
+	char path[PATH_MAX];
+	struct stat info;
+	
+	if (GetSelfBundle() == NULL)
+		return NULL;
+	
+	if (CFStringGetFileSystemRepresentation(templatesPath, path, sizeof(path)) && stat(path, &info) == 0)
+		rootInode = info.st_ino;
+	
+	names = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+	manifest = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	directories = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	
+	// Record the directories dates before enumerating them, so that a
+	// modification during the enumeration makes the manifest stale
+	AppendTemplatesFilenames(templatesPath, CFSTR(""), names, directories);
+	
+	// Describe each template
+	knownFiles = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	if (previous != NULL)
+		AddKnownTemplateFiles(previous, knownFiles);
+	count = CFArrayGetCount(names);
+	templates = CFArrayCreateMutable(NULL, count, &kCFTypeArrayCallBacks);
+	for (i = 0; i < count; i++) {
+		description = CreateTemplateDescription(CFArrayGetValueAtIndex(names, i), templatesPath, knownFiles);
+		CFArrayAppendValue(templates, description);
+		CFRelease(description);
+	}
+	CFRelease(knownFiles);
+	
+	number = CFNumberCreate(NULL, kCFNumberSInt32Type, &version);
+	CFDictionarySetValue(manifest, CFSTR("Version"), number);
+	CFDictionarySetValue(manifest, CFSTR("Root"), templatesPath);
+	CFDictionarySetValue(manifest, CFSTR("Directories"), directories);
+	CFDictionarySetValue(manifest, CFSTR("Templates"), templates);
+	CFRelease(number);
+	number = CFNumberCreate(NULL, kCFNumberSInt64Type, &rootInode);
+	CFDictionarySetValue(manifest, CFSTR("RootInode"), number);
+	
+	CFRelease(number);
+	CFRelease(templates);
+	CFRelease(directories);
+	CFRelease(names);
+	
+	return manifest;
+}
+
+/*
+ * CreateTemplateDescription
+ *
+ * Return the description of a template in the manifest :
+ *   - "Name" : the template name, as returned by CopyTemplatesFilenames,
+ *   - "Stem" : the file name before the first dot, which is also the key of
+ *     the localized template name,
+ *   - "Extensions" : the file name from the first dot, or an empty string,
+ *   - "Size" : the size of the file in bytes (for packages, the size of all
+ *     their files),
+ *   - "Package" : true if the template is a directory,
+ *   - "Hash" : a hash of the file contents (0 for packages),
+ *   - "Inode" and "Modified" : for files only, the inode and modification
+ *     date (in nanoseconds) the hash was computed from (see HashTemplateFile);
+ *     packages only have the "Modified" date of their directory,
+ *   - "Tree" : for packages only, the contents of the package (see
+ *     AppendTemplateTree).
+ */
+static CFDictionaryRef CreateTemplateDescription(CFStringRef templateName, CFStringRef templatesPath, CFDictionaryRef knownFiles)
+{
+	CFMutableDictionaryRef description;
+	CFStringRef filename, stem, extensions, templatePath;
+	CFNumberRef number;
+	CFMutableArrayRef tree;
+	CFRange slash, dot;
+	char path[PATH_MAX];
+	struct stat info;
+	SInt64 size = 0, modified;
+	UInt64 hash = 0;
+	Boolean isPackage = false;
+	
+	description = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	CFDictionarySetValue(description, CFSTR("Name"), templateName);
+	
+	// Split the file name on its first dot
+	slash = CFStringFind(templateName, CFSTR("/"), kCFCompareBackwards);
+	if (slash.location != kCFNotFound)
+		filename = CFStringCreateWithSubstring(NULL, templateName, CFRangeMake(slash.location + 1, CFStringGetLength(templateName) - slash.location - 1));
+	else
+		filename = CFRetain(templateName);
+	
+	dot = CFStringFind(filename, CFSTR("."), 0);
+	if (dot.location != kCFNotFound) {
+		stem = CFStringCreateWithSubstring(NULL, filename, CFRangeMake(0, dot.location));
+		extensions = CFStringCreateWithSubstring(NULL, filename, CFRangeMake(dot.location, CFStringGetLength(filename) - dot.location));
+	}
+	else {
+		stem = CFRetain(filename);
+		extensions = CFRetain(CFSTR(""));
+	}
+	CFDictionarySetValue(description, CFSTR("Stem"), stem);
+	CFDictionarySetValue(description, CFSTR("Extensions"), extensions);
+	
+	// Describe the file itself
+	templatePath = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@/%@"), templatesPath, templateName);
+	if (CFStringGetFileSystemRepresentation(templatePath, path, sizeof(path)) && stat(path, &info) == 0) {
+		isPackage = S_ISDIR(info.st_mode);
+		if (!isPackage) {
+			size = info.st_size;
+			hash = HashTemplateFile(path, &info, knownFiles, description);
+		}
+		else {
+			modified = GetModificationTime(&info);
+			number = CFNumberCreate(NULL, kCFNumberSInt64Type, &modified);
+			CFDictionarySetValue(description, CFSTR("Modified"), number);
+			CFRelease(number);
+			tree = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+			AppendTemplateTree(path, "", knownFiles, tree, &size);
+			CFDictionarySetValue(description, CFSTR("Tree"), tree);
+			CFRelease(tree);
+		}
+	}
+	
+	number = CFNumberCreate(NULL, kCFNumberSInt64Type, &size);
+	CFDictionarySetValue(description, CFSTR("Size"), number);
+	CFRelease(number);
+	number = CFNumberCreate(NULL, kCFNumberSInt64Type, &hash);
+	CFDictionarySetValue(description, CFSTR("Hash"), number);
+	CFRelease(number);
+	CFDictionarySetValue(description, CFSTR("Package"), isPackage ? kCFBooleanTrue : kCFBooleanFalse);
+	
+	CFRelease(templatePath);
+	CFRelease(extensions);
+	CFRelease(stem);
+	CFRelease(filename);
+	
+	return description;
+}
+
+/*
+ * IsTemplatesManifestStale
+ *
+ * Indicates wether a manifest doesn't match the templates directories anymore :
+ * wrong version, moved or replaced templates directory, or a modified
+ * directory. Only stats the directories, not the template files (see
+ * AreTemplateFilesModified), so that it can be called when building a menu.
+ */
+static Boolean IsTemplatesManifestStale(CFDictionaryRef manifest, CFStringRef templatesPath)
+{
+	CFDictionaryRef directories;
+	CFNumberRef version, rootInode;
+	CFStringRef root;
+	const void **keys, **values;
+	CFIndex i, count;
+	SInt32 versionValue = 0;
+	SInt64 recordedDate, date, recordedInode = 0;
+	char path[PATH_MAX];
+	struct stat info;
+	Boolean stale = false;
+	
+	version = CFDictionaryGetValue(manifest, CFSTR("Version"));
+	root = CFDictionaryGetValue(manifest, CFSTR("Root"));
+	rootInode = CFDictionaryGetValue(manifest, CFSTR("RootInode"));
+	directories = CFDictionaryGetValue(manifest, CFSTR("Directories"));
+	
+	if (version == NULL || root == NULL || rootInode == NULL || directories == NULL
+		|| CFDictionaryGetValue(manifest, CFSTR("Templates")) == NULL)
+		return true;
+	
+	CFNumberGetValue(version, kCFNumberSInt32Type, &versionValue);
+	if (versionValue != kNewDocumentPlugInManifestVersion || !CFEqual(root, templatesPath))
+		return true;
+	
+	// A synchronized catalog replaces the whole directory
+	CFNumberGetValue(rootInode, kCFNumberSInt64Type, &recordedInode);
+	if (!CFStringGetFileSystemRepresentation(templatesPath, path, sizeof(path))
+		|| stat(path, &info) != 0
+		|| (SInt64)info.st_ino != recordedInode)
+		return true;
+	
+	// Compare the modification dates of the directories
+	count = CFDictionaryGetCount(directories);
+	keys = (const void**) malloc(count * sizeof(void*));
+	values = (const void**) malloc(count * sizeof(void*));
+	CFDictionaryGetKeysAndValues(directories, keys, values);
+	
+	for (i = 0; i < count && !stale; i++) {
+		CFNumberGetValue(values[i], kCFNumberSInt64Type, &recordedDate);
+		stale = !GetDirectoryModificationDate(templatesPath, keys[i], &date) || date != recordedDate;
+	}
+	
+	free(keys);
+	free(values);
+	
+	return stale;
+}
+
+/*
+ * AreTemplateFilesModified
+ *
+ * Indicates wether one of the template files of a manifest (including the
+ * files of packages) has been modified. Editing a file doesn't modify its
+ * directory, so IsTemplatesManifestStale doesn't notice it. Stats every file :
+ * called by the warm-up thread rather than when building a menu.
+ */
+static Boolean AreTemplateFilesModified(CFDictionaryRef manifest, CFStringRef templatesPath)
+{
+	CFArrayRef templates;
+	CFIndex i, count;
+	char path[PATH_MAX];
+	Boolean modified = false;
+	
+	templates = CFDictionaryGetValue(manifest, CFSTR("Templates"));
+	if (templates == NULL || !CFStringGetFileSystemRepresentation(templatesPath, path, sizeof(path)))
+		return true;
+	
+	count = CFArrayGetCount(templates);
+	for (i = 0; i < count && !modified; i++)
+		modified = IsTemplateModified(CFArrayGetValueAtIndex(templates, i), path);
+	
+	return modified;
+}
+
+/*
+ * IsTemplateModified
+ *
+ * Indicates wether the file of a template description, or one of the files
+ * or directories of a package template, doesn't have the size and
+ * modification date recorded in the manifest anymore. Adding or removing an
+ * item in a package modifies the date of its directory.
+ */
+static Boolean IsTemplateModified(CFDictionaryRef description, const char *templatesPath)
+{
+	CFArrayRef tree;
+	CFDictionaryRef entry;
+	char templatePath[PATH_MAX], path[PATH_MAX];
+	CFIndex i, count;
+	
+	if (!GetTemplateTreeEntryPath(description, CFSTR("Name"), templatesPath, templatePath, sizeof(templatePath))
+		|| IsTemplateFileModified(description, templatePath))
+		return true;
+	
+	tree = CFDictionaryGetValue(description, CFSTR("Tree"));
+	if (tree == NULL)
+		return false;
+	
+	count = CFArrayGetCount(tree);
+	for (i = 0; i < count; i++) {
+		entry = CFArrayGetValueAtIndex(tree, i);
+		if (CFDictionaryContainsKey(entry, CFSTR("Modified"))
+			&& (!GetTemplateTreeEntryPath(entry, CFSTR("Path"), templatePath, path, sizeof(path))
+				|| IsTemplateFileModified(entry, path)))
+			return true;
+	}
+	
+	return false;
+}
+
+/*
+ * IsTemplateFileModified
+ *
+ * Indicates wether a file doesn't have the "Size" and "Modified" date recorded
+ * in its description anymore (only the date, for directories). Descriptions
+ * without date (symbolic links) are never modified.
+ */
+static Boolean IsTemplateFileModified(CFDictionaryRef description, const char *path)
+{
+	CFNumberRef number;
+	SInt64 recordedSize = -1, recordedDate = -1;
+	struct stat info;
+	
+	number = CFDictionaryGetValue(description, CFSTR("Modified"));
+	if (number == NULL)
+		return false;
+	CFNumberGetValue(number, kCFNumberSInt64Type, &recordedDate);
+	if ((number = CFDictionaryGetValue(description, CFSTR("Size"))) != NULL)
+		CFNumberGetValue(number, kCFNumberSInt64Type, &recordedSize);
+	
+	return stat(path, &info) != 0
+		|| (!S_ISDIR(info.st_mode) && info.st_size != recordedSize)
+		|| GetModificationTime(&info) != recordedDate;
+}
+
+/*
+ * CopyTemplatesDirectoryPath
+ *
+ * Return the POSIX path of the templates directory : the catalog synchronized
+ * for the user when the "TemplatesSource" preference is set and it exists (see
+ * SyncTemplates), or else the templates of the plugin resources. The path is
+ * computed once, and changed by the first synchronization.
+ */
+static CFStringRef CopyTemplatesDirectoryPath()
+{
+	CFPropertyListRef preference;
+	CFURLRef resourcesURL, absoluteURL;
+	CFStringRef resourcesPath, result;
+	char path[PATH_MAX];
+	struct stat info;
+	
+	pthread_mutex_lock(&gTemplatesManifestMutex);
+	result = (gTemplatesPath != NULL) ? CFRetain(gTemplatesPath) : NULL;
+	pthread_mutex_unlock(&gTemplatesManifestMutex);
+	if (result != NULL)
+		return result;
+	
+	preference = CFPreferencesCopyAppValue(CFSTR("TemplatesSource"), CFSTR(kNewDocumentPlugInBundle));
+	if (preference != NULL) {
+		result = CopySyncedTemplatesPath();
+		if (result != NULL
+			&& !(CFStringGetFileSystemRepresentation(result, path, sizeof(path))
+				 && stat(path, &info) == 0 && S_ISDIR(info.st_mode))) {
+			CFRelease(result);
+			result = NULL;
+		}
+		CFRelease(preference);
+	}
+	
+	if (result == NULL) {
+		if (GetSelfBundle() == NULL)
+			return NULL;
+		
+		resourcesURL = CFBundleCopyResourcesDirectoryURL(GetSelfBundle());
+		if (resourcesURL == NULL)
+			return NULL;
+		absoluteURL = CFURLCopyAbsoluteURL(resourcesURL);
+		resourcesPath = CFURLCopyFileSystemPath(absoluteURL, kCFURLPOSIXPathStyle);
+		
+		result = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@/%s"), resourcesPath, kNewDocumentPlugInTemplatesSubdir);
+		
+		CFRelease(resourcesPath);
+		CFRelease(absoluteURL);
+		CFRelease(resourcesURL);
+	}
+	
+	pthread_mutex_lock(&gTemplatesManifestMutex);
+	if (gTemplatesPath == NULL)
+		gTemplatesPath = CFRetain(result);
+	pthread_mutex_unlock(&gTemplatesManifestMutex);
+	
+	return result;
+}
+
+/*
+ * CopySyncedTemplatesPath
+ *
+ * Return the POSIX path of the catalog synchronized from the "TemplatesSource"
+ * directory, in the plugin caches directory. The catalog may not exist yet.
+ */
+static CFStringRef CopySyncedTemplatesPath()
+{
+	CFURLRef cachesURL, catalogURL;
+	CFStringRef result;
+	
+	cachesURL = CopyPlugInCachesURL();
+	if (cachesURL == NULL)
+		return NULL;
+	catalogURL = CFURLCreateCopyAppendingPathComponent(NULL, cachesURL, CFSTR(kNewDocumentPlugInSyncCatalogName), true);
+	result = CFURLCopyFileSystemPath(catalogURL, kCFURLPOSIXPathStyle);
+	
+	CFRelease(catalogURL);
+	CFRelease(cachesURL);
+	
+	return result;
+}
+
+/*
+ * CopyTemplatesManifestURL
+ *
+ * Return the URL of the manifest file, in the user caches folder, creating
+ * the plugin caches directory if needed. Returns NULL on error.
+ */
+static CFURLRef CopyTemplatesManifestURL()
+{
+	CFURLRef pluginCachesURL, result;
+	
+	pluginCachesURL = CopyPlugInCachesURL();
+	if (pluginCachesURL == NULL)
+		return NULL;
+	
+	result = CFURLCreateCopyAppendingPathComponent(NULL, pluginCachesURL, CFSTR(kNewDocumentPlugInManifestFilename), false);
+	CFRelease(pluginCachesURL);
+	
+	return result;
+}
+
+/*
+ * CopyPlugInCachesURL
+ *
+ * Return the URL of the plugin directory in the user caches folder
+ * (~/Library/Caches/<bundle identifier>), creating it if needed.
+ * Returns NULL if the directory can't be created.
+ */
+static CFURLRef CopyPlugInCachesURL()
+{
+	FSRef cachesFolder;
+	CFURLRef cachesURL, pluginCachesURL;
+	char path[PATH_MAX];
+	
+	if (FSFindFolder(kUserDomain, kCachedDataFolderType, kCreateFolder, &cachesFolder) != noErr)
+		return NULL;
+	
+	cachesURL = CFURLCreateFromFSRef(NULL, &cachesFolder);
+	pluginCachesURL = CFURLCreateCopyAppendingPathComponent(NULL, cachesURL, CFSTR(kNewDocumentPlugInBundle), true);
+	CFRelease(cachesURL);
+	
+	if (!CFURLGetFileSystemRepresentation(pluginCachesURL, true, (UInt8*)path, sizeof(path))
+		|| (mkdir(path, 0755) != 0 && errno != EEXIST)) {
+		CFRelease(pluginCachesURL);
+		return NULL;
+	}
+	
+	return pluginCachesURL;
+}
+
+/*
+ * CopyTemplatesManifestFromFile
+ *
+ * Load a manifest file with a single read. Returns NULL if the file doesn't
+ * exist or is not a valid manifest.
+ */
+static CFDictionaryRef CopyTemplatesManifestFromFile(CFURLRef manifestURL)
+{
+	CFDataRef data;
+	CFPropertyListRef manifest = NULL;
+	SInt32 errorCode;
+	
+	if (!CFURLCreateDataAndPropertiesFromResource(NULL, manifestURL, &data, NULL, NULL, &errorCode) || data == NULL)
+		return NULL;
+	
+	manifest = CFPropertyListCreateFromXMLData(NULL, data, kCFPropertyListImmutable, NULL);
+	CFRelease(data);
+	
+	if (manifest != NULL && CFGetTypeID(manifest) != CFDictionaryGetTypeID()) {
+		CFRelease(manifest);
+		manifest = NULL;
+	}
+	
+	return (CFDictionaryRef)manifest;
+}
+
+/*
+ * WriteTemplatesManifestToFile
+ *
+ * Store a manifest as a binary property list. The file is written aside and
+ * then renamed, so that other processes never read a partial manifest.
+ */
+static void WriteTemplatesManifestToFile(CFDictionaryRef manifest, CFURLRef manifestURL)
+{
+	CFWriteStreamRef stream;
+	CFURLRef directoryURL, temporaryURL;
+	CFStringRef temporaryName;
+	char path[PATH_MAX], temporaryPath[PATH_MAX];
+	CFIndex written = 0;
+	
+	temporaryName = CFStringCreateWithFormat(NULL, NULL, CFSTR("%s.%d"), kNewDocumentPlugInManifestFilename, (int)getpid());
+	directoryURL = CFURLCreateCopyDeletingLastPathComponent(NULL, manifestURL);
+	temporaryURL = CFURLCreateCopyAppendingPathComponent(NULL, directoryURL, temporaryName, false);
+	CFRelease(directoryURL);
+	
+	stream = CFWriteStreamCreateWithFile(NULL, temporaryURL);
+	if (stream != NULL && CFWriteStreamOpen(stream)) {
+		written = CFPropertyListWriteToStream(manifest, stream, kCFPropertyListBinaryFormat_v1_0, NULL);
+		CFWriteStreamClose(stream);
+	}
+	if (stream != NULL)
+		CFRelease(stream);
+	
+	if (CFURLGetFileSystemRepresentation(temporaryURL, true, (UInt8*)temporaryPath, sizeof(temporaryPath))
+		&& CFURLGetFileSystemRepresentation(manifestURL, true, (UInt8*)path, sizeof(path))) {
+		if (written > 0)
+			rename(temporaryPath, path);
+		else
+			unlink(temporaryPath);
+	}
+	
+	CFRelease(temporaryURL);
+	CFRelease(temporaryName);
+}
+
+/*
+ * GetDirectoryModificationDate
+ *
+ * Retrieve the modification date of a category directory (the empty string
+ * for the templates directory itself), in nanoseconds. Returns false if it
+ * doesn't exist.
+ */
+static Boolean GetDirectoryModificationDate(CFStringRef templatesPath, CFStringRef category, SInt64 *outDate)
+{
+	CFStringRef directoryPath;
+	char path[PATH_MAX];
+	struct stat info;
+	Boolean result = false;
+	
+	if (CFStringGetLength(category) > 0)
+		directoryPath = CFStringCreateWithFormat(NULL, NULL, CFSTR("%@/%@"), templatesPath, category);
+	else
+		directoryPath = CFRetain(templatesPath);
+	
+	if (CFStringGetFileSystemRepresentation(directoryPath, path, sizeof(path)) && stat(path, &info) == 0) {
+		*outDate = GetModificationTime(&info);
+		result = true;
+	}
+	
+	CFRelease(directoryPath);
+	
+	return result;
+}
+
+/*
+ * HashFileContents
+ *
+ * Return a 64 bits FNV-1a hash of a file contents, or 0 if it cannot be read.
+ */
+static UInt64 HashFileContents(const char *path)
+{
+	UInt8 buffer[16 * 1024];
+	UInt64 hash = 14695981039346656037ULL;
+	ssize_t length, i;
+	int fd;
+	
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	
+	while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+		for (i = 0; i < length; i++) {
+			hash ^= buffer[i];
+			hash *= 1099511628211ULL;
+		}
+	}
+	
+	close(fd);
+	
+	return (length < 0) ? 0 : hash;
+}
+
+/*
+ * HashTemplateFile
+ *
+ * Return the hash of a template file, and record the "Inode" and "Modified"
+ * date (in nanoseconds) it is computed from in the file description. The hash recorded by a
+ * previous manifest, in knownFiles, is reused if the file still has the same
+ * inode, size and modification date : the files of a synchronized catalog
+ * that didn't change are links to the same inodes.
+ */
+static UInt64 HashTemplateFile(const char *path, const struct stat *info, CFDictionaryRef knownFiles, CFMutableDictionaryRef description)
+{
+	CFDictionaryRef known;
+	CFNumberRef number;
+	SInt64 inode = info->st_ino, modified = GetModificationTime(info), knownSize = -1, knownModified = -1;
+	UInt64 hash = 0;
+	
+	number = CFNumberCreate(NULL, kCFNumberSInt64Type, &inode);
+	CFDictionarySetValue(description, CFSTR("Inode"), number);
+	known = CFDictionaryGetValue(knownFiles, number);
+	CFRelease(number);
+	number = CFNumberCreate(NULL, kCFNumberSInt64Type, &modified);
+	CFDictionarySetValue(description, CFSTR("Modified"), number);
+	CFRelease(number);
+	
+	if (known != NULL) {
+		CFNumberGetValue(CFDictionaryGetValue(known, CFSTR("Size")), kCFNumberSInt64Type, &knownSize);
+		CFNumberGetValue(CFDictionaryGetValue(known, CFSTR("Modified")), kCFNumberSInt64Type, &knownModified);
+		if (knownSize == info->st_size && knownModified == modified) {
+			CFNumberGetValue(CFDictionaryGetValue(known, CFSTR("Hash")), kCFNumberSInt64Type, &hash);
+			return hash;
+		}
+	}
+	
+	return HashFileContents(path);
+}
+
+/*
+ * AddKnownTemplateFiles
+ *
+ * Add the descriptions of the files of a manifest (plain templates and files
+ * of packages) to a dictionary keyed by inode, for HashTemplateFile.
+ */
+static void AddKnownTemplateFiles(CFDictionaryRef manifest, CFMutableDictionaryRef knownFiles)
+{
+	CFArrayRef templates, tree;
+	CFDictionaryRef description, entry;
+	CFNumberRef inode;
+	CFIndex i, j, count, entriesCount;
+	
+	templates = CFDictionaryGetValue(manifest, CFSTR("Templates"));
+	count = (templates != NULL) ? CFArrayGetCount(templates) : 0;
+	
+	for (i = 0; i < count; i++) {
+		description = CFArrayGetValueAtIndex(templates, i);
+		inode = CFDictionaryGetValue(description, CFSTR("Inode"));
+		if (inode != NULL && CFDictionaryContainsKey(description, CFSTR("Modified")))
+			CFDictionarySetValue(knownFiles, inode, description);
+		
+		tree = CFDictionaryGetValue(description, CFSTR("Tree"));
+		entriesCount = (tree != NULL) ? CFArrayGetCount(tree) : 0;
+		for (j = 0; j < entriesCount; j++) {
+			entry = CFArrayGetValueAtIndex(tree, j);
+			inode = CFDictionaryGetValue(entry, CFSTR("Inode"));
+			if (inode != NULL && CFDictionaryContainsKey(entry, CFSTR("Modified")))
+				CFDictionarySetValue(knownFiles, inode, entry);
+		}
+	}
+}
+
+/*
+ * AppendTemplateTree
+ *
+ * Describe the contents of a package template, below relativePath : append an
+ * entry for each directory, regular file and symbolic link, directories
+ * before their contents. Each entry has the "Path" of the item relative to
+ * the package, and either :
+ *   - "Directory" (true) and the "Modified" date of the directory,
+ *   - "Link", the target of the symbolic link,
+ *   - or the "Size" and "Hash" of the file, which are its key in the blob
+ *     store (with the "Inode" and "Modified" date of the file, see
+ *     HashTemplateFile).
+ * Other kinds of items are skipped.
+ */
+static void AppendTemplateTree(const char *packagePath, const char *relativePath, CFDictionaryRef knownFiles, CFMutableArrayRef tree, SInt64 *ioSize)
+{
+	CFMutableDictionaryRef entry;
+	CFStringRef childName;
+	CFNumberRef number;
+	DIR *dir;
+	struct dirent *dirEntry;
+	struct stat info;
+	CFStringRef target;
+	char path[PATH_MAX], childPath[PATH_MAX], targetPath[PATH_MAX];
+	ssize_t targetLength;
+	SInt64 size, modified;
+	UInt64 hash;
+	
+	if (snprintf(path, sizeof(path), "%s/%s", packagePath, relativePath) >= sizeof(path))
+		return;
+	
+	dir = opendir(path);
+	if (dir == NULL)
+		return;
+	
+	while ((dirEntry = readdir(dir)) != NULL) {
+		if (strcmp(dirEntry->d_name, ".") == 0 || strcmp(dirEntry->d_name, "..") == 0)
+			continue;
+		
+		if (snprintf(childPath, sizeof(childPath), (relativePath[0] != '\0') ? "%s/%s" : "%s%s", relativePath, dirEntry->d_name) >= sizeof(childPath)
+			|| snprintf(path, sizeof(path), "%s/%s", packagePath, childPath) >= sizeof(path)
+			|| lstat(path, &info) != 0
+			|| !(S_ISDIR(info.st_mode) || S_ISREG(info.st_mode) || S_ISLNK(info.st_mode)))
+			continue;
+		
+		childName = CFStringCreateWithFileSystemRepresentation(NULL, childPath);
+		entry = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+		CFDictionarySetValue(entry, CFSTR("Path"), childName);
+		
+		if (S_ISDIR(info.st_mode)) {
+			modified = GetModificationTime(&info);
+			number = CFNumberCreate(NULL, kCFNumberSInt64Type, &modified);
+			CFDictionarySetValue(entry, CFSTR("Directory"), kCFBooleanTrue);
+			CFDictionarySetValue(entry, CFSTR("Modified"), number);
+			CFRelease(number);
+			CFArrayAppendValue(tree, entry);
+			AppendTemplateTree(packagePath, childPath, knownFiles, tree, ioSize);
+		}
+		else if (S_ISLNK(info.st_mode)) {
+			// Links are recreated as they are, not followed
+			targetLength = readlink(path, targetPath, sizeof(targetPath) - 1);
+			if (targetLength > 0) {
+				targetPath[targetLength] = '\0';
+				target = CFStringCreateWithFileSystemRepresentation(NULL, targetPath);
+				CFDictionarySetValue(entry, CFSTR("Link"), target);
+				CFRelease(target);
+				CFArrayAppendValue(tree, entry);
+			}
+		}
+		else {
+			size = info.st_size;
+			hash = HashTemplateFile(path, &info, knownFiles, entry);
+			number = CFNumberCreate(NULL, kCFNumberSInt64Type, &size);
+			CFDictionarySetValue(entry, CFSTR("Size"), number);
+			CFRelease(number);
+			number = CFNumberCreate(NULL, kCFNumberSInt64Type, &hash);
+			CFDictionarySetValue(entry, CFSTR("Hash"), number);
+			CFRelease(number);
+			CFArrayAppendValue(tree, entry);
+			*ioSize += size;
+		}
+		
+		CFRelease(entry);
+		CFRelease(childName);
+	}
+	
+	closedir(dir);
+}
+
+
+// -----------------------------------------------------------------------------
+//	Templates descriptor table
+// -----------------------------------------------------------------------------
+
+/*
+ * CopyTemplateTable
+ *
+ * Return the descriptor table of the current templates manifest, building it
+ * if the manifest changed. Release it with ReleaseTemplateTable().
+ * Can be called from any thread.
+ */
+static TemplateTable* CopyTemplateTable()
+{
+	CFDictionaryRef manifest;
+	TemplateTable *table;
+	CFAbsoluteTime startDate;
+	
+	manifest = CopyTemplatesManifest();
+	if (manifest == NULL)
+		return NULL;
+	
+	pthread_mutex_lock(&gTemplatesManifestMutex);
+	
+	if (gTemplateTable == NULL || gTemplateTable->manifest != manifest) {
+		startDate = CFAbsoluteTimeGetCurrent();
+		table = CreateTemplateTable(manifest);
+		RecordPhaseTime(kNewDocumentPlugInTablePhase, startDate);
+		if (table != NULL) {
+			if (gTemplateTable != NULL && --gTemplateTable->refCount == 0)
+				FreeTemplateTable(gTemplateTable);
+			gTemplateTable = table;
+		}
+	}
+	
+	table = gTemplateTable;
+	if (table != NULL)
+		table->refCount++;
+	gTemplatesLastUse = CFAbsoluteTimeGetCurrent();
+	
+	pthread_mutex_unlock(&gTemplatesManifestMutex);
+	
+	CFRelease(manifest);
+	
+	return table;
+}
+
+/*
+ * CreateTemplateTable
+ *
+ * Build the descriptor table of a templates manifest. Templates names are
+ * localized once here. The table is returned with a reference count of 1, or
+ * NULL if memory runs out.
+ */
+static TemplateTable* CreateTemplateTable(CFDictionaryRef manifest)
+{
+	TemplateTable *table;
+	CFArrayRef templates;
+	CFDictionaryRef description;
+	CFStringRef name, stem, extensions, localizedStem, documentBaseName;
+	CFIndex i, count, length = 0, capacity = 0, fileNamesLength = 0, fileNamesCapacity = 0;
+	CFRange position;
+	
+	table = (TemplateTable*) calloc(1, sizeof(TemplateTable));
+	if (table == NULL)
+		return NULL;
+	
+	templates = CFDictionaryGetValue(manifest, CFSTR("Templates"));
+	count = CFArrayGetCount(templates);
+	
+	table->refCount = 1;
+	table->manifest = CFRetain(manifest);
+	table->count = count;
+	table->menuFormat = CFCopyLocalizedStringFromTableInBundle(CFSTR("templateMenuName"),
+															   NULL,
+															   GetSelfBundle(),
+															   CFSTR("Name of templates as displayed in menus"));
+	table->documentFormat = CFCopyLocalizedStringFromTableInBundle(CFSTR("templateDocumentName"),
+																   NULL,
+																   GetSelfBundle(),
+																   CFSTR("Name of new documents created from templates"));
+	
+	if (count > 0) {
+		table->nameOffsets = (CFIndex*) malloc(count * sizeof(CFIndex));
+		table->nameLengths = (UInt16*) malloc(count * sizeof(UInt16));
+		table->categoryLengths = (UInt16*) malloc(count * sizeof(UInt16));
+		table->extensionsLengths = (UInt16*) malloc(count * sizeof(UInt16));
+		table->lastExtensionLengths = (UInt16*) malloc(count * sizeof(UInt16));
+		table->labelOffsets = (CFIndex*) malloc(count * sizeof(CFIndex));
+		table->labelLengths = (UInt16*) malloc(count * sizeof(UInt16));
+		table->documentNameOffsets = (CFIndex*) malloc(count * sizeof(CFIndex));
+		table->extensionsNameOffsets = (CFIndex*) malloc(count * sizeof(CFIndex));
+		table->sizes = (SInt64*) malloc(count * sizeof(SInt64));
+		table->flags = (UInt8*) malloc(count * sizeof(UInt8));
+		table->trees = (CFArrayRef*) malloc(count * sizeof(CFArrayRef));
+		table->usageKeys = (SInt64*) malloc(count * sizeof(SInt64));
+		
+		if (table->nameOffsets == NULL || table->nameLengths == NULL || table->categoryLengths == NULL
+			|| table->extensionsLengths == NULL || table->lastExtensionLengths == NULL
+			|| table->labelOffsets == NULL || table->labelLengths == NULL
+			|| table->documentNameOffsets == NULL || table->extensionsNameOffsets == NULL
+			|| table->sizes == NULL || table->flags == NULL || table->trees == NULL
+			|| table->usageKeys == NULL) {
+			printf("NewDocumentPlugIn: Error : cannot allocate the templates table.\n");
+			FreeTemplateTable(table);
+			return NULL;
+		}
+	}
+	
+	for (i = 0; i < count; i++) {
+		description = CFArrayGetValueAtIndex(templates, i);
+		name = CFDictionaryGetValue(description, CFSTR("Name"));
+		stem = CFDictionaryGetValue(description, CFSTR("Stem"));
+		extensions = CFDictionaryGetValue(description, CFSTR("Extensions"));
+		
+		// Name, and the lengths of its parts
+		table->nameOffsets[i] = AppendToTemplateTableStrings(table, name, &length, &capacity);
+		if (table->nameOffsets[i] < 0)
+			break;
+		table->nameLengths[i] = CFStringGetLength(name);
+		table->usageKeys[i] = GetTemplateUsageKey(table->strings + table->nameOffsets[i], table->nameLengths[i]);
+		position = CFStringFind(name, CFSTR("/"), kCFCompareBackwards);
+		table->categoryLengths[i] = (position.location != kCFNotFound) ? position.location : 0;
+		table->extensionsLengths[i] = CFStringGetLength(extensions);
+		position = CFStringFind(extensions, CFSTR("."), kCFCompareBackwards);
+		table->lastExtensionLengths[i] = (position.location != kCFNotFound) ? CFStringGetLength(extensions) - position.location : 0;
+		
+		// Check if there is a specific override for this template
+		localizedStem = CFCopyLocalizedStringWithDefaultValue(stem, NULL, GetSelfBundle(), stem, "");
+		table->labelOffsets[i] = AppendToTemplateTableStrings(table, localizedStem, &length, &capacity);
+		table->labelLengths[i] = CFStringGetLength(localizedStem);
+		if (table->labelOffsets[i] < 0) {
+			CFRelease(localizedStem);
+			break;
+		}
+		
+		// File system representation of new documents names
+		documentBaseName = CFStringCreateWithFormat(NULL, NULL, table->documentFormat, localizedStem);
+		table->documentNameOffsets[i] = AppendToTemplateTableFileNames(table, documentBaseName, &fileNamesLength, &fileNamesCapacity);
+		table->extensionsNameOffsets[i] = AppendToTemplateTableFileNames(table, extensions, &fileNamesLength, &fileNamesCapacity);
+		CFRelease(documentBaseName);
+		CFRelease(localizedStem);
+		if (table->documentNameOffsets[i] < 0 || table->extensionsNameOffsets[i] < 0)
+			break;
+		
+		CFNumberGetValue(CFDictionaryGetValue(description, CFSTR("Size")), kCFNumberSInt64Type, &table->sizes[i]);
+		table->flags[i] = CFBooleanGetValue(CFDictionaryGetValue(description, CFSTR("Package"))) ? kNewDocumentPlugInTemplateIsPackage : 0;
+		table->trees[i] = CFDictionaryGetValue(description, CFSTR("Tree"));
+	}
+	
+	if (i < count) {
+		printf("NewDocumentPlugIn: Error : cannot allocate the templates table.\n");
+		FreeTemplateTable(table);
+		return NULL;
+	}
+	
+	// Account for the arrays and pools (the manifest itself isn't counted)
+	table->memorySize = sizeof(TemplateTable)
+		+ count * (4 * sizeof(CFIndex) + 5 * sizeof(UInt16) + sizeof(SInt64) + sizeof(UInt8) + sizeof(CFArrayRef) + sizeof(SInt64))
+		+ capacity * sizeof(UniChar)
+		+ fileNamesCapacity;
+	AddToMetric(&gMetrics.cacheBytes[kNewDocumentPlugInTableCache], table->memorySize);
+	
+	return table;
+}
+
+/*
+ * ReleaseTemplateTable
+ *
+ * Release a table returned by CopyTemplateTable().
+ */
+static void ReleaseTemplateTable(TemplateTable *table)
+{
+	pthread_mutex_lock(&gTemplatesManifestMutex);
+	if (--table->refCount == 0)
+		FreeTemplateTable(table);
+	pthread_mutex_unlock(&gTemplatesManifestMutex);
+}
+
+/*
+ * FreeTemplateTable
+ *
+ * Free a table and everything it holds.
+ */
+static void FreeTemplateTable(TemplateTable *table)
+{
+	AddToMetric(&gMetrics.cacheBytes[kNewDocumentPlugInTableCache], -table->memorySize);
+	
+	CFRelease(table->manifest);
+	CFRelease(table->menuFormat);
+	CFRelease(table->documentFormat);
+	free(table->strings);
+	free(table->nameOffsets);
+	free(table->nameLengths);
+	free(table->categoryLengths);
+	free(table->extensionsLengths);
+	free(table->lastExtensionLengths);
+	free(table->labelOffsets);
+	free(table->labelLengths);
+	free(table->fileNames);
+	free(table->documentNameOffsets);
+	free(table->extensionsNameOffsets);
+	free(table->sizes);
+	free(table->flags);
+	free(table->trees);
+	free(table->usageKeys);
+	free(table);
+}
+
+/*
+ * AppendToTemplateTableStrings
+ *
+ * Append the characters of a string to the characters pool of a table being
+ * built, and return their offset, or -1 if the pool cannot grow.
+ */
+static CFIndex AppendToTemplateTableStrings(TemplateTable *table, CFStringRef string, CFIndex *ioLength, CFIndex *ioCapacity)
+{
+	CFIndex offset = *ioLength, stringLength = CFStringGetLength(string), capacity;
+	UniChar *strings;
+	
+	if (offset + stringLength > *ioCapacity) {
+		capacity = (offset + stringLength) * 2;
+		strings = (UniChar*) realloc(table->strings, capacity * sizeof(UniChar));
+		if (strings == NULL)
+			return -1;
+		table->strings = strings;
+		*ioCapacity = capacity;
+	}
+	
+	CFStringGetCharacters(string, CFRangeMake(0, stringLength), table->strings + offset);
+	*ioLength += stringLength;
+	
+	return offset;
+}
+
+/*
+ * AppendToTemplateTableFileNames
+ *
+ * Append the NULL-terminated file system representation of a string to the
+ * file names pool of a table being built, and return its offset, or -1 if the
+ * pool cannot grow.
+ */
+static CFIndex AppendToTemplateTableFileNames(TemplateTable *table, CFStringRef string, CFIndex *ioLength, CFIndex *ioCapacity)
+{
+	char fileName[PATH_MAX];
+	CFIndex offset = *ioLength, fileNameLength, capacity;
+	char *fileNames;
+	
+	if (!CFStringGetFileSystemRepresentation(string, fileName, sizeof(fileName)))
+		fileName[0] = '\0';
+	fileNameLength = strlen(fileName) + 1;
+	
+	if (offset + fileNameLength > *ioCapacity) {
+		capacity = (offset + fileNameLength) * 2;
+		fileNames = (char*) realloc(table->fileNames, capacity);
+		if (fileNames == NULL)
+			return -1;
+		table->fileNames = fileNames;
+		*ioCapacity = capacity;
+	}
+	
+	memcpy(table->fileNames + offset, fileName, fileNameLength);
+	*ioLength += fileNameLength;
+	
+	return offset;
+}
+
+/*
+ * CopyTemplateTableName
+ *
+ * Return the name of a template, as returned by CopyTemplatesFilenames.
+ */
+static CFStringRef CopyTemplateTableName(const TemplateTable *table, CFIndex index)
+{
+	return CFStringCreateWithCharacters(NULL, table->strings + table->nameOffsets[index], table->nameLengths[index]);
+}
+
+/*
+ * FindTemplateTableIndex
+ *
+ * Return the index of a template in a table, from its name, or kCFNotFound.
+ */
+static CFIndex FindTemplateTableIndex(const TemplateTable *table, CFStringRef templateName)
+{
+	UniChar characters[PATH_MAX];
+	CFIndex i, length = CFStringGetLength(templateName);
+	
+	if (length > PATH_MAX)
+		return kCFNotFound;
+	CFStringGetCharacters(templateName, CFRangeMake(0, length), characters);
+	
+	for (i = 0; i < table->count; i++) {
+		if (table->nameLengths[i] == length
+			&& memcmp(table->strings + table->nameOffsets[i], characters, length * sizeof(UniChar)) == 0)
+			return i;
+	}
+	
+	return kCFNotFound;
+}
+
+/*
+ * CopyTemplateLabel
+ *
+ * Return the localized name of a template : its menu label if localizeForMenu
+ * is true (without its last extension), or the name of new documents created
+ * from it otherwise. The returned string is mutable.
+ */
+static CFMutableStringRef CopyTemplateLabel(const TemplateTable *table, CFIndex index, bool localizeForMenu)
+{
+	CFMutableStringRef label;
+	CFStringRef localizedStem;
+	CFIndex extensionsOffset, extensionsLength;
+	
+	extensionsOffset = table->nameOffsets[index] + table->nameLengths[index] - table->extensionsLengths[index];
+	extensionsLength = table->extensionsLengths[index];
+	if (localizeForMenu)
+		extensionsLength -= table->lastExtensionLengths[index];
+	
+	localizedStem = CFStringCreateWithCharactersNoCopy(NULL,
+													   table->strings + table->labelOffsets[index],
+													   table->labelLengths[index],
+													   kCFAllocatorNull);
+	
+	// Localize the template name, then append the extensions
+	label = CFStringCreateMutable(NULL, 0);
+	CFStringAppendFormat(label, NULL, localizeForMenu ? table->menuFormat : table->documentFormat, localizedStem);
+	CFStringAppendCharacters(label, table->strings + extensionsOffset, extensionsLength);
+	
+	CFRelease(localizedStem);
+	
+	return label;
+}
+
+
+// -----------------------------------------------------------------------------
+//	Templates usage
+// -----------------------------------------------------------------------------
+
+/*
+ * CreateTemplatesMenuOrder
+ *
+ * Return the order in which the templates of a table are listed in menus, as
+ * an array of table indexes to free: templates of the same category are
+ * sorted by decreasing usage score, categories keep the table order. The most
+ * frequent templates are also written in outFrequent, which has room for
+ * kNewDocumentPlugInFrequentItems indexes.
+ */
+static CFIndex* CreateTemplatesMenuOrder(const TemplateTable *table, CFIndex *outFrequent, CFIndex *outFrequentCount)
+{
+	const TemplateUsageFile *usage = GetTemplateUsageFile();
+	const TemplateUsageSlot *slot;
+	TemplateRank *ranks;
+	CFIndex *order, i, j, start, end;
+	CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+	Boolean used;
+	
+	*outFrequentCount = 0;
+	
+	order = (CFIndex*) malloc((table->count > 0 ? table->count : 1) * sizeof(CFIndex));
+	ranks = (TemplateRank*) malloc((table->count > 0 ? table->count : 1) * sizeof(TemplateRank));
+	if (order == NULL || ranks == NULL) {
+		free(ranks);
+		if (order != NULL) {
+			for (i = 0; i < table->count; i++)
+				order[i] = i;
+		}
+		return order;
+	}
+	
+	for (i = 0; i < table->count; i++) {
+		ranks[i].index = i;
+		ranks[i].score = GetTemplateUsageScore(usage, table->usageKeys[i], now);
+	}
+	
+	// Sort each run of templates of the same category, unless none was used
+	for (start = 0; start < table->count; start = end) {
+		used = (ranks[start].score > 0);
+		for (end = start + 1;
+			 end < table->count
+			 && table->categoryLengths[end] == table->categoryLengths[start]
+			 && memcmp(table->strings + table->nameOffsets[end],
+					   table->strings + table->nameOffsets[start],
+					   table->categoryLengths[start] * sizeof(UniChar)) == 0;
+			 end++)
+			used = used || (ranks[end].score > 0);
+		
+		if (used && end - start > 1)
+			qsort(ranks + start, end - start, sizeof(TemplateRank), CompareTemplateRanks);
+	}
+	
+	for (i = 0; i < table->count; i++)
+		order[i] = ranks[i].index;
+	
+	// Keep the best scores of the templates used often enough, best first
+	for (i = 0; i < table->count; i++) {
+		if (ranks[i].score <= 0)
+			continue;
+		slot = GetTemplateUsageSlot(usage, table->usageKeys[ranks[i].index], false);
+		if (slot == NULL || slot->uses < kNewDocumentPlugInFrequentMinUses)
+			continue;
+		
+		for (j = *outFrequentCount; j > 0 && CompareTemplateRanks(&ranks[i], &ranks[outFrequent[j - 1]]) < 0; j--) {
+			if (j < kNewDocumentPlugInFrequentItems)
+				outFrequent[j] = outFrequent[j - 1];
+		}
+		if (j < kNewDocumentPlugInFrequentItems) {
+			outFrequent[j] = i;
+			if (*outFrequentCount < kNewDocumentPlugInFrequentItems)
+				(*outFrequentCount)++;
+		}
+	}
+	
+	// outFrequent held positions in ranks, until now
+	for (i = 0; i < *outFrequentCount; i++)
+		outFrequent[i] = ranks[outFrequent[i]].index;
+	
+	free(ranks);
+	
+	return order;
+}
+
+/*
+ * RecordTemplateUse
+ *
+ * Count a use of the template at index in a table, in the usage statistics
+ * shared by every host process.
+ */
+static void RecordTemplateUse(const TemplateTable *table, CFIndex index)
+{
+	TemplateUsageSlot *slot;
+	SInt64 now = (SInt64)CFAbsoluteTimeGetCurrent(), lastUse;
+	
+	slot = GetTemplateUsageSlot(GetTemplateUsageFile(), table->usageKeys[index], true);
+	if (slot == NULL)
+		return;
+	
+	AtomicAdd64(&slot->uses, 1);
+	
+	// Another process may record a use at the same time : keep the latest
+	lastUse = AtomicLoad64(&slot->lastUse);
+	while (lastUse < now && !AtomicCompareAndSwap64(&slot->lastUse, &lastUse, now))
+		;
+}
+
+/*
+ * GetTemplateUsageScore
+ *
+ * Return the usage score of a template : its number of uses, weighted down
+ * by the time since its last use. Templates never used score 0.
+ */
+static double GetTemplateUsageScore(const TemplateUsageFile *usage, SInt64 key, CFAbsoluteTime now)
+{
+	const TemplateUsageSlot *slot;
+	double age;
+	
+	slot = GetTemplateUsageSlot(usage, key, false);
+	if (slot == NULL || slot->uses <= 0)
+		return 0;
+	
+	age = now - (CFAbsoluteTime)slot->lastUse;
+	if (age < 0)
+		age = 0;
+	
+	return (double)slot->uses * exp2(-age / kNewDocumentPlugInUsageHalfLife);
+}
+
+/*
+ * GetTemplateUsageSlot
+ *
+ * Return the slot of a template in the usage statistics, or NULL if it has
+ * none. If claim is true, a free slot is claimed for the template when it has
+ * none yet; NULL is still returned if the table is too crowded around the key.
+ */
+static TemplateUsageSlot* GetTemplateUsageSlot(const TemplateUsageFile *usage, SInt64 key, Boolean claim)
+{
+	TemplateUsageSlot *slot;
+	UInt32 probe, first;
+	SInt64 claimedKey;
+	
+	if (usage == NULL)
+		return NULL;
+	
+	first = (UInt64)key % kNewDocumentPlugInUsageSlots;
+	for (probe = 0; probe < kNewDocumentPlugInUsageMaxProbes; probe++) {
+		slot = (TemplateUsageSlot*)&usage->slots[(first + probe) % kNewDocumentPlugInUsageSlots];
+		if (slot->key == key)
+			return slot;
+		if (slot->key == 0) {
+			if (!claim)
+				return NULL;
+			// Another process may claim the slot first, maybe for the same key
+			claimedKey = 0;
+			if (AtomicCompareAndSwap64(&slot->key, &claimedKey, key)
+				|| claimedKey == key)
+				return slot;
+		}
+	}
+	
+	return NULL;
+}
+
+/*
+ * GetTemplateUsageFile
+ *
+ * Return the mapped usage statistics, mapping them on first use, or NULL if
+ * they are not available.
+ */
+static TemplateUsageFile* GetTemplateUsageFile()
+{
+	pthread_once(&gTemplateUsageOnce, MapTemplateUsageFile);
+	return gTemplateUsage;
+}
+
+/*
+ * MapTemplateUsageFile
+ *
+ * Map the usage statistics file, shared with the other host processes,
+ * creating it if needed. A new file is filled with zeroes, i.e. free slots.
+ */
+static void MapTemplateUsageFile()
+{
+	CFURLRef cachesURL;
+	char path[PATH_MAX];
+	TemplateUsageFile *usage;
+	struct stat info;
+	Boolean found;
+	int fd;
+	SInt32 magic;
+	CFAbsoluteTime startDate = CFAbsoluteTimeGetCurrent();
+	
+	cachesURL = CopyPlugInCachesURL();
+	if (cachesURL == NULL)
+		return;
+	found = CFURLGetFileSystemRepresentation(cachesURL, true, (UInt8*)path, sizeof(path))
+		&& strlcat(path, "/" kNewDocumentPlugInUsageFilename, sizeof(path)) < sizeof(path);
+	CFRelease(cachesURL);
+	if (!found)
+		return;
+	
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		printf("NewDocumentPlugIn : Cannot open the usage statistics (%d)\n", errno);
+		return;
+	}
+	
+	// Growing the file is harmless if another process does it too
+	if (fstat(fd, &info) != 0
+		|| (info.st_size < sizeof(TemplateUsageFile) && ftruncate(fd, sizeof(TemplateUsageFile)) != 0)) {
+		close(fd);
+		return;
+	}
+	
+	usage = (TemplateUsageFile*) mmap(NULL, sizeof(TemplateUsageFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (usage == MAP_FAILED)
+		return;
+	
+	// The header of a new file is written by whichever process maps it first,
+	// the magic number last
+	if (usage->magic == 0) {
+		usage->version = kNewDocumentPlugInUsageVersion;
+		usage->slotsCount = kNewDocumentPlugInUsageSlots;
+		magic = 0;
+		AtomicCompareAndSwap32(&usage->magic, &magic, kNewDocumentPlugInUsageMagic);
+	}
+	
+	if (usage->magic != kNewDocumentPlugInUsageMagic
+		|| usage->version != kNewDocumentPlugInUsageVersion
+		|| usage->slotsCount != kNewDocumentPlugInUsageSlots) {
+		printf("NewDocumentPlugIn : Ignoring usage statistics of another format\n");
+		munmap(usage, sizeof(TemplateUsageFile));
+		return;
+	}
+	
+	gTemplateUsage = usage;
+	RecordPhaseTime(kNewDocumentPlugInUsagePhase, startDate);
+}
+
+/*
+ * GetTemplateUsageKey
+ *
+ * Return the key of a template in the usage statistics : a 64 bits FNV-1a
+ * hash of its name, never 0 as 0 marks free slots.
+ */
+static SInt64 GetTemplateUsageKey(const UniChar *name, CFIndex length)
+{
+	UInt64 hash = 14695981039346656037ULL;
+	CFIndex i;
+	
+	for (i = 0; i < length; i++) {
+		hash ^= name[i];
+		hash *= 1099511628211ULL;
+	}
+	
+	return (hash != 0) ? (SInt64)hash : 1;
+}
+
+/*
+ * CompareTemplateRanks
+ *
+ * Sort callback ordering templates by decreasing score, then by table index.
+ */
+static int CompareTemplateRanks(const void *first, const void *second)
+{
+	const TemplateRank *firstRank = (const TemplateRank*)first;
+	const TemplateRank *secondRank = (const TemplateRank*)second;
+	
+	if (firstRank->score != secondRank->score)
+		return (firstRank->score > secondRank->score) ? -1 : 1;
+	
+	return (firstRank->index > secondRank->index) - (firstRank->index < secondRank->index);
+}
+
+
+// -----------------------------------------------------------------------------
+//	Templates content cache
+// -----------------------------------------------------------------------------
+
+/*
+ * CopyCachedTemplateContents
+ *
+ * Return the contents of a template file, loading it into the cache if needed.
+ * Returns NULL if the template is not a regular file, is too big to be cached,
+ * or cannot be read: in that case the template must be copied.
+ * Entries are keyed by path, and are reloaded when the inode or the modification
+ * date of the template changes, to the nanosecond. Can be called from any
+ * creation thread.
+ */
+static CFDataRef CopyCachedTemplateContents(CFURLRef templateURL)
+{
+	UInt8 path[PATH_MAX];
+	struct stat info;
+	TemplateCacheEntry *entry;
+	CFStringRef templatePath;
+	CFDataRef contents = NULL;
+	SInt32 errorCode;
+	
+	if (!CFURLGetFileSystemRepresentation(templateURL, true, path, sizeof(path)))
+		return NULL;
+	
+	// Packages and big templates go through the regular copy path
+	if (stat((char*)path, &info) != 0
+		|| !S_ISREG(info.st_mode)
+		|| info.st_size > kNewDocumentPlugInTemplateCacheMaxItemSize)
+		return NULL;
+	
+	templatePath = CFStringCreateWithFileSystemRepresentation(NULL, (char*)path);
+	
+	pthread_mutex_lock(&gTemplateCacheMutex);
+	
+	// Look for an existing entry
+	for (entry = gTemplateCacheHead; entry != NULL; entry = entry->next) {
+		if (CFEqual(entry->path, templatePath))
+			break;
+	}
+	
+	if (entry != NULL) {
+		if (entry->inode == info.st_ino && entry->mtime == GetModificationTime(&info)) {
+			// Cache hit : move the entry at the head of the list
+			gTemplateCacheStats.hits++;
+			entry->lastUse = CFAbsoluteTimeGetCurrent();
+			if (entry != gTemplateCacheHead) {
+				entry->prev->next = entry->next;
+				if (entry->next != NULL)
+					entry->next->prev = entry->prev;
+				else
+					gTemplateCacheTail = entry->prev;
+				entry->prev = NULL;
+				entry->next = gTemplateCacheHead;
+				gTemplateCacheHead->prev = entry;
+				gTemplateCacheHead = entry;
+			}
+			contents = (CFDataRef)CFRetain(entry->contents);
+		}
+		else {
+			// The template changed since it was cached
+			RemoveTemplateCacheEntry(entry);
+		}
+	}
+	
+	if (contents == NULL) {
+		// Cache miss : load the template contents
+		gTemplateCacheStats.misses++;
+		if (CFURLCreateDataAndPropertiesFromResource(NULL, templateURL, &contents, NULL, NULL, &errorCode)
+			&& contents != NULL) {
+			
+			entry = (TemplateCacheEntry*) malloc(sizeof(TemplateCacheEntry));
+			entry->path = CFRetain(templatePath);
+			entry->inode = info.st_ino;
+			entry->mtime = GetModificationTime(&info);
+			entry->lastUse = CFAbsoluteTimeGetCurrent();
+			entry->contents = CFRetain(contents);
+			entry->prev = NULL;
+			entry->next = gTemplateCacheHead;
+			if (gTemplateCacheHead != NULL)
+				gTemplateCacheHead->prev = entry;
+			else
+				gTemplateCacheTail = entry;
+			gTemplateCacheHead = entry;
+			gTemplateCacheSize += CFDataGetLength(contents);
+			AddToMetric(&gMetrics.cacheBytes[kNewDocumentPlugInContentCache], sizeof(TemplateCacheEntry) + CFDataGetLength(contents));
+			
+			// Evict the least recently used entries to stay within the budget
+			while (gTemplateCacheSize > kNewDocumentPlugInTemplateCacheBudget && gTemplateCacheTail != entry) {
+				RemoveTemplateCacheEntry(gTemplateCacheTail);
+				gTemplateCacheStats.evictions++;
+			}
+		}
+	}
+	
+	pthread_mutex_unlock(&gTemplateCacheMutex);
+	
+	CFRelease(templatePath);
+	
+	return contents;
+}
+
+/*
+ * RemoveTemplateCacheEntry
+ *
+ * Unlink an entry from the templates content cache, and free it.
+ */
+static void RemoveTemplateCacheEntry(TemplateCacheEntry *entry)
+{
+	if (entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		gTemplateCacheHead = entry->next;
+	
+	if (entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		gTemplateCacheTail = entry->prev;
+	
+	gTemplateCacheSize -= CFDataGetLength(entry->contents);
+	AddToMetric(&gMetrics.cacheBytes[kNewDocumentPlugInContentCache], -(SInt64)(sizeof(TemplateCacheEntry) + CFDataGetLength(entry->contents)));
+	
+	CFRelease(entry->path);
+	CFRelease(entry->contents);
+	free(entry);
+}
+
+/*
+ * WriteTemplateContents
+ *
+ * Create a new document named documentName in a directory, and fill it with
+ * the given contents in a single write. The document then gets the metadata of
+ * the template (permissions, extended attributes, Finder info, resource fork
+ * and ACL), as if it had been copied. Fails with dupFNErr if the document
+ * already exists.
+ */
+static OSStatus WriteTemplateContents(CFDataRef contents, const char *templatePath, const char *directory, int directoryFd, const char *documentName, FSRef *outItem)
+{
+	OSStatus err = noErr;
+	UInt8 path[PATH_MAX];
+	CFIndex length;
+	ssize_t written;
+	int fd, error;
+	
+	if (snprintf((char*)path, sizeof(path), "%s/%s", directory, documentName) >= sizeof(path))
+		return paramErr;
+	
+	if ((error = SimulateFileSystemCallIfNeeded(kNewDocumentPlugInOpenCall)) != 0)
+		return GetErrnoStatus(error);
+	
+	fd = OpenAt(directoryFd, documentName, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return GetErrnoStatus(errno);
+	
+	// A short write on a regular file means the volume is full
+	length = CFDataGetLength(contents);
+	error = SimulateFileSystemCallIfNeeded(kNewDocumentPlugInWriteCall);
+	if (error == 0) {
+		written = write(fd, CFDataGetBytePtr(contents), length);
+		if (written != length)
+			error = (written < 0) ? errno : ENOSPC;
+	}
+	if (error != 0)
+		err = GetErrnoStatus(error);
+	
+	if (close(fd) != 0)
+		err = ioErr;
+	
+	if (err == noErr && CopyFileMetadata(templatePath, (char*)path) != 0)
+		err = GetErrnoStatus(errno);
+	
+	if (err == noErr)
+		err = FSPathMakeRef(path, outItem, NULL);
+	else
+		UnlinkAt(directoryFd, documentName, 0);
+	
+	return err;
+}
+
+/*
+ * GetErrnoStatus
+ *
+ * Return the File Manager error matching an errno value.
+ */
+static OSStatus GetErrnoStatus(int error)
+{
+	switch (error) {
+		case 0:			return noErr;
+		case EEXIST:	return dupFNErr;
+		case ENOENT:	return fnfErr;
+		case ENOSPC:	return dskFulErr;
+		case EACCES:
+		case EPERM:		return permErr;
+		default:		return ioErr;
+	}
+}
+
+/*
+ * GetModificationTime
+ *
+ * Return the modification date of a file, in nanoseconds since the epoch.
+ */
+static SInt64 GetModificationTime(const struct stat *info)
+{
+	return (SInt64)info->st_mtimespec.tv_sec * 1000000000 + info->st_mtimespec.tv_nsec;
+}
+
+
+// -----------------------------------------------------------------------------
+//	Templates blob store
+// -----------------------------------------------------------------------------
+
+/*
+ * InstantiateTemplateTree
+ *
+ * Create a new document from a package template, following the tree of the
+ * package described in the manifest : directories and symbolic links are
+ * created, and files are cloned from the blob store, so that the files shared by several templates,
+ * or by several documents, take their space only once on volumes that support
+ * clones. The partially created document is removed on error.
+ */
+static OSStatus InstantiateTemplateTree(CFArrayRef tree, const char *templatePath, const char *directory, int directoryFd, const char *documentName, FSRef *outItem)
+{
+	CFDictionaryRef entry;
+	CFIndex i, count, created;
+	char documentPath[PATH_MAX], sourcePath[PATH_MAX], destinationPath[PATH_MAX], blobPath[PATH_MAX];
+	SInt64 size = 0;
+	UInt64 hash = 0;
+	int error, packageFd;
+	
+	if (snprintf(documentPath, sizeof(documentPath), "%s/%s", directory, documentName) >= sizeof(documentPath))
+		return paramErr;
+	
+	if ((error = SimulateFileSystemCallIfNeeded(kNewDocumentPlugInOpenCall)) != 0)
+		return GetErrnoStatus(error);
+	if (MakeDirectoryAt(directoryFd, documentName, 0755) != 0)
+		return GetErrnoStatus(errno);
+	
+	// The contents are created relative to the package, not to the volume root
+	packageFd = OpenAt(directoryFd, documentName, O_RDONLY | O_DIRECTORY, 0);
+	if (packageFd < 0) {
+		error = errno;
+		UnlinkAt(directoryFd, documentName, AT_REMOVEDIR);
+		return GetErrnoStatus(error);
+	}
+	
+	count = CFArrayGetCount(tree);
+	for (created = 0; created < count; created++) {
+		entry = CFArrayGetValueAtIndex(tree, created);
+		if (!GetTemplateTreeEntryPath(entry, CFSTR("Path"), ".", destinationPath, sizeof(destinationPath))) {
+			error = ENAMETOOLONG;
+			break;
+		}
+		
+		if (CFDictionaryContainsKey(entry, CFSTR("Directory"))) {
+			if (MakeDirectoryAt(packageFd, destinationPath, 0755) != 0)
+				error = errno;
+		}
+		else if (CFDictionaryContainsKey(entry, CFSTR("Link"))) {
+			if (!CFStringGetFileSystemRepresentation(CFDictionaryGetValue(entry, CFSTR("Link")), sourcePath, sizeof(sourcePath)))
+				error = ENAMETOOLONG;
+			else if (SymlinkAt(sourcePath, packageFd, destinationPath) != 0)
+				error = errno;
+		}
+		else {
+			if (!GetTemplateTreeEntryPath(entry, CFSTR("Path"), templatePath, sourcePath, sizeof(sourcePath))) {
+				error = ENAMETOOLONG;
+				break;
+			}
+			CFNumberGetValue(CFDictionaryGetValue(entry, CFSTR("Size")), kCFNumberSInt64Type, &size);
+			CFNumberGetValue(CFDictionaryGetValue(entry, CFSTR("Hash")), kCFNumberSInt64Type, &hash);
+			
+			// Clone the blob, or the template file itself if the store can't be used
+			if (!GetTemplateBlobPath(sourcePath, hash, size, blobPath, sizeof(blobPath)))
+				strlcpy(blobPath, sourcePath, sizeof(blobPath));
+			if ((error = SimulateFileSystemCallIfNeeded(kNewDocumentPlugInWriteCall)) == 0
+				&& CloneFileAt(blobPath, packageFd, destinationPath) != 0)
+				error = errno;
+			if (error != 0)
+				UnlinkAt(packageFd, destinationPath, 0);
+		}
+		
+		if (error != 0)
+			break;
+	}
+	
+	if (error != 0) {
+		// Remove what was created, contents before their directories
+		for (i = created - 1; i >= 0; i--) {
+			entry = CFArrayGetValueAtIndex(tree, i);
+			if (GetTemplateTreeEntryPath(entry, CFSTR("Path"), ".", destinationPath, sizeof(destinationPath)))
+				UnlinkAt(packageFd, destinationPath, CFDictionaryContainsKey(entry, CFSTR("Directory")) ? AT_REMOVEDIR : 0);
+		}
+		close(packageFd);
+		UnlinkAt(directoryFd, documentName, AT_REMOVEDIR);
+		return GetErrnoStatus(error);
+	}
+	
+	close(packageFd);
+	
+	// The package gets the attributes of the template (its icon, for instance)
+	CopyFileMetadata(templatePath, documentPath);
+	
+	return FSPathMakeRef((UInt8*)documentPath, outItem, NULL);
+}
+
+/*
+ * GetTemplateTreeEntryPath
+ *
+ * Write the path of a tree entry below a root directory into outPath. Returns
+ * false if the buffer is too small.
+ */
+static Boolean GetTemplateTreeEntryPath(CFDictionaryRef entry, CFStringRef key, const char *root, char *outPath, size_t outSize)
+{
+	size_t rootLength = strlen(root);
+	
+	if (rootLength + 1 >= outSize)
+		return false;
+	
+	memcpy(outPath, root, rootLength);
+	outPath[rootLength] = '/';
+	
+	return CFStringGetFileSystemRepresentation(CFDictionaryGetValue(entry, key),
+											   outPath + rootLength + 1,
+											   outSize - rootLength - 1);
+}
+
+/*
+ * GetTemplateBlobPath
+ *
+ * Return the path of a template file in the blob store, where files are named
+ * after their hash and size, so that every template containing the same file
+ * shares a single blob. Blobs are immutable : a blob is added on first use,
+ * once its contents have been checked against its name, and is never
+ * replaced. Returns false if the store can't be used, or if the template file
+ * doesn't match the hash and size of the manifest anymore : the template
+ * file itself must be used then.
+ */
+static Boolean GetTemplateBlobPath(const char *sourcePath, UInt64 hash, SInt64 size, char *outPath, size_t outSize)
+{
+	char temporaryPath[PATH_MAX];
+	struct stat info;
+	
+	pthread_once(&gTemplateBlobsOnce, InitTemplateBlobStore);
+	if (gTemplateBlobsPath[0] == '\0' || hash == 0)
+		return false;
+	
+	if (snprintf(outPath, outSize, "%s/%016llx-%lld", gTemplateBlobsPath, (unsigned long long)hash, (long long)size) >= outSize)
+		return false;
+	
+	if (lstat(outPath, &info) == 0 && S_ISREG(info.st_mode) && info.st_size == size)
+		return true;
+	
+	// Store the file under a temporary name first, so that other threads
+	// never clone a partial blob, and check what was actually stored : the
+	// template file may have changed since the manifest was built
+	if (snprintf(temporaryPath, sizeof(temporaryPath), "%s.%d.%lx", outPath, (int)getpid(), (unsigned long)pthread_self()) >= sizeof(temporaryPath))
+		return false;
+	if (CloneFile(sourcePath, temporaryPath) != 0
+		|| lstat(temporaryPath, &info) != 0
+		|| info.st_size != size
+		|| HashFileContents(temporaryPath) != hash) {
+		unlink(temporaryPath);
+		return false;
+	}
+	
+	// The first stored blob wins : an existing blob is never overwritten
+	if (link(temporaryPath, outPath) != 0 && errno != EEXIST) {
+		unlink(temporaryPath);
+		return false;
+	}
+	unlink(temporaryPath);
+	
+	return true;
+}
+
+/*
+ * CollectTemplateBlobs
+ *
+ * Remove the blobs that no template of a manifest uses anymore, and the
+ * temporary files left by interrupted additions. Only files older than
+ * kNewDocumentPlugInBlobsMinAge are removed : other host processes may use a
+ * newer manifest.
+ */
+static void CollectTemplateBlobs(CFDictionaryRef manifest)
+{
+	CFMutableSetRef usedBlobs;
+	CFArrayRef templates, tree;
+	CFDictionaryRef entry;
+	CFStringRef name;
+	CFIndex i, j, count, entriesCount;
+	SInt64 size;
+	UInt64 hash;
+	DIR *dir;
+	struct dirent *dirEntry;
+	struct stat info;
+	time_t oldestDate = time(NULL) - kNewDocumentPlugInBlobsMinAge;
+	char path[PATH_MAX];
+	int removed = 0;
+	
+	pthread_once(&gTemplateBlobsOnce, InitTemplateBlobStore);
+	if (gTemplateBlobsPath[0] == '\0')
+		return;
+	
+	// Names of the blobs of every package file
+	usedBlobs = CFSetCreateMutable(NULL, 0, &kCFTypeSetCallBacks);
+	templates = CFDictionaryGetValue(manifest, CFSTR("Templates"));
+	count = CFArrayGetCount(templates);
+	for (i = 0; i < count; i++) {
+		tree = CFDictionaryGetValue(CFArrayGetValueAtIndex(templates, i), CFSTR("Tree"));
+		entriesCount = (tree != NULL) ? CFArrayGetCount(tree) : 0;
+		for (j = 0; j < entriesCount; j++) {
+			entry = CFArrayGetValueAtIndex(tree, j);
+			if (!CFDictionaryContainsKey(entry, CFSTR("Hash")))
+				continue;
+			CFNumberGetValue(CFDictionaryGetValue(entry, CFSTR("Size")), kCFNumberSInt64Type, &size);
+			CFNumberGetValue(CFDictionaryGetValue(entry, CFSTR("Hash")), kCFNumberSInt64Type, &hash);
+			name = CFStringCreateWithFormat(NULL, NULL, CFSTR("%016llx-%lld"), (unsigned long long)hash, (long long)size);
+			CFSetAddValue(usedBlobs, name);
+			CFRelease(name);
+		}
+	}
+	
+	dir = opendir(gTemplateBlobsPath);
+	if (dir != NULL) {
+		while ((dirEntry = readdir(dir)) != NULL) {
+			if (dirEntry->d_name[0] == '.'
+				|| snprintf(path, sizeof(path), "%s/%s", gTemplateBlobsPath, dirEntry->d_name) >= sizeof(path)
+				|| lstat(path, &info) != 0
+				|| !S_ISREG(info.st_mode)
+				|| info.st_ctime > oldestDate)
+				continue;
+			
+			name = CFStringCreateWithFileSystemRepresentation(NULL, dirEntry->d_name);
+			if (name != NULL && !CFSetContainsValue(usedBlobs, name) && unlink(path) == 0)
+				removed++;
+			if (name != NULL)
+				CFRelease(name);
+		}
+		closedir(dir);
+	}
+	
+	CFRelease(usedBlobs);
+	
+	if (removed > 0)
+		printf("NewDocumentPlugIn: %d unused blobs removed.\n", removed);
+}
+
+/*
+ * InitTemplateBlobStore
+ *
+ * Find or create the blob store directory, once.
+ */
+static void InitTemplateBlobStore()
+{
+	CFURLRef cachesURL;
+	char path[PATH_MAX];
+	
+	cachesURL = CopyPlugInCachesURL();
+	if (cachesURL == NULL)
+		return;
+	
+	if (CFURLGetFileSystemRepresentation(cachesURL, true, (UInt8*)path, sizeof(path))
+		&& snprintf(gTemplateBlobsPath, sizeof(gTemplateBlobsPath), "%s/%s", path, kNewDocumentPlugInBlobsDirectory) < sizeof(gTemplateBlobsPath)
+		&& (mkdir(gTemplateBlobsPath, 0755) == 0 || errno == EEXIST)) {
+		CFRelease(cachesURL);
+		return;
+	}
+	
+	gTemplateBlobsPath[0] = '\0';
+	CFRelease(cachesURL);
+}
+
+/*
+ * CloneFile
+ *
+ * Copy a file with its attributes, as a clone sharing the storage of the
+ * original on volumes that support it. Fails if the destination exists.
+ * Returns 0, or -1 and sets errno.
+ */
+static int CloneFile(const char *sourcePath, const char *destinationPath)
+{
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 101200
+	if (clonefileat != NULL)
+		return copyfile(sourcePath, destinationPath, NULL, COPYFILE_CLONE);
+#endif
+	
+	return CopyFileAt(sourcePath, AT_FDCWD, destinationPath);
+}
+
+/*
+ * CloneFileAt
+ *
+ * Same as CloneFile, the destination being relative to an open directory.
+ * Volumes that can't clone get a copy. Returns -1 and sets errno on error.
+ */
+static int CloneFileAt(const char *sourcePath, int directoryFd, const char *destinationName)
+{
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 101200
+	int error;
+	
+	if (clonefileat != NULL) {
+		// A simulated error stands for the one of the clone
+		if ((error = SimulateFileSystemCallIfNeeded(kNewDocumentPlugInCloneCall)) != 0)
+			errno = error;
+		else if (clonefileat(AT_FDCWD, sourcePath, directoryFd, destinationName, 0) == 0)
+			return 0;
+		if (errno != ENOTSUP && errno != EXDEV)
+			return -1;
+	}
+#endif
+	
+	return CopyFileAt(sourcePath, directoryFd, destinationName);
+}
+
+
+// -----------------------------------------------------------------------------
+//	Templates synchronization
+// -----------------------------------------------------------------------------
+
+/*
+ * StartTemplatesSync
+ *
+ * Start the thread keeping the user's templates catalog a mirror of the
+ * directory set by the "TemplatesSource" preference, if any. Called from the host
+ * thread; the thread is only started once, and runs until the background
+ * threads are stopped.
+ */
+static void StartTemplatesSync()
+{
+	CFPropertyListRef preference;
+	char path[PATH_MAX];
+	char *sourcePath = NULL;
+	
+	if (gTemplatesSyncStarted)
+		return;
+	gTemplatesSyncStarted = true;
+	
+	preference = CFPreferencesCopyAppValue(CFSTR("TemplatesSource"), CFSTR(kNewDocumentPlugInBundle));
+	if (preference == NULL)
+		return;
+	if (CFGetTypeID(preference) == CFStringGetTypeID()
+		&& CFStringGetFileSystemRepresentation((CFStringRef)preference, path, sizeof(path)))
+		sourcePath = strdup(path);
+	CFRelease(preference);
+	if (sourcePath == NULL)
+		return;
+	
+	if (!StartBackgroundThread(SyncThreadMain, sourcePath)) {
+		printf("NewDocumentPlugIn: Error: cannot start the templates synchronization.\n");
+		free(sourcePath);
+	}
+}
+
+/*
+ * SyncThreadMain
+ *
+ * Main loop of the synchronization thread: synchronize the templates every
+ * kNewDocumentPlugInSyncInterval seconds, until the background threads are
+ * stopped. Its I/O is throttled, not to slow the host and the creations down.
+ */
+static void* SyncThreadMain(void *sourcePath)
+{
+	SetThreadIOThrottled(true);
+	
+	do
+		SyncTemplates((const char*)sourcePath);
+	while (!WaitForBackgroundThreadsStop(kNewDocumentPlugInSyncInterval));
+	
+	free(sourcePath);
+	
+	return NULL;
+}
+
+/*
+ * SyncTemplates
+ *
+ * Mirror the source directory into the user's templates catalog, in the
+ * plugin caches directory; the plugin bundle is never modified. A new catalog
+ * is built next to the current one : the files that didn't change since
+ * the last synchronization are links to the files of the current catalog, the
+ * others are cloned from a local file with the same contents, or from the
+ * source. The new catalog then replaces the current one at once, so that
+ * menus and creations never see a partial catalog, and unchanged templates
+ * keep their inode : their cache entries and manifest hashes stay valid.
+ * Only one host process of the user synchronizes the templates at a time.
+ * Once the catalog exists, it replaces the templates of the plugin resources.
+ */
+static void SyncTemplates(const char *sourcePath)
+{
+	TemplatesSync sync;
+	CFURLRef cachesURL;
+	CFStringRef catalog, source;
+	CFDictionaryRef state;
+	CFMutableDictionaryRef newState;
+	char catalogPath[PATH_MAX], stagingPath[PATH_MAX], parentPath[PATH_MAX];
+	char statePath[PATH_MAX], lockPath[PATH_MAX];
+	CFAbsoluteTime startDate = CFAbsoluteTimeGetCurrent();
+	int lockFd, parentFd;
+	Boolean found, swapped = false;
+	
+	// The new catalog is built in the caches directory, next to the current one
+	cachesURL = CopyPlugInCachesURL();
+	if (cachesURL == NULL)
+		return;
+	found = CFURLGetFileSystemRepresentation(cachesURL, true, (UInt8*)parentPath, sizeof(parentPath));
+	CFRelease(cachesURL);
+	if (!found
+		|| snprintf(catalogPath, sizeof(catalogPath), "%s/%s", parentPath, kNewDocumentPlugInSyncCatalogName) >= sizeof(catalogPath)
+		|| snprintf(stagingPath, sizeof(stagingPath), "%s/%s", parentPath, kNewDocumentPlugInSyncStagingName) >= sizeof(stagingPath)
+		|| snprintf(statePath, sizeof(statePath), "%s/%s", parentPath, kNewDocumentPlugInSyncStateFilename) >= sizeof(statePath)
+		|| snprintf(lockPath, sizeof(lockPath), "%s/%s", parentPath, kNewDocumentPlugInSyncLockFilename) >= sizeof(lockPath))
+		return;
+	
+	// Another host process is synchronizing the templates
+	lockFd = open(lockPath, O_RDWR | O_CREAT, 0644);
+	if (lockFd < 0)
+		return;
+	if (flock(lockFd, LOCK_EX | LOCK_NB) != 0) {
+		close(lockFd);
+		return;
+	}
+	
+	memset(&sync, 0, sizeof(sync));
+	sync.sourcePath = sourcePath;
+	sync.catalogPath = catalogPath;
+	sync.catalogFd = open(catalogPath, O_RDONLY | O_DIRECTORY);
+	sync.stagingFd = -1;
+	
+	// The state of the last synchronization, if it was from the same source
+	source = CFStringCreateWithFileSystemRepresentation(NULL, sourcePath);
+	state = CopySyncState(statePath);
+	if (state != NULL && CFEqual(source, CFDictionaryGetValue(state, CFSTR("Source"))))
+		sync.previousFiles = CFDictionaryGetValue(state, CFSTR("Files"));
+	if (sync.previousFiles == NULL || CFGetTypeID(sync.previousFiles) != CFDictionaryGetTypeID())
+		sync.previousFiles = NULL;
+	sync.files = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	sync.filesByHash = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	if (sync.previousFiles != NULL)
+		CFDictionaryApplyFunction(sync.previousFiles, AddSyncFileByHash, sync.filesByHash);
+	
+	// Build the new catalog, left by an interrupted synchronization if needed
+	parentFd = open(parentPath, O_RDONLY | O_DIRECTORY);
+	if (parentFd >= 0) {
+		RemoveDirectoryTree(parentFd, kNewDocumentPlugInSyncStagingName);
+		if (MakeDirectoryAt(parentFd, kNewDocumentPlugInSyncStagingName, 0755) == 0)
+			sync.stagingFd = OpenAt(parentFd, kNewDocumentPlugInSyncStagingName, O_RDONLY | O_DIRECTORY, 0);
+	}
+	
+	if (sync.stagingFd >= 0) {
+		SyncTemplatesDirectory(&sync, "");
+		
+		// Nothing changed, added or removed : the current catalog is kept
+		if (!sync.failed
+			&& (sync.changes > 0
+				|| sync.previousFiles == NULL
+				|| CFDictionaryGetCount(sync.files) != CFDictionaryGetCount(sync.previousFiles))) {
+			swapped = SwapTemplatesCatalog(stagingPath, catalogPath);
+			if (!swapped)
+				printf("NewDocumentPlugIn: Error: cannot replace the templates catalog (%d).\n", errno);
+		}
+		close(sync.stagingFd);
+		
+		// After a swap, the staging directory holds the previous catalog
+		RemoveDirectoryTree(parentFd, kNewDocumentPlugInSyncStagingName);
+	}
+	
+	if (swapped) {
+		newState = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+		CFDictionarySetValue(newState, CFSTR("Source"), source);
+		CFDictionarySetValue(newState, CFSTR("Files"), sync.files);
+		WriteSyncState(statePath, newState);
+		CFRelease(newState);
+		
+		// Use the catalog from now on, without waiting for the next check of
+		// the manifest, and let the warm-up thread build its manifest before
+		// the next menu
+		catalog = CFStringCreateWithFileSystemRepresentation(NULL, catalogPath);
+		pthread_mutex_lock(&gTemplatesManifestMutex);
+		if (gTemplatesPath != NULL)
+			CFRelease(gTemplatesPath);
+		gTemplatesPath = catalog;
+		gTemplatesManifestCheckDate = 0;
+		RequestTemplatesManifestRefresh();
+		pthread_mutex_unlock(&gTemplatesManifestMutex);
+		
+		printf("NewDocumentPlugIn : Templates synchronized : %ld files reused, %ld files (%lld bytes) copied\n",
+			   (long)sync.reusedFiles, (long)sync.copiedFiles, (long long)sync.copiedBytes);
+	}
+	else if (sync.failed && !gBackgroundThreadsStopping) {
+		printf("NewDocumentPlugIn: Error: cannot synchronize the templates from %s.\n", sourcePath);
+	}
+	
+	AddToMetric(&gMetrics.syncs, 1);
+	AddToMetric(&gMetrics.syncReusedFiles, sync.reusedFiles);
+	AddToMetric(&gMetrics.syncCopiedFiles, sync.copiedFiles);
+	AddToMetric(&gMetrics.syncCopiedBytes, sync.copiedBytes);
+	RecordHistogramValue(&gMetrics.syncTime, GetElapsedMicroseconds(startDate));
+	
+	if (parentFd >= 0)
+		close(parentFd);
+	if (sync.catalogFd >= 0)
+		close(sync.catalogFd);
+	CFRelease(sync.filesByHash);
+	CFRelease(sync.files);
+	if (state != NULL)
+		CFRelease(state);
+	CFRelease(source);
+	close(lockFd);
+}
+
+/*
+ * SyncTemplatesDirectory
+ *
+ * Mirror a directory of the source (relative to the source root, or the empty
+ * string for the root itself) into the new catalog, then its subdirectories.
+ * Hidden items and items that are neither directories nor regular files are
+ * skipped. An unreadable directory fails the whole synchronization, so that
+ * an unavailable source never empties the catalog; so does a stop of the
+ * background threads.
+ */
+static void SyncTemplatesDirectory(TemplatesSync *sync, const char *relativePath)
+{
+	char path[PATH_MAX], childPath[PATH_MAX], sourceChildPath[PATH_MAX];
+	DIR *dir;
+	struct dirent *dirEntry;
+	struct stat info;
+	CFStringRef key;
+	
+	if (snprintf(path, sizeof(path), "%s/%s", sync->sourcePath, relativePath) >= sizeof(path)
+		|| (dir = opendir(path)) == NULL) {
+		sync->failed = true;
+		return;
+	}
+	
+	while (!sync->failed && (dirEntry = readdir(dir)) != NULL) {
+		if (gBackgroundThreadsStopping) {
+			sync->failed = true;
+			break;
+		}
+		if (dirEntry->d_name[0] == '.')
+			continue;
+		
+		if (snprintf(childPath, sizeof(childPath), (relativePath[0] != '\0') ? "%s/%s" : "%s%s", relativePath, dirEntry->d_name) >= sizeof(childPath)
+			|| snprintf(sourceChildPath, sizeof(sourceChildPath), "%s/%s", sync->sourcePath, childPath) >= sizeof(sourceChildPath)
+			|| lstat(sourceChildPath, &info) != 0)
+			continue;
+		
+		if (S_ISDIR(info.st_mode)) {
+			if (MakeDirectoryAt(sync->stagingFd, childPath, 0755) != 0) {
+				sync->failed = true;
+				break;
+			}
+			
+			key = CFStringCreateWithFileSystemRepresentation(NULL, childPath);
+			if (sync->previousFiles == NULL || !CFDictionaryContainsKey(sync->previousFiles, key))
+				sync->changes++;
+			CFDictionarySetValue(sync->files, key, kCFBooleanTrue);
+			CFRelease(key);
+			
+			SyncTemplatesDirectory(sync, childPath);
+		}
+		else if (S_ISREG(info.st_mode)) {
+			SyncTemplateFile(sync, childPath, sourceChildPath, &info);
+		}
+	}
+	
+	closedir(dir);
+}
+
+/*
+ * SyncTemplateFile
+ *
+ * Mirror a file of the source into the new catalog, and record its size,
+ * modification date and hash. A file whose size and modification date
+ * didn't change since the last synchronization is linked from the current
+ * catalog, if the copy there is intact; otherwise, the source file is hashed,
+ * and cloned from a local file with the same contents, or from the source.
+ * Copies get the modification date of the source file. Modification dates
+ * are compared in nanoseconds, not to miss a change within the same second.
+ */
+static void SyncTemplateFile(TemplatesSync *sync, const char *relativePath, const char *sourcePath, const struct stat *info)
+{
+	CFMutableDictionaryRef record;
+	CFDictionaryRef previous = NULL;
+	CFStringRef key, localKey;
+	CFNumberRef number;
+	struct stat localInfo;
+	struct timespec times[2];
+	char localName[PATH_MAX], localPath[PATH_MAX];
+	SInt64 size = info->st_size, modified = GetModificationTime(info), previousSize = -1, previousModified = -1;
+	SInt64 hash = 0;
+	Boolean reused = false;
+	
+	key = CFStringCreateWithFileSystemRepresentation(NULL, relativePath);
+	if (sync->previousFiles != NULL)
+		previous = CFDictionaryGetValue(sync->previousFiles, key);
+	
+	// A record missing a value is hashed again
+	if (GetSyncRecordValue(previous, CFSTR("Size"), &previousSize)
+		&& GetSyncRecordValue(previous, CFSTR("Modified"), &previousModified)
+		&& GetSyncRecordValue(previous, CFSTR("Hash"), &hash)
+		&& previousSize == size && previousModified == modified) {
+		
+		// Unchanged file : share the inode of the current copy
+		reused = (sync->catalogFd >= 0
+				  && StatAt(sync->catalogFd, relativePath, &localInfo, AT_SYMLINK_NOFOLLOW) == 0
+				  && S_ISREG(localInfo.st_mode)
+				  && localInfo.st_size == size
+				  && GetModificationTime(&localInfo) == modified
+				  && LinkAt(sync->catalogFd, relativePath, sync->stagingFd, relativePath) == 0);
+	}
+	else {
+		hash = (SInt64)HashFileContents(sourcePath);
+	}
+	
+	if (!reused) {
+		sync->changes++;
+		
+		// A moved or duplicated template is cloned locally, if its copy is intact
+		number = CFNumberCreate(NULL, kCFNumberSInt64Type, &hash);
+		localKey = CFDictionaryGetValue(sync->filesByHash, number);
+		CFRelease(number);
+		if (localKey != NULL) {
+			previous = CFDictionaryGetValue(sync->previousFiles, localKey);
+			if (GetSyncRecordValue(previous, CFSTR("Modified"), &previousModified)
+				&& CFStringGetFileSystemRepresentation(localKey, localName, sizeof(localName))
+				&& StatAt(sync->catalogFd, localName, &localInfo, AT_SYMLINK_NOFOLLOW) == 0
+				&& S_ISREG(localInfo.st_mode)
+				&& localInfo.st_size == size
+				&& GetModificationTime(&localInfo) == previousModified
+				&& snprintf(localPath, sizeof(localPath), "%s/%s", sync->catalogPath, localName) < sizeof(localPath))
+				reused = (CloneFileAt(localPath, sync->stagingFd, relativePath) == 0);
+		}
+		
+		if (!reused) {
+			if (CloneFileAt(sourcePath, sync->stagingFd, relativePath) == 0) {
+				sync->copiedFiles++;
+				sync->copiedBytes += size;
+			}
+			else {
+				sync->failed = true;
+			}
+		}
+		
+		times[0] = info->st_atimespec;
+		times[1] = info->st_mtimespec;
+		if (!sync->failed)
+			SetFileTimesAt(sync->stagingFd, relativePath, times);
+	}
+	if (reused)
+		sync->reusedFiles++;
+	
+	record = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	number = CFNumberCreate(NULL, kCFNumberSInt64Type, &size);
+	CFDictionarySetValue(record, CFSTR("Size"), number);
+	CFRelease(number);
+	number = CFNumberCreate(NULL, kCFNumberSInt64Type, &modified);
+	CFDictionarySetValue(record, CFSTR("Modified"), number);
+	CFRelease(number);
+	number = CFNumberCreate(NULL, kCFNumberSInt64Type, &hash);
+	CFDictionarySetValue(record, CFSTR("Hash"), number);
+	CFRelease(number);
+	CFDictionarySetValue(sync->files, key, record);
+	CFRelease(record);
+	CFRelease(key);
+}
+
+/*
+ * AddSyncFileByHash
+ *
+ * CFDictionaryApplyFunction callback, indexing the files of a synchronization
+ * state by hash. Directories and unreadable files (hashed as 0) are not
+ * indexed.
+ */
+static void AddSyncFileByHash(const void *key, const void *value, void *context)
+{
+	SInt64 hashValue = 0;
+	
+	if (GetSyncRecordValue(value, CFSTR("Hash"), &hashValue) && hashValue != 0)
+		CFDictionarySetValue((CFMutableDictionaryRef)context, CFDictionaryGetValue((CFDictionaryRef)value, CFSTR("Hash")), key);
+}
+
+/*
+ * GetSyncRecordValue
+ *
+ * Read a number of a file record of a synchronization state. Returns false if
+ * the record is not a dictionary, or if the value is missing or not a number,
+ * as in a state written by hand or by an older version.
+ */
+static Boolean GetSyncRecordValue(CFTypeRef record, CFStringRef key, SInt64 *outValue)
+{
+	CFTypeRef value;
+	
+	if (record == NULL || CFGetTypeID(record) != CFDictionaryGetTypeID())
+		return false;
+	
+	value = CFDictionaryGetValue((CFDictionaryRef)record, key);
+	return value != NULL && CFGetTypeID(value) == CFNumberGetTypeID()
+		&& CFNumberGetValue((CFNumberRef)value, kCFNumberSInt64Type, outValue);
+}
+
+/*
+ * SwapTemplatesCatalog
+ *
+ * Exchange the new catalog with the current one, or move it in place at the
+ * first synchronization. Where the file system can't exchange them at once,
+ * the catalog is briefly missing. Returns false and sets errno on error.
+ */
+static Boolean SwapTemplatesCatalog(const char *stagingPath, const char *catalogPath)
+{
+	char previousPath[PATH_MAX];
+	
+	// The first synchronization
+	if (access(catalogPath, F_OK) != 0 && errno == ENOENT)
+		return rename(stagingPath, catalogPath) == 0;
+	
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 101200
+	if (renamex_np != NULL) {
+		if (renamex_np(stagingPath, catalogPath, RENAME_SWAP) == 0)
+			return true;
+		if (errno != ENOTSUP)
+			return false;
+	}
+#endif
+	
+	if (snprintf(previousPath, sizeof(previousPath), "%s.previous", stagingPath) >= sizeof(previousPath)
+		|| rename(catalogPath, previousPath) != 0)
+		return false;
+	if (rename(stagingPath, catalogPath) != 0) {
+		rename(previousPath, catalogPath);
+		return false;
+	}
+	
+	return rename(previousPath, stagingPath) == 0;
+}
+
+/*
+ * RemoveDirectoryTree
+ *
+ * Remove a directory of parentFd and all its contents. Does nothing if it
+ * doesn't exist.
+ */
+static void RemoveDirectoryTree(int parentFd, const char *name)
+{
+	DIR *dir;
+	struct dirent *dirEntry;
+	int fd;
+	
+	dir = OpenDirectoryAt(parentFd, name, O_NOFOLLOW);
+	if (dir == NULL)
+		return;
+	fd = dirfd(dir);
+	
+	while ((dirEntry = readdir(dir)) != NULL) {
+		if (strcmp(dirEntry->d_name, ".") == 0 || strcmp(dirEntry->d_name, "..") == 0)
+			continue;
+		if (UnlinkAt(fd, dirEntry->d_name, 0) != 0 && (errno == EPERM || errno == EISDIR))
+			RemoveDirectoryTree(fd, dirEntry->d_name);
+	}
+	
+	closedir(dir);
+	UnlinkAt(parentFd, name, AT_REMOVEDIR);
+}
+
+/*
+ * CopySyncState
+ *
+ * Load the state of the last synchronization, or return NULL if there is
+ * none. The state is a dictionary with the "Source" path, and the "Files"
+ * mirrored from it, by path relative to the source : true for directories,
+ * and the "Size", "Modified" date and "Hash" of the source files.
+ */
+static CFDictionaryRef CopySyncState(const char *path)
+{
+	CFURLRef stateURL;
+	CFDictionaryRef state;
+	
+	stateURL = CFURLCreateFromFileSystemRepresentation(NULL, (const UInt8*)path, strlen(path), false);
+	if (stateURL == NULL)
+		return NULL;
+	
+	// Loaded like the manifest, another property list dictionary
+	state = CopyTemplatesManifestFromFile(stateURL);
+	CFRelease(stateURL);
+	
+	return state;
+}
+
+/*
+ * WriteSyncState
+ *
+ * Store the state of the last synchronization. The file is written aside and
+ * then renamed.
+ */
+static void WriteSyncState(const char *path, CFDictionaryRef state)
+{
+	CFDataRef data;
+	char temporaryPath[PATH_MAX];
+	Boolean written = false;
+	int fd;
+	
+	if (snprintf(temporaryPath, sizeof(temporaryPath), "%s.%d", path, (int)getpid()) >= sizeof(temporaryPath))
+		return;
+	
+	data = CFPropertyListCreateXMLData(NULL, state);
+	if (data == NULL)
+		return;
+	
+	fd = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) {
+		written = (write(fd, CFDataGetBytePtr(data), CFDataGetLength(data)) == CFDataGetLength(data));
+		close(fd);
+		if (!written || rename(temporaryPath, path) != 0)
+			unlink(temporaryPath);
+	}
+	
+	CFRelease(data);
+}
+
+
+// -----------------------------------------------------------------------------
+//	Memory budget
+// -----------------------------------------------------------------------------
+
+/*
+ * TrimPlugInCaches
+ *
+ * Release the cached data that hasn't been used since coldDate, then, if the
+ * caches still exceed kNewDocumentPlugInMemoryBudget, the data that is the
+ * easiest to rebuild. Must be called from the host thread.
+ */
+static void TrimPlugInCaches(CFAbsoluteTime coldDate)
+{
+	CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+	SInt64 contentSize;
+	
+	TrimTemplatesManifest(coldDate);
+	TrimOccupancyIndexes(coldDate);
+	TrimScriptingComponent(coldDate);
+	
+	// Template contents get what the other caches leave of the budget
+	contentSize = GetMetric(&gMetrics.cacheBytes[kNewDocumentPlugInContentCache]);
+	TrimTemplateContentCache(coldDate, kNewDocumentPlugInMemoryBudget - (GetCachesSize() - contentSize));
+	
+	// Then the indexes are rebuilt on demand
+	if (GetCachesSize() > kNewDocumentPlugInMemoryBudget)
+		TrimOccupancyIndexes(now);
+}
+
+/*
+ * TrimPlugInCachesTimer
+ *
+ * Callback of the timer that trims the caches while the host is idle.
+ */
+static void TrimPlugInCachesTimer(CFRunLoopTimerRef timer, void *info)
+{
+	TrimPlugInCaches(CFAbsoluteTimeGetCurrent() - kNewDocumentPlugInIdleDelay);
+}
+
+/*
+ * StartCachesTrimming
+ *
+ * Attach the caches trimming timer to the run loop of the calling (host)
+ * thread. Does nothing if the timer already runs.
+ */
+static void StartCachesTrimming()
+{
+	if (gCachesTrimmingTimer != NULL)
+		return;
+	
+	gCachesTrimmingTimer = CFRunLoopTimerCreate(NULL,
+												CFAbsoluteTimeGetCurrent() + kNewDocumentPlugInIdleDelay,
+												kNewDocumentPlugInIdleDelay,
+												0, 0, TrimPlugInCachesTimer, NULL);
+	CFRunLoopAddTimer(CFRunLoopGetCurrent(), gCachesTrimmingTimer, kCFRunLoopCommonModes);
+}
+
+/*
+ * GetCachesSize
+ *
+ * Return the memory used by all the plugin caches, in bytes.
+ */
+static SInt64 GetCachesSize()
+{
+	SInt64 size = 0;
+	int cache;
+	
+	for (cache = 0; cache < kNewDocumentPlugInCaches; cache++)
+		size += GetMetric(&gMetrics.cacheBytes[cache]);
+	
+	return size;
+}
+
+/*
+ * TrimTemplatesManifest
+ *
+ * Release the templates manifest and table if they haven't been used since
+ * coldDate. The next menu loads the manifest file again. Creation threads
+ * still using the table keep it until they release it.
+ */
+static void TrimTemplatesManifest(CFAbsoluteTime coldDate)
+{
+	pthread_mutex_lock(&gTemplatesManifestMutex);
+	
+	if (gTemplatesManifest != NULL && gTemplatesLastUse <= coldDate) {
+		if (gTemplateTable != NULL && --gTemplateTable->refCount == 0)
+			FreeTemplateTable(gTemplateTable);
+		gTemplateTable = NULL;
+		CFRelease(gTemplatesManifest);
+		gTemplatesManifest = NULL;
+		if (gTemplatesNames != NULL)
+			CFRelease(gTemplatesNames);
+		gTemplatesNames = NULL;
+	}
+	
+	pthread_mutex_unlock(&gTemplatesManifestMutex);
+}
+
+/*
+ * TrimOccupancyIndexes
+ *
+ * Release the occupancy indexes that haven't been used since coldDate. As
+ * indexes are sorted by use, these are at the end of the list. Indexes with
+ * numbers still reserved by creations in progress are kept.
+ */
+static void TrimOccupancyIndexes(CFAbsoluteTime coldDate)
+{
+	OccupancyIndex **link, *unused;
+	
+	pthread_mutex_lock(&gOccupancyMutex);
+	
+	for (link = &gOccupancyIndexes; *link != NULL && (*link)->lastUse > coldDate; link = &(*link)->next)
+		;
+	while (*link != NULL) {
+		unused = *link;
+		if (HasReservedDocumentSuffixes(unused)) {
+			link = &unused->next;
+			continue;
+		}
+		*link = unused->next;
+		FreeOccupancyIndex(unused);
+	}
+	
+	pthread_mutex_unlock(&gOccupancyMutex);
+}
+
+/*
+ * TrimTemplateContentCache
+ *
+ * Evict the template contents that haven't been used since coldDate, then the
+ * least recently used ones until the cache uses at most maxSize bytes.
+ */
+static void TrimTemplateContentCache(CFAbsoluteTime coldDate, SInt64 maxSize)
+{
+	pthread_mutex_lock(&gTemplateCacheMutex);
+	
+	while (gTemplateCacheTail != NULL
+		   && (gTemplateCacheTail->lastUse <= coldDate
+			   || GetMetric(&gMetrics.cacheBytes[kNewDocumentPlugInContentCache]) > maxSize)) {
+		RemoveTemplateCacheEntry(gTemplateCacheTail);
+		gTemplateCacheStats.evictions++;
+	}
+	
+	pthread_mutex_unlock(&gTemplateCacheMutex);
+}
+
+/*
+ * TrimScriptingComponent
+ *
+ * Close the connection to the scripting component if no script has run since
+ * coldDate. It is opened again by the next script.
+ */
+static void TrimScriptingComponent(CFAbsoluteTime coldDate)
+{
+	if (gScriptingComponent != NULL && gScriptingComponentLastUse <= coldDate) {
+		CloseComponent(gScriptingComponent);
+		gScriptingComponent = NULL;
+	}
+}
+
+
+// -----------------------------------------------------------------------------
+//	Creation executor
+// -----------------------------------------------------------------------------
+
+/*
+ * StartCreationExecutor
+ *
+ * Start the creation threads, and attach the completion source to the run loop
+ * of the calling (host) thread. Does nothing if the executor already runs.
+ * Must be called from the host thread.
+ */
+static OSStatus StartCreationExecutor()
+{
+	CFRunLoopSourceContext context = { 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, DrainCompletedCreations };
+	int err = 0;
+	
+	if (gCompletionSource != NULL)
+		return noErr;
+	
+	// Resolve our bundle once, before the threads share it
+	GetSelfBundle();
+	
+	// Completed creations are drained by the host run loop
+	gHostRunLoop = (CFRunLoopRef)CFRetain(CFRunLoopGetCurrent());
+	gCompletionSource = CFRunLoopSourceCreate(NULL, 0, &context);
+	CFRunLoopAddSource(gHostRunLoop, gCompletionSource, kCFRunLoopCommonModes);
+	
+	// Spawn the creation threads
+	pthread_mutex_lock(&gCreationMutex);
+	while (gCreationThreadsCount < kNewDocumentPlugInCreationThreads && err == 0) {
+		err = pthread_create(&gCreationThreads[gCreationThreadsCount], NULL, CreationThreadMain, NULL);
+		if (err == 0)
+			gCreationThreadsCount++;
+	}
+	pthread_mutex_unlock(&gCreationMutex);
+	
+	if (gCreationThreadsCount == 0) {
+		CFRunLoopSourceInvalidate(gCompletionSource);
+		CFRelease(gCompletionSource);
+		CFRelease(gHostRunLoop);
+		gCompletionSource = NULL;
+		gHostRunLoop = NULL;
+		return memFullErr;
+	}
+	
+	return noErr;
+}
+
+/*
+ * StopCreationExecutor
+ *
+ * Cancel every creation request, wait for the creation threads to exit, then
+ * complete the requests and detach the completion source from the host run
+ * loop. A copy in progress cannot be interrupted : this waits for it to end.
+ * Does nothing if the executor doesn't run. Must be called from the host
+ * thread; the executor may be started again afterwards.
+ */
+static void StopCreationExecutor()
+{
+	int i, count;
+	
+	if (gCompletionSource == NULL)
+		return;
+	
+	CancelCreationRequest(kNewDocumentPlugInAllCreationRequests);
+	
+	pthread_mutex_lock(&gCreationMutex);
+	gCreationExecutorStopping = true;
+	count = gCreationThreadsCount;
+	pthread_cond_broadcast(&gCreationCondition);
+	pthread_mutex_unlock(&gCreationMutex);
+	
+	for (i = 0; i < count; i++)
+		pthread_join(gCreationThreads[i], NULL);
+	
+	pthread_mutex_lock(&gCreationMutex);
+	gCreationThreadsCount = 0;
+	gCreationExecutorStopping = false;
+	pthread_mutex_unlock(&gCreationMutex);
+	
+	// Release the completed requests and their batches, and run the hooks of
+	// the documents created in the meantime
+	DrainCompletedCreations(NULL);
+	
+	CFRunLoopSourceInvalidate(gCompletionSource);
+	CFRelease(gCompletionSource);
+	CFRelease(gHostRunLoop);
+	gCompletionSource = NULL;
+	gHostRunLoop = NULL;
+}
+
+/*
+ * SubmitCreationRequest
+ *
+ * Queue the creation of a new document from the template at index commandID,
+ * in the destURL directory, in the interactive or bulk lane. Never blocks on
+ * the file system: if the queue of the lane is full, the request is rejected.
+ * The request ID can be used to cancel it. batch may be NULL; otherwise the
+ * batch is updated when the request completes.
+ */
+static OSStatus SubmitCreationRequest(SInt32 commandID, CFURLRef destURL, int lane, CreationBatch *batch, UInt32 *outRequestID)
+{
+	CreationRequest *request;
+	OSStatus err;
+	
+	err = StartCreationExecutor();
+	if (err != noErr)
+		return err;
+	
+	request = (CreationRequest*) calloc(1, sizeof(CreationRequest));
+	if (request == NULL)
+		return memFullErr;
+	
+	request->commandID = commandID;
+	request->lane = lane;
+	request->destURL = (CFURLRef)CFRetain(destURL);
+	request->batch = batch;
+	request->deadline = CFAbsoluteTimeGetCurrent() + kNewDocumentPlugInCreationTimeout;
+	request->step = kNewDocumentPlugInOpenStep;
+	request->directoryFd = -1;
+	
+	pthread_mutex_lock(&gCreationMutex);
+	if (gPendingCreations[lane].count >= kNewDocumentPlugInMaxPendingCreations) {
+		err = kNewDocumentPlugInQueueFullErr;
+	}
+	else {
+		request->requestID = ++gLastCreationRequestID;
+		EnqueueCreationRequest(&gPendingCreations[lane], request);
+		pthread_cond_signal(&gCreationCondition);
+	}
+	pthread_mutex_unlock(&gCreationMutex);
+	
+	if (err != noErr) {
+		FreeCreationRequest(request);
+		return err;
+	}
+	
+	if (outRequestID != NULL)
+		*outRequestID = request->requestID;
+	
+	return noErr;
+}
+
+/*
+ * CancelCreationRequest
+ *
+ * Cancel a pending or running creation request, or all of them with
+ * kNewDocumentPlugInAllCreationRequests. A running request stops at the next
+ * step boundary : a copy in progress cannot be interrupted, and a document
+ * already copied is still stamped and reported.
+ */
+static void CancelCreationRequest(UInt32 requestID)
+{
+	CreationRequest *request;
+	int lane;
+	
+	pthread_mutex_lock(&gCreationMutex);
+	for (lane = 0; lane < kNewDocumentPlugInLanes; lane++) {
+		for (request = gPendingCreations[lane].head; request != NULL; request = request->next) {
+			if (requestID == kNewDocumentPlugInAllCreationRequests || request->requestID == requestID)
+				request->cancelled = true;
+		}
+		for (request = gRunningCreations[lane].head; request != NULL; request = request->next) {
+			if (requestID == kNewDocumentPlugInAllCreationRequests || request->requestID == requestID)
+				request->cancelled = true;
+		}
+	}
+	pthread_mutex_unlock(&gCreationMutex);
+}
+
+/*
+ * CancelCreationBatch
+ *
+ * Cancel the pending and running creation requests of a batch, as
+ * CancelCreationRequest does.
+ */
+static void CancelCreationBatch(const CreationBatch *batch)
+{
+	CreationRequest *request;
+	int lane;
+	
+	pthread_mutex_lock(&gCreationMutex);
+	for (lane = 0; lane < kNewDocumentPlugInLanes; lane++) {
+		for (request = gPendingCreations[lane].head; request != NULL; request = request->next) {
+			if (request->batch == batch)
+				request->cancelled = true;
+		}
+		for (request = gRunningCreations[lane].head; request != NULL; request = request->next) {
+			if (request->batch == batch)
+				request->cancelled = true;
+		}
+	}
+	pthread_mutex_unlock(&gCreationMutex);
+}
+
+/*
+ * CreationThreadMain
+ *
+ * Main loop of a creation thread: perform pending requests one after the
+ * other, and signal the host thread when they complete, until the executor
+ * stops and no request is left. Several creation threads share the pending
+ * queues. A bulk request is set aside between two
+ * of its steps when interactive requests are waiting, and resumed later by
+ * any creation thread.
+ */
+static void* CreationThreadMain(void *unused)
+{
+	CreationRequest *request;
+	CFAbsoluteTime startDate;
+	OSStatus err;
+	int lane = kNewDocumentPlugInInteractiveLane;
+	
+	for (;;) {
+		// Wait for a request this thread may perform
+		pthread_mutex_lock(&gCreationMutex);
+		while ((request = DequeueNextCreationRequest()) == NULL && !gCreationExecutorStopping)
+			pthread_cond_wait(&gCreationCondition, &gCreationMutex);
+		if (request == NULL) {
+			pthread_mutex_unlock(&gCreationMutex);
+			break;
+		}
+		EnqueueCreationRequest(&gRunningCreations[request->lane], request);
+		
+		// Bulk requests may wait long behind each other : their delay only
+		// starts when they run
+		if (request->lane == kNewDocumentPlugInBulkLane && request->step == kNewDocumentPlugInOpenStep)
+			request->deadline = CFAbsoluteTimeGetCurrent() + kNewDocumentPlugInCreationTimeout;
+		pthread_mutex_unlock(&gCreationMutex);
+		
+		// Bulk creations yield the disk to everything else
+		if (request->lane != lane) {
+			lane = request->lane;
+			SetCreationThreadLane(lane);
+		}
+		
+		startDate = CFAbsoluteTimeGetCurrent();
+		do {
+			err = ResumeCreationRequest(request);
+		} while (request->step != kNewDocumentPlugInDoneStep && !ShouldSetCreationAside(request));
+		request->runTime += GetElapsedMicroseconds(startDate);
+		
+		if (request->step != kNewDocumentPlugInDoneStep) {
+			// Set the bulk request aside, first of its lane, until the
+			// interactive requests are performed
+			pthread_mutex_lock(&gCreationMutex);
+			RemoveCreationRequest(&gRunningCreations[lane], request);
+			PushCreationRequest(&gPendingCreations[lane], request);
+			pthread_mutex_unlock(&gCreationMutex);
+			AddToMetric(&gMetrics.creationsSetAside, 1);
+			continue;
+		}
+		
+		request->status = err;
+		AddToMetric(&gMetrics.creations, 1);
+		if (request->status != noErr)
+			AddToMetric(&gMetrics.creationFailures, 1);
+		RecordHistogramValue(&gMetrics.creationTime[lane], request->runTime);
+		
+		// Hand the request back to the host thread
+		pthread_mutex_lock(&gCreationMutex);
+		RemoveCreationRequest(&gRunningCreations[lane], request);
+		EnqueueCreationRequest(&gCompletedCreations, request);
+		
+		// A thread waiting for the bulk concurrency cap may go on
+		if (lane == kNewDocumentPlugInBulkLane && gPendingCreations[lane].head != NULL)
+			pthread_cond_signal(&gCreationCondition);
+		pthread_mutex_unlock(&gCreationMutex);
+		
+		CFRunLoopSourceSignal(gCompletionSource);
+		CFRunLoopWakeUp(gHostRunLoop);
+	}
+	
+	return NULL;
+}
+
+/*
+ * DequeueNextCreationRequest
+ *
+ * Return the next request to perform, or NULL if there is none. Interactive
+ * requests have a strict priority over bulk requests, and bulk requests are
+ * only returned while less than kNewDocumentPlugInMaxBulkCreations of them
+ * are running. The caller must hold gCreationMutex.
+ */
+static CreationRequest* DequeueNextCreationRequest()
+{
+	if (gPendingCreations[kNewDocumentPlugInInteractiveLane].head != NULL)
+		return DequeueCreationRequest(&gPendingCreations[kNewDocumentPlugInInteractiveLane]);
+	
+	if (gPendingCreations[kNewDocumentPlugInBulkLane].head != NULL
+		&& gRunningCreations[kNewDocumentPlugInBulkLane].count < kNewDocumentPlugInMaxBulkCreations)
+		return DequeueCreationRequest(&gPendingCreations[kNewDocumentPlugInBulkLane]);
+	
+	return NULL;
+}
+
+/*
+ * SetCreationThreadLane
+ *
+ * Set the disk I/O policy of the calling creation thread for a lane: bulk
+ * creations are throttled whenever other I/O is pending, interactive
+ * creations use the default policy.
+ */
+static void SetCreationThreadLane(int lane)
+{
+	SetThreadIOThrottled(lane == kNewDocumentPlugInBulkLane);
+}
+
+/*
+ * ResumeCreationRequest
+ *
+ * Perform the next step of a creation request on a creation thread, or on
+ * the executor of the creation API: open the template and the destination
+ * directory, resolve a free document name, copy the template, then stamp the
+ * new item (hide its extension). Once the
+ * request is done, or has failed, its step is kNewDocumentPlugInDoneStep and
+ * the resources of its steps are released, unless the request keeps them
+ * open for further documents.
+ */
+static OSStatus ResumeCreationRequest(CreationRequest *request)
+{
+	OSStatus err;
+	struct stat info;
+	int maxAttempts = 3;
+	
+	// A copied document is always stamped and reported : cancelling it now
+	// would leave it in the directory, unannounced
+	err = (request->step != kNewDocumentPlugInStampStep) ? CheckCreationRequest(request) : noErr;
+	
+	if (err == noErr) {
+		switch (request->step) {
+			case kNewDocumentPlugInOpenStep:
+				err = OpenCreationRequest(request);
+				request->step = kNewDocumentPlugInNameStep;
+				break;
+			
+			case kNewDocumentPlugInNameStep:
+				// Define the name of the new document, unless it is given
+				if (request->fixedName)
+					request->step = kNewDocumentPlugInCopyStep;
+				else if (ResolveDocumentName(request->directory,
+										request->directoryFd,
+										GetCreationBaseName(request),
+										GetCreationExtensions(request),
+										request->documentName,
+										sizeof(request->documentName),
+										&request->suffix))
+					request->step = kNewDocumentPlugInCopyStep;
+				else
+					err = dupFNErr;
+				break;
+			
+			case kNewDocumentPlugInCopyStep:
+				// The state of the directory just before the copy tells whether
+				// the copy is its only change
+				request->directoryDate = 0;
+				if (SimulateFileSystemCallIfNeeded(kNewDocumentPlugInStatCall) == 0 && fstat(request->directoryFd, &info) == 0)
+					request->directoryDate = GetModificationTime(&info);
+				
+				err = CopyCreationTemplate(request);
+				
+				// Another creation thread or application may grab the same name in the
+				// meantime : in that case, resolve the name again (the taken number
+				// stays used in the occupancy index).
+				if (err == dupFNErr && !request->fixedName && ++request->attempts < maxAttempts) {
+					ReleaseDocumentName(request->directory, GetCreationBaseName(request), GetCreationExtensions(request), request->suffix, true);
+					request->suffix = 0;
+					request->step = kNewDocumentPlugInNameStep;
+					err = noErr;
+				}
+				else {
+					request->step = kNewDocumentPlugInStampStep;
+				}
+				break;
+			
+			case kNewDocumentPlugInStampStep:
+				// Hide the extension of the item (which will not be shown,
+				// except if the Finder is configured to show all extensions anyway)
+				LSSetExtensionHiddenForRef(&request->itemRef, true);
+				request->itemName = CFStringCreateWithFileSystemRepresentation(NULL, request->documentName);
+				if (!request->fixedName)
+					NoteDocumentCreated(request->directory, request->directoryFd,
+										GetCreationBaseName(request), GetCreationExtensions(request),
+										request->suffix, request->directoryDate);
+				request->suffix = 0;
+				request->step = kNewDocumentPlugInDoneStep;
+				break;
+		}
+	}
+	
+	if (err != noErr) {
+		// Free the number reserved for the document, unless its name is taken
+		if (request->suffix != 0) {
+			ReleaseDocumentName(request->directory, GetCreationBaseName(request), GetCreationExtensions(request), request->suffix, err == dupFNErr);
+			request->suffix = 0;
+		}
+		request->step = kNewDocumentPlugInDoneStep;
+	}
+	if (request->step == kNewDocumentPlugInDoneStep && !request->keepOpen)
+		CloseCreationRequest(request);
+	
+	return err;
+}
+
+/*
+ * GetCreationBaseName
+ *
+ * Return the base name of the documents created by an open request, as a file
+ * system representation.
+ */
+static const char* GetCreationBaseName(const CreationRequest *request)
+{
+	return request->table->fileNames + request->table->documentNameOffsets[request->commandID];
+}
+
+/*
+ * GetCreationExtensions
+ *
+ * Return the extensions of the documents created by an open request, as a
+ * file system representation.
+ */
+static const char* GetCreationExtensions(const CreationRequest *request)
+{
+	return request->table->fileNames + request->table->extensionsNameOffsets[request->commandID];
+}
+
+/*
+ * OpenCreationRequest
+ *
+ * First step of a creation request: retrieve the URL of the selected template,
+ * and open the destination directory, which is looked up once : naming and
+ * writing are relative to it.
+ */
+static OSStatus OpenCreationRequest(CreationRequest *request)
+{
+	CFStringRef templateName;
+	char directory[PATH_MAX];
+	int error;
+	
+	request->table = CopyTemplateTable();
+	if (request->table == NULL)
+		return fnfErr;
+	if (request->commandID < 0 || request->commandID >= request->table->count)
+		return paramErr;
+	
+	templateName = CopyTemplateTableName(request->table, request->commandID);
+	request->templateURL = CopyTemplateURL(templateName);
+	CFRelease(templateName);
+	if (request->templateURL == NULL)
+		return fnfErr;
+	
+	if (!CFURLGetFileSystemRepresentation(request->destURL, true, (UInt8*)directory, sizeof(directory)))
+		return paramErr;
+	request->directory = strdup(directory);
+	if (request->directory == NULL)
+		return memFullErr;
+	
+	error = SimulateFileSystemCallIfNeeded(kNewDocumentPlugInOpenCall);
+	request->directoryFd = (error == 0) ? open(directory, O_RDONLY | O_DIRECTORY) : -1;
+	if (request->directoryFd < 0)
+		return GetErrnoStatus((error != 0) ? error : errno);
+	
+	return noErr;
+}
+
+/*
+ * CopyCreationTemplate
+ *
+ * Copy step of a creation request: write or copy the template under the
+ * resolved document name. Returns dupFNErr if the name has been taken since.
+ */
+static OSStatus CopyCreationTemplate(CreationRequest *request)
+{
+	OSStatus err;
+	TemplateTable *table = request->table;
+	CFStringRef newDocumentName;
+	CFDataRef templateContents;
+	char templatePath[PATH_MAX];
+	FSRef selectionPathFS, templateFilenameFS;
+	
+	if (!CFURLGetFileSystemRepresentation(request->templateURL, true, (UInt8*)templatePath, sizeof(templatePath)))
+		return paramErr;
+	
+	// Small templates are written directly from the content cache…
+	templateContents = CopyCachedTemplateContents(request->templateURL);
+	if (templateContents != NULL) {
+		err = WriteTemplateContents(templateContents, templatePath, request->directory, request->directoryFd, request->documentName, &request->itemRef);
+		if (err == noErr)
+			AddToMetric(&gMetrics.bytesCopied[kNewDocumentPlugInCacheBackend], CFDataGetLength(templateContents));
+		CFRelease(templateContents);
+	}
+	// …packages are instantiated from the blob store…
+	else if (table->trees[request->commandID] != NULL) {
+		err = InstantiateTemplateTree(table->trees[request->commandID], templatePath, request->directory, request->directoryFd, request->documentName, &request->itemRef);
+		if (err == noErr)
+			AddToMetric(&gMetrics.bytesCopied[kNewDocumentPlugInBlobStoreBackend], table->sizes[request->commandID]);
+	}
+	// …while the others are copied by the file manager.
+	else {
+		newDocumentName = CFStringCreateWithFileSystemRepresentation(NULL, request->documentName);
+		CFURLGetFSRef(request->templateURL, &templateFilenameFS);
+		CFURLGetFSRef(request->destURL, &selectionPathFS);
+		err = GetErrnoStatus(SimulateFileSystemCallIfNeeded(kNewDocumentPlugInCopyCall));
+		if (err == noErr)
+			err = FSCopyObjectSync(&templateFilenameFS,
+								   &selectionPathFS,
+								   newDocumentName,
+								   &request->itemRef,
+								   kFSFileOperationDefaultOptions);
+		if (err == noErr)
+			AddToMetric(&gMetrics.bytesCopied[kNewDocumentPlugInFileManagerBackend], table->sizes[request->commandID]);
+		CFRelease(newDocumentName);
+	}
+	
+	return err;
+}
+
+/*
+ * CloseCreationRequest
+ *
+ * Release the template table, template URL and destination directory held by
+ * the steps of a creation request. May be called more than once.
+ */
+static void CloseCreationRequest(CreationRequest *request)
+{
+	if (request->directoryFd >= 0) {
+		close(request->directoryFd);
+		request->directoryFd = -1;
+	}
+	if (request->directory != NULL) {
+		free(request->directory);
+		request->directory = NULL;
+	}
+	if (request->templateURL != NULL) {
+		CFRelease(request->templateURL);
+		request->templateURL = NULL;
+	}
+	if (request->table != NULL) {
+		ReleaseTemplateTable(request->table);
+		request->table = NULL;
+	}
+}
+
+/*
+ * ShouldSetCreationAside
+ *
+ * Return true if a running bulk request should be set aside at its next step
+ * boundary, because interactive requests are waiting.
+ */
+static Boolean ShouldSetCreationAside(CreationRequest *request)
+{
+	Boolean waiting;
+	
+	if (request->lane != kNewDocumentPlugInBulkLane)
+		return false;
+	
+	pthread_mutex_lock(&gCreationMutex);
+	waiting = (gPendingCreations[kNewDocumentPlugInInteractiveLane].head != NULL);
+	pthread_mutex_unlock(&gCreationMutex);
+	
+	return waiting;
+}
+
+/*
+ * CheckCreationRequest
+ *
+ * Return userCanceledErr if the request has been cancelled, errAETimeout if
+ * its deadline has passed, or noErr if it can proceed. Only checked before
+ * the open, name and copy steps : a blocking copy runs to its end, whatever
+ * its deadline, and is then always stamped.
+ */
+static OSStatus CheckCreationRequest(CreationRequest *request)
+{
+	Boolean cancelled;
+	
+	pthread_mutex_lock(&gCreationMutex);
+	cancelled = request->cancelled;
+	pthread_mutex_unlock(&gCreationMutex);
+	
+	if (cancelled)
+		return userCanceledErr;
+	if (CFAbsoluteTimeGetCurrent() > request->deadline)
+		return errAETimeout;
+	
+	return noErr;
+}
+
+/*
+ * DrainCompletedCreations
+ *
+ * Completion source callback, run on the host thread: select the created
+ * items in the Finder, report the batches results, and release the completed
+ * requests. Items created as part of a multiple selection are not selected.
+ */
+static void DrainCompletedCreations(void *info)
+{
+	CreationRequest *request, *completed;
+	CreationBatch *batch;
+	
+	// Grab the whole completion queue at once
+	pthread_mutex_lock(&gCreationMutex);
+	completed = gCompletedCreations.head;
+	gCompletedCreations.head = NULL;
+	gCompletedCreations.tail = NULL;
+	gCompletedCreations.count = 0;
+	pthread_mutex_unlock(&gCreationMutex);
+	
+	while (completed != NULL) {
+		request = completed;
+		completed = request->next;
+		
+		batch = request->batch;
+		
+		// Only a document created alone from the menu is edited in the Finder
+		if (request->status == noErr)
+			QueueHookItem(request->destURL,
+						  request->itemName,
+						  request->lane == kNewDocumentPlugInInteractiveLane);
+		else if (request->status != userCanceledErr)
+			printf("NewDocumentPlugIn : Document creation error (%d)\n", (int)request->status);
+		
+		// Aggregate the result of the whole batch. When the volume is full or
+		// doesn't answer, the other documents of the batch would only wait for
+		// the same failure : give up on them.
+		if (batch != NULL) {
+			if (request->status != noErr)
+				batch->failed++;
+			if ((request->status == dskFulErr || request->status == errAETimeout) && batch->remaining > 1)
+				CancelCreationBatch(batch);
+			if (--batch->remaining == 0) {
+				if (batch->failed > 0)
+					printf("NewDocumentPlugIn : %u of %u documents could not be created\n",
+						   (unsigned int)batch->failed, (unsigned int)batch->total);
+				free(batch);
+			}
+		}
+		
+		FreeCreationRequest(request);
+	}
+	
+	ScheduleHookItems();
+}
+
+/*
+ * EnqueueCreationRequest
+ *
+ * Append a request at the end of a queue. The caller must hold gCreationMutex.
+ */
+static void EnqueueCreationRequest(CreationQueue *queue, CreationRequest *request)
+{
+	request->next = NULL;
+	if (queue->tail != NULL)
+		queue->tail->next = request;
+	else
+		queue->head = request;
+	queue->tail = request;
+	queue->count++;
+}
+
+/*
+ * PushCreationRequest
+ *
+ * Insert a request at the head of a queue. The caller must hold gCreationMutex.
+ */
+static void PushCreationRequest(CreationQueue *queue, CreationRequest *request)
+{
+	request->next = queue->head;
+	queue->head = request;
+	if (queue->tail == NULL)
+		queue->tail = request;
+	queue->count++;
+}
+
+/*
+ * DequeueCreationRequest
+ *
+ * Remove and return the first request of a queue, or NULL if the queue is
+ * empty. The caller must hold gCreationMutex.
+ */
+static CreationRequest* DequeueCreationRequest(CreationQueue *queue)
+{
+	CreationRequest *request = queue->head;
+	
+	if (request != NULL) {
+		queue->head = request->next;
+		if (queue->head == NULL)
+			queue->tail = NULL;
+		queue->count--;
+		request->next = NULL;
+	}
+	
+	return request;
+}
+
+/*
+ * RemoveCreationRequest
+ *
+ * Unlink a request from anywhere in a queue. The caller must hold gCreationMutex.
+ */
+static void RemoveCreationRequest(CreationQueue *queue, CreationRequest *request)
+{
+	CreationRequest *previous = NULL, *current;
+	
+	for (current = queue->head; current != NULL; previous = current, current = current->next) {
+		if (current == request) {
+			if (previous != NULL)
+				previous->next = current->next;
+			else
+				queue->head = current->next;
+			if (queue->tail == current)
+				queue->tail = previous;
+			queue->count--;
+			request->next = NULL;
+			break;
+		}
+	}
+}
+
+/*
+ * FreeCreationRequest
+ *
+ * Release a creation request and the objects it holds.
+ */
+static void FreeCreationRequest(CreationRequest *request)
+{
+	CloseCreationRequest(request);
+	if (request->destURL != NULL)
+		CFRelease(request->destURL);
+	if (request->itemName != NULL)
+		CFRelease(request->itemName);
+	free(request);
+}
+
+
+// -----------------------------------------------------------------------------
+//	Creation API
+// -----------------------------------------------------------------------------
+
+/*
+ * NewDocumentPlugInCreateDocument
+ *
+ * Create the request of a new document from the template at index commandID,
+ * in the destURL directory, to be performed by the caller's event loop rather
+ * than by the creation threads. If executor isn't NULL, it is called with info
+ * to schedule the first step, and again after each step until the creation is
+ * done; otherwise the caller calls NewDocumentPlugInStepCreation until it
+ * returns true. The created document isn't selected in the Finder. The
+ * creation must be released with NewDocumentPlugInDisposeCreation.
+ */
+OSStatus NewDocumentPlugInCreateDocument(SInt32 commandID, CFURLRef destURL, NewDocumentCreationExecutor executor, void *info, NewDocumentCreationRef *outCreation)
+{
+	CreationRequest *request;
+	
+	if (destURL == NULL || outCreation == NULL)
+		return paramErr;
+	
+	request = (CreationRequest*) calloc(1, sizeof(CreationRequest));
+	if (request == NULL)
+		return memFullErr;
+	
+	request->commandID = commandID;
+	request->lane = kNewDocumentPlugInInteractiveLane;
+	request->destURL = (CFURLRef)CFRetain(destURL);
+	request->status = kNewDocumentPlugInCreationInProgressErr;
+	request->step = kNewDocumentPlugInOpenStep;
+	request->directoryFd = -1;
+	request->executor = executor;
+	request->executorInfo = info;
+	
+	pthread_mutex_lock(&gCreationMutex);
+	request->requestID = ++gLastCreationRequestID;
+	pthread_mutex_unlock(&gCreationMutex);
+	
+	*outCreation = request;
+	if (executor != NULL)
+		executor(request, info);
+	
+	return noErr;
+}
+
+/*
+ * NewDocumentPlugInStepCreation
+ *
+ * Perform the next step of a creation (see ResumeCreationRequest), then
+ * schedule the following one with the executor of the creation. Returns true
+ * once the creation is done, whether it succeeded or not. The steps of a
+ * creation must not run concurrently, but each may run on any thread. The
+ * delay of kNewDocumentPlugInCreationTimeout starts with the first step.
+ */
+Boolean NewDocumentPlugInStepCreation(NewDocumentCreationRef creation)
+{
+	CFAbsoluteTime startDate;
+	OSStatus err;
+	
+	if (creation->step == kNewDocumentPlugInDoneStep)
+		return true;
+	
+	startDate = CFAbsoluteTimeGetCurrent();
+	if (creation->step == kNewDocumentPlugInOpenStep)
+		creation->deadline = startDate + kNewDocumentPlugInCreationTimeout;
+	
+	err = ResumeCreationRequest(creation);
+	creation->runTime += GetElapsedMicroseconds(startDate);
+	
+	if (creation->step != kNewDocumentPlugInDoneStep) {
+		if (creation->executor != NULL)
+			creation->executor(creation, creation->executorInfo);
+		return false;
+	}
+	
+	creation->status = err;
+	AddToMetric(&gMetrics.creations, 1);
+	if (err != noErr)
+		AddToMetric(&gMetrics.creationFailures, 1);
+	RecordHistogramValue(&gMetrics.creationTime[creation->lane], creation->runTime);
+	
+	return true;
+}
+
+/*
+ * NewDocumentPlugInPollCreation
+ *
+ * Return the status of a creation : kNewDocumentPlugInCreationInProgressErr
+ * until it is done, then noErr or the error that made it fail. Once it has
+ * succeeded, outItemName (if not NULL) is set to the name of the new
+ * document, which belongs to the creation.
+ */
+OSStatus NewDocumentPlugInPollCreation(NewDocumentCreationRef creation, CFStringRef *outItemName)
+{
+	if (outItemName != NULL)
+		*outItemName = (creation->status == noErr) ? creation->itemName : NULL;
+	
+	return creation->status;
+}
+
+/*
+ * NewDocumentPlugInCancelCreation
+ *
+ * Cancel a creation, from any thread. Like CancelCreationRequest, it stops at
+ * its next step boundary, with userCanceledErr : the next call to
+ * NewDocumentPlugInStepCreation completes it, unless its document has already
+ * been copied.
+ */
+void NewDocumentPlugInCancelCreation(NewDocumentCreationRef creation)
+{
+	pthread_mutex_lock(&gCreationMutex);
+	creation->cancelled = true;
+	pthread_mutex_unlock(&gCreationMutex);
+}
+
+/*
+ * NewDocumentPlugInDisposeCreation
+ *
+ * Release a creation. A creation that isn't done is cancelled and completed
+ * first, so that the number reserved for its document is freed. The executor
+ * is no longer called.
+ */
+void NewDocumentPlugInDisposeCreation(NewDocumentCreationRef creation)
+{
+	creation->executor = NULL;
+	if (creation->step != kNewDocumentPlugInDoneStep) {
+		NewDocumentPlugInCancelCreation(creation);
+		while (!NewDocumentPlugInStepCreation(creation))
+			;
+	}
+	
+	FreeCreationRequest(creation);
+}
+
+
+// -----------------------------------------------------------------------------
+//	Post-creation hooks
+// -----------------------------------------------------------------------------
+
+/*
+ * QueueHookItem
+ *
+ * Queue a created document for the post-creation hooks. When
+ * kNewDocumentPlugInHookBatchSize documents are waiting, the hooks run as soon
+ * as the host run loop is back, rather than in the middle of the completion
+ * of the creations.
+ */
+static void QueueHookItem(CFURLRef directoryURL, CFStringRef itemName, Boolean edit)
+{
+	HookItem *item;
+	
+	item = (HookItem*) calloc(1, sizeof(HookItem));
+	if (item == NULL)
+		return;
+	
+	item->directoryURL = (CFURLRef)CFRetain(directoryURL);
+	item->itemName = (CFStringRef)CFRetain(itemName);
+	item->edit = edit;
+	
+	if (gHookItemsTail != NULL)
+		gHookItemsTail->next = item;
+	else
+		gHookItemsHead = item;
+	gHookItemsTail = item;
+	gHookItemsCount++;
+	
+	if (gHookItemsCount == kNewDocumentPlugInHookBatchSize)
+		SetHookTimer(CFAbsoluteTimeGetCurrent());
+}
+
+/*
+ * ScheduleHookItems
+ *
+ * Decide when to run the hooks on the waiting documents: right now if no other
+ * creation may join them, or once the coalescing delay has passed.
+ */
+static void ScheduleHookItems()
+{
+	Boolean idle;
+	int lane;
+	
+	if (gHookItemsCount == 0)
+		return;
+	
+	pthread_mutex_lock(&gCreationMutex);
+	idle = (gCompletedCreations.head == NULL);
+	for (lane = 0; lane < kNewDocumentPlugInLanes; lane++)
+		idle = idle && gPendingCreations[lane].head == NULL && gRunningCreations[lane].head == NULL;
+	pthread_mutex_unlock(&gCreationMutex);
+	
+	if (idle)
+		FlushHookItems(NULL, NULL);
+	else if (gHookTimer == NULL)
+		SetHookTimer(CFAbsoluteTimeGetCurrent() + kNewDocumentPlugInHookCoalesceDelay);
+}
+
+/*
+ * SetHookTimer
+ *
+ * Make the hooks run on the host run loop at the given date, or earlier if
+ * they are already due.
+ */
+static void SetHookTimer(CFAbsoluteTime fireDate)
+{
+	if (gHookTimer == NULL) {
+		gHookTimer = CFRunLoopTimerCreate(NULL, fireDate, 0, 0, 0, FlushHookItems, NULL);
+		CFRunLoopAddTimer(gHostRunLoop, gHookTimer, kCFRunLoopCommonModes);
+	}
+	else if (fireDate < CFRunLoopTimerGetNextFireDate(gHookTimer)) {
+		CFRunLoopTimerSetNextFireDate(gHookTimer, fireDate);
+	}
+}
+
+/*
+ * FlushHookItems
+ *
+ * Run the hooks on every waiting document, in creation order, by runs of at
+ * most kNewDocumentPlugInHookBatchSize documents. Also the callback of the
+ * coalescing timer.
+ */
+static void FlushHookItems(CFRunLoopTimerRef timer, void *info)
+{
+	HookItem *items, *item, *last, *next;
+	UInt32 count;
+	
+	if (gHookTimer != NULL) {
+		CFRunLoopTimerInvalidate(gHookTimer);
+		CFRelease(gHookTimer);
+		gHookTimer = NULL;
+	}
+	
+	// Detach the list first : the hooks may run the run loop
+	items = gHookItemsHead;
+	count = gHookItemsCount;
+	gHookItemsHead = NULL;
+	gHookItemsTail = NULL;
+	gHookItemsCount = 0;
+	
+	while (items != NULL) {
+		// Cut a run of at most kNewDocumentPlugInHookBatchSize documents
+		last = items;
+		for (count = 1; count < kNewDocumentPlugInHookBatchSize && last->next != NULL; count++)
+			last = last->next;
+		next = last->next;
+		last->next = NULL;
+		
+		RunPostCreationHooks(items, count);
+		
+		while (items != NULL) {
+			item = items;
+			items = item->next;
+			FreeHookItem(item);
+		}
+		items = next;
+	}
+}
+
+/*
+ * RunPostCreationHooks
+ *
+ * Run the post-creation hooks once for a list of created documents, with a
+ * single run of the "UpdateFinderItems" script:
+ *   - the Finder updates all the documents at once, so that its windows show
+ *     them (documents written from the content cache don't go through the
+ *     File Manager),
+ *   - the name of the last document that asked for it is selected and edited
+ *     (the Finder can only edit one name at a time).
+ */
+static void RunPostCreationHooks(const HookItem *items, UInt32 count)
+{
+	CFAbsoluteTime startDate = CFAbsoluteTimeGetCurrent();
+	CFMutableArrayRef paths;
+	CFURLRef itemURL;
+	CFStringRef path, editedItemName = NULL;
+	const HookItem *item;
+	OSErr err;
+	
+	paths = CFArrayCreateMutable(NULL, count, &kCFTypeArrayCallBacks);
+	if (paths == NULL)
+		return;
+	
+	for (item = items; item != NULL; item = item->next) {
+		itemURL = CFURLCreateCopyAppendingPathComponent(NULL, item->directoryURL, item->itemName, false);
+		if (itemURL != NULL) {
+			path = CFURLCopyFileSystemPath(itemURL, kCFURLPOSIXPathStyle);
+			if (path != NULL) {
+				CFArrayAppendValue(paths, path);
+				CFRelease(path);
+			}
+			CFRelease(itemURL);
+		}
+		if (item->edit)
+			editedItemName = item->itemName;
+	}
+	
+	// tell the Finder to show the items, and to select the edited one
+	if (SimulateFileSystemCallIfNeeded(kNewDocumentPlugInNotifyCall) == 0) {
+		err = UpdateFinderItems(paths, editedItemName);
+		if (err != noErr) {
+			AddToMetric(&gMetrics.hookFailures, 1);
+			printf("NewDocumentPlugIn: Error while executing the script (%d).\n", err);
+		}
+	}
+	
+	CFRelease(paths);
+	
+	AddToMetric(&gMetrics.hookRuns, 1);
+	AddToMetric(&gMetrics.hookItems, count);
+	RecordHistogramValue(&gMetrics.hookTime, GetElapsedMicroseconds(startDate));
+}
+
+/*
+ * FreeHookItem
+ *
+ * Release a hook item and the references it holds.
+ */
+static void FreeHookItem(HookItem *item)
+{
+	CFRelease(item->directoryURL);
+	CFRelease(item->itemName);
+	free(item);
+}
+
+
+// -----------------------------------------------------------------------------
+//	Spool service
+// -----------------------------------------------------------------------------
+
+/*
+ * StartSpoolService
+ *
+ * Start the thread serving the spool directory set by the "SpoolDirectory"
+ * preference, if any. Called from the host thread; the thread is only
+ * started once, and runs until the background threads are stopped.
+ */
+static void StartSpoolService()
+{
+	CFPropertyListRef preference;
+	char path[PATH_MAX];
+	char *spoolPath = NULL;
+	
+	if (gSpoolServiceStarted)
+		return;
+	gSpoolServiceStarted = true;
+	
+	preference = CFPreferencesCopyAppValue(CFSTR("SpoolDirectory"), CFSTR(kNewDocumentPlugInBundle));
+	if (preference == NULL)
+		return;
+	if (CFGetTypeID(preference) == CFStringGetTypeID()
+		&& CFStringGetFileSystemRepresentation((CFStringRef)preference, path, sizeof(path)))
+		spoolPath = strdup(path);
+	CFRelease(preference);
+	if (spoolPath == NULL)
+		return;
+	
+	if (!StartBackgroundThread(SpoolThreadMain, spoolPath)) {
+		printf("NewDocumentPlugIn: Error: cannot start the spool service.\n");
+		free(spoolPath);
+	}
+}
+
+/*
+ * SpoolThreadMain
+ *
+ * Main loop of the spool service: perform the jobs of the spool directory,
+ * then wait until the directory changes, or for at most
+ * kNewDocumentPlugInSpoolScanInterval seconds, until the background threads
+ * are stopped. Jobs are performed at the I/O priority of the bulk lane.
+ */
+static void* SpoolThreadMain(void *spoolPath)
+{
+	struct kevent changes[2], event;
+	struct timespec timeout = { kNewDocumentPlugInSpoolScanInterval, 0 };
+	struct stat info;
+	int spoolFd, queue;
+	
+	spoolFd = open((char*)spoolPath, O_RDONLY | O_DIRECTORY);
+	if (spoolFd < 0)
+		printf("NewDocumentPlugIn: Error: cannot open the spool directory %s (%d).\n", (char*)spoolPath, errno);
+	
+	// Anyone who can drop a job creates documents as the user
+	else if (fstat(spoolFd, &info) != 0 || info.st_uid != geteuid() || (info.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+		printf("NewDocumentPlugIn: Error: the spool directory %s must be owned, and only writable, by the user.\n", (char*)spoolPath);
+		close(spoolFd);
+		spoolFd = -1;
+	}
+	free(spoolPath);
+	if (spoolFd < 0)
+		return NULL;
+	
+	// Without a kernel queue, the directory is only scanned periodically. The
+	// stop pipe wakes the thread up either way.
+	queue = kqueue();
+	if (queue >= 0) {
+		EV_SET(&changes[0], spoolFd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, NULL);
+		EV_SET(&changes[1], gBackgroundStopPipe[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+		if (kevent(queue, changes, 2, NULL, 0, NULL) != 0) {
+			close(queue);
+			queue = -1;
+		}
+	}
+	
+	SetCreationThreadLane(kNewDocumentPlugInBulkLane);
+	
+	while (!gBackgroundThreadsStopping) {
+		// A full batch may leave jobs behind. Jobs locked by another process
+		// don't count : their results wake the thread up once written.
+		while (PerformSpoolJobs(spoolFd) == kNewDocumentPlugInSpoolBatchSize && !gBackgroundThreadsStopping)
+			;
+		
+		if (queue >= 0)
+			kevent(queue, NULL, 0, &event, 1, &timeout);
+		else
+			WaitForBackgroundThreadsStop(kNewDocumentPlugInSpoolScanInterval);
+	}
+	
+	if (queue >= 0)
+		close(queue);
+	close(spoolFd);
+	
+	return NULL;
+}
+
+/*
+ * PerformSpoolJobs
+ *
+ * Claim and perform a batch of up to kNewDocumentPlugInSpoolBatchSize jobs of
+ * the spool directory, in the order of their names, along with the claimed
+ * jobs left behind by a process that died. Stops early when the background
+ * threads are stopped, leaving the jobs not yet claimed to the next batch.
+ * A job whose result cannot be written is renamed to *.failed, so that it is
+ * not performed again and again. Returns the number of jobs performed.
+ */
+static int PerformSpoolJobs(int spoolFd)
+{
+	char (*names)[NAME_MAX + 1];
+	char jobName[NAME_MAX + 1], claimedName[NAME_MAX + 1], failedName[NAME_MAX + 1];
+	size_t length, extensionLength = strlen(kNewDocumentPlugInSpoolJobExtension);
+	size_t claimedLength = strlen(kNewDocumentPlugInSpoolClaimedExtension);
+	DIR *directory;
+	struct dirent *entry;
+	SpoolJob job;
+	SpoolJobResult result;
+	int i, count = 0, performed = 0, fd;
+	
+	names = malloc(kNewDocumentPlugInSpoolBatchSize * sizeof(names[0]));
+	if (names == NULL)
+		return 0;
+	
+	directory = OpenDirectoryAt(spoolFd, ".", 0);
+	if (directory == NULL) {
+		free(names);
+		return 0;
+	}
+	while (count < kNewDocumentPlugInSpoolBatchSize && (entry = readdir(directory)) != NULL) {
+		length = strlen(entry->d_name);
+		if ((length > extensionLength
+			 && strcmp(entry->d_name + length - extensionLength, kNewDocumentPlugInSpoolJobExtension) == 0)
+			|| (length > claimedLength
+				&& strcmp(entry->d_name + length - claimedLength, kNewDocumentPlugInSpoolClaimedExtension) == 0))
+			strlcpy(names[count++], entry->d_name, sizeof(names[0]));
+	}
+	closedir(directory);
+	
+	qsort(names, count, sizeof(names[0]), CompareSpoolJobNames);
+	
+	for (i = 0; i < count && !gBackgroundThreadsStopping; i++) {
+		fd = ClaimSpoolJob(spoolFd, names[i], jobName, claimedName, sizeof(jobName));
+		if (fd < 0)
+			continue;
+		
+		memset(&result, 0, sizeof(result));
+		result.status = ReadSpoolJob(fd, &job);
+		if (result.status == noErr) {
+			PerformSpoolJob(&job, &result);
+			FreeSpoolJob(&job);
+		}
+		
+		// The job is only removed once its result is written, and before it
+		// is unlocked. Without a result, it is set aside (or dropped, as a
+		// last resort).
+		if (WriteSpoolJobResult(spoolFd, jobName, &result))
+			UnlinkAt(spoolFd, claimedName, 0);
+		else if (!GetSpoolJobFileName(jobName, kNewDocumentPlugInSpoolFailedExtension, failedName, sizeof(failedName))
+				 || RenameAt(spoolFd, claimedName, spoolFd, failedName) != 0)
+			UnlinkAt(spoolFd, claimedName, 0);
+		close(fd);
+		AddToMetric(&gMetrics.spoolJobs, 1);
+		performed++;
+	}
+	
+	free(names);
+	
+	return performed;
+}
+
+/*
+ * ClaimSpoolJob
+ *
+ * Claim a job (*.job) of the spool directory by renaming it, so that it is
+ * performed once even when several host processes serve the same spool
+ * directory, or reclaim a claimed job (*.claimed). A claimed job stays locked
+ * while it is performed: one that can be locked was left behind by a process
+ * that died. Returns the locked claimed job file, or -1 if the job is not
+ * to be performed by the caller.
+ */
+static int ClaimSpoolJob(int spoolFd, const char *name, char *outJobName, char *outClaimedName, size_t outSize)
+{
+	size_t length = strlen(name), claimedLength = strlen(kNewDocumentPlugInSpoolClaimedExtension);
+	char resultName[NAME_MAX + 1];
+	struct stat info;
+	Boolean reclaimed;
+	int fd;
+	
+	reclaimed = (length > claimedLength
+				 && strcmp(name + length - claimedLength, kNewDocumentPlugInSpoolClaimedExtension) == 0);
+	if (reclaimed) {
+		if (snprintf(outJobName, outSize, "%.*s%s", (int)(length - claimedLength), name,
+					 kNewDocumentPlugInSpoolJobExtension) >= (int)outSize)
+			return -1;
+		strlcpy(outClaimedName, name, outSize);
+	}
+	else {
+		strlcpy(outJobName, name, outSize);
+		if (!GetSpoolJobFileName(name, kNewDocumentPlugInSpoolClaimedExtension, outClaimedName, outSize))
+			return -1;
+		
+		// Another process got it first
+		if (RenameAt(spoolFd, name, spoolFd, outClaimedName) != 0)
+			return -1;
+	}
+	
+	// The job is being performed by another process, or was already
+	// performed and removed
+	fd = OpenAt(spoolFd, outClaimedName, O_RDONLY | O_NOFOLLOW, 0);
+	if (fd < 0)
+		return -1;
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &info) != 0 || info.st_nlink == 0) {
+		close(fd);
+		return -1;
+	}
+	
+	// The process died after writing the result
+	if (reclaimed
+		&& GetSpoolJobFileName(outJobName, kNewDocumentPlugInSpoolResultExtension, resultName, sizeof(resultName))
+		&& StatAt(spoolFd, resultName, &info, AT_SYMLINK_NOFOLLOW) == 0) {
+		UnlinkAt(spoolFd, outClaimedName, 0);
+		close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+/*
+ * ReadSpoolJob
+ *
+ * Read and check a job file of the spool directory, which is left open.
+ * Returns paramErr if the file isn't a valid job, or isn't a regular file
+ * owned by the user.
+ */
+static OSStatus ReadSpoolJob(int fd, SpoolJob *job)
+{
+	CFDataRef data;
+	CFPropertyListRef properties;
+	CFTypeRef templateName, directory, names, count;
+	struct stat info;
+	UInt8 *bytes;
+	ssize_t length, offset = 0;
+	OSStatus err = paramErr;
+	CFIndex i;
+	
+	memset(job, 0, sizeof(*job));
+	
+	if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_uid != geteuid()
+		|| info.st_size > kNewDocumentPlugInSpoolMaxJobSize)
+		return paramErr;
+	
+	// The whole file is read at once, and parsed without copy
+	bytes = (UInt8*) malloc(info.st_size);
+	if (bytes == NULL)
+		return memFullErr;
+	while (offset < info.st_size && (length = read(fd, bytes + offset, info.st_size - offset)) > 0)
+		offset += length;
+	
+	data = CFDataCreateWithBytesNoCopy(NULL, bytes, offset, kCFAllocatorMalloc);
+	if (data == NULL) {
+		free(bytes);
+		return memFullErr;
+	}
+	properties = CFPropertyListCreateFromXMLData(NULL, data, kCFPropertyListImmutable, NULL);
+	CFRelease(data);
+	if (properties == NULL)
+		return paramErr;
+	
+	if (CFGetTypeID(properties) == CFDictionaryGetTypeID()) {
+		templateName = CFDictionaryGetValue((CFDictionaryRef)properties, CFSTR("Template"));
+		directory = CFDictionaryGetValue((CFDictionaryRef)properties, CFSTR("Directory"));
+		names = CFDictionaryGetValue((CFDictionaryRef)properties, CFSTR("Names"));
+		count = CFDictionaryGetValue((CFDictionaryRef)properties, CFSTR("Count"));
+		
+		if (templateName != NULL && CFGetTypeID(templateName) == CFStringGetTypeID()
+			&& directory != NULL && CFGetTypeID(directory) == CFStringGetTypeID()
+			&& CFStringHasPrefix((CFStringRef)directory, CFSTR("/"))) {
+			
+			if (names != NULL && CFGetTypeID(names) == CFArrayGetTypeID()) {
+				job->names = (CFArrayRef)CFRetain(names);
+				job->count = CFArrayGetCount(job->names);
+				for (i = 0; i < job->count; i++) {
+					if (CFGetTypeID(CFArrayGetValueAtIndex(job->names, i)) != CFStringGetTypeID())
+						break;
+				}
+				if (i == job->count)
+					err = noErr;
+			}
+			else if (count != NULL && CFGetTypeID(count) == CFNumberGetTypeID()) {
+				CFNumberGetValue((CFNumberRef)count, kCFNumberCFIndexType, &job->count);
+				err = noErr;
+			}
+			
+			if (job->count < 1 || job->count > kNewDocumentPlugInSpoolMaxJobDocuments)
+				err = paramErr;
+			
+			job->templateName = (CFStringRef)CFRetain(templateName);
+			job->directoryURL = CFURLCreateWithFileSystemPath(NULL, (CFStringRef)directory, kCFURLPOSIXPathStyle, true);
+			if (job->directoryURL == NULL)
+				err = paramErr;
+		}
+	}
+	CFRelease(properties);
+	
+	if (err != noErr)
+		FreeSpoolJob(job);
+	
+	return err;
+}
+
+/*
+ * PerformSpoolJob
+ *
+ * Create the documents of a job, one after the other, through the steps of a
+ * single creation request: the template and the destination directory are
+ * only opened once for the whole job. Documents named by the job are never
+ * renamed : they fail if the name is taken.
+ */
+static void PerformSpoolJob(const SpoolJob *job, SpoolJobResult *result)
+{
+	CreationRequest request;
+	TemplateTable *table;
+	CFIndex i, index;
+	CFAbsoluteTime startDate = CFAbsoluteTimeGetCurrent(), documentDate;
+	OSStatus err;
+	
+	table = CopyTemplateTable();
+	index = (table != NULL) ? FindTemplateTableIndex(table, job->templateName) : kCFNotFound;
+	if (table != NULL)
+		ReleaseTemplateTable(table);
+	if (index == kCFNotFound) {
+		result->status = fnfErr;
+		result->failed = job->count;
+		return;
+	}
+	
+	memset(&request, 0, sizeof(request));
+	request.commandID = index;
+	request.lane = kNewDocumentPlugInBulkLane;
+	request.destURL = job->directoryURL;
+	request.deadline = startDate + kNewDocumentPlugInCreationTimeout;
+	request.step = kNewDocumentPlugInOpenStep;
+	request.directoryFd = -1;
+	request.fixedName = (job->names != NULL);
+	request.keepOpen = true;
+	
+	err = ResumeCreationRequest(&request);
+	if (err != noErr) {
+		CloseCreationRequest(&request);
+		result->status = err;
+		result->failed = job->count;
+		return;
+	}
+	
+	for (i = 0; i < job->count; i++) {
+		documentDate = CFAbsoluteTimeGetCurrent();
+		request.deadline = documentDate + kNewDocumentPlugInCreationTimeout;
+		request.step = kNewDocumentPlugInNameStep;
+		request.attempts = 0;
+		
+		err = noErr;
+		if (job->names != NULL && !GetSpoolDocumentName(CFArrayGetValueAtIndex(job->names, i), request.documentName, sizeof(request.documentName)))
+			err = paramErr;
+		
+		while (err == noErr && request.step != kNewDocumentPlugInDoneStep)
+			err = ResumeCreationRequest(&request);
+		
+		if (request.itemName != NULL) {
+			CFRelease(request.itemName);
+			request.itemName = NULL;
+		}
+		
+		if (err == noErr)
+			result->created++;
+		else {
+			result->failed++;
+			if (result->status == noErr)
+				result->status = err;
+		}
+		
+		AddToMetric(&gMetrics.creations, 1);
+		if (err != noErr)
+			AddToMetric(&gMetrics.creationFailures, 1);
+		RecordHistogramValue(&gMetrics.creationTime[kNewDocumentPlugInBulkLane], GetElapsedMicroseconds(documentDate));
+	}
+	
+	CloseCreationRequest(&request);
+	
+	result->duration = GetElapsedMicroseconds(startDate);
+	AddToMetric(&gMetrics.spoolDocuments, result->created);
+	AddToMetric(&gMetrics.spoolFailures, result->failed);
+	AddToMetric(&gMetrics.spoolBusyTime, result->duration);
+}
+
+/*
+ * WriteSpoolJobResult
+ *
+ * Write the result of a job next to it, as a property list named after the
+ * job: the numbers of documents created and failed, the first error, and the
+ * creation rate. The file is written aside and then renamed, so that
+ * provisioning systems never read a partial result.
+ */
+static Boolean WriteSpoolJobResult(int spoolFd, const char *jobName, const SpoolJobResult *result)
+{
+	CFMutableDictionaryRef properties;
+	CFNumberRef number;
+	CFDataRef data;
+	char resultName[NAME_MAX + 1], temporaryName[NAME_MAX + 1];
+	double seconds = result->duration / 1000000.0, rate = (seconds > 0) ? result->created / seconds : 0;
+	SInt32 status = result->status;
+	Boolean written = false;
+	int fd;
+	
+	if (!GetSpoolJobFileName(jobName, kNewDocumentPlugInSpoolResultExtension, resultName, sizeof(resultName))
+		|| snprintf(temporaryName, sizeof(temporaryName), ".%s.%d", resultName, (int)getpid()) >= (int)sizeof(temporaryName))
+		return false;
+	
+	properties = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	if (properties == NULL)
+		return false;
+	
+	number = CFNumberCreate(NULL, kCFNumberCFIndexType, &result->created);
+	CFDictionarySetValue(properties, CFSTR("Created"), number);
+	CFRelease(number);
+	number = CFNumberCreate(NULL, kCFNumberCFIndexType, &result->failed);
+	CFDictionarySetValue(properties, CFSTR("Failed"), number);
+	CFRelease(number);
+	number = CFNumberCreate(NULL, kCFNumberSInt32Type, &status);
+	CFDictionarySetValue(properties, CFSTR("Error"), number);
+	CFRelease(number);
+	number = CFNumberCreate(NULL, kCFNumberDoubleType, &seconds);
+	CFDictionarySetValue(properties, CFSTR("Seconds"), number);
+	CFRelease(number);
+	number = CFNumberCreate(NULL, kCFNumberDoubleType, &rate);
+	CFDictionarySetValue(properties, CFSTR("CreationsPerSecond"), number);
+	CFRelease(number);
+	
+	data = CFPropertyListCreateXMLData(NULL, properties);
+	CFRelease(properties);
+	if (data == NULL)
+		return false;
+	
+	fd = OpenAt(spoolFd, temporaryName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) {
+		written = (write(fd, CFDataGetBytePtr(data), CFDataGetLength(data)) == CFDataGetLength(data));
+		close(fd);
+		
+		if (written)
+			written = (RenameAt(spoolFd, temporaryName, spoolFd, resultName) == 0);
+		if (!written)
+			UnlinkAt(spoolFd, temporaryName, 0);
+	}
+	CFRelease(data);
+	
+	if (!written)
+		printf("NewDocumentPlugIn: Error: cannot write the result of the spool job %s.\n", jobName);
+	
+	return written;
+}
+
+/*
+ * GetSpoolJobFileName
+ *
+ * Replace the extension of a job file name by another one.
+ */
+static Boolean GetSpoolJobFileName(const char *jobName, const char *extension, char *outName, size_t outSize)
+{
+	int length = (int)(strlen(jobName) - strlen(kNewDocumentPlugInSpoolJobExtension));
+	
+	return snprintf(outName, outSize, "%.*s%s", length, jobName, extension) < (int)outSize;
+}
+
+/*
+ * GetSpoolDocumentName
+ *
+ * Convert a document name given by a job to a file name, rejecting the names
+ * that are not a single path component.
+ */
+static Boolean GetSpoolDocumentName(CFStringRef name, char *outName, size_t outSize)
+{
+	if (!CFStringGetFileSystemRepresentation(name, outName, outSize))
+		return false;
+	
+	return outName[0] != '\0'
+		&& strchr(outName, '/') == NULL
+		&& strcmp(outName, ".") != 0
+		&& strcmp(outName, "..") != 0;
+}
+
+/*
+ * CompareSpoolJobNames
+ *
+ * qsort comparator, ordering jobs file names.
+ */
+static int CompareSpoolJobNames(const void *name1, const void *name2)
+{
+	return strcmp((const char*)name1, (const char*)name2);
+}
+
+/*
+ * FreeSpoolJob
+ *
+ * Release the objects held by a job.
+ */
+static void FreeSpoolJob(SpoolJob *job)
+{
+	if (job->templateName != NULL)
+		CFRelease(job->templateName);
+	if (job->directoryURL != NULL)
+		CFRelease(job->directoryURL);
+	if (job->names != NULL)
+		CFRelease(job->names);
+	memset(job, 0, sizeof(*job));
+}
+
+
+// -----------------------------------------------------------------------------
+//	Metrics
+// -----------------------------------------------------------------------------
+
+/*
+ * AddToMetric
+ *
+ * Atomically add an amount to a counter. Never takes a lock, so it can be
+ * called on any hot path, from any thread.
+ */
+static void AddToMetric(volatile SInt64 *metric, SInt64 amount)
+{
+	AtomicAdd64(metric, amount);
+}
+
+/*
+ * GetMetric
+ *
+ * Atomically read a counter (64-bit loads are not atomic on every
+ * architecture we run on).
+ */
+static SInt64 GetMetric(volatile SInt64 *metric)
+{
+	return AtomicLoad64(metric);
+}
+
+/*
+ * RecordHistogramValue
+ *
+ * Add a value to a histogram. Negative values are recorded as 0.
+ */
+static void RecordHistogramValue(MetricsHistogram *histogram, SInt64 value)
+{
+	if (value < 0)
+		value = 0;
+	
+	AddToMetric(&histogram->buckets[GetHistogramBucket(value)], 1);
+	AddToMetric(&histogram->sum, value);
+	AddToMetric(&histogram->count, 1);
+}
+
+/*
+ * GetHistogramBucket
+ *
+ * Return the bucket of a non-negative value: values below 4 have their own
+ * bucket, then each power of two is split into four buckets according to the
+ * two bits following the most significant one.
+ */
+static int GetHistogramBucket(SInt64 value)
+{
+	int power;
+	
+	if (value < 4)
+		return (int)value;
+	
+	power = 63 - __builtin_clzll((UInt64)value);
+	
+	return 4 + (power - 2) * 4 + (int)((value >> (power - 2)) & 3);
+}
+
+/*
+ * GetHistogramBucketLimit
+ *
+ * Return the highest value recorded in a bucket.
+ */
+static SInt64 GetHistogramBucketLimit(int bucket)
+{
+	int power, quarter;
+	
+	if (bucket < 4)
+		return bucket;
+	
+	power = (bucket - 4) / 4 + 2;
+	quarter = (bucket - 4) % 4;
+	
+	return ((SInt64)(4 + quarter) << (power - 2)) + (((SInt64)1 << (power - 2)) - 1);
+}
+
+/*
+ * GetHistogramQuantile
+ *
+ * Return an upper bound of a quantile (e.g. 0.99) of the values recorded in a
+ * histogram since baseline, a copy of it taken earlier (or NULL), or 0 if no
+ * value was recorded.
+ */
+static SInt64 GetHistogramQuantile(const MetricsHistogram *histogram, const MetricsHistogram *baseline, double quantile)
+{
+	SInt64 count, rank, seen = 0;
+	int bucket;
+	
+	count = histogram->count - ((baseline != NULL) ? baseline->count : 0);
+	if (count <= 0)
+		return 0;
+	
+	rank = (SInt64)ceil(quantile * count);
+	if (rank < 1)
+		rank = 1;
+	
+	for (bucket = 0; bucket < kNewDocumentPlugInHistogramBuckets; bucket++) {
+		seen += histogram->buckets[bucket] - ((baseline != NULL) ? baseline->buckets[bucket] : 0);
+		if (seen >= rank)
+			return GetHistogramBucketLimit(bucket);
+	}
+	
+	return GetHistogramBucketLimit(kNewDocumentPlugInHistogramBuckets - 1);
+}
+
+/*
+ * GetElapsedMicroseconds
+ *
+ * Return the number of microseconds elapsed since a date.
+ */
+static SInt64 GetElapsedMicroseconds(CFAbsoluteTime startDate)
+{
+	return (SInt64)((CFAbsoluteTimeGetCurrent() - startDate) * 1000000.0);
+}
+
+/*
+ * StartMetricsExporter
+ *
+ * Start the thread that exposes the metrics through the metrics file and
+ * socket, if the "ExportMetrics" preference is true : the thread only runs on
+ * request, as it wakes up every kNewDocumentPlugInMetricsFlushInterval
+ * seconds for as long as the plugin is loaded. It never blocks the host
+ * thread. The preference is read once per session. Does nothing if the
+ * exporter already runs. Must be called from the host thread.
+ */
+static void StartMetricsExporter()
+{
+	if (gMetricsExporterStarted)
+		return;
+	gMetricsExporterStarted = true;
+	
+	if (!CFPreferencesGetAppBooleanValue(CFSTR("ExportMetrics"), CFSTR(kNewDocumentPlugInBundle), NULL))
+		return;
+	
+	if (!StartBackgroundThread(MetricsThreadMain, NULL))
+		printf("NewDocumentPlugIn: Error: cannot start the metrics exporter.\n");
+}
+
+/*
+ * MetricsThreadMain
+ *
+ * Main loop of the metrics exporter: answer the clients of the metrics
+ * socket, and rewrite the metrics file every
+ * kNewDocumentPlugInMetricsFlushInterval seconds, until the background
+ * threads are stopped. Only reads the metrics, so it never slows down the
+ * threads that record them.
+ */
+static void* MetricsThreadMain(void *unused)
+{
+	CFURLRef cachesURL;
+	char directory[PATH_MAX], filePath[PATH_MAX], socketPath[PATH_MAX];
+	char *buffer;
+	size_t size = 64 * 1024;
+	int listener, client, maxFd;
+	Boolean found;
+	fd_set readable;
+	struct timeval timeout;
+	CFAbsoluteTime flushDate, now;
+	
+	// Both the file and the socket live in the plugin caches directory
+	cachesURL = CopyPlugInCachesURL();
+	if (cachesURL == NULL)
+		return NULL;
+	found = CFURLGetFileSystemRepresentation(cachesURL, true, (UInt8*)directory, sizeof(directory));
+	CFRelease(cachesURL);
+	if (!found)
+		return NULL;
+	
+	buffer = (char*) malloc(size);
+	if (buffer == NULL)
+		return NULL;
+	
+	snprintf(filePath, sizeof(filePath), "%s/%s", directory, kNewDocumentPlugInMetricsFilename);
+	snprintf(socketPath, sizeof(socketPath), "%s/%s", directory, kNewDocumentPlugInMetricsSocketName);
+	
+	// Without a socket, only the file is written
+	listener = OpenMetricsSocket(socketPath);
+	
+	flushDate = CFAbsoluteTimeGetCurrent() + kNewDocumentPlugInMetricsFlushInterval;
+	
+	while (!gBackgroundThreadsStopping) {
+		now = CFAbsoluteTimeGetCurrent();
+		if (now >= flushDate) {
+			WriteMetricsFile(filePath, buffer, size);
+			flushDate = now + kNewDocumentPlugInMetricsFlushInterval;
+		}
+		
+		// Wait for a client until the next flush, or for the stop pipe
+		timeout.tv_sec = (long)(flushDate - now);
+		timeout.tv_usec = (long)((flushDate - now - timeout.tv_sec) * 1000000.0);
+		FD_ZERO(&readable);
+		FD_SET(gBackgroundStopPipe[0], &readable);
+		maxFd = gBackgroundStopPipe[0];
+		if (listener >= 0) {
+			FD_SET(listener, &readable);
+			if (listener > maxFd)
+				maxFd = listener;
+		}
+		
+		if (select(maxFd + 1, &readable, NULL, NULL, &timeout) > 0
+			&& listener >= 0 && FD_ISSET(listener, &readable)) {
+			client = accept(listener, NULL, NULL);
+			if (client >= 0) {
+				AnswerMetricsClient(client, buffer, size);
+				close(client);
+			}
+		}
+	}
+	
+	// The next session opens its own socket
+	if (listener >= 0) {
+		close(listener);
+		unlink(socketPath);
+	}
+	free(buffer);
+	
+	return NULL;
+}
+
+/*
+ * OpenMetricsSocket
+ *
+ * Create the metrics socket, replacing the one left by a previous session,
+ * and make it accessible to the current user only. A socket still answered by
+ * another host process is left alone : only the metrics file is written then.
+ * Returns the listening socket, or -1 on error.
+ */
+static int OpenMetricsSocket(const char *path)
+{
+	struct sockaddr_un address;
+	struct stat info;
+	int listener;
+	
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		printf("NewDocumentPlugIn: Error: the metrics socket path is too long.\n");
+		return -1;
+	}
+	
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0)
+		return -1;
+	
+	// Only remove our own sockets, once nobody listens to them anymore
+	if (lstat(path, &info) == 0) {
+		if (!S_ISSOCK(info.st_mode) || info.st_uid != geteuid()
+			|| connect(listener, (struct sockaddr*)&address, sizeof(address)) == 0) {
+			printf("NewDocumentPlugIn: the metrics socket is in use by another process.\n");
+			close(listener);
+			return -1;
+		}
+		close(listener);
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listener < 0)
+			return -1;
+		unlink(path);
+	}
+	
+	if (bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0
+		|| chmod(path, 0600) != 0
+		|| listen(listener, 4) != 0) {
+		printf("NewDocumentPlugIn: Error: cannot open the metrics socket (%d).\n", errno);
+		close(listener);
+		return -1;
+	}
+	
+	return listener;
+}
+
+/*
+ * AnswerMetricsClient
+ *
+ * Send the current metrics to a client of the metrics socket, as an HTTP
+ * response so that HTTP clients can scrape the socket. The request itself,
+ * if any, is ignored.
+ */
+static void AnswerMetricsClient(int client, char *buffer, size_t size)
+{
+	struct timeval timeout = { 1, 0 };
+	char header[128];
+	struct iovec vectors[2];
+	size_t length;
+	int option = 1;
+	
+	// A client that went away must not kill the host application
+#if defined(SO_NOSIGPIPE)
+	setsockopt(client, SOL_SOCKET, SO_NOSIGPIPE, &option, sizeof(option));
+#endif
+	
+	// Skip the request, without waiting for clients that don't send any
+	setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	recv(client, buffer, size, 0);
+	
+	length = FormatMetrics(buffer, size);
+	
+	vectors[0].iov_base = header;
+	vectors[0].iov_len = snprintf(header, sizeof(header),
+								  "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\n\r\n",
+								  (unsigned long)length);
+	vectors[1].iov_base = buffer;
+	vectors[1].iov_len = length;
+	writev(client, vectors, 2);
+}
+
+/*
+ * WriteMetricsFile
+ *
+ * Write the current metrics to the metrics file. The file is replaced
+ * atomically, so that readers never see a partial file.
+ */
+static void WriteMetricsFile(const char *path, char *buffer, size_t size)
+{
+	char temporaryPath[PATH_MAX];
+	size_t length;
+	ssize_t written;
+	int file;
+	
+	snprintf(temporaryPath, sizeof(temporaryPath), "%s.%d", path, (int)getpid());
+	
+	file = open(temporaryPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (file < 0)
+		return;
+	
+	length = FormatMetrics(buffer, size);
+	written = write(file, buffer, length);
+	close(file);
+	
+	if (written == (ssize_t)length)
+		rename(temporaryPath, path);
+	else
+		unlink(temporaryPath);
+}
+
+/*
+ * FormatMetrics
+ *
+ * Format the current metrics in the Prometheus text format. Returns the length
+ * of the text; the text is truncated if the buffer is too small, and always
+ * terminated.
+ */
+static size_t FormatMetrics(char *buffer, size_t size)
+{
+	size_t length = 0;
+	
+	if (size > 0)
+		buffer[0] = '\0';
+	
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_menu_builds_total Number of New Document menus built.\n"
+					  "# TYPE newdocument_menu_builds_total counter\n"
+					  "newdocument_menu_builds_total %lld\n",
+					  (long long)GetMetric(&gMetrics.menuBuilds));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_templates_listed_total Number of templates listed in New Document menus.\n"
+					  "# TYPE newdocument_templates_listed_total counter\n"
+					  "newdocument_templates_listed_total %lld\n",
+					  (long long)GetMetric(&gMetrics.templatesListed));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_name_resolutions_total Number of document names resolved.\n"
+					  "# TYPE newdocument_name_resolutions_total counter\n"
+					  "newdocument_name_resolutions_total %lld\n",
+					  (long long)GetMetric(&gMetrics.nameResolutions));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_name_resolution_failures_total Number of document names that could not be resolved.\n"
+					  "# TYPE newdocument_name_resolution_failures_total counter\n"
+					  "newdocument_name_resolution_failures_total %lld\n",
+					  (long long)GetMetric(&gMetrics.nameResolutionFailures));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_directory_scans_total Number of directories enumerated to resolve document names.\n"
+					  "# TYPE newdocument_directory_scans_total counter\n"
+					  "newdocument_directory_scans_total %lld\n",
+					  (long long)GetMetric(&gMetrics.directoryScans));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_directory_entries_scanned_total Number of directory entries compared to document names.\n"
+					  "# TYPE newdocument_directory_entries_scanned_total counter\n"
+					  "newdocument_directory_entries_scanned_total %lld\n",
+					  (long long)GetMetric(&gMetrics.directoryEntriesScanned));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_creations_total Number of document creations performed.\n"
+					  "# TYPE newdocument_creations_total counter\n"
+					  "newdocument_creations_total %lld\n",
+					  (long long)GetMetric(&gMetrics.creations));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_creation_failures_total Number of document creations that failed.\n"
+					  "# TYPE newdocument_creation_failures_total counter\n"
+					  "newdocument_creation_failures_total %lld\n",
+					  (long long)GetMetric(&gMetrics.creationFailures));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_creations_set_aside_total Number of times a bulk creation was set aside for interactive ones.\n"
+					  "# TYPE newdocument_creations_set_aside_total counter\n"
+					  "newdocument_creations_set_aside_total %lld\n",
+					  (long long)GetMetric(&gMetrics.creationsSetAside));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_spool_jobs_total Number of spool jobs performed.\n"
+					  "# TYPE newdocument_spool_jobs_total counter\n"
+					  "newdocument_spool_jobs_total %lld\n",
+					  (long long)GetMetric(&gMetrics.spoolJobs));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_spool_documents_total Number of documents of spool jobs, by result.\n"
+					  "# TYPE newdocument_spool_documents_total counter\n"
+					  "newdocument_spool_documents_total{result=\"created\"} %lld\n"
+					  "newdocument_spool_documents_total{result=\"failed\"} %lld\n",
+					  (long long)GetMetric(&gMetrics.spoolDocuments),
+					  (long long)GetMetric(&gMetrics.spoolFailures));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_spool_busy_microseconds_total Time spent performing spool jobs.\n"
+					  "# TYPE newdocument_spool_busy_microseconds_total counter\n"
+					  "newdocument_spool_busy_microseconds_total %lld\n",
+					  (long long)GetMetric(&gMetrics.spoolBusyTime));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_syncs_total Number of templates synchronizations.\n"
+					  "# TYPE newdocument_syncs_total counter\n"
+					  "newdocument_syncs_total %lld\n",
+					  (long long)GetMetric(&gMetrics.syncs));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_sync_files_total Number of template files synchronized, by transfer.\n"
+					  "# TYPE newdocument_sync_files_total counter\n"
+					  "newdocument_sync_files_total{transfer=\"reused\"} %lld\n"
+					  "newdocument_sync_files_total{transfer=\"copied\"} %lld\n",
+					  (long long)GetMetric(&gMetrics.syncReusedFiles),
+					  (long long)GetMetric(&gMetrics.syncCopiedFiles));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_sync_bytes_copied_total Number of template bytes copied from the templates source.\n"
+					  "# TYPE newdocument_sync_bytes_copied_total counter\n"
+					  "newdocument_sync_bytes_copied_total %lld\n",
+					  (long long)GetMetric(&gMetrics.syncCopiedBytes));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_bytes_copied_total Number of template bytes copied, by copy backend.\n"
+					  "# TYPE newdocument_bytes_copied_total counter\n"
+					  "newdocument_bytes_copied_total{backend=\"cache\"} %lld\n"
+					  "newdocument_bytes_copied_total{backend=\"file_manager\"} %lld\n"
+					  "newdocument_bytes_copied_total{backend=\"blob_store\"} %lld\n",
+					  (long long)GetMetric(&gMetrics.bytesCopied[kNewDocumentPlugInCacheBackend]),
+					  (long long)GetMetric(&gMetrics.bytesCopied[kNewDocumentPlugInFileManagerBackend]),
+					  (long long)GetMetric(&gMetrics.bytesCopied[kNewDocumentPlugInBlobStoreBackend]));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_hook_runs_total Number of post-creation hooks runs.\n"
+					  "# TYPE newdocument_hook_runs_total counter\n"
+					  "newdocument_hook_runs_total %lld\n",
+					  (long long)GetMetric(&gMetrics.hookRuns));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_hook_items_total Number of created documents given to the post-creation hooks.\n"
+					  "# TYPE newdocument_hook_items_total counter\n"
+					  "newdocument_hook_items_total %lld\n",
+					  (long long)GetMetric(&gMetrics.hookItems));
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_hook_failures_total Number of post-creation hooks runs that failed.\n"
+					  "# TYPE newdocument_hook_failures_total counter\n"
+					  "newdocument_hook_failures_total %lld\n",
+					  (long long)GetMetric(&gMetrics.hookFailures));
+	
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_cache_bytes Memory used by each plugin cache.\n"
+					  "# TYPE newdocument_cache_bytes gauge\n"
+					  "newdocument_cache_bytes{cache=\"table\"} %lld\n"
+					  "newdocument_cache_bytes{cache=\"occupancy\"} %lld\n"
+					  "newdocument_cache_bytes{cache=\"content\"} %lld\n",
+					  (long long)GetMetric(&gMetrics.cacheBytes[kNewDocumentPlugInTableCache]),
+					  (long long)GetMetric(&gMetrics.cacheBytes[kNewDocumentPlugInOccupancyCache]),
+					  (long long)GetMetric(&gMetrics.cacheBytes[kNewDocumentPlugInContentCache]));
+	
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_fs_calls_total File system operations performed, by kind.\n"
+					  "# TYPE newdocument_fs_calls_total counter\n"
+					  "newdocument_fs_calls_total{call=\"stat\"} %lld\n"
+					  "newdocument_fs_calls_total{call=\"readdir\"} %lld\n"
+					  "newdocument_fs_calls_total{call=\"open\"} %lld\n"
+					  "newdocument_fs_calls_total{call=\"write\"} %lld\n"
+					  "newdocument_fs_calls_total{call=\"copy\"} %lld\n"
+					  "newdocument_fs_calls_total{call=\"catalog\"} %lld\n"
+					  "newdocument_fs_calls_total{call=\"notify\"} %lld\n"
+					  "newdocument_fs_calls_total{call=\"clone\"} %lld\n",
+					  (long long)GetMetric(&gMetrics.fileSystemCalls[kNewDocumentPlugInStatCall]),
+					  (long long)GetMetric(&gMetrics.fileSystemCalls[kNewDocumentPlugInReadDirCall]),
+					  (long long)GetMetric(&gMetrics.fileSystemCalls[kNewDocumentPlugInOpenCall]),
+					  (long long)GetMetric(&gMetrics.fileSystemCalls[kNewDocumentPlugInWriteCall]),
+					  (long long)GetMetric(&gMetrics.fileSystemCalls[kNewDocumentPlugInCopyCall]),
+					  (long long)GetMetric(&gMetrics.fileSystemCalls[kNewDocumentPlugInCatalogInfoCall]),
+					  (long long)GetMetric(&gMetrics.fileSystemCalls[kNewDocumentPlugInNotifyCall]),
+					  (long long)GetMetric(&gMetrics.fileSystemCalls[kNewDocumentPlugInCloneCall]));
+	
+	AppendMetricsText(buffer, size, &length,
+					  "# HELP newdocument_cold_start_microseconds Time spent on the host thread from the plugin load to the first menu.\n"
+					  "# TYPE newdocument_cold_start_microseconds gauge\n"
+					  "newdocument_cold_start_microseconds %lld\n"
+					  "# HELP newdocument_cold_start_budget_microseconds Budget of the cold start.\n"
+					  "# TYPE newdocument_cold_start_budget_microseconds gauge\n"
+					  "newdocument_cold_start_budget_microseconds %lld\n",
+					  (long long)GetMetric(&gMetrics.coldStartTime),
+					  (long long)(kNewDocumentPlugInColdStartBudget * 1000000));
+	
+	FormatHistogram(&gMetrics.phaseTime[kNewDocumentPlugInBundlePhase], "newdocument_init_phase_microseconds", "phase=\"bundle\"",
+					"Time spent in the lazy initialization phases, each time they run.", buffer, size, &length);
+	FormatHistogram(&gMetrics.phaseTime[kNewDocumentPlugInManifestPhase], "newdocument_init_phase_microseconds", "phase=\"manifest\"",
+					NULL, buffer, size, &length);
+	FormatHistogram(&gMetrics.phaseTime[kNewDocumentPlugInTablePhase], "newdocument_init_phase_microseconds", "phase=\"table\"",
+					NULL, buffer, size, &length);
+	FormatHistogram(&gMetrics.phaseTime[kNewDocumentPlugInUsagePhase], "newdocument_init_phase_microseconds", "phase=\"usage\"",
+					NULL, buffer, size, &length);
+	FormatHistogram(&gMetrics.phaseTime[kNewDocumentPlugInScriptingPhase], "newdocument_init_phase_microseconds", "phase=\"scripting\"",
+					NULL, buffer, size, &length);
+	FormatHistogram(&gMetrics.contextParseTime, "newdocument_context_parse_microseconds", NULL,
+					"Time spent reading the selected directories from the menu context.", buffer, size, &length);
+	FormatHistogram(&gMetrics.menuBuildTime, "newdocument_menu_build_microseconds", NULL,
+					"Time spent building New Document menus.", buffer, size, &length);
+	FormatHistogram(&gMetrics.menuOrderTime, "newdocument_menu_order_microseconds", NULL,
+					"Time spent ordering templates by usage, per menu.", buffer, size, &length);
+	FormatHistogram(&gMetrics.creationTime[kNewDocumentPlugInInteractiveLane], "newdocument_creation_microseconds", "lane=\"interactive\"",
+					"Time spent creating documents on the creation threads, by lane.", buffer, size, &length);
+	FormatHistogram(&gMetrics.creationTime[kNewDocumentPlugInBulkLane], "newdocument_creation_microseconds", "lane=\"bulk\"",
+					NULL, buffer, size, &length);
+	FormatHistogram(&gMetrics.hookTime, "newdocument_hook_microseconds", NULL,
+					"Time spent running the post-creation hooks, per run.", buffer, size, &length);
+	FormatHistogram(&gMetrics.namingTime, "newdocument_naming_microseconds", NULL,
+					"Time spent finding a free name for new documents.", buffer, size, &length);
+	FormatHistogram(&gMetrics.syncTime, "newdocument_sync_microseconds", NULL,
+					"Time spent synchronizing the templates, per synchronization.", buffer, size, &length);
+	FormatHistogram(&gMetrics.collisionDepth, "newdocument_collision_depth", NULL,
+					"Number appended to new document names to make them unique (1 for no number).", buffer, size, &length);
+	
+	return length;
+}
+
+/*
+ * FormatHistogram
+ *
+ * Append a histogram in the Prometheus text format. Buckets are cumulative,
+ * and listed up to the highest non-empty one. labels (e.g. lane="bulk") may be
+ * NULL. The help and type lines are only written if help isn't NULL, so that
+ * the histograms of a family share them.
+ */
+static void FormatHistogram(MetricsHistogram *histogram, const char *name, const char *labels, const char *help, char *buffer, size_t size, size_t *ioLength)
+{
+	SInt64 counts[kNewDocumentPlugInHistogramBuckets], cumulative = 0;
+	int bucket, last = -1;
+	const char *separator = ",", *openBrace = "{", *closeBrace = "}";
+	
+	if (labels == NULL) {
+		labels = separator = openBrace = closeBrace = "";
+	}
+	
+	for (bucket = 0; bucket < kNewDocumentPlugInHistogramBuckets; bucket++) {
+		counts[bucket] = GetMetric(&histogram->buckets[bucket]);
+		if (counts[bucket] > 0)
+			last = bucket;
+	}
+	
+	if (help != NULL)
+		AppendMetricsText(buffer, size, ioLength, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	
+	for (bucket = 0; bucket <= last; bucket++) {
+		cumulative += counts[bucket];
+		AppendMetricsText(buffer, size, ioLength, "%s_bucket{%s%sle=\"%lld\"} %lld\n",
+						  name, labels, separator, (long long)GetHistogramBucketLimit(bucket), (long long)cumulative);
+	}
+	
+	// The total is taken from the buckets, as other threads may record values
+	// while they are read
+	AppendMetricsText(buffer, size, ioLength, "%s_bucket{%s%sle=\"+Inf\"} %lld\n%s_sum%s%s%s %lld\n%s_count%s%s%s %lld\n",
+					  name, labels, separator, (long long)cumulative,
+					  name, openBrace, labels, closeBrace, (long long)GetMetric(&histogram->sum),
+					  name, openBrace, labels, closeBrace, (long long)cumulative);
+}
+
+/*
+ * AppendMetricsText
+ *
+ * Append formatted text to a buffer, updating its length. The text is
+ * truncated if the buffer is full.
+ */
+static void AppendMetricsText(char *buffer, size_t size, size_t *ioLength, const char *format, ...)
+{
+	va_list arguments;
+	int written;
+	
+	if (*ioLength + 1 >= size)
+		return;
+	
+	va_start(arguments, format);
+	written = vsnprintf(buffer + *ioLength, size - *ioLength, format, arguments);
+	va_end(arguments);
+	
+	if (written > 0)
+		*ioLength += ((size_t)written < size - *ioLength) ? (size_t)written : size - *ioLength - 1;
+}
+
+
+// -----------------------------------------------------------------------------
+//	Trace recorder
+// -----------------------------------------------------------------------------
+
+/*
+ * RecordTraceEvent
+ *
+ * Append an event to the trace file, if traces are recorded. templateName is
+ * NULL for examine events.
+ */
+static void RecordTraceEvent(int type, CFStringRef templateName, CFArrayRef directoryURLs)
+{
+	FILE *trace = GetTraceFile();
+	char name[PATH_MAX], directory[PATH_MAX];
+	CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+	CFIndex i, count;
+	
+	if (trace == NULL)
+		return;
+	
+	name[0] = '\0';
+	if (templateName != NULL && !CFStringGetCString(templateName, name, sizeof(name), kCFStringEncodingUTF8))
+		return;
+	
+	fprintf(trace, "%.3f\t%s\t%s",
+			(gTraceLastEventDate > 0) ? (now - gTraceLastEventDate) * 1000.0 : 0.0,
+			(type == kNewDocumentPlugInSelectEvent) ? "select" : "examine",
+			name);
+	count = CFArrayGetCount(directoryURLs);
+	for (i = 0; i < count; i++) {
+		if (CFURLGetFileSystemRepresentation(CFArrayGetValueAtIndex(directoryURLs, i), true, (UInt8*)directory, sizeof(directory)))
+			fprintf(trace, "\t%s", directory);
+	}
+	fputc('\n', trace);
+	fflush(trace);
+	
+	gTraceLastEventDate = now;
+	
+	if (ftell(trace) >= kNewDocumentPlugInTraceMaxSize)
+		RotateTraceFile();
+}
+
+/*
+ * GetTraceFile
+ *
+ * Return the trace file, opened for appending on first use, or NULL if the
+ * "RecordTrace" preference isn't true. Tracing is off by default : the trace
+ * holds the paths of the user directories.
+ */
+static FILE* GetTraceFile()
+{
+	CFURLRef cachesURL;
+	
+	if (gTraceFileChecked)
+		return gTraceFile;
+	gTraceFileChecked = true;
+	
+	if (!CFPreferencesGetAppBooleanValue(CFSTR("RecordTrace"), CFSTR(kNewDocumentPlugInBundle), NULL))
+		return NULL;
+	
+	cachesURL = CopyPlugInCachesURL();
+	if (cachesURL == NULL)
+		return NULL;
+	
+	if (CFURLGetFileSystemRepresentation(cachesURL, true, (UInt8*)gTracePath, sizeof(gTracePath))
+		&& strlcat(gTracePath, "/" kNewDocumentPlugInTraceFilename, sizeof(gTracePath)) < sizeof(gTracePath))
+		gTraceFile = OpenTraceFile(gTracePath);
+	CFRelease(cachesURL);
+	
+	return gTraceFile;
+}
+
+/*
+ * OpenTraceFile
+ *
+ * Open a trace file for appending, readable by the current user only.
+ */
+static FILE* OpenTraceFile(const char *path)
+{
+	FILE *file = NULL;
+	int fd;
+	
+	fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if (fd >= 0 && (file = fdopen(fd, "a")) == NULL)
+		close(fd);
+	if (file == NULL)
+		printf("NewDocumentPlugIn: Error: cannot open the trace file (%d).\n", errno);
+	
+	return file;
+}
+
+/*
+ * RotateTraceFile
+ *
+ * Keep the trace file under kNewDocumentPlugInTraceMaxSize bytes : the current
+ * trace replaces the previous one, suffixed by ".1", and a new trace starts.
+ * If the trace cannot be renamed, it goes on in the current file, and the
+ * rotation is tried again with the next event.
+ */
+static void RotateTraceFile()
+{
+	char previousPath[PATH_MAX];
+	
+	fclose(gTraceFile);
+	
+	if (snprintf(previousPath, sizeof(previousPath), "%s.1", gTracePath) >= sizeof(previousPath)
+		|| rename(gTracePath, previousPath) != 0)
+		printf("NewDocumentPlugIn: Error: cannot rotate the trace file (%d).\n", errno);
+	
+	gTraceFile = OpenTraceFile(gTracePath);
+}
+
+
+// -----------------------------------------------------------------------------
+//	System compatibility
+// -----------------------------------------------------------------------------
+
+// The plugin runs from Mac OS X 10.4 on. The calls that appeared later are
+// weakly linked, and only made when the running system has them; these
+// functions fall back on the calls of 10.4 otherwise.
+
+/*
+ * GetPathAt
+ *
+ * Write the path of a file relative to an open directory (or to the current
+ * directory, for AT_FDCWD) into outPath, for the systems without the calls
+ * relative to a directory descriptor. Returns false and sets errno on error.
+ */
+static Boolean GetPathAt(int directoryFd, const char *name, char *outPath, size_t outSize)
+{
+	char directory[MAXPATHLEN];
+	
+	if (name[0] == '/' || directoryFd == AT_FDCWD) {
+		if (strlcpy(outPath, name, outSize) < outSize)
+			return true;
+	}
+	else {
+		if (fcntl(directoryFd, F_GETPATH, directory) == -1)
+			return false;
+		if (snprintf(outPath, outSize, "%s/%s", directory, name) < outSize)
+			return true;
+	}
+	
+	errno = ENAMETOOLONG;
+	return false;
+}
+
+/*
+ * OpenAt
+ *
+ * openat(), or open() on the path of the file.
+ */
+static int OpenAt(int directoryFd, const char *name, int flags, mode_t mode)
+{
+	char path[PATH_MAX];
+	
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 101000
+	if (openat != NULL)
+		return openat(directoryFd, name, flags, mode);
+#endif
+	
+	if (!GetPathAt(directoryFd, name, path, sizeof(path)))
+		return -1;
+	return open(path, flags, mode);
+}
+
+/*
+ * OpenDirectoryAt
+ *
+ * Open a directory relative to an open directory for reading, as
+ * fdopendir(openat()) does. flags may add O_NOFOLLOW. Returns NULL and sets
+ * errno on error.
+ */
+static DIR* OpenDirectoryAt(int directoryFd, const char *name, int flags)
+{
+	char path[PATH_MAX];
+	struct stat info;
+	DIR *dir;
+	int fd, error;
+	
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 101000
+	if (openat != NULL && fdopendir != NULL) {
+		fd = openat(directoryFd, name, O_RDONLY | O_DIRECTORY | flags);
+		if (fd < 0)
+			return NULL;
+		dir = fdopendir(fd);
+		if (dir == NULL) {
+			error = errno;
+			close(fd);
+			errno = error;
+		}
+		return dir;
+	}
+#endif
+	
+	if (!GetPathAt(directoryFd, name, path, sizeof(path)))
+		return NULL;
+	if ((flags & O_NOFOLLOW) && lstat(path, &info) == 0 && S_ISLNK(info.st_mode)) {
+		errno = ELOOP;
+		return NULL;
+	}
+	return opendir(path);
+}
+
+/*
+ * StatAt
+ *
+ * fstatat(), or stat() or lstat() on the path of the file.
+ */
+static int StatAt(int directoryFd, const char *name, struct stat *outInfo, int flags)
+{
+	char path[PATH_MAX];
+	
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 101000
+	if (fstatat != NULL)
+		return fstatat(directoryFd, name, outInfo, flags);
+#endif
+	
+	if (!GetPathAt(directoryFd, name, path, sizeof(path)))
+		return -1;
+	return (flags & AT_SYMLINK_NOFOLLOW) ? lstat(path, outInfo) : stat(path, outInfo);
+}
+
+/*
+ * MakeDirectoryAt
+ *
+ * mkdirat(), or mkdir() on the path of the directory.
+ */
+static int MakeDirectoryAt(int directoryFd, const char *name, mode_t mode)
+{
+	char path[PATH_MAX];
+	
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 101000
+	if (mkdirat != NULL)
+		return mkdirat(directoryFd, name, mode);
+#endif
+	
+	if (!GetPathAt(directoryFd, name, path, sizeof(path)))
+		return -1;
+	return mkdir(path, mode);
+}
+
+/*
+ * RenameAt
+ *
+ * renameat(), or rename() on the paths of the files.
+ */
+static int RenameAt(int fromFd, const char *fromName, int toFd, const char *toName)
+{
+	char fromPath[PATH_MAX], toPath[PATH_MAX];
+	
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 101000
+	if (renameat != NULL)
+		return renameat(fromFd, fromName, toFd, toName);
+#endif
+	
+	if (!GetPathAt(fromFd, fromName, fromPath, sizeof(fromPath))
+		|| !GetPathAt(toFd, toName, toPath, sizeof(toPath)))
+		return -1;
+	return rename(fromPath, toPath);
+}
+
+/*
+ * UnlinkAt
+ *
+ * unlinkat(), or unlink() or rmdir() (for AT_REMOVEDIR) on the path of the
+ * file.
+ */
+static int UnlinkAt(int directoryFd, const char *name, int flags)
+{
+	char path[PATH_MAX];
+	
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 101000
+	if (unlinkat != NULL)
+		return unlinkat(directoryFd, name, flags);
+#endif
+	
+	if (!GetPathAt(directoryFd, name, path, sizeof(path)))
+		return -1;
+	return (flags & AT_REMOVEDIR) ? rmdir(path) : unlink(path);
+}
+
+/*
+ * LinkAt
+ *
+ * linkat() without flags, or link() on the paths of the files.
+ */
+static int LinkAt(int fromFd, const char *fromName, int toFd, const char *toName)
+{
+	char fromPath[PATH_MAX], toPath[PATH_MAX];
+	
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 101000
+	if (linkat != NULL)
+		return linkat(fromFd, fromName, toFd, toName, 0);
+#endif
+	
+	if (!GetPathAt(fromFd, fromName, fromPath, sizeof(fromPath))
+		|| !GetPathAt(toFd, toName, toPath, sizeof(toPath)))
+		return -1;
+	return link(fromPath, toPath);
+}
+
+/*
+ * SymlinkAt
+ *
+ * symlinkat(), or symlink() on the path of the link.
+ */
+static int SymlinkAt(const char *target, int directoryFd, const char *name)
+{
+	char path[PATH_MAX];
+	
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 101000
+	if (symlinkat != NULL)
+		return symlinkat(target, directoryFd, name);
+#endif
+	
+	if (!GetPathAt(directoryFd, name, path, sizeof(path)))
+		return -1;
+	return symlink(target, path);
+}
+
+/*
+ * SetFileTimesAt
+ *
+ * Set the access and modification dates of a regular file relative to an
+ * open directory : utimensat(), or utimes() on the path of the file, with
+ * microseconds.
+ */
+static int SetFileTimesAt(int directoryFd, const char *name, const struct timespec times[2])
+{
+	char path[PATH_MAX];
+	struct timeval values[2];
+	
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 101300
+	if (utimensat != NULL)
+		return utimensat(directoryFd, name, times, AT_SYMLINK_NOFOLLOW);
+#endif
+	
+	if (!GetPathAt(directoryFd, name, path, sizeof(path)))
+		return -1;
+	values[0].tv_sec = times[0].tv_sec;
+	values[0].tv_usec = times[0].tv_nsec / 1000;
+	values[1].tv_sec = times[1].tv_sec;
+	values[1].tv_usec = times[1].tv_nsec / 1000;
+	return utimes(path, values);
+}
+
+/*
+ * CopyFileAt
+ *
+ * Copy a file with its attributes to a new file relative to an open
+ * directory : fcopyfile(), or a copy of the data followed by
+ * CopyFileMetadata. Fails if the destination exists. Returns 0, or -1 and
+ * sets errno.
+ */
+static int CopyFileAt(const char *sourcePath, int directoryFd, const char *destinationName)
+{
+	char destinationPath[PATH_MAX];
+	UInt8 buffer[64 * 1024];
+	ssize_t length, written;
+	int sourceFd, destinationFd, result = -1, error;
+	
+	sourceFd = open(sourcePath, O_RDONLY);
+	if (sourceFd < 0)
+		return -1;
+	destinationFd = OpenAt(directoryFd, destinationName, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (destinationFd < 0) {
+		error = errno;
+		close(sourceFd);
+		errno = error;
+		return -1;
+	}
+	
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 1050
+	if (fcopyfile != NULL) {
+		result = fcopyfile(sourceFd, destinationFd, NULL, COPYFILE_ALL);
+		error = errno;
+		close(destinationFd);
+		close(sourceFd);
+		errno = error;
+		return result;
+	}
+#endif
 	
-	// Localize the template name, then append the extensions
-	filename = CFStringCreateMutable(NULL, 0);
-	CFStringAppendFormat(filename,
-						 NULL,
-						 localized,
-						 templateName);
-	CFStringAppend(filename, templateExtensions);
+	// A short write on a regular file means the volume is full
+	do {
+		length = read(sourceFd, buffer, sizeof(buffer));
+		written = (length > 0) ? write(destinationFd, buffer, length) : 0;
+	} while (length > 0 && written == length);
+	if (length > 0 && written >= 0)
+		errno = ENOSPC;
+	else if (length == 0 && GetPathAt(directoryFd, destinationName, destinationPath, sizeof(destinationPath)))
+		result = CopyFileMetadata(sourcePath, destinationPath);
 	
-	// Clean-up
-	CFRelease(localized);
-	CFRelease(templateName);
-	CFRelease(templateExtensions);
+	error = errno;
+	close(destinationFd);
+	close(sourceFd);
+	errno = error;
 	
-	return filename;
+	return result;
 }
 
 /*
- * RemoveLastExtension
+ * CopyFileMetadata
  *
- * Return a localized version of the template filename.
+ * Give a file the metadata of another one (permissions, extended attributes,
+ * Finder info, resource fork and ACL) : copyfile(), or the permissions and
+ * the extended attributes, which hold the Finder info and the resource fork,
+ * where it's missing. Returns 0, or -1 and sets errno.
  */
-static void RemoveLastExtension(CFMutableStringRef filename)
+static int CopyFileMetadata(const char *sourcePath, const char *destinationPath)
 {
-	CFArrayRef dotResults;
+	struct stat info;
+	char *names, *name;
+	void *value;
+	ssize_t namesLength, valueLength;
+	int result = 0;
 	
-	// Remove the last of remaining extensions, if any
-	dotResults = CFStringCreateArrayWithFindResults(NULL,
-													filename,
-													CFSTR("."), 
-													CFRangeMake(0, CFStringGetLength(filename)),
-													0);
-	if (dotResults != NULL && CFArrayGetCount(dotResults) > 0) {
-		CFRange* dotRange = (CFRange*)CFArrayGetValueAtIndex(dotResults, CFArrayGetCount(dotResults) - 1);
-		CFStringDelete(filename, CFRangeMake(dotRange->location, CFStringGetLength(filename) - dotRange->location));
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 1050
+	if (copyfile != NULL)
+		return copyfile(sourcePath, destinationPath, NULL, COPYFILE_METADATA);
+#endif
+	
+	if (stat(sourcePath, &info) != 0 || chmod(destinationPath, info.st_mode & 07777) != 0)
+		return -1;
+	
+	namesLength = listxattr(sourcePath, NULL, 0, 0);
+	if (namesLength <= 0)
+		return (namesLength < 0 && errno != ENOTSUP) ? -1 : 0;
+	names = (char*) malloc(namesLength);
+	if (names == NULL)
+		return -1;
+	namesLength = listxattr(sourcePath, names, namesLength, 0);
+	
+	for (name = names; result == 0 && name < names + namesLength; name += strlen(name) + 1) {
+		valueLength = getxattr(sourcePath, name, NULL, 0, 0, 0);
+		value = (valueLength >= 0) ? malloc(valueLength + 1) : NULL;
+		if (value == NULL
+			|| (valueLength = getxattr(sourcePath, name, value, valueLength, 0, 0)) < 0
+			|| setxattr(destinationPath, name, value, valueLength, 0, 0) != 0)
+			result = -1;
+		free(value);
 	}
 	
-	CFRelease(dotResults);
+	free(names);
+	
+	return (namesLength < 0) ? -1 : result;
+}
+
+/*
+ * SetThreadIOThrottled
+ *
+ * Throttle the disk I/O of the calling thread whenever other I/O is pending,
+ * or restore the default policy. Does nothing before Mac OS X 10.5.
+ */
+static void SetThreadIOThrottled(Boolean throttled)
+{
+#if defined(IOPOL_TYPE_DISK)
+	if (setiopolicy_np != NULL)
+		setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, throttled ? IOPOL_THROTTLE : IOPOL_DEFAULT);
+#endif
+}
+
+/*
+ * AtomicAdd64
+ *
+ * Atomically add an amount to a 64-bit value, and return the new value. The
+ * compilers of Mac OS X 10.4 have no atomic builtins : OSAtomic is used there.
+ */
+static SInt64 AtomicAdd64(volatile SInt64 *value, SInt64 amount)
+{
+#if defined(__ATOMIC_SEQ_CST)
+	return __atomic_add_fetch(value, amount, __ATOMIC_SEQ_CST);
+#else
+	return OSAtomicAdd64Barrier(amount, (volatile int64_t*)value);
+#endif
+}
+
+/*
+ * AtomicLoad64
+ *
+ * Atomically read a 64-bit value (64-bit loads are not atomic on every
+ * architecture we run on).
+ */
+static SInt64 AtomicLoad64(volatile SInt64 *value)
+{
+#if defined(__ATOMIC_SEQ_CST)
+	return __atomic_load_n(value, __ATOMIC_SEQ_CST);
+#else
+	return OSAtomicAdd64Barrier(0, (volatile int64_t*)value);
+#endif
+}
+
+/*
+ * AtomicCompareAndSwap64
+ *
+ * Atomically replace a 64-bit value by newValue if it is *ioExpected.
+ * Otherwise, returns false and sets *ioExpected to the value found.
+ */
+static Boolean AtomicCompareAndSwap64(volatile SInt64 *value, SInt64 *ioExpected, SInt64 newValue)
+{
+#if defined(__ATOMIC_SEQ_CST)
+	return __atomic_compare_exchange_n(value, ioExpected, newValue, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#else
+	if (OSAtomicCompareAndSwap64Barrier(*ioExpected, newValue, (volatile int64_t*)value))
+		return true;
+	*ioExpected = AtomicLoad64(value);
+	return false;
+#endif
+}
+
+/*
+ * AtomicCompareAndSwap32
+ *
+ * Same as AtomicCompareAndSwap64, for a 32-bit value.
+ */
+static Boolean AtomicCompareAndSwap32(volatile SInt32 *value, SInt32 *ioExpected, SInt32 newValue)
+{
+#if defined(__ATOMIC_SEQ_CST)
+	return __atomic_compare_exchange_n(value, ioExpected, newValue, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+#else
+	if (OSAtomicCompareAndSwap32Barrier(*ioExpected, newValue, (volatile int32_t*)value))
+		return true;
+	*ioExpected = *value;
+	return false;
+#endif
 }
 
 
@@ -1000,31 +7319,47 @@ static void RemoveLastExtension(CFMutableStringRef filename)
 // -----------------------------------------------------------------------------
 
 /*
- * EditFinderItem
+ * UpdateFinderItems
  *
- * Run the "EditFinderItem" Applescript to enable the renaming of a specific item
- * in the Finder front window.
+ * Run the "UpdateFinderItems" Applescript to show a list of new items (POSIX
+ * paths) in the Finder windows, and to enable the renaming of the item named
+ * editedItemName in the Finder front window, unless it is NULL.
  */
-static OSAError EditFinderItem(CFStringRef itemName)
+static OSAError UpdateFinderItems(CFArrayRef itemPaths, CFStringRef editedItemName)
 {
 	OSAError err;
 	OSAID scriptID;
 	ComponentInstance scriptComponent;
-	CFMutableStringRef itemProperty;
+	CFMutableStringRef itemsProperty, itemProperty;
+	CFIndex i, count;
 	
 	// Get the Applescript scripting component
 	scriptComponent = GetAppleScriptComponent();
 	
 	// Load and compile the script from resources
-	err = LoadScriptFromResources(CFSTR("EditFinderItem.scpt"), &scriptID);
+	err = LoadScriptFromResources(CFSTR("UpdateFinderItems.applescript"), &scriptID);
 	
 	if (err == noErr) {
 		
 		// Bind vars
-		itemProperty = CFStringCreateMutable(NULL, 0);
-		CFStringAppendFormat(itemProperty, NULL, CFSTR("\"%@\""), itemName); // Add double-quotes
-		err = InjectPropertyIntoScript(scriptID, CFSTR("theItem"), itemProperty, kCFStringEncodingUTF8);
-		CFRelease(itemProperty);
+		itemsProperty = CFStringCreateMutable(NULL, 0);
+		CFStringAppend(itemsProperty, CFSTR("{"));
+		count = CFArrayGetCount(itemPaths);
+		for (i = 0; i < count; i++) {
+			if (i > 0)
+				CFStringAppend(itemsProperty, CFSTR(", "));
+			AppendScriptString(itemsProperty, CFArrayGetValueAtIndex(itemPaths, i));
+		}
+		CFStringAppend(itemsProperty, CFSTR("}"));
+		err = InjectPropertyIntoScript(scriptID, CFSTR("theItems"), itemsProperty, kCFStringEncodingUTF8);
+		CFRelease(itemsProperty);
+		
+		if (err == noErr) {
+			itemProperty = CFStringCreateMutable(NULL, 0);
+			AppendScriptString(itemProperty, (editedItemName != NULL) ? editedItemName : CFSTR(""));
+			err = InjectPropertyIntoScript(scriptID, CFSTR("theEditedItem"), itemProperty, kCFStringEncodingUTF8);
+			CFRelease(itemProperty);
+		}
 		
 		// Execute the script
 		if (err == noErr) {
@@ -1038,6 +7373,23 @@ static OSAError EditFinderItem(CFStringRef itemName)
 	return err;
 }
 
+/*
+ * AppendScriptString
+ *
+ * Append a string to a script source, as an AppleScript string literal :
+ * double-quoted, with its quotes and backslashes escaped.
+ */
+static void AppendScriptString(CFMutableStringRef source, CFStringRef string)
+{
+	CFMutableStringRef escaped;
+	
+	escaped = CFStringCreateMutableCopy(NULL, 0, string);
+	CFStringFindAndReplace(escaped, CFSTR("\\"), CFSTR("\\\\"), CFRangeMake(0, CFStringGetLength(escaped)), 0);
+	CFStringFindAndReplace(escaped, CFSTR("\""), CFSTR("\\\""), CFRangeMake(0, CFStringGetLength(escaped)), 0);
+	CFStringAppendFormat(source, NULL, CFSTR("\"%@\""), escaped);
+	CFRelease(escaped);
+}
+
 /*
  * GetApplescriptScriptingComponent
  *
@@ -1046,11 +7398,16 @@ static OSAError EditFinderItem(CFStringRef itemName)
 static ComponentInstance GetAppleScriptComponent()
 {
 	ComponentInstance AppleScriptComponent;
+	CFAbsoluteTime startDate;
+	
+	gScriptingComponentLastUse = CFAbsoluteTimeGetCurrent();
 	
 	if (gScriptingComponent == NULL) {
 		
 		// Get the generic scripting component
+		startDate = CFAbsoluteTimeGetCurrent();
 		gScriptingComponent = OpenDefaultComponent(kOSAComponentType, kOSAGenericScriptingComponentSubtype);
+		RecordPhaseTime(kNewDocumentPlugInScriptingPhase, startDate);
 		
 		if (gScriptingComponent == NULL)
 			printf("NewDocumentPlugIn->getGenericComponent : No such component.");
@@ -1220,7 +7577,7 @@ static OSAError ExecuteScript(OSAID scriptID, OSAID* outResultingScriptID)
 						   kOSAErrorMessage,
 						   typeChar,
 						   &scriptError);
-			errorMsg = CopyStringFromDesc(&scriptError);
+			errorMsg = CopyDescToString(&scriptError);
 			
 			CFShow(errorMsg);
 			
@@ -1304,4 +7661,508 @@ static CFStringRef CopyDescToString(AEDesc* desc)
 	free(cString);
 	return result;
 }
+
+/* LogTemplateCacheStats
+ * Debug function that prints the usage counters of the templates content cache.
+ */
+static void LogTemplateCacheStats()
+{
+	printf("NewDocumentPlugIn: template cache: %u hits, %u misses, %u evictions, %ld bytes\n",
+		   (unsigned int)gTemplateCacheStats.hits,
+		   (unsigned int)gTemplateCacheStats.misses,
+		   (unsigned int)gTemplateCacheStats.evictions,
+		   (long)gTemplateCacheSize);
+}
+
+/* SimulateFileSystemCall
+ * Debug function that makes the plugin behave as on a slow or faulty volume
+ * (a network volume, for instance): waits for the simulated latency of a file
+ * system call, then returns the errno value the call must fail with, or 0.
+ * Called through SimulateFileSystemCallIfNeeded, from any thread.
+ */
+static int SimulateFileSystemCall(int call)
+{
+	SimulatedFileSystemCall *simulated;
+	double delay;
+	
+	AddToMetric(&gMetrics.fileSystemCalls[call], 1);
+	
+	pthread_once(&gSimulatedFileSystemOnce, LoadSimulatedFileSystem);
+	simulated = &gSimulatedFileSystem[call];
+	
+	// Latency, plus or minus the jitter
+	delay = simulated->latency + simulated->jitter * (2.0 * random() / 2147483647.0 - 1.0);
+	if (delay > 0)
+		usleep((useconds_t)(delay * 1000.0));
+	
+	if (simulated->errorRate > 0 && random() / 2147483647.0 < simulated->errorRate)
+		return simulated->error;
+	
+	return 0;
+}
+
+/* LoadSimulatedFileSystem
+ * Debug function that loads the simulated file system calls from the
+ * "SimulatedFileSystem" preference of the plugin, a dictionary of the
+ * simulated calls (stat, readdir, open, write, copy, catalog, notify and
+ * clone),
+ * e.g. :
+ *   defaults write com.kemenaran.Finder.NewDocumentPlugIn SimulatedFileSystem
+ *     '{ copy = { Latency = 20; Jitter = 10; ErrorRate = 0.01; Error = 28; }; }'
+ * Latency and Jitter are in milliseconds, and Error is an errno value (EIO by
+ * default). Calls not listed behave normally.
+ */
+static void LoadSimulatedFileSystem()
+{
+	static const CFStringRef callNames[kNewDocumentPlugInFileSystemCalls] = {
+		CFSTR("stat"), CFSTR("readdir"), CFSTR("open"), CFSTR("write"), CFSTR("copy"), CFSTR("catalog"), CFSTR("notify"), CFSTR("clone")
+	};
+	CFPropertyListRef preference;
+	CFDictionaryRef callDescription;
+	CFNumberRef number;
+	SimulatedFileSystemCall *simulated;
+	int call;
+	
+	preference = CFPreferencesCopyAppValue(CFSTR("SimulatedFileSystem"), CFSTR(kNewDocumentPlugInBundle));
+	if (preference == NULL)
+		return;
+	
+	if (CFGetTypeID(preference) == CFDictionaryGetTypeID()) {
+		for (call = 0; call < kNewDocumentPlugInFileSystemCalls; call++) {
+			callDescription = CFDictionaryGetValue(preference, callNames[call]);
+			if (callDescription == NULL || CFGetTypeID(callDescription) != CFDictionaryGetTypeID())
+				continue;
+			
+			simulated = &gSimulatedFileSystem[call];
+			simulated->error = EIO;
+			if ((number = CFDictionaryGetValue(callDescription, CFSTR("Latency"))) != NULL)
+				CFNumberGetValue(number, kCFNumberDoubleType, &simulated->latency);
+			if ((number = CFDictionaryGetValue(callDescription, CFSTR("Jitter"))) != NULL)
+				CFNumberGetValue(number, kCFNumberDoubleType, &simulated->jitter);
+			if ((number = CFDictionaryGetValue(callDescription, CFSTR("ErrorRate"))) != NULL)
+				CFNumberGetValue(number, kCFNumberDoubleType, &simulated->errorRate);
+			if ((number = CFDictionaryGetValue(callDescription, CFSTR("Error"))) != NULL)
+				CFNumberGetValue(number, kCFNumberIntType, &simulated->error);
+			
+			printf("NewDocumentPlugIn: simulating a slow file system for calls #%d.\n", call);
+		}
+	}
+	
+	CFRelease(preference);
+}
+
+/* StartTraceReplay
+ * Debug function that replays a workload against the whole plugin, from the
+ * "ReplayTrace" preference : either the path of a trace file (see
+ * RecordTraceEvent), or a dictionary describing a synthetic trace (see
+ * CreateSyntheticTrace), e.g. :
+ *   defaults write com.kemenaran.Finder.NewDocumentPlugIn ReplayTrace
+ *     '{ Directory = "/tmp/replay"; Events = 1000; Burst = 20; }'
+ * Events are replayed by the host run loop, with their recorded delays, as
+ * the Contextual Menu Manager would call the plugin. Once every document is
+ * created, the throughput and latencies of each stage are logged.
+ */
+static void StartTraceReplay()
+{
+	CFPropertyListRef preference;
+	CFRunLoopTimerContext context = { 0, NULL, NULL, NULL, NULL };
+	TraceReplay *replay;
+	TraceEvent *events = NULL;
+	CFIndex count = 0;
+	CFAbsoluteTime now;
+	
+	if (gTraceReplayStarted)
+		return;
+	gTraceReplayStarted = true;
+	
+	preference = CFPreferencesCopyAppValue(CFSTR("ReplayTrace"), CFSTR(kNewDocumentPlugInBundle));
+	if (preference == NULL)
+		return;
+	
+	if (CFGetTypeID(preference) == CFStringGetTypeID())
+		events = CopyTraceFromFile(preference, &count);
+	else if (CFGetTypeID(preference) == CFDictionaryGetTypeID())
+		events = CreateSyntheticTrace(preference, &count);
+	CFRelease(preference);
+	
+	replay = (events != NULL && count > 0) ? (TraceReplay*) calloc(1, sizeof(TraceReplay)) : NULL;
+	if (replay == NULL) {
+		printf("NewDocumentPlugIn: cannot load the trace to replay.\n");
+		if (events != NULL)
+			FreeTraceEvents(events, count);
+		return;
+	}
+	
+	now = CFAbsoluteTimeGetCurrent();
+	replay->events = events;
+	replay->count = count;
+	replay->startDate = now;
+	replay->startMetrics = gMetrics;
+	
+	// The timer is rescheduled for each event
+	context.info = replay;
+	replay->timer = CFRunLoopTimerCreate(NULL, now + events[0].delay / 1000.0, 3600.0, 0, 0, ReplayNextTraceEvent, &context);
+	CFRunLoopAddTimer(CFRunLoopGetCurrent(), replay->timer, kCFRunLoopCommonModes);
+	gTraceReplay = replay;
+	
+	printf("NewDocumentPlugIn: replaying %ld events.\n", (long)count);
+}
+
+/* CopyTraceFromFile
+ * Debug function that reads the events of a trace file. Malformed lines are
+ * skipped. Returns NULL on error.
+ */
+static TraceEvent* CopyTraceFromFile(CFStringRef path, CFIndex *outCount)
+{
+	char filePath[PATH_MAX], *line = NULL, *cursor, *field;
+	size_t lineCapacity = 0;
+	ssize_t lineLength;
+	TraceEvent *events = NULL, *grownEvents, event;
+	CFIndex count = 0, capacity = 0;
+	CFMutableArrayRef directoryURLs;
+	CFURLRef directoryURL;
+	FILE *file;
+	int fieldIndex;
+	
+	if (!CFStringGetFileSystemRepresentation(path, filePath, sizeof(filePath)))
+		return NULL;
+	file = fopen(filePath, "r");
+	if (file == NULL)
+		return NULL;
+	
+	while ((lineLength = ReadTraceLine(file, &line, &lineCapacity)) > 0) {
+		if (line[lineLength - 1] == '\n')
+			line[lineLength - 1] = '\0';
+		
+		memset(&event, 0, sizeof(event));
+		event.type = -1;
+		directoryURLs = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+		cursor = line;
+		for (fieldIndex = 0; (field = strsep(&cursor, "\t")) != NULL; fieldIndex++) {
+			if (fieldIndex == 0)
+				event.delay = strtod(field, NULL);
+			else if (fieldIndex == 1)
+				event.type = (strcmp(field, "select") == 0) ? kNewDocumentPlugInSelectEvent
+						   : (strcmp(field, "examine") == 0) ? kNewDocumentPlugInExamineEvent : -1;
+			else if (fieldIndex == 2) {
+				if (field[0] != '\0')
+					event.templateName = CFStringCreateWithCString(NULL, field, kCFStringEncodingUTF8);
+			}
+			else {
+				directoryURL = CFURLCreateFromFileSystemRepresentation(NULL, (const UInt8*)field, strlen(field), true);
+				if (directoryURL != NULL) {
+					CFArrayAppendValue(directoryURLs, directoryURL);
+					CFRelease(directoryURL);
+				}
+			}
+		}
+		event.directoryURLs = directoryURLs;
+		
+		if (event.type < 0 || CFArrayGetCount(directoryURLs) == 0
+			|| (event.type == kNewDocumentPlugInSelectEvent) != (event.templateName != NULL)) {
+			if (event.templateName != NULL)
+				CFRelease(event.templateName);
+			CFRelease(directoryURLs);
+			continue;
+		}
+		
+		if (count == capacity) {
+			capacity = (capacity > 0) ? capacity * 2 : 256;
+			grownEvents = (TraceEvent*) realloc(events, capacity * sizeof(TraceEvent));
+			if (grownEvents == NULL) {
+				if (event.templateName != NULL)
+					CFRelease(event.templateName);
+				CFRelease(directoryURLs);
+				break;
+			}
+			events = grownEvents;
+		}
+		events[count++] = event;
+	}
+	
+	free(line);
+	fclose(file);
+	
+	*outCount = count;
+	return events;
+}
+
+/* ReadTraceLine
+ * Debug function that reads a line of a trace file, like getline() (which
+ * appeared in Mac OS X 10.7) : the line buffer is grown as needed. Returns the
+ * length of the line, or -1 at the end of the file.
+ */
+static ssize_t ReadTraceLine(FILE *file, char **ioLine, size_t *ioCapacity)
+{
+	char *grownLine;
+	size_t length = 0;
+	
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 1070
+	if (getline != NULL)
+		return getline(ioLine, ioCapacity, file);
+#endif
+	
+	for (;;) {
+		if (*ioCapacity - length < 2) {
+			grownLine = (char*) realloc(*ioLine, *ioCapacity + 1024);
+			if (grownLine == NULL)
+				return -1;
+			*ioLine = grownLine;
+			*ioCapacity += 1024;
+		}
+		if (fgets(*ioLine + length, *ioCapacity - length, file) == NULL)
+			break;
+		length += strlen(*ioLine + length);
+		if ((*ioLine)[length - 1] == '\n')
+			break;
+	}
+	
+	return (length > 0) ? (ssize_t)length : -1;
+}
+
+/* CreateSyntheticTrace
+ * Debug function that creates a trace of bursts in a single directory : each
+ * burst examines the directory, then selects the same template Burst times
+ * (20 by default), Delay milliseconds apart (10 by default). Bursts are Pause
+ * milliseconds apart (1000 by default), and use each template in turn, so
+ * that templates of every size are created, and their "untitled N" chains
+ * grow longer with each burst. Events is the total number of events (1000
+ * by default), and Directory the path of the directory, which must exist.
+ */
+static TraceEvent* CreateSyntheticTrace(CFDictionaryRef parameters, CFIndex *outCount)
+{
+	CFStringRef directory;
+	CFNumberRef number;
+	CFURLRef directoryURL;
+	CFArrayRef directoryURLs;
+	TemplateTable *table;
+	TraceEvent *events;
+	int eventsCount = 1000, burst = 20;
+	double delay = 10, pause = 1000;
+	CFIndex i;
+	
+	directory = CFDictionaryGetValue(parameters, CFSTR("Directory"));
+	if (directory == NULL || CFGetTypeID(directory) != CFStringGetTypeID())
+		return NULL;
+	if ((number = CFDictionaryGetValue(parameters, CFSTR("Events"))) != NULL)
+		CFNumberGetValue(number, kCFNumberIntType, &eventsCount);
+	if ((number = CFDictionaryGetValue(parameters, CFSTR("Burst"))) != NULL)
+		CFNumberGetValue(number, kCFNumberIntType, &burst);
+	if ((number = CFDictionaryGetValue(parameters, CFSTR("Delay"))) != NULL)
+		CFNumberGetValue(number, kCFNumberDoubleType, &delay);
+	if ((number = CFDictionaryGetValue(parameters, CFSTR("Pause"))) != NULL)
+		CFNumberGetValue(number, kCFNumberDoubleType, &pause);
+	if (eventsCount <= 0 || burst <= 0)
+		return NULL;
+	
+	table = CopyTemplateTable();
+	if (table == NULL)
+		return NULL;
+	events = (table->count > 0) ? (TraceEvent*) calloc(eventsCount, sizeof(TraceEvent)) : NULL;
+	if (events == NULL) {
+		ReleaseTemplateTable(table);
+		return NULL;
+	}
+	
+	directoryURL = CFURLCreateWithFileSystemPath(NULL, directory, kCFURLPOSIXPathStyle, true);
+	directoryURLs = CFArrayCreate(NULL, (const void**)&directoryURL, 1, &kCFTypeArrayCallBacks);
+	CFRelease(directoryURL);
+	
+	for (i = 0; i < eventsCount; i++) {
+		if (i % (burst + 1) == 0) {
+			events[i].type = kNewDocumentPlugInExamineEvent;
+			events[i].delay = (i > 0) ? pause : 0;
+		}
+		else {
+			events[i].type = kNewDocumentPlugInSelectEvent;
+			events[i].delay = delay;
+			events[i].templateName = CopyTemplateTableName(table, (i / (burst + 1)) % table->count);
+		}
+		events[i].directoryURLs = CFRetain(directoryURLs);
+	}
+	
+	CFRelease(directoryURLs);
+	ReleaseTemplateTable(table);
+	
+	*outCount = eventsCount;
+	return events;
+}
+
+/* ReplayNextTraceEvent
+ * Debug function called by the replay timer : replays the next event, and
+ * schedules the following one. Once all events are replayed, waits for the
+ * creations to complete, then logs the report.
+ */
+static void ReplayNextTraceEvent(CFRunLoopTimerRef timer, void *info)
+{
+	TraceReplay *replay = (TraceReplay*)info;
+	CFAbsoluteTime now;
+	
+	if (replay->next < replay->count) {
+		ReplayTraceEvent(&replay->events[replay->next++]);
+		if (replay->next < replay->count) {
+			CFRunLoopTimerSetNextFireDate(timer, CFAbsoluteTimeGetCurrent() + replay->events[replay->next].delay / 1000.0);
+			return;
+		}
+	}
+	
+	now = CFAbsoluteTimeGetCurrent();
+	if (!IsCreationExecutorIdle()) {
+		CFRunLoopTimerSetNextFireDate(timer, now + 0.1);
+		return;
+	}
+	
+	ReportTraceReplay(replay);
+	
+	CFRunLoopTimerInvalidate(timer);
+	CFRelease(timer);
+	FreeTraceEvents(replay->events, replay->count);
+	free(replay);
+	gTraceReplay = NULL;
+}
+
+/* ReplayTraceEvent
+ * Debug function that calls the plugin as the Contextual Menu Manager would
+ * for an event : examine the context, or handle the selection of the
+ * template, then clean up after the menu.
+ */
+static void ReplayTraceEvent(const TraceEvent *event)
+{
+	AEDescList context, commands;
+	TemplateTable *table;
+	CFIndex index = kCFNotFound;
+	
+	if (CreateContextFromURLs(event->directoryURLs, &context) != noErr)
+		return;
+	
+	if (event->type == kNewDocumentPlugInExamineEvent) {
+		if (AECreateList(NULL, 0, false, &commands) == noErr) {
+			NewDocumentPlugInExamineContext(NULL, &context, &commands);
+			AEDisposeDesc(&commands);
+		}
+	}
+	else {
+		// Command IDs change with the templates : find the template by name
+		table = CopyTemplateTable();
+		if (table != NULL) {
+			index = FindTemplateTableIndex(table, event->templateName);
+			ReleaseTemplateTable(table);
+		}
+		if (index != kCFNotFound)
+			NewDocumentPlugInHandleSelection(NULL, &context, index);
+		else
+			printf("NewDocumentPlugIn: replay: unknown template.\n");
+	}
+	
+	NewDocumentPlugInPostMenuCleanup(NULL);
+	AEDisposeDesc(&context);
+}
+
+/* CreateContextFromURLs
+ * Debug function that creates a menu context listing directories, as file
+ * URLs.
+ */
+static OSErr CreateContextFromURLs(CFArrayRef directoryURLs, AEDescList *outContext)
+{
+	OSErr err;
+	AEDesc item;
+	CFDataRef data;
+	CFIndex i, count;
+	
+	err = AECreateList(NULL, 0, false, outContext);
+	if (err != noErr)
+		return err;
+	
+	count = CFArrayGetCount(directoryURLs);
+	for (i = 0; i < count && err == noErr; i++) {
+		data = CFURLCreateData(NULL, CFArrayGetValueAtIndex(directoryURLs, i), kCFStringEncodingUTF8, true);
+		if (data == NULL) {
+			err = memFullErr;
+			break;
+		}
+		err = AECreateDesc(typeFileURL, CFDataGetBytePtr(data), CFDataGetLength(data), &item);
+		if (err == noErr) {
+			err = AEPutDesc(outContext, 0, &item);
+			AEDisposeDesc(&item);
+		}
+		CFRelease(data);
+	}
+	
+	if (err != noErr)
+		AEDisposeDesc(outContext);
+	
+	return err;
+}
+
+/* IsCreationExecutorIdle
+ * Debug function that tells whether every creation request and every
+ * post-creation hook has completed. Must be called from the host thread.
+ */
+static Boolean IsCreationExecutorIdle()
+{
+	Boolean idle = (gHookItemsCount == 0);
+	int lane;
+	
+	pthread_mutex_lock(&gCreationMutex);
+	for (lane = 0; lane < kNewDocumentPlugInLanes; lane++)
+		idle = idle && gPendingCreations[lane].count == 0 && gRunningCreations[lane].count == 0;
+	idle = idle && gCompletedCreations.count == 0;
+	pthread_mutex_unlock(&gCreationMutex);
+	
+	return idle;
+}
+
+/* ReportTraceReplay
+ * Debug function that logs the throughput and latencies of each stage during
+ * a replay.
+ */
+static void ReportTraceReplay(const TraceReplay *replay)
+{
+	const PlugInMetrics *start = &replay->startMetrics;
+	double elapsed = CFAbsoluteTimeGetCurrent() - replay->startDate;
+	
+	printf("NewDocumentPlugIn: replayed %ld events in %.3f s : %lld documents created, %lld failures.\n",
+		   (long)replay->count, elapsed,
+		   (long long)(gMetrics.creations - start->creations),
+		   (long long)(gMetrics.creationFailures - start->creationFailures));
+	printf("NewDocumentPlugIn:   %-10s %8s %10s %8s %8s %8s (microseconds)\n", "stage", "count", "per second", "p50", "p99", "p999");
+	ReportTraceStage("context", &gMetrics.contextParseTime, &start->contextParseTime, elapsed);
+	ReportTraceStage("menu", &gMetrics.menuBuildTime, &start->menuBuildTime, elapsed);
+	ReportTraceStage("naming", &gMetrics.namingTime, &start->namingTime, elapsed);
+	ReportTraceStage("creation", &gMetrics.creationTime[kNewDocumentPlugInInteractiveLane],
+					 &start->creationTime[kNewDocumentPlugInInteractiveLane], elapsed);
+	ReportTraceStage("hooks", &gMetrics.hookTime, &start->hookTime, elapsed);
+	printf("NewDocumentPlugIn:   deepest name suffix : %lld\n",
+		   (long long)GetHistogramQuantile(&gMetrics.collisionDepth, &start->collisionDepth, 1.0));
+}
+
+/* ReportTraceStage
+ * Debug function that logs the count, throughput and latencies of a stage,
+ * from its histogram and the baseline taken when the replay started.
+ */
+static void ReportTraceStage(const char *stage, const MetricsHistogram *histogram, const MetricsHistogram *baseline, double elapsed)
+{
+	SInt64 count = histogram->count - baseline->count;
+	
+	printf("NewDocumentPlugIn:   %-10s %8lld %10.1f %8lld %8lld %8lld\n",
+		   stage, (long long)count, (elapsed > 0) ? count / elapsed : 0.0,
+		   (long long)GetHistogramQuantile(histogram, baseline, 0.5),
+		   (long long)GetHistogramQuantile(histogram, baseline, 0.99),
+		   (long long)GetHistogramQuantile(histogram, baseline, 0.999));
+}
+
+/* FreeTraceEvents
+ * Debug function that frees an array of trace events.
+ */
+static void FreeTraceEvents(TraceEvent *events, CFIndex count)
+{
+	CFIndex i;
+	
+	for (i = 0; i < count; i++) {
+		if (events[i].templateName != NULL)
+			CFRelease(events[i].templateName);
+		CFRelease(events[i].directoryURLs);
+	}
+	free(events);
+}
 #endif
@@ -19,6 +19,212 @@
 // If templates are not in a subdirectory, replace the name by NULL.
 #define kNewDocumentPlugInTemplatesSubdir "Templates"
 
+// Maximum number of items shown in each templates menu or category submenu.
+// Subdirectories of the templates directory (without extension) are shown
+// as category submenus.
+#define kNewDocumentPlugInMaxMenuItems 200
+
+// Name of the templates manifest, stored in the user caches folder. The manifest
+// describes every template, and is only rebuilt when one of the templates
+// directories or files changes.
+#define kNewDocumentPlugInManifestFilename "TemplatesManifest.plist"
+
+// Version of the manifest format. Manifests of other versions are rebuilt.
+#define kNewDocumentPlugInManifestVersion 5
+
+// Delay (in seconds) during which the manifest in memory is trusted without
+// checking the templates directories again. Menus shown within this delay
+// are built from memory only. Once it has passed, a menu stats the
+// directories, and asks the warm-up thread to compare the template files.
+#define kNewDocumentPlugInManifestCheckInterval 2.0
+
+// Name of the blob store, in the plugin caches directory. The files of package
+// templates are stored there once, named after their contents, and new
+// documents are cloned from them on volumes that support it. Blobs no
+// template uses anymore are removed by the warm-up thread, once they are
+// older than kNewDocumentPlugInBlobsMinAge seconds.
+#define kNewDocumentPlugInBlobsDirectory "Blobs"
+#define kNewDocumentPlugInBlobsMinAge (7 * 24 * 3600)
+
+// Synchronization of the templates. When the "TemplatesSource" preference is
+// set, a catalog of the user, named kNewDocumentPlugInSyncCatalogName in the
+// plugin caches directory, is kept a mirror of that directory (e.g. the master
+// library on a shared volume) by a background thread, every
+// kNewDocumentPlugInSyncInterval seconds, and replaces the templates of the
+// plugin resources once it exists; the plugin bundle is never modified. Only
+// the files changed since the last synchronization are transferred : a new
+// catalog is built aside, named kNewDocumentPlugInSyncStagingName, then
+// exchanged with the current one. The state of the last synchronization and
+// the lock held while synchronizing are next to the catalog.
+#define kNewDocumentPlugInSyncInterval (15 * 60)
+#define kNewDocumentPlugInSyncCatalogName "Templates"
+#define kNewDocumentPlugInSyncStagingName ".Templates.sync"
+#define kNewDocumentPlugInSyncStateFilename "Sync.plist"
+#define kNewDocumentPlugInSyncLockFilename "Sync.lock"
+
+// Usage statistics of the templates, shared by every host process of the
+// user: name of the file, in the plugin caches directory, and number of
+// templates it can track. Templates are listed by decreasing usage within
+// their category, the usage of a template losing half its weight after
+// kNewDocumentPlugInUsageHalfLife (in seconds) without use. Up to
+// kNewDocumentPlugInFrequentItems templates used at least
+// kNewDocumentPlugInFrequentMinUses times are also shown at the top of
+// the menu.
+#define kNewDocumentPlugInUsageFilename "Usage.stats"
+#define kNewDocumentPlugInUsageSlots 4096
+#define kNewDocumentPlugInUsageHalfLife (30 * 24 * 3600.0)
+#define kNewDocumentPlugInFrequentItems 5
+#define kNewDocumentPlugInFrequentMinUses 3
+
+// Templates smaller than this size (in bytes) are kept in memory after their first
+// use, and instantiated with a single write instead of a Finder copy.
+// Set it to 0 to disable the templates content cache.
+#define kNewDocumentPlugInTemplateCacheMaxItemSize (64 * 1024)
+
+// Total amount of memory (in bytes) the templates content cache may use.
+// Least recently used templates are evicted first.
+#define kNewDocumentPlugInTemplateCacheBudget (512 * 1024)
+
+// Memory (in bytes) all the plugin caches may use together: templates table,
+// used names indexes and templates content cache. When the
+// budget is exceeded, the caches are trimmed, the easiest to rebuild first.
+// The NewDocumentPlugInMenuCycles tool checks that menus keep within it.
+#define kNewDocumentPlugInMemoryBudget (1024 * 1024)
+
+// Delay (in seconds) without use after which cached data is released. Caches
+// are trimmed after each menu, and periodically while the host is idle.
+#define kNewDocumentPlugInIdleDelay 120.0
+
+// Plugin caches, used to index the memory accounting.
+#define kNewDocumentPlugInTableCache 0
+#define kNewDocumentPlugInOccupancyCache 1
+#define kNewDocumentPlugInContentCache 2
+#define kNewDocumentPlugInCaches 3
+
+// Maximum number of document creations waiting for a creation thread, in
+// each lane. Further requests are rejected until the queue drains.
+#define kNewDocumentPlugInMaxPendingCreations 1024
+
+// Number of creation threads, i.e. the maximum number of documents created
+// concurrently when several directories are selected.
+#define kNewDocumentPlugInCreationThreads 4
+
+// Creation lanes. Interactive creations (a document in a single directory)
+// always run before bulk creations (a document in each of several selected
+// directories), which run at a reduced I/O priority. Spool jobs are performed
+// by the spool thread, at the same reduced priority.
+#define kNewDocumentPlugInInteractiveLane 0
+#define kNewDocumentPlugInBulkLane 1
+#define kNewDocumentPlugInLanes 2
+
+// Maximum number of bulk creations performed concurrently. Keep it below
+// kNewDocumentPlugInCreationThreads, so that interactive creations always
+// find a free creation thread.
+#define kNewDocumentPlugInMaxBulkCreations 2
+
+// Delay (in seconds) during which created documents are gathered to run the
+// post-creation hooks once for all of them, and maximum number of documents
+// given to a single run of the hooks.
+#define kNewDocumentPlugInHookCoalesceDelay 0.1
+#define kNewDocumentPlugInHookBatchSize 64
+
+// Highest number appended to a document name to make it unique.
+#define kNewDocumentPlugInMaxDocumentSuffix 999
+
+// Number of (directory, document name) pairs whose used names are remembered
+// between creations.
+#define kNewDocumentPlugInMaxOccupancyIndexes 32
+
+// Error returned when a creation request is rejected because the queue is full.
+#define kNewDocumentPlugInQueueFullErr (-1)
+
+// Status of a creation driven through the creation API that isn't done yet
+// (see NewDocumentPlugInPollCreation).
+#define kNewDocumentPlugInCreationInProgressErr (-2)
+
+// Delay (in seconds) after which a document creation that hasn't completed
+// yet is abandoned. Like cancellation, it is only checked before the open,
+// name and copy steps : a copy in progress cannot be interrupted, and a copied
+// document is always stamped.
+#define kNewDocumentPlugInCreationTimeout 30.0
+
+// Request ID that designates every creation request, to cancel them all.
+#define kNewDocumentPlugInAllCreationRequests 0
+
+// Steps of a creation request. A creation is resumed one step at a time, so
+// that a creation thread can set a bulk creation aside between two steps
+// when interactive creations are waiting.
+#define kNewDocumentPlugInOpenStep 0
+#define kNewDocumentPlugInNameStep 1
+#define kNewDocumentPlugInCopyStep 2
+#define kNewDocumentPlugInStampStep 3
+#define kNewDocumentPlugInDoneStep 4
+
+// Spool service. When the "SpoolDirectory" preference is set, a thread watches
+// that directory for job files (property lists named *.job) dropped by
+// provisioning systems, and creates the documents they describe: the
+// "Template" name, the absolute "Directory" path, and either the "Names" of
+// the documents, or a "Count" of documents named like from the menu (at most
+// kNewDocumentPlugInMaxDocumentSuffix of them per name). Up to
+// kNewDocumentPlugInSpoolBatchSize jobs are read at each scan of the
+// directory, which is scanned when it changes, and at least every
+// kNewDocumentPlugInSpoolScanInterval seconds. A job is renamed to *.claimed,
+// and locked while it is performed, then replaced by its result, named
+// *.result; an unlocked claimed job is performed again. A job whose result
+// cannot be written is renamed to *.failed instead. The directory must be
+// owned, and only writable, by the user, and so must be the jobs.
+#define kNewDocumentPlugInSpoolJobExtension ".job"
+#define kNewDocumentPlugInSpoolClaimedExtension ".claimed"
+#define kNewDocumentPlugInSpoolResultExtension ".result"
+#define kNewDocumentPlugInSpoolFailedExtension ".failed"
+#define kNewDocumentPlugInSpoolBatchSize 64
+#define kNewDocumentPlugInSpoolScanInterval 30
+#define kNewDocumentPlugInSpoolMaxJobSize (64 * 1024 * 1024)
+#define kNewDocumentPlugInSpoolMaxJobDocuments 1000000
+
+// Names of the metrics file and socket, stored in the user caches folder. Both
+// expose the plugin metrics in the Prometheus text format: the file is
+// rewritten periodically, and the socket answers each connection with the
+// current values (e.g. curl --unix-socket <path> http://localhost/metrics).
+// They are only exported when the "ExportMetrics" preference is true.
+#define kNewDocumentPlugInMetricsFilename "Metrics.prom"
+#define kNewDocumentPlugInMetricsSocketName "Metrics.sock"
+
+// Delay (in seconds) between two writes of the metrics file.
+#define kNewDocumentPlugInMetricsFlushInterval 60
+
+// Name of the trace file, in the plugin caches directory. Tracing is opt-in :
+// only when the "RecordTrace" preference is true, every contextual menu and
+// selection is appended to it, so that the workload can be replayed by debug
+// builds (see StartTraceReplay). Once the trace reaches
+// kNewDocumentPlugInTraceMaxSize bytes, it replaces the previous trace, named
+// after it with a ".1" suffix, and a new trace starts.
+#define kNewDocumentPlugInTraceFilename "Trace.log"
+#define kNewDocumentPlugInTraceMaxSize (4 * 1024 * 1024)
+
+// Initialization phases of the plugin. Each phase is performed lazily, on
+// first use, and timed separately: resolving the plugin bundle, loading or
+// building the templates manifest, building the templates table, mapping the
+// usage statistics, and opening the scripting component.
+#define kNewDocumentPlugInBundlePhase 0
+#define kNewDocumentPlugInManifestPhase 1
+#define kNewDocumentPlugInTablePhase 2
+#define kNewDocumentPlugInUsagePhase 3
+#define kNewDocumentPlugInScriptingPhase 4
+#define kNewDocumentPlugInPhases 5
+
+// Time (in seconds) the plugin may spend on the host thread before its first
+// menu is shown: loading the plugin and building the first menu, with the
+// initialization phases it needs. A message is logged when it is exceeded,
+// and the NewDocumentPlugInColdStart tool fails.
+// Unless the "WarmUp" preference is false, the phases that don't need the host
+// thread are performed by a background thread as soon as the plugin is loaded.
+#define kNewDocumentPlugInColdStartBudget 0.1
+
+// Maximum number of background threads: warm-up, spool service, templates
+// synchronization and metrics exporter.
+#define kNewDocumentPlugInBackgroundThreads 4
+
 #define kNewDocumentPlugInFactoryID	( CFUUIDGetConstantUUIDWithBytes( NULL,		\
 0x67, 0x06, 0x3B, 0xEC, 0xF0, 0x42, 0x4C, 0x5F, 	\
 0xA3, 0xD3, 0x35, 0x2A, 0x8D, 0x28, 0x17, 0xEF ) )
@@ -30,6 +236,27 @@ goto location;
 #define scm_require_noerr(value,location)	\
 scm_require((value)==noErr,location)
 
+// File system calls that the file system simulator can slow down or make fail,
+// and that are counted by the metrics.
+#define kNewDocumentPlugInStatCall 0
+#define kNewDocumentPlugInReadDirCall 1
+#define kNewDocumentPlugInOpenCall 2
+#define kNewDocumentPlugInWriteCall 3
+#define kNewDocumentPlugInCopyCall 4
+#define kNewDocumentPlugInCatalogInfoCall 5
+#define kNewDocumentPlugInNotifyCall 6
+#define kNewDocumentPlugInCloneCall 7
+#define kNewDocumentPlugInFileSystemCalls 8
+
+// Counts a file system call, and evaluates to the errno value it must fail
+// with, or to 0. In debug builds, the file system simulator also waits for the
+// simulated latency of the call; in release builds, this is always 0.
+#ifdef DEBUG
+#define SimulateFileSystemCallIfNeeded(call)	SimulateFileSystemCall(call)
+#else
+#define SimulateFileSystemCallIfNeeded(call)	(AddToMetric(&gMetrics.fileSystemCalls[call], 1), 0)
+#endif
+
 
 // -----------------------------------------------------------------------------
 //	typedefs
@@ -43,6 +270,325 @@ typedef struct NewDocumentPlugInType
 	UInt32							refCount;
 } NewDocumentPlugInType;
 
+// An entry of the templates content cache. Entries are kept in a doubly-linked
+// list, most recently used first, and are validated against the inode and
+// modification date of the template file.
+typedef struct TemplateCacheEntry
+{
+	CFStringRef					path;
+	ino_t						inode;
+	SInt64						mtime;		// nanoseconds
+	CFAbsoluteTime				lastUse;
+	CFDataRef					contents;
+	struct TemplateCacheEntry	*prev;
+	struct TemplateCacheEntry	*next;
+} TemplateCacheEntry;
+
+// The numbers already used by documents named "<baseName> N<extensions>" in a
+// directory, as a bitmap (bit 1 stands for the name without number), and the
+// numbers reserved by creations in progress, which stay used when the index
+// is rebuilt. Indexes are kept in a list, most recently used first, and
+// rebuilt when the modification date of the directory changes. Directory entries are matched
+// against the folded (decomposed and case-folded) base name and extensions.
+typedef struct OccupancyIndex
+{
+	char					*directory;
+	char					*baseName;
+	char					*extensions;
+	char					*foldedBaseName;
+	char					*foldedExtensions;
+	ino_t					inode;
+	SInt64					mtime;		// nanoseconds
+	CFAbsoluteTime			lastUse;
+	Boolean					valid;
+	UInt32					used[kNewDocumentPlugInMaxDocumentSuffix / 32 + 1];
+	UInt32					reserved[kNewDocumentPlugInMaxDocumentSuffix / 32 + 1];
+	struct OccupancyIndex	*next;
+} OccupancyIndex;
+
+// A group of creation requests submitted together, one per selected directory.
+// Only accessed from the host thread.
+typedef struct CreationBatch
+{
+	UInt32	total;
+	UInt32	remaining;
+	UInt32	failed;
+} CreationBatch;
+
+// A creation driven by another event loop through the creation API, and the
+// executor hook that schedules its next step : it is called each time the
+// creation has a step to perform, and the event loop then calls
+// NewDocumentPlugInStepCreation, from any thread.
+typedef struct CreationRequest *NewDocumentCreationRef;
+typedef void (*NewDocumentCreationExecutor)(NewDocumentCreationRef creation, void *info);
+
+// A document creation request. Requests are submitted by the host thread,
+// performed step by step by creation threads (name resolution, copy and
+// metadata), then handed back to the host thread to run the Finder script.
+// Requests made through the creation API are performed by their executor
+// instead, and never queued. The step fields hold the state carried from one
+// step to the next.
+typedef struct CreationRequest
+{
+	UInt32					requestID;
+	SInt32					commandID;
+	int						lane;
+	CFURLRef				destURL;
+	CreationBatch			*batch;
+	CFAbsoluteTime			deadline;
+	Boolean					cancelled;
+	OSStatus				status;
+	CFStringRef				itemName;
+	int						step;
+	int						attempts;
+	SInt64					runTime;		// microseconds spent running the steps
+	struct TemplateTable	*table;
+	CFURLRef				templateURL;
+	char					*directory;
+	int						directoryFd;
+	char					documentName[NAME_MAX + 1];
+	int						suffix;			// number reserved for documentName, or 0
+	SInt64					directoryDate;	// of the directory before the copy (nanoseconds)
+	FSRef					itemRef;
+	Boolean					fixedName;		// documentName is given, not resolved
+	Boolean					keepOpen;		// the step resources are kept when done
+	NewDocumentCreationExecutor	executor;	// creation API only
+	void					*executorInfo;
+	struct CreationRequest	*next;
+} CreationRequest;
+
+// A created document waiting for the post-creation hooks. Items are kept in a
+// FIFO list, in the order their creations completed. Only accessed from the
+// host thread.
+typedef struct HookItem
+{
+	CFURLRef		directoryURL;
+	CFStringRef		itemName;
+	Boolean			edit;
+	struct HookItem	*next;
+} HookItem;
+
+// A synchronization of the templates in progress: the source directory, the
+// current and new catalogs, the files of the last and of this
+// synchronization (see CopySyncState), the files of the last one by hash, and
+// what has been done so far.
+typedef struct TemplatesSync
+{
+	const char				*sourcePath;
+	const char				*catalogPath;
+	int						catalogFd;
+	int						stagingFd;
+	CFDictionaryRef			previousFiles;
+	CFMutableDictionaryRef	files;
+	CFMutableDictionaryRef	filesByHash;
+	CFIndex					changes;
+	CFIndex					reusedFiles;
+	CFIndex					copiedFiles;
+	SInt64					copiedBytes;
+	Boolean					failed;
+} TemplatesSync;
+
+// A job of the spool directory. count is the number of names, if the
+// documents are named by the job.
+typedef struct SpoolJob
+{
+	CFStringRef	templateName;
+	CFURLRef	directoryURL;
+	CFArrayRef	names;
+	CFIndex		count;
+} SpoolJob;
+
+// The result of a spool job: the error that prevented the job from running,
+// or the error of its first failed document.
+typedef struct SpoolJobResult
+{
+	OSStatus	status;
+	CFIndex		created;
+	CFIndex		failed;
+	SInt64		duration;	// microseconds
+} SpoolJobResult;
+
+// A FIFO list of creation requests.
+typedef struct CreationQueue
+{
+	CreationRequest	*head;
+	CreationRequest	*tail;
+	UInt32			count;
+} CreationQueue;
+
+// Flags of a template in the templates table.
+#define kNewDocumentPlugInTemplateIsPackage 0x01
+
+// The templates descriptor table, built from the templates manifest. Each
+// template attribute is stored in its own array, indexed by command ID, and
+// every string lives in a single characters pool, so that building menus and
+// names walks contiguous memory instead of parsing paths again. The names of
+// new documents are also kept in a pool of NULL-terminated file system
+// representations, so that naming a document doesn't allocate anything.
+// Tables are reference counted, as creation threads may use a table while
+// a newer one replaces it.
+typedef struct TemplateTable
+{
+	UInt32			refCount;
+	SInt64			memorySize;
+	CFDictionaryRef	manifest;
+	CFIndex			count;
+	CFStringRef		menuFormat;
+	CFStringRef		documentFormat;
+	UniChar			*strings;
+	CFIndex			*nameOffsets;			// "Category/Stem.ext" in strings
+	UInt16			*nameLengths;
+	UInt16			*categoryLengths;		// length of the "Category" prefix
+	UInt16			*extensionsLengths;		// length of the ".ext" suffix
+	UInt16			*lastExtensionLengths;
+	CFIndex			*labelOffsets;			// localized stem in strings
+	UInt16			*labelLengths;
+	char			*fileNames;
+	CFIndex			*documentNameOffsets;	// new documents name in fileNames
+	CFIndex			*extensionsNameOffsets;	// ".ext" in fileNames
+	SInt64			*sizes;
+	UInt8			*flags;
+	CFArrayRef		*trees;					// contents of packages, in manifest
+	SInt64			*usageKeys;				// key of the template usage statistics
+} TemplateTable;
+
+// Copy backends, used to index the bytes copied metric: templates written from
+// the content cache, copied by the file manager, or cloned from the blob store.
+#define kNewDocumentPlugInCacheBackend 0
+#define kNewDocumentPlugInFileManagerBackend 1
+#define kNewDocumentPlugInBlobStoreBackend 2
+#define kNewDocumentPlugInCopyBackends 3
+
+// A histogram of non-negative values. Each power of two is split into four
+// buckets, so that values are recorded with a 25% precision whatever their
+// magnitude; values below 4 have a bucket of their own. Only updated with
+// atomic operations.
+#define kNewDocumentPlugInHistogramBuckets 256
+typedef struct MetricsHistogram
+{
+	volatile SInt64	count;
+	volatile SInt64	sum;
+	volatile SInt64	buckets[kNewDocumentPlugInHistogramBuckets];
+} MetricsHistogram;
+
+// The plugin metrics. Counters and histograms are updated with atomic
+// operations, so that recording never takes a lock.
+typedef struct PlugInMetrics
+{
+	volatile SInt64		menuBuilds;
+	volatile SInt64		templatesListed;
+	volatile SInt64		nameResolutions;
+	volatile SInt64		nameResolutionFailures;
+	volatile SInt64		directoryScans;
+	volatile SInt64		directoryEntriesScanned;
+	volatile SInt64		creations;
+	volatile SInt64		creationFailures;
+	volatile SInt64		creationsSetAside;
+	volatile SInt64		spoolJobs;
+	volatile SInt64		spoolDocuments;
+	volatile SInt64		spoolFailures;
+	volatile SInt64		spoolBusyTime;		// microseconds
+	volatile SInt64		syncs;
+	volatile SInt64		syncReusedFiles;
+	volatile SInt64		syncCopiedFiles;
+	volatile SInt64		syncCopiedBytes;
+	volatile SInt64		bytesCopied[kNewDocumentPlugInCopyBackends];
+	volatile SInt64		hookRuns;
+	volatile SInt64		hookItems;
+	volatile SInt64		hookFailures;
+	volatile SInt64		cacheBytes[kNewDocumentPlugInCaches];
+	volatile SInt64		fileSystemCalls[kNewDocumentPlugInFileSystemCalls];
+	volatile SInt64		coldStartTime;		// microseconds, 0 until the first menu
+	MetricsHistogram	contextParseTime;	// microseconds
+	MetricsHistogram	menuBuildTime;		// microseconds
+	MetricsHistogram	menuOrderTime;		// microseconds
+	MetricsHistogram	creationTime[kNewDocumentPlugInLanes];	// microseconds
+	MetricsHistogram	hookTime;			// microseconds
+	MetricsHistogram	syncTime;			// microseconds
+	MetricsHistogram	namingTime;			// microseconds
+	MetricsHistogram	collisionDepth;		// number appended to the document name
+	MetricsHistogram	phaseTime[kNewDocumentPlugInPhases];	// microseconds
+} PlugInMetrics;
+
+// The simulated behavior of a file system call: a latency and a jitter (in
+// milliseconds), and the rate at which the call fails with the given errno
+// value. See LoadSimulatedFileSystem.
+typedef struct SimulatedFileSystemCall
+{
+	double	latency;
+	double	jitter;
+	double	errorRate;
+	int		error;
+} SimulatedFileSystemCall;
+
+// The usage statistics file is mapped by every host process, and only
+// updated with atomic operations, so that it can be shared without locks and
+// read without parsing. A header is followed by an open addressing hash table
+// of slots, keyed by a hash of the template names. A slot is claimed by
+// swapping its key from 0, and is never released: templates that don't exist
+// anymore keep their slot.
+#define kNewDocumentPlugInUsageMagic 'NDUS'
+#define kNewDocumentPlugInUsageVersion 1
+#define kNewDocumentPlugInUsageMaxProbes 16
+
+typedef struct TemplateUsageSlot
+{
+	volatile SInt64	key;
+	volatile SInt64	uses;
+	volatile SInt64	lastUse;		// CFAbsoluteTime, in seconds
+} TemplateUsageSlot;
+
+typedef struct TemplateUsageFile
+{
+	volatile SInt32		magic;
+	volatile SInt32		version;
+	volatile SInt32		slotsCount;
+	UInt32				reserved;
+	TemplateUsageSlot	slots[kNewDocumentPlugInUsageSlots];
+} TemplateUsageFile;
+
+// A template and its usage score, to order menus.
+typedef struct TemplateRank
+{
+	double	score;
+	CFIndex	index;
+} TemplateRank;
+
+// An event of a trace : a contextual menu examined, or a template selected,
+// in one or more directories, delay milliseconds after the previous event.
+// Traces are text files, with a line per event :
+//   <delay>\t<examine|select>\t<template name, or nothing>\t<directory>[\t<directory>…]
+#define kNewDocumentPlugInExamineEvent 0
+#define kNewDocumentPlugInSelectEvent 1
+
+typedef struct TraceEvent
+{
+	int			type;
+	double		delay;			// milliseconds
+	CFStringRef	templateName;	// NULL for examine events
+	CFArrayRef	directoryURLs;
+} TraceEvent;
+
+// A trace being replayed, and the metrics when its replay started, so that
+// the report only accounts for the replay.
+typedef struct TraceReplay
+{
+	TraceEvent			*events;
+	CFIndex				count;
+	CFIndex				next;
+	CFAbsoluteTime		startDate;
+	CFRunLoopTimerRef	timer;
+	PlugInMetrics		startMetrics;
+} TraceReplay;
+
+// Usage counters of the templates content cache.
+typedef struct TemplateCacheStats
+{
+	UInt32	hits;
+	UInt32	misses;
+	UInt32	evictions;
+} TemplateCacheStats;
+
 
 // -----------------------------------------------------------------------------
 //	prototypes
@@ -57,6 +603,14 @@ static ULONG	NewDocumentPlugInRelease(void *thisInstance);
 static NewDocumentPlugInType* AllocNewDocumentPlugInType(CFUUIDRef inFactoryID);
 static void		DeallocNewDocumentPlugInType(NewDocumentPlugInType *thisInstance);
 void*			NewDocumentPlugInFactory(CFAllocatorRef allocator, CFUUIDRef typeID);
+static void		StartWarmUp();
+static void*	WarmUpThreadMain(void *unused);
+static Boolean	StartBackgroundThread(void* (*threadMain)(void*), void *argument);
+static void		StopBackgroundThreads();
+static Boolean	WaitForBackgroundThreadsStop(double delay);
+static void		InitSelfBundle();
+static void		RecordPhaseTime(int phase, CFAbsoluteTime startDate);
+static void		CheckColdStartBudget(CFAbsoluteTime menuStartDate);
 
 //  Context Menu Manager entry points 
 static OSStatus NewDocumentPlugInExamineContext(void* thisInstance, const AEDesc* inContext, AEDescList* outCommandPairs);
@@ -65,6 +619,7 @@ static void NewDocumentPlugInPostMenuCleanup(void *thisInstance);
 
 //	Menu-handling functions
 static OSErr		AddNewDocumentMenu(AEDescList* ioCommandList);
+static CFIndex		AddTemplatesToSubmenu(const TemplateTable *table, const CFIndex *order, CFIndex first, const UniChar *category, CFIndex categoryLength, AEDescList* submenu);
 static OSStatus	AddMenuItemToAEDescList(CFStringRef		inCommandCFString,
 									   TextEncoding		inEncoding,
 									   DescType			inDescType,
@@ -81,21 +636,207 @@ static OSErr StickSubmenuInParent(AEDescList* submenuCommands,
 //	File System and templates manipulations
 static CFBundleRef	GetPlugInBundleRef(CFStringRef bundleIdentifier);
 static CFBundleRef GetSelfBundle();
-static bool			FSIsDir(const FSRef *ref);
-static CFURLRef		CopyFileURLFromAEDescList(const AEDesc* inContext);
-static void IncrementDocumentName(CFStringRef documentPath, CFMutableStringRef documentName);
-void TemplateCopyCallback(FSFileOperationRef fileOp,
-						  const FSRef *currentItem,
-						  FSFileOperationStage stage,
-						  OSStatus error,
-						  CFDictionaryRef statusDictionary,
-						  void *info);
+static Boolean		IsDirectoryURL(CFURLRef url);
+static CFArrayRef	CopyFileURLsFromAEDescList(const AEDesc* inContext);
+static Boolean ResolveDocumentName(const char *directory, int directoryFd, const char *baseName, const char *extensions, char *outName, size_t outSize, int *outSuffix);
+static Boolean FormatDocumentName(const char *baseName, int suffix, const char *extensions, char *outName, size_t outSize);
+static OccupancyIndex* GetOccupancyIndex(const char *directory, int directoryFd, const char *baseName, const char *extensions);
+static void	RebuildOccupancyIndex(OccupancyIndex *index, int directoryFd);
+static int	ReserveDocumentSuffix(OccupancyIndex *index);
+static void	NoteDocumentCreated(const char *directory, int directoryFd, const char *baseName, const char *extensions, int suffix, SInt64 previousDate);
+static void	ReleaseDocumentName(const char *directory, const char *baseName, const char *extensions, int suffix, Boolean taken);
+static Boolean	HasReservedDocumentSuffixes(const OccupancyIndex *index);
+static void	FreeOccupancyIndex(OccupancyIndex *index);
+static SInt64 GetOccupancyIndexSize(const OccupancyIndex *index);
+static Boolean FoldFileName(const char *name, char *outFolded, size_t outSize);
+static Boolean FoldASCIIFileName(const char *name, size_t length, char *outFolded);
+static Boolean FoldUnicodeFileName(const char *name, char *outFolded, size_t outSize);
 static CFArrayRef	CopyTemplatesFilenames();
-static CFMutableStringRef CopyLocalizedTemplateName(CFStringRef templateFilename, bool localizeForMenu);
+static void			AppendTemplatesFilenames(CFStringRef templatesPath, CFStringRef category, CFMutableArrayRef templates, CFMutableDictionaryRef directories);
+static CFURLRef		CopyTemplateURL(CFStringRef templateName);
+static CFStringRef	CopyTemplateCategory(CFStringRef templateName);
+static CFMutableStringRef CopyLocalizedTemplateName(CFStringRef templatePath, bool localizeForMenu);
 static void RemoveLastExtension(CFMutableStringRef filename);
 
+// Templates manifest
+static CFDictionaryRef	CopyTemplatesManifest();
+static void				RefreshTemplatesManifest(Boolean checkFiles);
+static void				RequestTemplatesManifestRefresh();
+static CFDictionaryRef	CreateTemplatesManifest(CFStringRef templatesPath, CFDictionaryRef previous);
+static CFDictionaryRef	CreateTemplateDescription(CFStringRef templateName, CFStringRef templatesPath, CFDictionaryRef knownFiles);
+static Boolean			IsTemplatesManifestStale(CFDictionaryRef manifest, CFStringRef templatesPath);
+static Boolean			AreTemplateFilesModified(CFDictionaryRef manifest, CFStringRef templatesPath);
+static Boolean			IsTemplateModified(CFDictionaryRef description, const char *templatesPath);
+static Boolean			IsTemplateFileModified(CFDictionaryRef description, const char *path);
+static CFStringRef		CopyTemplatesDirectoryPath();
+static CFStringRef		CopySyncedTemplatesPath();
+static CFURLRef			CopyTemplatesManifestURL();
+static CFURLRef			CopyPlugInCachesURL();
+static CFDictionaryRef	CopyTemplatesManifestFromFile(CFURLRef manifestURL);
+static void				WriteTemplatesManifestToFile(CFDictionaryRef manifest, CFURLRef manifestURL);
+static Boolean			GetDirectoryModificationDate(CFStringRef templatesPath, CFStringRef category, SInt64 *outDate);
+static UInt64			HashFileContents(const char *path);
+static UInt64			HashTemplateFile(const char *path, const struct stat *info, CFDictionaryRef knownFiles, CFMutableDictionaryRef description);
+static void				AddKnownTemplateFiles(CFDictionaryRef manifest, CFMutableDictionaryRef knownFiles);
+static void				AppendTemplateTree(const char *packagePath, const char *relativePath, CFDictionaryRef knownFiles, CFMutableArrayRef tree, SInt64 *ioSize);
+
+// Templates descriptor table
+static TemplateTable*	CopyTemplateTable();
+static TemplateTable*	CreateTemplateTable(CFDictionaryRef manifest);
+static void				ReleaseTemplateTable(TemplateTable *table);
+static void				FreeTemplateTable(TemplateTable *table);
+static CFIndex			AppendToTemplateTableStrings(TemplateTable *table, CFStringRef string, CFIndex *ioLength, CFIndex *ioCapacity);
+static CFIndex			AppendToTemplateTableFileNames(TemplateTable *table, CFStringRef string, CFIndex *ioLength, CFIndex *ioCapacity);
+static CFStringRef		CopyTemplateTableName(const TemplateTable *table, CFIndex index);
+static CFIndex			FindTemplateTableIndex(const TemplateTable *table, CFStringRef templateName);
+static CFMutableStringRef CopyTemplateLabel(const TemplateTable *table, CFIndex index, bool localizeForMenu);
+
+// Templates usage
+static CFIndex*		CreateTemplatesMenuOrder(const TemplateTable *table, CFIndex *outFrequent, CFIndex *outFrequentCount);
+static void			RecordTemplateUse(const TemplateTable *table, CFIndex index);
+static double		GetTemplateUsageScore(const TemplateUsageFile *usage, SInt64 key, CFAbsoluteTime now);
+static TemplateUsageSlot* GetTemplateUsageSlot(const TemplateUsageFile *usage, SInt64 key, Boolean claim);
+static TemplateUsageFile* GetTemplateUsageFile();
+static void			MapTemplateUsageFile();
+static SInt64		GetTemplateUsageKey(const UniChar *name, CFIndex length);
+static int			CompareTemplateRanks(const void *first, const void *second);
+
+// Templates content cache
+static CFDataRef	CopyCachedTemplateContents(CFURLRef templateURL);
+static void			RemoveTemplateCacheEntry(TemplateCacheEntry *entry);
+static OSStatus		WriteTemplateContents(CFDataRef contents, const char *templatePath, const char *directory, int directoryFd, const char *documentName, FSRef *outItem);
+static OSStatus		GetErrnoStatus(int error);
+static SInt64		GetModificationTime(const struct stat *info);
+
+// Templates blob store
+static OSStatus	InstantiateTemplateTree(CFArrayRef tree, const char *templatePath, const char *directory, int directoryFd, const char *documentName, FSRef *outItem);
+static Boolean	GetTemplateTreeEntryPath(CFDictionaryRef entry, CFStringRef key, const char *root, char *outPath, size_t outSize);
+static Boolean	GetTemplateBlobPath(const char *sourcePath, UInt64 hash, SInt64 size, char *outPath, size_t outSize);
+static void		CollectTemplateBlobs(CFDictionaryRef manifest);
+static void		InitTemplateBlobStore();
+static int		CloneFile(const char *sourcePath, const char *destinationPath);
+static int		CloneFileAt(const char *sourcePath, int directoryFd, const char *destinationName);
+
+// Templates synchronization
+static void				StartTemplatesSync();
+static void*			SyncThreadMain(void *sourcePath);
+static void				SyncTemplates(const char *sourcePath);
+static void				SyncTemplatesDirectory(TemplatesSync *sync, const char *relativePath);
+static void				SyncTemplateFile(TemplatesSync *sync, const char *relativePath, const char *sourcePath, const struct stat *info);
+static void				AddSyncFileByHash(const void *key, const void *value, void *context);
+static Boolean			GetSyncRecordValue(CFTypeRef record, CFStringRef key, SInt64 *outValue);
+static Boolean			SwapTemplatesCatalog(const char *stagingPath, const char *catalogPath);
+static void				RemoveDirectoryTree(int parentFd, const char *name);
+static CFDictionaryRef	CopySyncState(const char *path);
+static void				WriteSyncState(const char *path, CFDictionaryRef state);
+
+// Memory budget
+static void		TrimPlugInCaches(CFAbsoluteTime coldDate);
+static void		TrimPlugInCachesTimer(CFRunLoopTimerRef timer, void *info);
+static void		StartCachesTrimming();
+static SInt64	GetCachesSize();
+static void		TrimTemplatesManifest(CFAbsoluteTime coldDate);
+static void		TrimOccupancyIndexes(CFAbsoluteTime coldDate);
+static void		TrimTemplateContentCache(CFAbsoluteTime coldDate, SInt64 maxSize);
+static void		TrimScriptingComponent(CFAbsoluteTime coldDate);
+
+// Creation executor
+static OSStatus	StartCreationExecutor();
+static void		StopCreationExecutor();
+static OSStatus	SubmitCreationRequest(SInt32 commandID, CFURLRef destURL, int lane, CreationBatch *batch, UInt32 *outRequestID);
+static void		CancelCreationRequest(UInt32 requestID);
+static void		CancelCreationBatch(const CreationBatch *batch);
+static void*	CreationThreadMain(void *unused);
+static CreationRequest* DequeueNextCreationRequest();
+static void		SetCreationThreadLane(int lane);
+static OSStatus	ResumeCreationRequest(CreationRequest *request);
+static const char* GetCreationBaseName(const CreationRequest *request);
+static const char* GetCreationExtensions(const CreationRequest *request);
+static OSStatus	OpenCreationRequest(CreationRequest *request);
+static OSStatus	CopyCreationTemplate(CreationRequest *request);
+static void		CloseCreationRequest(CreationRequest *request);
+static Boolean	ShouldSetCreationAside(CreationRequest *request);
+static OSStatus	CheckCreationRequest(CreationRequest *request);
+static void		DrainCompletedCreations(void *info);
+static void		EnqueueCreationRequest(CreationQueue *queue, CreationRequest *request);
+static void		PushCreationRequest(CreationQueue *queue, CreationRequest *request);
+static CreationRequest* DequeueCreationRequest(CreationQueue *queue);
+static void		RemoveCreationRequest(CreationQueue *queue, CreationRequest *request);
+static void		FreeCreationRequest(CreationRequest *request);
+
+// Creation API, exported for the tools embedding the creation pipeline
+OSStatus	NewDocumentPlugInCreateDocument(SInt32 commandID, CFURLRef destURL, NewDocumentCreationExecutor executor, void *info, NewDocumentCreationRef *outCreation);
+Boolean		NewDocumentPlugInStepCreation(NewDocumentCreationRef creation);
+OSStatus	NewDocumentPlugInPollCreation(NewDocumentCreationRef creation, CFStringRef *outItemName);
+void		NewDocumentPlugInCancelCreation(NewDocumentCreationRef creation);
+void		NewDocumentPlugInDisposeCreation(NewDocumentCreationRef creation);
+
+// Post-creation hooks
+static void	QueueHookItem(CFURLRef directoryURL, CFStringRef itemName, Boolean edit);
+static void	ScheduleHookItems();
+static void	SetHookTimer(CFAbsoluteTime fireDate);
+static void	FlushHookItems(CFRunLoopTimerRef timer, void *info);
+static void	RunPostCreationHooks(const HookItem *items, UInt32 count);
+static void	FreeHookItem(HookItem *item);
+
+// Spool service
+static void		StartSpoolService();
+static void*	SpoolThreadMain(void *spoolPath);
+static int		PerformSpoolJobs(int spoolFd);
+static int		ClaimSpoolJob(int spoolFd, const char *name, char *outJobName, char *outClaimedName, size_t outSize);
+static OSStatus	ReadSpoolJob(int fd, SpoolJob *job);
+static void		PerformSpoolJob(const SpoolJob *job, SpoolJobResult *result);
+static Boolean	WriteSpoolJobResult(int spoolFd, const char *jobName, const SpoolJobResult *result);
+static Boolean	GetSpoolJobFileName(const char *jobName, const char *extension, char *outName, size_t outSize);
+static Boolean	GetSpoolDocumentName(CFStringRef name, char *outName, size_t outSize);
+static int		CompareSpoolJobNames(const void *name1, const void *name2);
+static void		FreeSpoolJob(SpoolJob *job);
+
+// Metrics
+static void		AddToMetric(volatile SInt64 *metric, SInt64 amount);
+static SInt64	GetMetric(volatile SInt64 *metric);
+static void		RecordHistogramValue(MetricsHistogram *histogram, SInt64 value);
+static int		GetHistogramBucket(SInt64 value);
+static SInt64	GetHistogramBucketLimit(int bucket);
+static SInt64	GetHistogramQuantile(const MetricsHistogram *histogram, const MetricsHistogram *baseline, double quantile);
+static SInt64	GetElapsedMicroseconds(CFAbsoluteTime startDate);
+static void		StartMetricsExporter();
+static void*	MetricsThreadMain(void *unused);
+static int		OpenMetricsSocket(const char *path);
+static void		AnswerMetricsClient(int client, char *buffer, size_t size);
+static void		WriteMetricsFile(const char *path, char *buffer, size_t size);
+static size_t	FormatMetrics(char *buffer, size_t size);
+static void		FormatHistogram(MetricsHistogram *histogram, const char *name, const char *labels, const char *help, char *buffer, size_t size, size_t *ioLength);
+static void		AppendMetricsText(char *buffer, size_t size, size_t *ioLength, const char *format, ...);
+
+// Trace recorder
+static void		RecordTraceEvent(int type, CFStringRef templateName, CFArrayRef directoryURLs);
+static FILE*	GetTraceFile();
+static FILE*	OpenTraceFile(const char *path);
+static void		RotateTraceFile();
+
+// System compatibility
+static Boolean	GetPathAt(int directoryFd, const char *name, char *outPath, size_t outSize);
+static int		OpenAt(int directoryFd, const char *name, int flags, mode_t mode);
+static DIR*		OpenDirectoryAt(int directoryFd, const char *name, int flags);
+static int		StatAt(int directoryFd, const char *name, struct stat *outInfo, int flags);
+static int		MakeDirectoryAt(int directoryFd, const char *name, mode_t mode);
+static int		RenameAt(int fromFd, const char *fromName, int toFd, const char *toName);
+static int		UnlinkAt(int directoryFd, const char *name, int flags);
+static int		LinkAt(int fromFd, const char *fromName, int toFd, const char *toName);
+static int		SymlinkAt(const char *target, int directoryFd, const char *name);
+static int		SetFileTimesAt(int directoryFd, const char *name, const struct timespec times[2]);
+static int		CopyFileAt(const char *sourcePath, int directoryFd, const char *destinationName);
+static int		CopyFileMetadata(const char *sourcePath, const char *destinationPath);
+static void		SetThreadIOThrottled(Boolean throttled);
+static SInt64	AtomicAdd64(volatile SInt64 *value, SInt64 amount);
+static SInt64	AtomicLoad64(volatile SInt64 *value);
+static Boolean	AtomicCompareAndSwap64(volatile SInt64 *value, SInt64 *ioExpected, SInt64 newValue);
+static Boolean	AtomicCompareAndSwap32(volatile SInt32 *value, SInt32 *ioExpected, SInt32 newValue);
+
 // Scripting functions
-static OSAError EditFinderItem(CFStringRef itemName);
+static OSAError UpdateFinderItems(CFArrayRef itemPaths, CFStringRef editedItemName);
+static void AppendScriptString(CFMutableStringRef source, CFStringRef string);
 static ComponentInstance GetAppleScriptComponent();
 static OSAError LoadScriptFromResources(CFStringRef scriptName, OSAID* outScriptID);
 static OSErr	CreateAEDescFromString(CFStringRef string, CFStringEncoding encoding, AEDesc* outDesc);
@@ -108,7 +849,21 @@ static OSAError DisposeScript(OSAID scriptID);
 
 // Debug functions
 #ifdef DEBUG
-static CFStringRef CopyStringFromDesc(AEDesc* desc);
+static int	SimulateFileSystemCall(int call);
+static void	LoadSimulatedFileSystem();
+static CFStringRef CopyDescToString(AEDesc* desc);
+static void LogTemplateCacheStats();
+static void StartTraceReplay();
+static TraceEvent* CopyTraceFromFile(CFStringRef path, CFIndex *outCount);
+static ssize_t ReadTraceLine(FILE *file, char **ioLine, size_t *ioCapacity);
+static TraceEvent* CreateSyntheticTrace(CFDictionaryRef parameters, CFIndex *outCount);
+static void ReplayNextTraceEvent(CFRunLoopTimerRef timer, void *info);
+static void ReplayTraceEvent(const TraceEvent *event);
+static OSErr CreateContextFromURLs(CFArrayRef directoryURLs, AEDescList *outContext);
+static Boolean IsCreationExecutorIdle();
+static void ReportTraceReplay(const TraceReplay *replay);
+static void ReportTraceStage(const char *stage, const MetricsHistogram *histogram, const MetricsHistogram *baseline, double elapsed);
+static void FreeTraceEvents(TraceEvent *events, CFIndex count);
 #endif
 
 
@@ -0,0 +1,118 @@
+/*
+	File:		NewDocumentPlugInColdStart.c
+
+	Contains:	Cold start check of the NewDocumentPlugIn.
+
+	Author:		KemenAran, 2009
+	
+	Licence : MIT Licence (see NewDocumentPlugIn.c)
+	
+	Loads the built plugin bundle given as the first argument, creates an
+	instance and builds the first menu for the user's home directory, as the
+	Finder does on its first contextual menu. The tool exits with a non-zero
+	status if that took more than kNewDocumentPlugInColdStartBudget, or if no
+	menu could be built. Like the unit tests, it includes the plugin source.
+*/
+
+#include "../NewDocumentPlugIn.c"
+
+static OSErr	CreateColdStartContext(const char *directoryPath, AEDescList *outContext);
+
+
+// -----------------------------------------------------------------------------
+//	Cold start check
+// -----------------------------------------------------------------------------
+
+int main(int argc, const char *argv[])
+{
+	CFURLRef bundleURL;
+	CFBundleRef bundle;
+	NewDocumentPlugInType *instance;
+	AEDescList context, commands;
+	const char *home = getenv("HOME");
+	SInt64 coldStartTime;
+	
+	if (argc != 2 || home == NULL) {
+		printf("usage: NewDocumentPlugInColdStart <NewDocumentPlugIn.plugin>\n");
+		return 2;
+	}
+	
+	// Register the bundle, so that GetSelfBundle finds it by its identifier
+	bundleURL = CFURLCreateFromFileSystemRepresentation(NULL, (const UInt8*)argv[1], strlen(argv[1]), true);
+	bundle = (bundleURL != NULL) ? CFBundleCreate(NULL, bundleURL) : NULL;
+	if (bundleURL != NULL)
+		CFRelease(bundleURL);
+	if (bundle == NULL) {
+		printf("NewDocumentPlugInColdStart : cannot load the bundle %s.\n", argv[1]);
+		return 2;
+	}
+	
+	instance = (NewDocumentPlugInType*) NewDocumentPlugInFactory(NULL, kContextualMenuTypeID);
+	if (instance == NULL
+		|| CreateColdStartContext(home, &context) != noErr) {
+		printf("NewDocumentPlugInColdStart : cannot create the plugin instance.\n");
+		return 2;
+	}
+	
+	if (AECreateList(NULL, 0, false, &commands) == noErr) {
+		NewDocumentPlugInExamineContext(instance, &context, &commands);
+		AEDisposeDesc(&commands);
+	}
+	NewDocumentPlugInPostMenuCleanup(instance);
+	AEDisposeDesc(&context);
+	
+	// Also checks that the background threads stop with the last instance
+	NewDocumentPlugInRelease(instance);
+	CFRelease(bundle);
+	
+	coldStartTime = AtomicLoad64(&gMetrics.coldStartTime);
+	if (!gColdStartChecked) {
+		printf("NewDocumentPlugInColdStart : no menu was built.\n");
+		return 1;
+	}
+	if (coldStartTime > kNewDocumentPlugInColdStartBudget * 1000000) {
+		printf("NewDocumentPlugInColdStart : %lld ms, over the budget of %d ms.\n",
+			   (long long)coldStartTime / 1000, (int)(kNewDocumentPlugInColdStartBudget * 1000));
+		return 1;
+	}
+	
+	printf("NewDocumentPlugInColdStart : %lld ms, within the budget of %d ms.\n",
+		   (long long)coldStartTime / 1000, (int)(kNewDocumentPlugInColdStartBudget * 1000));
+	return 0;
+}
+
+/*
+ * CreateColdStartContext
+ *
+ * Create a menu context holding a directory, as a file URL, like the one the
+ * Finder passes to the plugin.
+ */
+static OSErr CreateColdStartContext(const char *directoryPath, AEDescList *outContext)
+{
+	OSErr err;
+	AEDesc item;
+	CFURLRef url;
+	CFDataRef data = NULL;
+	
+	url = CFURLCreateFromFileSystemRepresentation(NULL, (const UInt8*)directoryPath, strlen(directoryPath), true);
+	if (url != NULL) {
+		data = CFURLCreateData(NULL, url, kCFStringEncodingUTF8, true);
+		CFRelease(url);
+	}
+	if (data == NULL)
+		return memFullErr;
+	
+	err = AECreateList(NULL, 0, false, outContext);
+	if (err == noErr) {
+		err = AECreateDesc(typeFileURL, CFDataGetBytePtr(data), CFDataGetLength(data), &item);
+		if (err == noErr) {
+			err = AEPutDesc(outContext, 0, &item);
+			AEDisposeDesc(&item);
+		}
+		if (err != noErr)
+			AEDisposeDesc(outContext);
+	}
+	CFRelease(data);
+	
+	return err;
+}
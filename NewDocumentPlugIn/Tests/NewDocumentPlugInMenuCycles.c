@@ -0,0 +1,159 @@
+/*
+	File:		NewDocumentPlugInMenuCycles.c
+
+	Contains:	Menu cycles check of the NewDocumentPlugIn caches.
+
+	Author:		KemenAran, 2009
+	
+	Licence : MIT Licence (see NewDocumentPlugIn.c)
+
+	Loads the built plugin bundle given as the first argument, and builds
+	kMenuCyclesCount menus for the user's home directory, each followed by the
+	post-menu cleanup, as the Finder does. Every kMenuCyclesIdleInterval menus,
+	the caches are trimmed as if the host had been idle. The tool exits with a
+	non-zero status if the plugin caches (gMetrics.cacheBytes) ever grow over
+	their size after the first menu, or over kNewDocumentPlugInMemoryBudget.
+	Like the unit tests, it includes the plugin source.
+*/
+
+#include <sys/resource.h>
+
+#include "../NewDocumentPlugIn.c"
+
+// Number of menus built, and number of menus between two idle trims.
+#define kMenuCyclesCount 100000
+#define kMenuCyclesIdleInterval 1000
+
+static OSErr	CreateMenuCyclesContext(const char *directoryPath, AEDescList *outContext);
+static long		GetMaxResidentSize();
+
+
+// -----------------------------------------------------------------------------
+//	Menu cycles check
+// -----------------------------------------------------------------------------
+
+int main(int argc, const char *argv[])
+{
+	CFURLRef bundleURL;
+	CFBundleRef bundle;
+	NewDocumentPlugInType *instance;
+	AEDescList context, commands;
+	const char *home = getenv("HOME");
+	SInt64 size, firstSize = 0, largestSize = 0;
+	long firstResidentSize = 0;
+	int cycle, failures = 0;
+	
+	if (argc != 2 || home == NULL) {
+		printf("usage: NewDocumentPlugInMenuCycles <NewDocumentPlugIn.plugin>\n");
+		return 2;
+	}
+	
+	// Register the bundle, so that GetSelfBundle finds it by its identifier
+	bundleURL = CFURLCreateFromFileSystemRepresentation(NULL, (const UInt8*)argv[1], strlen(argv[1]), true);
+	bundle = (bundleURL != NULL) ? CFBundleCreate(NULL, bundleURL) : NULL;
+	if (bundleURL != NULL)
+		CFRelease(bundleURL);
+	if (bundle == NULL) {
+		printf("NewDocumentPlugInMenuCycles : cannot load the bundle %s.\n", argv[1]);
+		return 2;
+	}
+	
+	instance = (NewDocumentPlugInType*) NewDocumentPlugInFactory(NULL, kContextualMenuTypeID);
+	if (instance == NULL
+		|| CreateMenuCyclesContext(home, &context) != noErr) {
+		printf("NewDocumentPlugInMenuCycles : cannot create the plugin instance.\n");
+		return 2;
+	}
+	
+	for (cycle = 0; cycle < kMenuCyclesCount && failures < 10; cycle++) {
+		if (AECreateList(NULL, 0, false, &commands) == noErr) {
+			NewDocumentPlugInExamineContext(instance, &context, &commands);
+			AEDisposeDesc(&commands);
+		}
+		NewDocumentPlugInPostMenuCleanup(instance);
+		
+		// The caches as the menu left them : the same after every menu
+		size = GetCachesSize();
+		if (cycle == 0) {
+			firstSize = size;
+			firstResidentSize = GetMaxResidentSize();
+		}
+		else if (size > firstSize || size > kNewDocumentPlugInMemoryBudget) {
+			printf("NewDocumentPlugInMenuCycles : menu %d : caches of %lld bytes, %lld bytes after the first menu.\n",
+				   cycle, (long long)size, (long long)firstSize);
+			failures++;
+		}
+		if (size > largestSize)
+			largestSize = size;
+		
+		// Then release everything, as the trimming timer does once idle
+		if (cycle % kMenuCyclesIdleInterval == kMenuCyclesIdleInterval - 1)
+			TrimPlugInCaches(CFAbsoluteTimeGetCurrent());
+	}
+	
+	AEDisposeDesc(&context);
+	NewDocumentPlugInRelease(instance);
+	CFRelease(bundle);
+	
+	printf("NewDocumentPlugInMenuCycles : %d menus, caches of %lld bytes at most, maximum resident size from %ld to %ld KB.\n",
+		   cycle, (long long)largestSize, firstResidentSize, GetMaxResidentSize());
+	
+	if (firstSize == 0) {
+		printf("NewDocumentPlugInMenuCycles : no menu was built.\n");
+		return 1;
+	}
+	
+	return (failures > 0) ? 1 : 0;
+}
+
+/*
+ * CreateMenuCyclesContext
+ *
+ * Create a menu context holding a directory, as a file URL, like the one the
+ * Finder passes to the plugin.
+ */
+static OSErr CreateMenuCyclesContext(const char *directoryPath, AEDescList *outContext)
+{
+	OSErr err;
+	AEDesc item;
+	CFURLRef url;
+	CFDataRef data = NULL;
+	
+	url = CFURLCreateFromFileSystemRepresentation(NULL, (const UInt8*)directoryPath, strlen(directoryPath), true);
+	if (url != NULL) {
+		data = CFURLCreateData(NULL, url, kCFStringEncodingUTF8, true);
+		CFRelease(url);
+	}
+	if (data == NULL)
+		return memFullErr;
+	
+	err = AECreateList(NULL, 0, false, outContext);
+	if (err == noErr) {
+		err = AECreateDesc(typeFileURL, CFDataGetBytePtr(data), CFDataGetLength(data), &item);
+		if (err == noErr) {
+			err = AEPutDesc(outContext, 0, &item);
+			AEDisposeDesc(&item);
+		}
+		if (err != noErr)
+			AEDisposeDesc(outContext);
+	}
+	CFRelease(data);
+	
+	return err;
+}
+
+/*
+ * GetMaxResidentSize
+ *
+ * Return the largest resident size of the process so far, in kilobytes.
+ */
+static long GetMaxResidentSize()
+{
+	struct rusage usage;
+	
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+	
+	// Counted in bytes on Mac OS X
+	return usage.ru_maxrss / 1024;
+}
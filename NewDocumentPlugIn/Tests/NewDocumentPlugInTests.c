@@ -0,0 +1,2465 @@
+/*
+	File:		NewDocumentPlugInTests.c
+
+	Contains:	Unit tests of the NewDocumentPlugIn internals.
+
+	Author:		KemenAran, 2009
+	
+	Licence : MIT Licence (see NewDocumentPlugIn.c)
+	
+	The plugin functions are static : the tests include the plugin source, and
+	run as a command line tool. Each test prints its failures, and the tool
+	exits with a non-zero status if any test failed.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+// Number of heap allocations made so far. The plugin source is included after
+// the allocation functions are replaced by the counting ones below, and so
+// are the allocations of CoreFoundation while TestNamingAllocations counts
+// them. Only read while a single thread runs.
+static long gTestAllocations;
+
+/*
+ * CountTestMalloc, CountTestCalloc, CountTestRealloc, CountTestStrdup
+ *
+ * Count an allocation, then make it.
+ */
+static void* CountTestMalloc(size_t size)
+{
+	gTestAllocations++;
+	return malloc(size);
+}
+
+static void* CountTestCalloc(size_t count, size_t size)
+{
+	gTestAllocations++;
+	return calloc(count, size);
+}
+
+static void* CountTestRealloc(void *pointer, size_t size)
+{
+	gTestAllocations++;
+	return realloc(pointer, size);
+}
+
+static char* CountTestStrdup(const char *string)
+{
+	gTestAllocations++;
+	return strdup(string);
+}
+
+#define malloc(size) CountTestMalloc(size)
+#define calloc(count, size) CountTestCalloc(count, size)
+#define realloc(pointer, size) CountTestRealloc(pointer, size)
+#define strdup(string) CountTestStrdup(string)
+
+#include "../NewDocumentPlugIn.c"
+
+// Number of failed checks.
+static int gTestFailures;
+
+#define test_check(condition)												\
+do {																		\
+	if (!(condition)) {														\
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);	\
+		gTestFailures++;													\
+	}																		\
+} while (0)
+
+// Number of directory entries folded by the folding benchmark, and number of
+// distinct names among them.
+#define kTestFoldedEntries 1000000
+#define kTestFoldedNames 1000
+
+// Number of threads, and of documents created by each thread, in the
+// concurrent naming test.
+#define kTestNamingThreads 8
+#define kTestNamingDocuments 50
+
+// Number of names resolved by the naming allocations test.
+#define kTestNamingAllocationsNames 10000
+
+// Directory shared by the naming threads.
+typedef struct TestNamingDirectory
+{
+	char	path[PATH_MAX];
+	int		fd;
+	volatile SInt64	collisions;
+} TestNamingDirectory;
+
+// Number of templates of the templates table test, and number of them looked
+// up by name.
+#define kTestTableTemplates 10000
+#define kTestTableLookups 100
+
+// Number and size of the templates of the content cache test : the cache
+// budget holds all of them but one.
+#define kTestCacheTemplates 9
+#define kTestCacheTemplateSize (60 * 1024)
+
+// Size of the template, and number of documents written from it, in the
+// content cache benchmark.
+#define kTestCachedWriteSize (4 * 1024)
+#define kTestCachedWrites 1000
+
+// Number of threads, and of keys claimed by each thread, in the concurrent
+// usage test.
+#define kTestUsageThreads 8
+#define kTestUsageKeys 256
+
+// A thread of the concurrent usage test, and the slots it found for each key.
+typedef struct TestUsageThread
+{
+	pthread_t			thread;
+	TemplateUsageFile	*usage;
+	int					first;
+	TemplateUsageSlot	*slots[kTestUsageKeys];
+} TestUsageThread;
+
+// Number of templates, and of orders computed, in the menu order benchmark.
+#define kTestMenuOrderTemplates 10000
+#define kTestMenuOrderRuns 100
+
+// Template installed for the creation executor tests, and the longest wait
+// for their creations to complete, in seconds. Documents created from the
+// template are named "note[ N].txt".
+#define kTestTemplateName "Note.txt"
+#define kTestTemplateSize 64
+#define kTestCreationsTimeout 10.0
+
+// Simulated latency of the directory opens (in milliseconds), and number of
+// creations submitted while they stall, in the stalled executor test.
+#define kTestStallLatency 2000
+#define kTestStalledCreations 16
+
+// Number of directories of the multiple selection benchmark.
+#define kTestSelectedDirectories 1000
+
+// Simulated latency of the directory opens (in milliseconds), and number of
+// directories of the cancelled batch and of the other one, in the batches
+// test.
+#define kTestBatchLatency 500
+#define kTestCancelledBatchSize 6
+#define kTestBatchSize 3
+
+// Number of creations in flight in the creation API benchmark.
+#define kTestCreationsInFlight 10000
+
+// Creations scheduled by the executor of the creation API tests, in a ring
+// buffer : the creation scheduled in the nth place is at n % capacity.
+typedef struct TestCreationQueue
+{
+	NewDocumentCreationRef	*creations;
+	UInt32					capacity;
+	UInt32					count;
+} TestCreationQueue;
+
+static void		TestFoldASCIIFileName();
+static void		TestFoldFileName();
+static void		TestFoldedCollisions();
+static void		TestFoldDirectoryEntries();
+static void		TestFormatDocumentName();
+static void		TestResolveDocumentName();
+static void		TestConcurrentNaming();
+static void*	TestNamingThreadMain(void *directory);
+static Boolean	CreateTestDocument(TestNamingDirectory *directory, int failEvery, int *ioCount);
+static int		CountTestDocuments(const char *path, int *outHighest);
+static Boolean	CreateTestFile(int directoryFd, const char *name);
+static void		RemoveTestDirectory(const char *path);
+static void		TestNamingAllocations();
+static void*	AllocateTestCFMemory(CFIndex size, CFOptionFlags hint, void *info);
+static void*	ReallocateTestCFMemory(void *pointer, CFIndex size, CFOptionFlags hint, void *info);
+static void		DeallocateTestCFMemory(void *pointer, void *info);
+static void		TestAppendTemplatesFilenames();
+static CFIndex	FindTestTemplate(CFArrayRef templates, CFStringRef name);
+static void		TestTemplateTablePools();
+static void		TestTemplateContentCache();
+static void		TestCachedTemplateWrites();
+static CFURLRef	CreateTestTemplate(const char *directory, const char *name, size_t size, char fill);
+static void		TestLockedSpoolJobs();
+static void		TestRotateTraceFile();
+static void		TestHistogramBuckets();
+static void		TestFormatMetrics();
+static void		TestUsageSlotClaim();
+static void		TestConcurrentUsageSlotClaim();
+static void*	TestUsageThreadMain(void *thread);
+static SInt64	GetTestUsageKey(int n);
+static void		TestUsageScores();
+static void		TestTemplatesMenuOrder();
+static TemplateTable* CreateTestTemplateTable(CFIndex count);
+static void		FreeTestTemplateTable(TemplateTable *table);
+static void		IgnoreTemplateUsageFile();
+static void		TestCreationExecutor();
+static void		TestMultipleSelectionCreations();
+static Boolean	InstallTestTemplates(char *path, size_t size);
+static void		RemoveTestTemplates(const char *path);
+static CreationRequest* WaitForTestCreations(UInt32 count);
+static void		FreeTestCreations(CreationRequest *requests);
+static off_t	GetTestDocumentSize(const char *directory, const char *name);
+static UInt32	CountRunningTestCreations(int lane);
+static Boolean	CreateTestDirectories(char *path, size_t size, int count, CFURLRef *outURLs);
+static void		TestCreationAPI();
+static void		TestCreationsInFlight();
+static void		QueueTestCreation(NewDocumentCreationRef creation, void *info);
+#ifdef DEBUG
+static void		TestSimulatedFileSystemErrors();
+static void		TestCloneFallback();
+static void		TestSimulatedFileSystemLatency();
+static void		TestHookOverhead();
+static void		TestStalledCreationExecutor();
+static void		TestCreationBatches();
+static void		SimulateTestFileSystemCall(int call, double latency, double errorRate, int error);
+static Boolean	CompareTestFiles(const char *path, const char *otherPath);
+static void		IgnoreSimulatedFileSystemPreference();
+#endif
+
+
+// -----------------------------------------------------------------------------
+//	Test runner
+// -----------------------------------------------------------------------------
+
+int main(int argc, const char *argv[])
+{
+#ifdef DEBUG
+	// Only simulate what the tests ask for
+	pthread_once(&gSimulatedFileSystemOnce, IgnoreSimulatedFileSystemPreference);
+#endif
+	
+	TestFoldASCIIFileName();
+	TestFoldFileName();
+	TestFoldedCollisions();
+	TestFoldDirectoryEntries();
+	TestFormatDocumentName();
+	TestResolveDocumentName();
+	TestConcurrentNaming();
+	TestNamingAllocations();
+	TestAppendTemplatesFilenames();
+	TestTemplateTablePools();
+	TestTemplateContentCache();
+	TestCachedTemplateWrites();
+	TestLockedSpoolJobs();
+	TestRotateTraceFile();
+	TestHistogramBuckets();
+	TestFormatMetrics();
+	TestUsageSlotClaim();
+	TestConcurrentUsageSlotClaim();
+	TestUsageScores();
+	TestTemplatesMenuOrder();
+	TestCreationExecutor();
+	TestMultipleSelectionCreations();
+	TestCreationAPI();
+	TestCreationsInFlight();
+#ifdef DEBUG
+	TestSimulatedFileSystemErrors();
+	TestCloneFallback();
+	TestSimulatedFileSystemLatency();
+	TestHookOverhead();
+	TestStalledCreationExecutor();
+	TestCreationBatches();
+#endif
+	
+	if (gTestFailures > 0) {
+		printf("NewDocumentPlugInTests : %d checks failed.\n", gTestFailures);
+		return 1;
+	}
+	
+	printf("NewDocumentPlugInTests : all tests passed.\n");
+	return 0;
+}
+
+
+// -----------------------------------------------------------------------------
+//	Folding tests
+// -----------------------------------------------------------------------------
+
+/*
+ * TestFoldASCIIFileName
+ *
+ * Names shorter than 16 bytes only go through the scalar loop, longer ones
+ * through the SIMD loop and then the scalar loop for their tail. Non-ASCII
+ * bytes must be refused in either part.
+ */
+static void TestFoldASCIIFileName()
+{
+	static const struct {
+		const char	*name;
+		const char	*expected;	// NULL if the name isn't ASCII
+	} cases[] = {
+		{ "",										"" },
+		{ "Untitled.TXT",							"untitled.txt" },
+		{ "AZaz@[`{09 .-_",							"azaz@[`{09 .-_" },
+		{ "UNTITLED DOCUMENT",						"untitled document" },	// 16 + 1
+		{ "Untitled Documen",						"untitled documen" },	// exactly 16
+		{ "New Document From Template 42.HTML",		"new document from template 42.html" },
+		{ "Caf\xc3\xa9.txt",							NULL },		// scalar loop
+		{ "Document \xc3\xa9t\xc3\xa9 sans titre.rtf",	NULL },		// SIMD loop
+		{ "Nouveau document texte \xc3\xa9.txt",		NULL },		// tail after SIMD
+	};
+	char folded[NAME_MAX + 1];
+	size_t i, length;
+	
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		length = strlen(cases[i].name);
+		if (cases[i].expected != NULL) {
+			test_check(FoldASCIIFileName(cases[i].name, length, folded));
+			test_check(strcmp(folded, cases[i].expected) == 0);
+		}
+		else {
+			test_check(!FoldASCIIFileName(cases[i].name, length, folded));
+		}
+	}
+}
+
+/*
+ * TestFoldFileName
+ *
+ * French names fold to the same decomposed lower case form, whatever their
+ * case and normalization, and whichever path they take.
+ */
+static void TestFoldFileName()
+{
+	static const struct {
+		const char	*name;
+		const char	*expected;
+	} cases[] = {
+		{ "Sans Titre.TXT",						"sans titre.txt" },
+		{ "\xc3\x89t\xc3\xa9.txt",					"e\xcc\x81te\xcc\x81.txt" },		// precomposed
+		{ "E\xcc\x81te\xcc\x81.txt",					"e\xcc\x81te\xcc\x81.txt" },		// decomposed
+		{ "\xc3\x87" "a.txt",							"c\xcc\xa7" "a.txt" },
+		{ "\xc5\x92uvre.odt",						"\xc5\x93uvre.odt" },
+		{ "Lettre \xc3\xa0 \xc3\x89lo\xc3\xafse.rtf",		"lettre a\xcc\x80 e\xcc\x81loi\xcc\x88se.rtf" },
+		{ "NOUVEAU DOCUMENT TEXTE \xc3\x89T\xc3\x89.txt",	"nouveau document texte e\xcc\x81te\xcc\x81.txt" },
+	};
+	char folded[NAME_MAX + 1];
+	size_t i;
+	
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		test_check(FoldFileName(cases[i].name, folded, sizeof(folded)));
+		test_check(strcmp(folded, cases[i].expected) == 0);
+	}
+	
+	// The folded form must fit the buffer
+	test_check(!FoldFileName("\xc3\x89t\xc3\xa9.txt", folded, 8));
+}
+
+
+/*
+ * TestFoldedCollisions
+ *
+ * Documents whose names differ from the resolved ones only by their case or
+ * their normalization take their numbers, as the file system would refuse
+ * the new names.
+ */
+static void TestFoldedCollisions()
+{
+	char path[PATH_MAX], name[NAME_MAX + 1];
+	int fd, suffix;
+	
+	strlcpy(path, "/tmp/NewDocumentPlugInTests.XXXXXX", sizeof(path));
+	test_check(mkdtemp(path) != NULL);
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	test_check(fd >= 0);
+	if (fd < 0)
+		return;
+	
+	test_check(CreateTestFile(fd, "Untitled Text Document.TXT"));
+	test_check(CreateTestFile(fd, "UNTITLED TEXT DOCUMENT 2.txt"));
+	test_check(ResolveDocumentName(path, fd, "untitled text document", ".txt", name, sizeof(name), &suffix));
+	test_check(suffix == 3 && strcmp(name, "untitled text document 3.txt") == 0);
+	ReleaseDocumentName(path, "untitled text document", ".txt", suffix, false);
+	
+	// Precomposed and decomposed spellings
+	test_check(CreateTestFile(fd, "Document \xc3\x89t\xc3\xa9 sans titre.rtf"));
+	test_check(CreateTestFile(fd, "document e\xcc\x81te\xcc\x81 sans titre 2.rtf"));
+	test_check(ResolveDocumentName(path, fd, "document \xc3\xa9t\xc3\xa9 sans titre", ".rtf", name, sizeof(name), &suffix));
+	test_check(suffix == 3 && strcmp(name, "document \xc3\xa9t\xc3\xa9 sans titre 3.rtf") == 0);
+	ReleaseDocumentName(path, "document \xc3\xa9t\xc3\xa9 sans titre", ".rtf", suffix, false);
+	
+	close(fd);
+	RemoveTestDirectory(path);
+}
+
+/*
+ * TestFoldDirectoryEntries
+ *
+ * Benchmark of the folding : kTestFoldedEntries ASCII names of directory
+ * entries folded, as a rebuild of an occupancy index does.
+ */
+static void TestFoldDirectoryEntries()
+{
+	char (*names)[NAME_MAX + 1];
+	char folded[NAME_MAX + 1];
+	CFAbsoluteTime startDate;
+	SInt64 elapsed;
+	int i, count = 0;
+	
+	names = malloc(kTestFoldedNames * sizeof(*names));
+	test_check(names != NULL);
+	if (names == NULL)
+		return;
+	for (i = 0; i < kTestFoldedNames; i++) {
+		if (i % 2 == 0)
+			snprintf(names[i], sizeof(names[i]), "Untitled Text Document %d.txt", i);
+		else
+			snprintf(names[i], sizeof(names[i]), "IMG_%04d.JPG", i);
+	}
+	
+	startDate = CFAbsoluteTimeGetCurrent();
+	for (i = 0; i < kTestFoldedEntries; i++) {
+		if (FoldFileName(names[i % kTestFoldedNames], folded, sizeof(folded)))
+			count++;
+	}
+	elapsed = GetElapsedMicroseconds(startDate);
+	test_check(count == kTestFoldedEntries);
+	
+	printf("NewDocumentPlugInTests : %d directory entries folded : %.1f ms, %.1f ns per entry\n",
+		   kTestFoldedEntries, elapsed / 1000.0, elapsed * 1000.0 / kTestFoldedEntries);
+	
+	free(names);
+}
+
+// -----------------------------------------------------------------------------
+//	Naming tests
+// -----------------------------------------------------------------------------
+
+/*
+ * TestFormatDocumentName
+ *
+ * The number goes before the extensions, with none for the first document,
+ * and names that don't fit the buffer are refused.
+ */
+static void TestFormatDocumentName()
+{
+	static const struct {
+		const char	*baseName;
+		int			suffix;
+		const char	*extensions;
+		size_t		size;
+		const char	*expected;	// NULL if the name doesn't fit
+	} cases[] = {
+		{ "untitled",			1,			".txt",		NAME_MAX + 1,	"untitled.txt" },
+		{ "untitled",			2,			".txt",		NAME_MAX + 1,	"untitled 2.txt" },
+		{ "untitled",			10,			".txt",		NAME_MAX + 1,	"untitled 10.txt" },
+		{ "untitled",			2147483647,	".txt",		NAME_MAX + 1,	"untitled 2147483647.txt" },
+		{ "archive",			3,			".tar.gz",	NAME_MAX + 1,	"archive 3.tar.gz" },
+		{ "Makefile",			4,			"",			NAME_MAX + 1,	"Makefile 4" },
+		{ "document sans titre",	2,			".rtf",		NAME_MAX + 1,	"document sans titre 2.rtf" },
+		{ "untitled",			2,			".txt",		15,				"untitled 2.txt" },
+		{ "untitled",			2,			".txt",		14,				NULL },
+		{ "untitled",			1,			".txt",		12,				NULL },
+	};
+	char name[NAME_MAX + 1];
+	size_t i;
+	
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		memset(name, 'x', sizeof(name));
+		if (cases[i].expected != NULL) {
+			test_check(FormatDocumentName(cases[i].baseName, cases[i].suffix, cases[i].extensions, name, cases[i].size));
+			test_check(strcmp(name, cases[i].expected) == 0);
+		}
+		else {
+			test_check(!FormatDocumentName(cases[i].baseName, cases[i].suffix, cases[i].extensions, name, cases[i].size));
+		}
+	}
+}
+
+/*
+ * TestResolveDocumentName
+ *
+ * The first free number is chosen, only documents with the same base name and
+ * extensions count, reserved numbers survive the trimming of the caches, and
+ * a name that doesn't fit gives its number back.
+ */
+static void TestResolveDocumentName()
+{
+	char path[PATH_MAX], name[NAME_MAX + 1];
+	int fd, suffix;
+	
+	strlcpy(path, "/tmp/NewDocumentPlugInTests.XXXXXX", sizeof(path));
+	test_check(mkdtemp(path) != NULL);
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	test_check(fd >= 0);
+	if (fd < 0)
+		return;
+	
+	// Empty directory : no number
+	test_check(ResolveDocumentName(path, fd, "untitled", ".txt", name, sizeof(name), &suffix));
+	test_check(suffix == 1 && strcmp(name, "untitled.txt") == 0);
+	ReleaseDocumentName(path, "untitled", ".txt", suffix, false);
+	
+	// Other names and extensions don't count, the gap at 2 is used first
+	test_check(CreateTestFile(fd, "untitled.txt"));
+	test_check(CreateTestFile(fd, "untitled 3.txt"));
+	test_check(CreateTestFile(fd, "untitled 2.rtf"));
+	test_check(CreateTestFile(fd, "untitled 2.txt.bak"));
+	test_check(CreateTestFile(fd, "untitled copy 2.txt"));
+	test_check(ResolveDocumentName(path, fd, "untitled", ".txt", name, sizeof(name), &suffix));
+	test_check(suffix == 2 && strcmp(name, "untitled 2.txt") == 0);
+	
+	// A reserved number isn't given twice
+	test_check(ResolveDocumentName(path, fd, "untitled", ".txt", name, sizeof(name), &suffix));
+	test_check(suffix == 4 && strcmp(name, "untitled 4.txt") == 0);
+	ReleaseDocumentName(path, "untitled", ".txt", 2, false);
+	ReleaseDocumentName(path, "untitled", ".txt", 4, false);
+	
+	// Documents without extensions
+	test_check(ResolveDocumentName(path, fd, "untitled", "", name, sizeof(name), &suffix));
+	test_check(suffix == 1 && strcmp(name, "untitled") == 0);
+	ReleaseDocumentName(path, "untitled", "", suffix, false);
+	
+	// Trimming the caches keeps the indexes with reserved numbers
+	test_check(ResolveDocumentName(path, fd, "untitled", ".txt", name, sizeof(name), &suffix));
+	test_check(suffix == 2);
+	TrimOccupancyIndexes(CFAbsoluteTimeGetCurrent() + 1);
+	test_check(ResolveDocumentName(path, fd, "untitled", ".txt", name, sizeof(name), &suffix));
+	test_check(suffix == 4);
+	ReleaseDocumentName(path, "untitled", ".txt", 2, false);
+	ReleaseDocumentName(path, "untitled", ".txt", 4, false);
+	
+	// A name too long for the buffer fails, and frees its number
+	suffix = 0;
+	test_check(!ResolveDocumentName(path, fd, "untitled", ".txt", name, 14, &suffix));
+	test_check(suffix == 0);
+	test_check(ResolveDocumentName(path, fd, "untitled", ".txt", name, sizeof(name), &suffix));
+	test_check(suffix == 2);
+	ReleaseDocumentName(path, "untitled", ".txt", suffix, false);
+	
+	close(fd);
+	RemoveTestDirectory(path);
+}
+
+/*
+ * TestConcurrentNaming
+ *
+ * Several threads create documents in the same directory at the same time :
+ * every name must be resolved once, without collision, and the numbers of
+ * the failed creations must be given to the following ones. A document
+ * removed by someone else must free its number.
+ */
+static void TestConcurrentNaming()
+{
+	TestNamingDirectory directory;
+	pthread_t threads[kTestNamingThreads];
+	char name[NAME_MAX + 1];
+	int i, count, highest, suffix;
+	
+	strlcpy(directory.path, "/tmp/NewDocumentPlugInTests.XXXXXX", sizeof(directory.path));
+	test_check(mkdtemp(directory.path) != NULL);
+	directory.fd = open(directory.path, O_RDONLY | O_DIRECTORY);
+	directory.collisions = 0;
+	test_check(directory.fd >= 0);
+	if (directory.fd < 0)
+		return;
+	
+	for (i = 0; i < kTestNamingThreads; i++)
+		test_check(pthread_create(&threads[i], NULL, TestNamingThreadMain, &directory) == 0);
+	for (i = 0; i < kTestNamingThreads; i++)
+		pthread_join(threads[i], NULL);
+	
+	// Every number from 1 is used once, released numbers included
+	count = CountTestDocuments(directory.path, &highest);
+	test_check(directory.collisions == 0);
+	test_check(count == kTestNamingThreads * kTestNamingDocuments);
+	test_check(highest == kTestNamingThreads * kTestNamingDocuments);
+	
+	// A document removed behind our back frees its number
+	test_check(UnlinkAt(directory.fd, "untitled 2.txt", 0) == 0);
+	test_check(ResolveDocumentName(directory.path, directory.fd, "untitled", ".txt", name, sizeof(name), &suffix));
+	test_check(suffix == 2 && strcmp(name, "untitled 2.txt") == 0);
+	ReleaseDocumentName(directory.path, "untitled", ".txt", suffix, false);
+	
+	close(directory.fd);
+	RemoveTestDirectory(directory.path);
+}
+
+/*
+ * TestNamingAllocations
+ *
+ * Once the occupancy index of a directory is built, resolving, releasing and
+ * formatting names makes no heap allocation, neither in the plugin nor in
+ * CoreFoundation. Also prints the time to resolve and release a name.
+ */
+static void TestNamingAllocations()
+{
+	CFAllocatorContext context = { 0, NULL, NULL, NULL, NULL, AllocateTestCFMemory, ReallocateTestCFMemory, DeallocateTestCFMemory, NULL };
+	CFAllocatorRef allocator, defaultAllocator;
+	CFAbsoluteTime startDate;
+	SInt64 elapsed;
+	char path[PATH_MAX], name[NAME_MAX + 1];
+	long allocations;
+	int fd, i, suffix, resolved = 0;
+	
+	strlcpy(path, "/tmp/NewDocumentPlugInTests.XXXXXX", sizeof(path));
+	test_check(mkdtemp(path) != NULL);
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	test_check(fd >= 0);
+	if (fd < 0)
+		return;
+	test_check(CreateTestFile(fd, "untitled.txt"));
+	test_check(CreateTestFile(fd, "untitled 2.txt"));
+	
+	// Build the index
+	test_check(ResolveDocumentName(path, fd, "untitled", ".txt", name, sizeof(name), &suffix));
+	ReleaseDocumentName(path, "untitled", ".txt", suffix, false);
+	
+	allocator = CFAllocatorCreate(NULL, &context);
+	defaultAllocator = CFAllocatorGetDefault();
+	CFAllocatorSetDefault(allocator);
+	allocations = gTestAllocations;
+	
+	startDate = CFAbsoluteTimeGetCurrent();
+	for (i = 0; i < kTestNamingAllocationsNames; i++) {
+		if (ResolveDocumentName(path, fd, "untitled", ".txt", name, sizeof(name), &suffix) && suffix == 3)
+			resolved++;
+		ReleaseDocumentName(path, "untitled", ".txt", suffix, false);
+		FormatDocumentName("untitled", i + 2, ".txt", name, sizeof(name));
+	}
+	elapsed = GetElapsedMicroseconds(startDate);
+	
+	allocations = gTestAllocations - allocations;
+	CFAllocatorSetDefault(defaultAllocator);
+	CFRelease(allocator);
+	test_check(resolved == kTestNamingAllocationsNames);
+	test_check(allocations == 0);
+	
+	printf("NewDocumentPlugInTests : %d names resolved with %ld allocations, %.2f us per name\n",
+		   kTestNamingAllocationsNames, allocations, (double)elapsed / kTestNamingAllocationsNames);
+	
+	close(fd);
+	RemoveTestDirectory(path);
+}
+
+/*
+ * AllocateTestCFMemory, ReallocateTestCFMemory, DeallocateTestCFMemory
+ *
+ * Callbacks of the allocator counting the allocations of CoreFoundation.
+ */
+static void* AllocateTestCFMemory(CFIndex size, CFOptionFlags hint, void *info)
+{
+	return malloc(size);
+}
+
+static void* ReallocateTestCFMemory(void *pointer, CFIndex size, CFOptionFlags hint, void *info)
+{
+	return realloc(pointer, size);
+}
+
+static void DeallocateTestCFMemory(void *pointer, void *info)
+{
+	free(pointer);
+}
+
+/*
+ * TestNamingThreadMain
+ *
+ * Create kTestNamingDocuments documents in the test directory, failing one
+ * creation out of seven after its name has been reserved.
+ */
+static void* TestNamingThreadMain(void *directory)
+{
+	int count = 0, attempts = 0;
+	
+	while (count < kTestNamingDocuments && attempts++ < kTestNamingDocuments * 2)
+		CreateTestDocument((TestNamingDirectory*)directory, 7, &count);
+	
+	return NULL;
+}
+
+/*
+ * CreateTestDocument
+ *
+ * Resolve a document name in the test directory, then create the document
+ * as a creation request would, or give up on it every failEvery attempts.
+ */
+static Boolean CreateTestDocument(TestNamingDirectory *directory, int failEvery, int *ioCount)
+{
+	static volatile SInt64 attempts;
+	char name[NAME_MAX + 1];
+	struct stat info;
+	SInt64 previousDate = 0;
+	int suffix, fd;
+	
+	if (!ResolveDocumentName(directory->path, directory->fd, "untitled", ".txt", name, sizeof(name), &suffix))
+		return false;
+	
+	if (AtomicAdd64(&attempts, 1) % failEvery == 0) {
+		ReleaseDocumentName(directory->path, "untitled", ".txt", suffix, false);
+		return false;
+	}
+	
+	if (fstat(directory->fd, &info) == 0)
+		previousDate = GetModificationTime(&info);
+	
+	fd = OpenAt(directory->fd, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		AtomicAdd64(&directory->collisions, 1);
+		ReleaseDocumentName(directory->path, "untitled", ".txt", suffix, true);
+		return false;
+	}
+	close(fd);
+	
+	NoteDocumentCreated(directory->path, directory->fd, "untitled", ".txt", suffix, previousDate);
+	(*ioCount)++;
+	return true;
+}
+
+/*
+ * CountTestDocuments
+ *
+ * Return the number of documents named "untitled[ N].txt" in a directory, and
+ * the highest number they use.
+ */
+static int CountTestDocuments(const char *path, int *outHighest)
+{
+	DIR *dir;
+	struct dirent *entry;
+	int count = 0, number;
+	
+	*outHighest = 0;
+	dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+	
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, "untitled.txt") == 0)
+			number = 1;
+		else if (sscanf(entry->d_name, "untitled %d.txt", &number) != 1)
+			continue;
+		count++;
+		if (number > *outHighest)
+			*outHighest = number;
+	}
+	
+	closedir(dir);
+	return count;
+}
+
+/*
+ * CreateTestFile
+ *
+ * Create an empty file in a test directory.
+ */
+static Boolean CreateTestFile(int directoryFd, const char *name)
+{
+	int fd;
+	
+	fd = OpenAt(directoryFd, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return false;
+	close(fd);
+	return true;
+}
+
+/*
+ * RemoveTestDirectory
+ *
+ * Remove a test directory and the documents it holds.
+ */
+static void RemoveTestDirectory(const char *path)
+{
+	RemoveDirectoryTree(AT_FDCWD, path);
+}
+
+
+
+// -----------------------------------------------------------------------------
+//	Templates tests
+// -----------------------------------------------------------------------------
+
+/*
+ * TestAppendTemplatesFilenames
+ *
+ * The templates of a category come before those of its subcategories, named
+ * after their category path. Directories with an extension are package
+ * templates, not categories, and hidden items are skipped. The date of every
+ * category directory is recorded.
+ */
+static void TestAppendTemplatesFilenames()
+{
+	static const char *directories[] = { "Report.pages", "Letters", "Letters/Formal", "Sheets", "Sheets/Budget.numbers" };
+	static const char *files[] = { "Letter.txt", ".DS_Store", "Report.pages/Index.xml", "Letters/Thanks.rtf",
+								   "Letters/.Draft.rtf", "Letters/Formal/Invitation.rtf", "Sheets/Budget.numbers/Index.xml" };
+	char path[PATH_MAX], itemPath[PATH_MAX];
+	CFStringRef templatesPath, category;
+	CFMutableArrayRef templates;
+	CFMutableDictionaryRef categories;
+	CFIndex letter, report, thanks, invitation, budget;
+	size_t i;
+	int fd;
+	
+	strlcpy(path, "/tmp/NewDocumentPlugInTests.XXXXXX", sizeof(path));
+	test_check(mkdtemp(path) != NULL);
+	for (i = 0; i < sizeof(directories) / sizeof(directories[0]); i++) {
+		snprintf(itemPath, sizeof(itemPath), "%s/%s", path, directories[i]);
+		test_check(mkdir(itemPath, 0755) == 0);
+	}
+	for (i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		snprintf(itemPath, sizeof(itemPath), "%s/%s", path, files[i]);
+		fd = open(itemPath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		test_check(fd >= 0);
+		if (fd >= 0)
+			close(fd);
+	}
+	
+	templatesPath = CFStringCreateWithFileSystemRepresentation(NULL, path);
+	templates = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+	categories = CFDictionaryCreateMutable(NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	AppendTemplatesFilenames(templatesPath, CFSTR(""), templates, categories);
+	
+	letter = FindTestTemplate(templates, CFSTR("Letter.txt"));
+	report = FindTestTemplate(templates, CFSTR("Report.pages"));
+	thanks = FindTestTemplate(templates, CFSTR("Letters/Thanks.rtf"));
+	invitation = FindTestTemplate(templates, CFSTR("Letters/Formal/Invitation.rtf"));
+	budget = FindTestTemplate(templates, CFSTR("Sheets/Budget.numbers"));
+	test_check(CFArrayGetCount(templates) == 5);
+	test_check(letter < 2 && report < 2);
+	test_check(thanks >= 2 && thanks < invitation && budget >= 2);
+	test_check(CFDictionaryGetCount(categories) == 4);
+	test_check(CFDictionaryContainsKey(categories, CFSTR("")));
+	test_check(CFDictionaryContainsKey(categories, CFSTR("Letters/Formal")));
+	
+	category = CopyTemplateCategory(CFSTR("Letters/Formal/Invitation.rtf"));
+	test_check(CFEqual(category, CFSTR("Letters/Formal")));
+	CFRelease(category);
+	category = CopyTemplateCategory(CFSTR("Letter.txt"));
+	test_check(CFStringGetLength(category) == 0);
+	CFRelease(category);
+	
+	CFRelease(categories);
+	CFRelease(templates);
+	CFRelease(templatesPath);
+	RemoveTestDirectory(path);
+}
+
+/*
+ * FindTestTemplate
+ *
+ * Return the index of a template name in an array, or kCFNotFound.
+ */
+static CFIndex FindTestTemplate(CFArrayRef templates, CFStringRef name)
+{
+	return CFArrayGetFirstIndexOfValue(templates, CFRangeMake(0, CFArrayGetCount(templates)), name);
+}
+
+/*
+ * TestTemplateTablePools
+ *
+ * Names appended to the pools of a table are laid out one after the other,
+ * and file names are NULL-terminated. Templates are found back by name, and
+ * their names copied out of the pool. Also prints the memory a template takes
+ * in the pools, and the time to look a template up by name.
+ */
+static void TestTemplateTablePools()
+{
+	TemplateTable *table;
+	CFStringRef name, copy;
+	char buffer[64];
+	CFIndex i, length = 0, capacity = 0, fileNamesLength = 0, fileNamesCapacity = 0, expectedOffset = 0, index;
+	CFAbsoluteTime startDate;
+	SInt64 elapsed;
+	
+	table = (TemplateTable*) calloc(1, sizeof(TemplateTable));
+	test_check(table != NULL);
+	if (table == NULL)
+		return;
+	table->count = kTestTableTemplates;
+	table->nameOffsets = (CFIndex*) malloc(kTestTableTemplates * sizeof(CFIndex));
+	table->nameLengths = (UInt16*) malloc(kTestTableTemplates * sizeof(UInt16));
+	table->documentNameOffsets = (CFIndex*) malloc(kTestTableTemplates * sizeof(CFIndex));
+	test_check(table->nameOffsets != NULL && table->nameLengths != NULL && table->documentNameOffsets != NULL);
+	if (table->nameOffsets == NULL || table->nameLengths == NULL || table->documentNameOffsets == NULL) {
+		FreeTestTemplateTable(table);
+		return;
+	}
+	
+	for (i = 0; i < kTestTableTemplates; i++) {
+		snprintf(buffer, sizeof(buffer), "Category%03ld/Template%05ld.txt", (long)(i / 100), (long)i);
+		name = CFStringCreateWithFileSystemRepresentation(NULL, buffer);
+		table->nameOffsets[i] = AppendToTemplateTableStrings(table, name, &length, &capacity);
+		table->nameLengths[i] = CFStringGetLength(name);
+		test_check(table->nameOffsets[i] == expectedOffset);
+		expectedOffset += table->nameLengths[i];
+		CFRelease(name);
+		
+		snprintf(buffer, sizeof(buffer), "template %05ld", (long)i);
+		name = CFStringCreateWithFileSystemRepresentation(NULL, buffer);
+		table->documentNameOffsets[i] = AppendToTemplateTableFileNames(table, name, &fileNamesLength, &fileNamesCapacity);
+		CFRelease(name);
+	}
+	test_check(length == expectedOffset && length <= capacity && fileNamesLength <= fileNamesCapacity);
+	for (i = 0; i < kTestTableTemplates; i++) {
+		snprintf(buffer, sizeof(buffer), "template %05ld", (long)i);
+		test_check(strcmp(table->fileNames + table->documentNameOffsets[i], buffer) == 0);
+	}
+	
+	startDate = CFAbsoluteTimeGetCurrent();
+	for (i = 0; i < kTestTableLookups; i++) {
+		index = i * (kTestTableTemplates / kTestTableLookups);
+		snprintf(buffer, sizeof(buffer), "Category%03ld/Template%05ld.txt", (long)(index / 100), (long)index);
+		name = CFStringCreateWithFileSystemRepresentation(NULL, buffer);
+		test_check(FindTemplateTableIndex(table, name) == index);
+		copy = CopyTemplateTableName(table, index);
+		test_check(CFEqual(copy, name));
+		CFRelease(copy);
+		CFRelease(name);
+	}
+	elapsed = GetElapsedMicroseconds(startDate);
+	test_check(FindTemplateTableIndex(table, CFSTR("Category000/Template.txt")) == kCFNotFound);
+	
+	printf("NewDocumentPlugInTests : table of %d templates : %.1f bytes per template in the pools, %.2f us per lookup by name\n",
+		   kTestTableTemplates, (double)(capacity * sizeof(UniChar) + fileNamesCapacity) / kTestTableTemplates,
+		   (double)elapsed / kTestTableLookups);
+	
+	FreeTestTemplateTable(table);
+}
+
+// -----------------------------------------------------------------------------
+//	Content cache tests
+// -----------------------------------------------------------------------------
+
+/*
+ * TestTemplateContentCache
+ *
+ * A small template is read once, then served from the cache until it changes.
+ * Big templates and packages aren't cached. Over its budget, the cache evicts
+ * the least recently used templates first, and trimming it frees everything.
+ */
+static void TestTemplateContentCache()
+{
+	char path[PATH_MAX], name[NAME_MAX + 1];
+	CFURLRef urls[kTestCacheTemplates], bigURL, directoryURL;
+	CFDataRef contents, again;
+	TemplateCacheStats stats;
+	struct stat info;
+	struct timeval dates[2];
+	int i;
+	
+	strlcpy(path, "/tmp/NewDocumentPlugInTests.XXXXXX", sizeof(path));
+	test_check(mkdtemp(path) != NULL);
+	
+	for (i = 0; i < kTestCacheTemplates; i++) {
+		snprintf(name, sizeof(name), "template %d.txt", i);
+		urls[i] = CreateTestTemplate(path, name, kTestCacheTemplateSize, 'a');
+		test_check(urls[i] != NULL);
+		if (urls[i] == NULL)
+			return;
+	}
+	bigURL = CreateTestTemplate(path, "big.txt", kNewDocumentPlugInTemplateCacheMaxItemSize + 1, 'a');
+	directoryURL = CFURLCreateFromFileSystemRepresentation(NULL, (const UInt8*)path, strlen(path), true);
+	test_check(bigURL != NULL && directoryURL != NULL);
+	
+	// A miss, then a hit on the same contents
+	stats = gTemplateCacheStats;
+	contents = CopyCachedTemplateContents(urls[0]);
+	test_check(contents != NULL && CFDataGetLength(contents) == kTestCacheTemplateSize);
+	again = CopyCachedTemplateContents(urls[0]);
+	test_check(again == contents);
+	test_check(gTemplateCacheStats.misses == stats.misses + 1 && gTemplateCacheStats.hits == stats.hits + 1);
+	if (again != NULL)
+		CFRelease(again);
+	if (contents != NULL)
+		CFRelease(contents);
+	
+	// A template modified since it was read is read again
+	CFRelease(CreateTestTemplate(path, "template 0.txt", kTestCacheTemplateSize, 'b'));
+	snprintf(name, sizeof(name), "%s/template 0.txt", path);
+	test_check(stat(name, &info) == 0);
+	dates[0].tv_sec = dates[1].tv_sec = info.st_mtimespec.tv_sec - 10;
+	dates[0].tv_usec = dates[1].tv_usec = 0;
+	test_check(utimes(name, dates) == 0);
+	stats = gTemplateCacheStats;
+	contents = CopyCachedTemplateContents(urls[0]);
+	test_check(contents != NULL && CFDataGetBytePtr(contents)[0] == 'b');
+	test_check(gTemplateCacheStats.misses == stats.misses + 1);
+	if (contents != NULL)
+		CFRelease(contents);
+	
+	// Big templates and packages go through the copy path
+	test_check(CopyCachedTemplateContents(bigURL) == NULL);
+	test_check(CopyCachedTemplateContents(directoryURL) == NULL);
+	
+	// The first template is the least recently used when the last one comes
+	// in : it is evicted, while the others stay
+	stats = gTemplateCacheStats;
+	for (i = 1; i < kTestCacheTemplates; i++)
+		CFRelease(CopyCachedTemplateContents(urls[i]));
+	test_check(gTemplateCacheStats.evictions == stats.evictions + 1);
+	test_check(gTemplateCacheSize == (kTestCacheTemplates - 1) * kTestCacheTemplateSize);
+	test_check(gTemplateCacheSize <= kNewDocumentPlugInTemplateCacheBudget);
+	stats = gTemplateCacheStats;
+	CFRelease(CopyCachedTemplateContents(urls[1]));
+	test_check(gTemplateCacheStats.hits == stats.hits + 1);
+	CFRelease(CopyCachedTemplateContents(urls[0]));
+	test_check(gTemplateCacheStats.misses == stats.misses + 1);
+	test_check(gTemplateCacheStats.evictions == stats.evictions + 1);
+	
+	// Trimming to nothing frees every entry
+	TrimTemplateContentCache(CFAbsoluteTimeGetCurrent(), 0);
+	test_check(gTemplateCacheHead == NULL && gTemplateCacheSize == 0);
+	test_check(GetMetric(&gMetrics.cacheBytes[kNewDocumentPlugInContentCache]) == 0);
+	
+	for (i = 0; i < kTestCacheTemplates; i++)
+		CFRelease(urls[i]);
+	CFRelease(bigURL);
+	CFRelease(directoryURL);
+	RemoveTestDirectory(path);
+}
+
+/*
+ * TestCachedTemplateWrites
+ *
+ * Benchmark of the content cache : the documents written per second from a
+ * small template, served by the cache, and read again for each document as
+ * if the cache had no room for it.
+ */
+static void TestCachedTemplateWrites()
+{
+	char path[PATH_MAX], templatePath[PATH_MAX], name[NAME_MAX + 1];
+	CFURLRef templateURL;
+	CFDataRef contents;
+	CFAbsoluteTime startDate;
+	SInt64 elapsed[2];
+	FSRef item;
+	int fd, pass, i;
+	
+	strlcpy(path, "/tmp/NewDocumentPlugInTests.XXXXXX", sizeof(path));
+	test_check(mkdtemp(path) != NULL);
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	templateURL = CreateTestTemplate(path, "template.txt", kTestCachedWriteSize, 'a');
+	test_check(fd >= 0 && templateURL != NULL);
+	if (fd < 0 || templateURL == NULL)
+		return;
+	snprintf(templatePath, sizeof(templatePath), "%s/template.txt", path);
+	
+	for (pass = 0; pass < 2; pass++) {
+		startDate = CFAbsoluteTimeGetCurrent();
+		for (i = 0; i < kTestCachedWrites; i++) {
+			// Second pass : the cache is empty for each document
+			if (pass == 1)
+				TrimTemplateContentCache(CFAbsoluteTimeGetCurrent(), 0);
+			contents = CopyCachedTemplateContents(templateURL);
+			test_check(contents != NULL);
+			if (contents == NULL)
+				break;
+			snprintf(name, sizeof(name), "document %d %d.txt", pass, i);
+			test_check(WriteTemplateContents(contents, templatePath, path, fd, name, &item) == noErr);
+			CFRelease(contents);
+		}
+		elapsed[pass] = GetElapsedMicroseconds(startDate);
+	}
+	
+	printf("NewDocumentPlugInTests : %d KB template : %.0f documents per second from the cache, %.0f from the disk\n",
+		   kTestCachedWriteSize / 1024,
+		   kTestCachedWrites * 1e6 / (elapsed[0] > 0 ? elapsed[0] : 1),
+		   kTestCachedWrites * 1e6 / (elapsed[1] > 0 ? elapsed[1] : 1));
+	
+	TrimTemplateContentCache(CFAbsoluteTimeGetCurrent(), 0);
+	CFRelease(templateURL);
+	close(fd);
+	RemoveTestDirectory(path);
+}
+
+/*
+ * CreateTestTemplate
+ *
+ * Write a template of the given size, filled with one character, in a test
+ * directory, replacing any previous one, and return its URL.
+ */
+static CFURLRef CreateTestTemplate(const char *directory, const char *name, size_t size, char fill)
+{
+	char path[PATH_MAX];
+	char *bytes;
+	ssize_t written;
+	int fd;
+	
+	snprintf(path, sizeof(path), "%s/%s", directory, name);
+	bytes = (char*) malloc(size);
+	if (bytes == NULL)
+		return NULL;
+	memset(bytes, fill, size);
+	
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	written = (fd >= 0) ? write(fd, bytes, size) : -1;
+	if (fd >= 0)
+		close(fd);
+	free(bytes);
+	if (written != size)
+		return NULL;
+	
+	return CFURLCreateFromFileSystemRepresentation(NULL, (const UInt8*)path, strlen(path), false);
+}
+
+
+// -----------------------------------------------------------------------------
+//	Spool tests
+// -----------------------------------------------------------------------------
+
+/*
+ * TestLockedSpoolJobs
+ *
+ * A claimed job locked by another process is left alone, and not counted as
+ * performed : otherwise a full batch of them would make the spool thread scan
+ * the directory again and again.
+ */
+static void TestLockedSpoolJobs()
+{
+	char path[PATH_MAX], name[NAME_MAX + 1];
+	struct stat info;
+	int fd, i, locks[kNewDocumentPlugInSpoolBatchSize];
+	
+	strlcpy(path, "/tmp/NewDocumentPlugInTests.XXXXXX", sizeof(path));
+	test_check(mkdtemp(path) != NULL);
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	test_check(fd >= 0);
+	if (fd < 0)
+		return;
+	
+	// A full batch, locked by "another process" : flock locks are held by
+	// open files, not by processes
+	for (i = 0; i < kNewDocumentPlugInSpoolBatchSize; i++) {
+		snprintf(name, sizeof(name), "job %d%s", i, kNewDocumentPlugInSpoolClaimedExtension);
+		locks[i] = OpenAt(fd, name, O_RDONLY | O_CREAT | O_EXCL, 0600);
+		test_check(locks[i] >= 0 && flock(locks[i], LOCK_EX | LOCK_NB) == 0);
+	}
+	
+	test_check(PerformSpoolJobs(fd) == 0);
+	
+	for (i = 0; i < kNewDocumentPlugInSpoolBatchSize; i++) {
+		snprintf(name, sizeof(name), "job %d%s", i, kNewDocumentPlugInSpoolClaimedExtension);
+		test_check(StatAt(fd, name, &info, AT_SYMLINK_NOFOLLOW) == 0);
+		close(locks[i]);
+	}
+	
+	close(fd);
+	RemoveTestDirectory(path);
+}
+
+
+// -----------------------------------------------------------------------------
+//	Trace tests
+// -----------------------------------------------------------------------------
+
+/*
+ * TestRotateTraceFile
+ *
+ * The trace moves to its ".1" file, and a new trace starts. A trace that
+ * can't be moved goes on in the current file, rather than stopping.
+ */
+static void TestRotateTraceFile()
+{
+	char path[PATH_MAX], previousPath[PATH_MAX], blockerPath[PATH_MAX];
+	struct stat info;
+	
+	strlcpy(path, "/tmp/NewDocumentPlugInTests.XXXXXX", sizeof(path));
+	test_check(mkdtemp(path) != NULL);
+	snprintf(gTracePath, sizeof(gTracePath), "%s/%s", path, kNewDocumentPlugInTraceFilename);
+	snprintf(previousPath, sizeof(previousPath), "%s.1", gTracePath);
+	snprintf(blockerPath, sizeof(blockerPath), "%s/blocker", previousPath);
+	
+	gTraceFile = OpenTraceFile(gTracePath);
+	test_check(gTraceFile != NULL);
+	if (gTraceFile == NULL)
+		return;
+	fputs("first\n", gTraceFile);
+	
+	// A non-empty directory can't be replaced by the trace
+	test_check(mkdir(previousPath, 0700) == 0);
+	test_check(CreateTestFile(AT_FDCWD, blockerPath));
+	RotateTraceFile();
+	test_check(gTraceFile != NULL);
+	if (gTraceFile == NULL)
+		return;
+	fputs("second\n", gTraceFile);
+	fflush(gTraceFile);
+	test_check(stat(gTracePath, &info) == 0 && info.st_size == 13 && (info.st_mode & 0777) == 0600);
+	
+	// Once it can, the trace moves, and a new one starts
+	test_check(unlink(blockerPath) == 0 && rmdir(previousPath) == 0);
+	RotateTraceFile();
+	test_check(gTraceFile != NULL);
+	test_check(stat(previousPath, &info) == 0 && info.st_size == 13);
+	test_check(stat(gTracePath, &info) == 0 && info.st_size == 0);
+	
+	if (gTraceFile != NULL)
+		fclose(gTraceFile);
+	gTraceFile = NULL;
+	gTracePath[0] = '\0';
+	RemoveTestDirectory(path);
+}
+
+
+// -----------------------------------------------------------------------------
+//	Metrics tests
+// -----------------------------------------------------------------------------
+
+/*
+ * TestHistogramBuckets
+ *
+ * Each value goes to the bucket whose limit is the first one not below it,
+ * with a precision of 25%, up to the largest value. Buckets follow each other
+ * without gaps.
+ */
+static void TestHistogramBuckets()
+{
+	static const SInt64 values[] = {
+		0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 15, 16, 17, 100, 1000, 999999, 1000000,
+		(SInt64)1 << 31, ((SInt64)1 << 32) + 1, 0x7FFFFFFFFFFFFFFFLL
+	};
+	SInt64 limit;
+	int bucket, i;
+	
+	for (i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+		bucket = GetHistogramBucket(values[i]);
+		limit = GetHistogramBucketLimit(bucket);
+		test_check(bucket >= 0 && bucket < kNewDocumentPlugInHistogramBuckets);
+		test_check(limit >= values[i]);
+		test_check(bucket == 0 || GetHistogramBucketLimit(bucket - 1) < values[i]);
+		test_check(values[i] < 4 ? limit == values[i] : limit - values[i] <= values[i] / 4);
+	}
+	
+	// The limit of a bucket is its last value, the next value starts the next one
+	for (bucket = 0; bucket < GetHistogramBucket(0x7FFFFFFFFFFFFFFFLL); bucket++) {
+		limit = GetHistogramBucketLimit(bucket);
+		test_check(GetHistogramBucket(limit) == bucket);
+		test_check(GetHistogramBucket(limit + 1) == bucket + 1);
+	}
+	test_check(GetHistogramBucketLimit(GetHistogramBucket(0x7FFFFFFFFFFFFFFFLL)) == 0x7FFFFFFFFFFFFFFFLL);
+}
+
+/*
+ * TestFormatMetrics
+ *
+ * A buffer too small gets the beginning of the text, terminated, and the
+ * returned length is the length of that beginning.
+ */
+static void TestFormatMetrics()
+{
+	static const size_t sizes[] = { 1, 2, 64, 1000 };
+	char *full, *truncated;
+	size_t fullLength, length, i;
+	
+	full = malloc(256 * 1024);
+	truncated = malloc(256 * 1024);
+	test_check(full != NULL && truncated != NULL);
+	if (full == NULL || truncated == NULL)
+		return;
+	
+	fullLength = FormatMetrics(full, 256 * 1024);
+	test_check(fullLength > 1000 && fullLength < 256 * 1024 - 1);
+	test_check(strlen(full) == fullLength && full[fullLength - 1] == '\n');
+	
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		memset(truncated, 'x', sizes[i] + 1);
+		length = FormatMetrics(truncated, sizes[i]);
+		test_check(length < sizes[i]);
+		test_check(strlen(truncated) == length);
+		test_check(memcmp(truncated, full, length) == 0);
+		test_check(truncated[sizes[i]] == 'x');
+	}
+	
+	// Exactly the size of the text : the last byte goes to the terminator
+	length = FormatMetrics(truncated, fullLength);
+	test_check(length == fullLength - 1 && memcmp(truncated, full, length) == 0);
+	length = FormatMetrics(truncated, fullLength + 1);
+	test_check(length == fullLength && strcmp(truncated, full) == 0);
+	
+	free(full);
+	free(truncated);
+}
+
+// -----------------------------------------------------------------------------
+//	Usage tests
+// -----------------------------------------------------------------------------
+
+/*
+ * TestUsageSlotClaim
+ *
+ * A key only gets a slot when claimed, and then always finds the same one.
+ * Colliding keys take the following slots, wrapping around the end of the
+ * table, until kNewDocumentPlugInUsageMaxProbes slots are taken.
+ */
+static void TestUsageSlotClaim()
+{
+	TemplateUsageFile *usage;
+	TemplateUsageSlot *slot, *slots[kNewDocumentPlugInUsageMaxProbes];
+	SInt64 key = kNewDocumentPlugInUsageSlots - 2;
+	int i;
+	
+	usage = (TemplateUsageFile*) calloc(1, sizeof(TemplateUsageFile));
+	test_check(usage != NULL);
+	if (usage == NULL)
+		return;
+	
+	test_check(GetTemplateUsageSlot(NULL, key, true) == NULL);
+	test_check(GetTemplateUsageSlot(usage, key, false) == NULL);
+	
+	// Keys with the same first slot, the first of them two slots before the end
+	for (i = 0; i < kNewDocumentPlugInUsageMaxProbes; i++) {
+		slots[i] = GetTemplateUsageSlot(usage, key + i * kNewDocumentPlugInUsageSlots, true);
+		test_check(slots[i] == &usage->slots[(key + i) % kNewDocumentPlugInUsageSlots]);
+		test_check(slots[i] != NULL && slots[i]->key == key + i * kNewDocumentPlugInUsageSlots);
+	}
+	for (i = 0; i < kNewDocumentPlugInUsageMaxProbes; i++) {
+		test_check(GetTemplateUsageSlot(usage, key + i * kNewDocumentPlugInUsageSlots, false) == slots[i]);
+		test_check(GetTemplateUsageSlot(usage, key + i * kNewDocumentPlugInUsageSlots, true) == slots[i]);
+	}
+	
+	// Too crowded around the key
+	slot = GetTemplateUsageSlot(usage, key + kNewDocumentPlugInUsageMaxProbes * kNewDocumentPlugInUsageSlots, true);
+	test_check(slot == NULL);
+	
+	// A key starting at a taken slot goes on after the taken ones
+	slot = GetTemplateUsageSlot(usage, key + 1 + kNewDocumentPlugInUsageSlots * 100, true);
+	test_check(slot == &usage->slots[(key + kNewDocumentPlugInUsageMaxProbes) % kNewDocumentPlugInUsageSlots]);
+	
+	free(usage);
+}
+
+/*
+ * TestConcurrentUsageSlotClaim
+ *
+ * Several threads claim the same colliding keys at the same time, each in
+ * its own order, as host processes do : each key must get a single slot,
+ * found by every thread, and count every use.
+ */
+static void TestConcurrentUsageSlotClaim()
+{
+	TestUsageThread threads[kTestUsageThreads];
+	TemplateUsageFile *usage;
+	TemplateUsageSlot *slot;
+	int i, j;
+	
+	usage = (TemplateUsageFile*) calloc(1, sizeof(TemplateUsageFile));
+	test_check(usage != NULL);
+	if (usage == NULL)
+		return;
+	
+	for (i = 0; i < kTestUsageThreads; i++) {
+		threads[i].usage = usage;
+		threads[i].first = i * 37;
+		test_check(pthread_create(&threads[i].thread, NULL, TestUsageThreadMain, &threads[i]) == 0);
+	}
+	for (i = 0; i < kTestUsageThreads; i++)
+		pthread_join(threads[i].thread, NULL);
+	
+	for (j = 0; j < kTestUsageKeys; j++) {
+		slot = threads[0].slots[j];
+		test_check(slot != NULL && slot->key == GetTestUsageKey(j));
+		test_check(slot != NULL && slot->uses == kTestUsageThreads);
+		for (i = 1; i < kTestUsageThreads; i++)
+			test_check(threads[i].slots[j] == slot);
+	}
+	
+	// No key has a second slot
+	for (j = 0, i = 0; i < kNewDocumentPlugInUsageSlots; i++)
+		j += (usage->slots[i].key != 0);
+	test_check(j == kTestUsageKeys);
+	
+	free(usage);
+}
+
+/*
+ * TestUsageThreadMain
+ *
+ * Main function of the threads of the concurrent usage test : claim every
+ * test key, from a key of its own, and count a use of each.
+ */
+static void* TestUsageThreadMain(void *thread)
+{
+	TestUsageThread *usageThread = (TestUsageThread*) thread;
+	TemplateUsageSlot *slot;
+	int i, j;
+	
+	for (i = 0; i < kTestUsageKeys; i++) {
+		j = (usageThread->first + i) % kTestUsageKeys;
+		slot = GetTemplateUsageSlot(usageThread->usage, GetTestUsageKey(j), true);
+		usageThread->slots[j] = slot;
+		if (slot != NULL)
+			AtomicAdd64(&slot->uses, 1);
+	}
+	
+	return NULL;
+}
+
+/*
+ * GetTestUsageKey
+ *
+ * Return the nth key of the concurrent usage test. Keys come in groups of 8
+ * sharing the same first slot, 16 slots apart.
+ */
+static SInt64 GetTestUsageKey(int n)
+{
+	return 1 + (n / 8) * 16 + (SInt64)(n % 8) * kNewDocumentPlugInUsageSlots;
+}
+
+/*
+ * TestUsageScores
+ *
+ * The score of a template halves every kNewDocumentPlugInUsageHalfLife
+ * seconds without use, and templates are ranked by decreasing score, then by
+ * table index.
+ */
+static void TestUsageScores()
+{
+	TemplateRank ranks[] = { { 1, 0 }, { 3, 1 }, { 3, 2 }, { 0, 3 }, { 2, 4 }, { 3, 5 } };
+	static const CFIndex sorted[] = { 1, 2, 5, 4, 0, 3 };
+	TemplateUsageFile *usage;
+	TemplateUsageSlot *slot;
+	CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+	SInt64 key = 42;
+	int i;
+	
+	usage = (TemplateUsageFile*) calloc(1, sizeof(TemplateUsageFile));
+	test_check(usage != NULL);
+	if (usage == NULL)
+		return;
+	
+	test_check(GetTemplateUsageScore(usage, key, now) == 0);
+	slot = GetTemplateUsageSlot(usage, key, true);
+	test_check(slot != NULL);
+	if (slot != NULL) {
+		test_check(GetTemplateUsageScore(usage, key, now) == 0);
+		slot->uses = 8;
+		slot->lastUse = (SInt64)now;
+		test_check(fabs(GetTemplateUsageScore(usage, key, (SInt64)now) - 8) < 1e-9);
+		test_check(fabs(GetTemplateUsageScore(usage, key, (SInt64)now + kNewDocumentPlugInUsageHalfLife) - 4) < 1e-9);
+		test_check(fabs(GetTemplateUsageScore(usage, key, (SInt64)now + 3 * kNewDocumentPlugInUsageHalfLife) - 1) < 1e-9);
+		
+		// A use recorded by a process whose clock is ahead doesn't count more
+		test_check(fabs(GetTemplateUsageScore(usage, key, (SInt64)now - 1000) - 8) < 1e-9);
+	}
+	
+	qsort(ranks, sizeof(ranks) / sizeof(ranks[0]), sizeof(TemplateRank), CompareTemplateRanks);
+	for (i = 0; i < sizeof(ranks) / sizeof(ranks[0]); i++)
+		test_check(ranks[i].index == sorted[i]);
+	
+	free(usage);
+}
+
+/*
+ * TestTemplatesMenuOrder
+ *
+ * Benchmark of the menu order at kTestMenuOrderTemplates templates, in
+ * categories of 100 templates, some of them used. Categories keep the table
+ * order, the templates of a category are listed by decreasing score, and the
+ * frequent templates are the best of those used often enough. Without
+ * statistics, the table order is kept.
+ */
+static void TestTemplatesMenuOrder()
+{
+	TemplateTable *table;
+	TemplateUsageFile *usage;
+	TemplateUsageSlot *slot;
+	CFIndex *order, frequent[kNewDocumentPlugInFrequentItems], frequentCount, i, best = -1;
+	CFAbsoluteTime now = CFAbsoluteTimeGetCurrent(), startDate;
+	SInt64 elapsed;
+	double score, previousScore = 0, bestScore = 0;
+	int run;
+	
+	table = CreateTestTemplateTable(kTestMenuOrderTemplates);
+	usage = (TemplateUsageFile*) calloc(1, sizeof(TemplateUsageFile));
+	test_check(table != NULL && usage != NULL);
+	if (table == NULL || usage == NULL) {
+		FreeTestTemplateTable(table);
+		free(usage);
+		return;
+	}
+	
+	// Without statistics
+	pthread_once(&gTemplateUsageOnce, IgnoreTemplateUsageFile);
+	gTemplateUsage = NULL;
+	order = CreateTemplatesMenuOrder(table, frequent, &frequentCount);
+	test_check(order != NULL && frequentCount == 0);
+	for (i = 0; order != NULL && i < table->count; i++)
+		test_check(order[i] == i);
+	free(order);
+	
+	// One template out of 7 used, at various dates
+	gTemplateUsage = usage;
+	for (i = 0; i < table->count; i += 7) {
+		slot = GetTemplateUsageSlot(usage, table->usageKeys[i], true);
+		if (slot == NULL)
+			continue;
+		slot->uses = i % 13 + 1;
+		slot->lastUse = (SInt64)now - (i % 5) * 24 * 3600;
+		score = GetTemplateUsageScore(usage, table->usageKeys[i], now);
+		if (slot->uses >= kNewDocumentPlugInFrequentMinUses && score > bestScore) {
+			best = i;
+			bestScore = score;
+		}
+	}
+	
+	startDate = CFAbsoluteTimeGetCurrent();
+	for (run = 0; run < kTestMenuOrderRuns; run++)
+		free(CreateTemplatesMenuOrder(table, frequent, &frequentCount));
+	elapsed = GetElapsedMicroseconds(startDate);
+	
+	order = CreateTemplatesMenuOrder(table, frequent, &frequentCount);
+	test_check(order != NULL);
+	for (i = 0; order != NULL && i < table->count; i++) {
+		// Categories are runs of 100 templates
+		test_check(order[i] / 100 == i / 100);
+		score = GetTemplateUsageScore(usage, table->usageKeys[order[i]], now);
+		if (i % 100 != 0) {
+			test_check(score <= previousScore);
+			if (score == previousScore)
+				test_check(order[i] > order[i - 1]);
+		}
+		previousScore = score;
+	}
+	free(order);
+	
+	test_check(frequentCount == kNewDocumentPlugInFrequentItems);
+	test_check(frequent[0] == best);
+	for (i = 0; i < frequentCount; i++) {
+		slot = GetTemplateUsageSlot(usage, table->usageKeys[frequent[i]], false);
+		test_check(slot != NULL && slot->uses >= kNewDocumentPlugInFrequentMinUses);
+		score = GetTemplateUsageScore(usage, table->usageKeys[frequent[i]], now);
+		test_check(i == 0 || score <= previousScore);
+		previousScore = score;
+	}
+	
+	printf("NewDocumentPlugInTests : menu order of %d templates : %.2f us\n",
+		   kTestMenuOrderTemplates, (double)elapsed / kTestMenuOrderRuns);
+	
+	gTemplateUsage = NULL;
+	FreeTestTemplateTable(table);
+	free(usage);
+}
+
+/*
+ * CreateTestTemplateTable
+ *
+ * Create a templates table holding only what menus are ordered from : the
+ * names "CategoryNNN/TemplateNNNNN", in categories of 100 templates, and their
+ * usage keys.
+ */
+static TemplateTable* CreateTestTemplateTable(CFIndex count)
+{
+	TemplateTable *table;
+	char name[32];
+	CFIndex i, j, length = 25;
+	
+	table = (TemplateTable*) calloc(1, sizeof(TemplateTable));
+	if (table == NULL)
+		return NULL;
+	table->count = count;
+	table->strings = (UniChar*) malloc(count * length * sizeof(UniChar));
+	table->nameOffsets = (CFIndex*) malloc(count * sizeof(CFIndex));
+	table->categoryLengths = (UInt16*) malloc(count * sizeof(UInt16));
+	table->usageKeys = (SInt64*) malloc(count * sizeof(SInt64));
+	if (table->strings == NULL || table->nameOffsets == NULL || table->categoryLengths == NULL || table->usageKeys == NULL) {
+		FreeTestTemplateTable(table);
+		return NULL;
+	}
+	
+	for (i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "Category%03ld/Template%05ld", (long)(i / 100), (long)i);
+		for (j = 0; j < length; j++)
+			table->strings[i * length + j] = name[j];
+		table->nameOffsets[i] = i * length;
+		table->categoryLengths[i] = 11;
+		table->usageKeys[i] = GetTemplateUsageKey(table->strings + i * length, length);
+	}
+	
+	return table;
+}
+
+/*
+ * FreeTestTemplateTable
+ *
+ * Free a table created by the tests, which may be NULL.
+ */
+static void FreeTestTemplateTable(TemplateTable *table)
+{
+	if (table == NULL)
+		return;
+	
+	if (table->manifest != NULL)
+		CFRelease(table->manifest);
+	free(table->strings);
+	free(table->nameOffsets);
+	free(table->nameLengths);
+	free(table->categoryLengths);
+	free(table->fileNames);
+	free(table->documentNameOffsets);
+	free(table->extensionsNameOffsets);
+	free(table->sizes);
+	free(table->flags);
+	free(table->trees);
+	free(table->usageKeys);
+	free(table);
+}
+
+/*
+ * IgnoreTemplateUsageFile
+ *
+ * Stands for MapTemplateUsageFile : the tests use their own statistics, not
+ * the ones of the user.
+ */
+static void IgnoreTemplateUsageFile()
+{
+}
+
+// -----------------------------------------------------------------------------
+//	Creation executor tests
+// -----------------------------------------------------------------------------
+
+/*
+ * TestCreationExecutor
+ *
+ * Creations submitted together get their own names, and are written from the
+ * template. Stopping the executor joins its threads and detaches it from the
+ * run loop; the next submission starts it again.
+ */
+static void TestCreationExecutor()
+{
+	char templatesPath[PATH_MAX], path[PATH_MAX];
+	CFURLRef directoryURL;
+	CreationRequest *completed, *request;
+	SInt64 creations;
+	int i, lane;
+	
+	strlcpy(path, "/tmp/NewDocumentPlugInTests.XXXXXX", sizeof(path));
+	test_check(mkdtemp(path) != NULL);
+	test_check(InstallTestTemplates(templatesPath, sizeof(templatesPath)));
+	directoryURL = CFURLCreateFromFileSystemRepresentation(NULL, (const UInt8*)path, strlen(path), true);
+	creations = GetMetric(&gMetrics.creations);
+	
+	for (i = 0; i < 2; i++)
+		test_check(SubmitCreationRequest(0, directoryURL, kNewDocumentPlugInInteractiveLane, NULL, NULL) == noErr);
+	test_check(gCompletionSource != NULL && gCreationThreadsCount == kNewDocumentPlugInCreationThreads);
+	completed = WaitForTestCreations(2);
+	for (request = completed; request != NULL; request = request->next)
+		test_check(request->status == noErr);
+	FreeTestCreations(completed);
+	test_check(GetMetric(&gMetrics.creations) == creations + 2);
+	test_check(GetTestDocumentSize(path, "note.txt") == kTestTemplateSize);
+	test_check(GetTestDocumentSize(path, "note 2.txt") == kTestTemplateSize);
+	
+	StopCreationExecutor();
+	test_check(gCompletionSource == NULL && gHostRunLoop == NULL && gCreationThreadsCount == 0);
+	for (lane = 0; lane < kNewDocumentPlugInLanes; lane++)
+		test_check(gPendingCreations[lane].head == NULL && gRunningCreations[lane].head == NULL);
+	
+	test_check(SubmitCreationRequest(0, directoryURL, kNewDocumentPlugInInteractiveLane, NULL, NULL) == noErr);
+	completed = WaitForTestCreations(1);
+	test_check(completed != NULL && completed->status == noErr);
+	FreeTestCreations(completed);
+	test_check(GetTestDocumentSize(path, "note 3.txt") == kTestTemplateSize);
+	StopCreationExecutor();
+	test_check(gCompletionSource == NULL && gCreationThreadsCount == 0);
+	
+	CFRelease(directoryURL);
+	RemoveTestTemplates(templatesPath);
+	RemoveTestDirectory(path);
+}
+
+/*
+ * TestMultipleSelectionCreations
+ *
+ * Benchmark of a multiple selection : a document created in each of
+ * kTestSelectedDirectories directories, as a batch of bulk creations, then
+ * one directory after the other on the calling thread.
+ */
+static void TestMultipleSelectionCreations()
+{
+	char templatesPath[PATH_MAX], path[PATH_MAX];
+	CFURLRef *urls;
+	CreationBatch batch = { kTestSelectedDirectories, kTestSelectedDirectories, 0 };
+	NewDocumentCreationRef creation;
+	CreationRequest *completed, *request;
+	CFAbsoluteTime startDate;
+	SInt64 parallel, sequential;
+	int i, created = 0;
+	
+	urls = (CFURLRef*) malloc(kTestSelectedDirectories * sizeof(CFURLRef));
+	test_check(urls != NULL);
+	if (urls == NULL)
+		return;
+	test_check(InstallTestTemplates(templatesPath, sizeof(templatesPath)));
+	test_check(CreateTestDirectories(path, sizeof(path), kTestSelectedDirectories, urls));
+	
+	startDate = CFAbsoluteTimeGetCurrent();
+	for (i = 0; i < kTestSelectedDirectories; i++)
+		test_check(SubmitCreationRequest(0, urls[i], kNewDocumentPlugInBulkLane, &batch, NULL) == noErr);
+	completed = WaitForTestCreations(kTestSelectedDirectories);
+	parallel = GetElapsedMicroseconds(startDate);
+	for (request = completed; request != NULL; request = request->next) {
+		if (request->status == noErr)
+			created++;
+	}
+	FreeTestCreations(completed);
+	test_check(created == kTestSelectedDirectories);
+	StopCreationExecutor();
+	
+	created = 0;
+	startDate = CFAbsoluteTimeGetCurrent();
+	for (i = 0; i < kTestSelectedDirectories; i++) {
+		if (NewDocumentPlugInCreateDocument(0, urls[i], NULL, NULL, &creation) != noErr)
+			continue;
+		while (!NewDocumentPlugInStepCreation(creation))
+			;
+		if (NewDocumentPlugInPollCreation(creation, NULL) == noErr)
+			created++;
+		NewDocumentPlugInDisposeCreation(creation);
+	}
+	sequential = GetElapsedMicroseconds(startDate);
+	test_check(created == kTestSelectedDirectories);
+	
+	printf("NewDocumentPlugInTests : a document in each of %d directories : %.1f ms as a batch, %.1f ms one after the other\n",
+		   kTestSelectedDirectories, parallel / 1000.0, sequential / 1000.0);
+	
+	for (i = 0; i < kTestSelectedDirectories; i++)
+		CFRelease(urls[i]);
+	free(urls);
+	RemoveTestTemplates(templatesPath);
+	RemoveTestDirectory(path);
+}
+
+/*
+ * InstallTestTemplates
+ *
+ * Create a templates directory holding kTestTemplateName, and make it the
+ * templates of the plugin, with a table of its own : the test tool has no
+ * bundle to find templates in. The manifest is never checked again, so the
+ * table stays.
+ */
+static Boolean InstallTestTemplates(char *path, size_t size)
+{
+	static const char fileNames[] = "note\0.txt";
+	const char *name = kTestTemplateName;
+	TemplateTable *table;
+	CFURLRef templateURL;
+	CFIndex i, length = strlen(name);
+	
+	strlcpy(path, "/tmp/NewDocumentPlugInTests.XXXXXX", size);
+	if (mkdtemp(path) == NULL)
+		return false;
+	templateURL = CreateTestTemplate(path, name, kTestTemplateSize, 'a');
+	if (templateURL == NULL)
+		return false;
+	CFRelease(templateURL);
+	
+	table = (TemplateTable*) calloc(1, sizeof(TemplateTable));
+	if (table == NULL)
+		return false;
+	table->refCount = 1;
+	table->count = 1;
+	table->manifest = CFDictionaryCreate(NULL, NULL, NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	table->strings = (UniChar*) malloc(length * sizeof(UniChar));
+	table->nameOffsets = (CFIndex*) calloc(1, sizeof(CFIndex));
+	table->nameLengths = (UInt16*) calloc(1, sizeof(UInt16));
+	table->categoryLengths = (UInt16*) calloc(1, sizeof(UInt16));
+	table->fileNames = (char*) malloc(sizeof(fileNames));
+	table->documentNameOffsets = (CFIndex*) calloc(1, sizeof(CFIndex));
+	table->extensionsNameOffsets = (CFIndex*) calloc(1, sizeof(CFIndex));
+	table->sizes = (SInt64*) calloc(1, sizeof(SInt64));
+	table->flags = (UInt8*) calloc(1, sizeof(UInt8));
+	table->trees = (CFArrayRef*) calloc(1, sizeof(CFArrayRef));
+	table->usageKeys = (SInt64*) calloc(1, sizeof(SInt64));
+	if (table->manifest == NULL || table->strings == NULL || table->nameOffsets == NULL
+		|| table->nameLengths == NULL || table->categoryLengths == NULL || table->fileNames == NULL
+		|| table->documentNameOffsets == NULL || table->extensionsNameOffsets == NULL
+		|| table->sizes == NULL || table->flags == NULL || table->trees == NULL || table->usageKeys == NULL) {
+		FreeTestTemplateTable(table);
+		return false;
+	}
+	
+	for (i = 0; i < length; i++)
+		table->strings[i] = name[i];
+	table->nameLengths[0] = length;
+	memcpy(table->fileNames, fileNames, sizeof(fileNames));
+	table->extensionsNameOffsets[0] = strlen(fileNames) + 1;
+	table->sizes[0] = kTestTemplateSize;
+	table->usageKeys[0] = GetTemplateUsageKey(table->strings, length);
+	
+	pthread_mutex_lock(&gTemplatesManifestMutex);
+	gTemplatesPath = CFStringCreateWithFileSystemRepresentation(NULL, path);
+	gTemplatesManifest = (CFDictionaryRef)CFRetain(table->manifest);
+	gTemplatesManifestCheckDate = CFAbsoluteTimeGetCurrent() + 24 * 3600;
+	gTemplateTable = table;
+	pthread_mutex_unlock(&gTemplatesManifestMutex);
+	
+	return true;
+}
+
+/*
+ * RemoveTestTemplates
+ *
+ * Uninstall the templates installed by InstallTestTemplates, which must not
+ * be used anymore, and remove their directory.
+ */
+static void RemoveTestTemplates(const char *path)
+{
+	TemplateTable *table;
+	
+	pthread_mutex_lock(&gTemplatesManifestMutex);
+	table = gTemplateTable;
+	gTemplateTable = NULL;
+	if (gTemplatesManifest != NULL)
+		CFRelease(gTemplatesManifest);
+	gTemplatesManifest = NULL;
+	if (gTemplatesPath != NULL)
+		CFRelease(gTemplatesPath);
+	gTemplatesPath = NULL;
+	pthread_mutex_unlock(&gTemplatesManifestMutex);
+	
+	// Every creation released the table
+	test_check(table != NULL && table->refCount == 1);
+	FreeTestTemplateTable(table);
+	
+	TrimTemplateContentCache(CFAbsoluteTimeGetCurrent(), 0);
+	RemoveTestDirectory(path);
+}
+
+/*
+ * WaitForTestCreations
+ *
+ * Wait for count creation requests to complete, for kTestCreationsTimeout
+ * seconds at most, and take every completed request off the completion queue
+ * in place of the host run loop. Returns them in completion order, linked by
+ * their next field, or NULL if less than count completed in time.
+ */
+static CreationRequest* WaitForTestCreations(UInt32 count)
+{
+	CreationRequest *completed = NULL;
+	CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + kTestCreationsTimeout;
+	Boolean done = false;
+	
+	while (!done && CFAbsoluteTimeGetCurrent() < deadline) {
+		pthread_mutex_lock(&gCreationMutex);
+		done = (gCompletedCreations.count >= count);
+		if (done) {
+			completed = gCompletedCreations.head;
+			gCompletedCreations.head = NULL;
+			gCompletedCreations.tail = NULL;
+			gCompletedCreations.count = 0;
+		}
+		pthread_mutex_unlock(&gCreationMutex);
+		if (!done)
+			usleep(1000);
+	}
+	
+	test_check(done);
+	return completed;
+}
+
+/*
+ * FreeTestCreations
+ *
+ * Free the requests returned by WaitForTestCreations. Their batches are left
+ * to the test.
+ */
+static void FreeTestCreations(CreationRequest *requests)
+{
+	CreationRequest *request;
+	
+	while (requests != NULL) {
+		request = requests;
+		requests = request->next;
+		FreeCreationRequest(request);
+	}
+}
+
+/*
+ * GetTestDocumentSize
+ *
+ * Return the size of a document in a test directory, or -1 if there is none.
+ */
+static off_t GetTestDocumentSize(const char *directory, const char *name)
+{
+	char path[PATH_MAX];
+	struct stat info;
+	
+	snprintf(path, sizeof(path), "%s/%s", directory, name);
+	if (stat(path, &info) != 0)
+		return -1;
+	
+	return info.st_size;
+}
+/*
+ * CountRunningTestCreations
+ *
+ * Return the number of creation requests of a lane being performed.
+ */
+static UInt32 CountRunningTestCreations(int lane)
+{
+	UInt32 count;
+	
+	pthread_mutex_lock(&gCreationMutex);
+	count = gRunningCreations[lane].count;
+	pthread_mutex_unlock(&gCreationMutex);
+	
+	return count;
+}
+
+/*
+ * CreateTestDirectories
+ *
+ * Create a test directory holding count directories, named after their
+ * index, and return their URLs.
+ */
+static Boolean CreateTestDirectories(char *path, size_t size, int count, CFURLRef *outURLs)
+{
+	char directory[PATH_MAX];
+	int i;
+	
+	strlcpy(path, "/tmp/NewDocumentPlugInTests.XXXXXX", size);
+	if (mkdtemp(path) == NULL)
+		return false;
+	
+	for (i = 0; i < count; i++) {
+		snprintf(directory, sizeof(directory), "%s/%d", path, i);
+		if (mkdir(directory, 0755) != 0)
+			return false;
+		outURLs[i] = CFURLCreateFromFileSystemRepresentation(NULL, (const UInt8*)directory, strlen(directory), true);
+	}
+	
+	return true;
+}
+
+// -----------------------------------------------------------------------------
+//	Creation API tests
+// -----------------------------------------------------------------------------
+
+/*
+ * TestCreationAPI
+ *
+ * The executor is called once per step to perform, and the status stays
+ * kNewDocumentPlugInCreationInProgressErr until the creation is done. The
+ * test tool has no templates bundle, so creations fail at their open step,
+ * unless they are cancelled first. A creation disposed of before it is done
+ * is completed without calling its executor again.
+ */
+static void TestCreationAPI()
+{
+	NewDocumentCreationRef creation, slots[2];
+	TestCreationQueue queue = { slots, 2, 0 };
+	CFURLRef directoryURL;
+	CFStringRef itemName;
+	OSStatus err;
+	
+	directoryURL = CFURLCreateWithFileSystemPath(NULL, CFSTR("/tmp"), kCFURLPOSIXPathStyle, true);
+	
+	err = NewDocumentPlugInCreateDocument(0, directoryURL, QueueTestCreation, &queue, &creation);
+	test_check(err == noErr && queue.count == 1 && slots[0] == creation);
+	if (err == noErr) {
+		test_check(NewDocumentPlugInPollCreation(creation, &itemName) == kNewDocumentPlugInCreationInProgressErr && itemName == NULL);
+		test_check(NewDocumentPlugInStepCreation(creation));
+		test_check(queue.count == 1);
+		err = NewDocumentPlugInPollCreation(creation, &itemName);
+		test_check(err != noErr && err != kNewDocumentPlugInCreationInProgressErr && itemName == NULL);
+		test_check(NewDocumentPlugInStepCreation(creation) && queue.count == 1);
+		NewDocumentPlugInDisposeCreation(creation);
+	}
+	
+	err = NewDocumentPlugInCreateDocument(0, directoryURL, NULL, NULL, &creation);
+	test_check(err == noErr);
+	if (err == noErr) {
+		NewDocumentPlugInCancelCreation(creation);
+		test_check(NewDocumentPlugInStepCreation(creation));
+		test_check(NewDocumentPlugInPollCreation(creation, NULL) == userCanceledErr);
+		NewDocumentPlugInDisposeCreation(creation);
+	}
+	
+	queue.count = 0;
+	err = NewDocumentPlugInCreateDocument(0, directoryURL, QueueTestCreation, &queue, &creation);
+	test_check(err == noErr && queue.count == 1);
+	if (err == noErr)
+		NewDocumentPlugInDisposeCreation(creation);
+	test_check(queue.count == 1);
+	
+	test_check(NewDocumentPlugInCreateDocument(0, NULL, NULL, NULL, &creation) == paramErr);
+	
+	CFRelease(directoryURL);
+}
+
+/*
+ * TestCreationsInFlight
+ *
+ * Benchmark of the creation API : kTestCreationsInFlight creations in flight
+ * on a single thread, whose executor queues them, and the memory each one
+ * takes while pending.
+ */
+static void TestCreationsInFlight()
+{
+	TestCreationQueue queue = { NULL, kTestCreationsInFlight, 0 };
+	NewDocumentCreationRef creation;
+	CFURLRef directoryURL;
+	CFAbsoluteTime startDate;
+	SInt64 elapsed;
+	UInt32 i, steps = 0, done = 0;
+	
+	queue.creations = malloc(kTestCreationsInFlight * sizeof(NewDocumentCreationRef));
+	test_check(queue.creations != NULL);
+	if (queue.creations == NULL)
+		return;
+	directoryURL = CFURLCreateWithFileSystemPath(NULL, CFSTR("/tmp"), kCFURLPOSIXPathStyle, true);
+	
+	startDate = CFAbsoluteTimeGetCurrent();
+	for (i = 0; i < kTestCreationsInFlight; i++)
+		test_check(NewDocumentPlugInCreateDocument(0, directoryURL, QueueTestCreation, &queue, &creation) == noErr);
+	test_check(queue.count == kTestCreationsInFlight);
+	
+	// Drive the creations one step at a time, in the order the executor
+	// scheduled them, and dispose of them once done
+	for (i = 0; i < queue.count; i++, steps++) {
+		creation = queue.creations[i % queue.capacity];
+		if (NewDocumentPlugInStepCreation(creation)) {
+			test_check(NewDocumentPlugInPollCreation(creation, NULL) != kNewDocumentPlugInCreationInProgressErr);
+			NewDocumentPlugInDisposeCreation(creation);
+			done++;
+		}
+	}
+	elapsed = GetElapsedMicroseconds(startDate);
+	test_check(done == kTestCreationsInFlight);
+	
+	printf("NewDocumentPlugInTests : %d creations in flight on one thread, %lu bytes each, %.2f us per step\n",
+		   kTestCreationsInFlight, (unsigned long)sizeof(CreationRequest), (double)elapsed / steps);
+	
+	CFRelease(directoryURL);
+	free(queue.creations);
+}
+
+/*
+ * QueueTestCreation
+ *
+ * Executor of the creation API tests : queue the creation in a ring buffer, to
+ * be stepped by the test. A creation waits for one step at most, so the
+ * buffer holds every creation in flight.
+ */
+static void QueueTestCreation(NewDocumentCreationRef creation, void *info)
+{
+	TestCreationQueue *queue = (TestCreationQueue*) info;
+	
+	queue->creations[queue->count % queue->capacity] = creation;
+	queue->count++;
+}
+
+#ifdef DEBUG
+
+// -----------------------------------------------------------------------------
+//	File system simulator tests
+// -----------------------------------------------------------------------------
+
+/*
+ * TestSimulatedFileSystemErrors
+ *
+ * A failed stat fails the name resolution without keeping a number, a
+ * directory that could not be read is read again on next use, and a failed
+ * open or write reports the matching File Manager error and leaves no
+ * document behind.
+ */
+static void TestSimulatedFileSystemErrors()
+{
+	char path[PATH_MAX], name[NAME_MAX + 1];
+	CFDataRef contents;
+	FSRef item;
+	struct stat info;
+	SInt64 failures;
+	int fd, suffix;
+	
+	strlcpy(path, "/tmp/NewDocumentPlugInTests.XXXXXX", sizeof(path));
+	test_check(mkdtemp(path) != NULL);
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	test_check(fd >= 0);
+	if (fd < 0)
+		return;
+	test_check(CreateTestFile(fd, "untitled.txt"));
+	test_check(CreateTestFile(fd, "notes.txt"));
+	
+	// The directory state is unknown : no name
+	failures = GetMetric(&gMetrics.nameResolutionFailures);
+	SimulateTestFileSystemCall(kNewDocumentPlugInStatCall, 0, 1, EIO);
+	test_check(!ResolveDocumentName(path, fd, "untitled", ".txt", name, sizeof(name), &suffix));
+	test_check(GetMetric(&gMetrics.nameResolutionFailures) == failures + 1);
+	SimulateTestFileSystemCall(kNewDocumentPlugInStatCall, 0, 0, 0);
+	test_check(ResolveDocumentName(path, fd, "untitled", ".txt", name, sizeof(name), &suffix));
+	test_check(suffix == 2);
+	ReleaseDocumentName(path, "untitled", ".txt", suffix, false);
+	
+	// The directory can't be read : it is read again once it can
+	SimulateTestFileSystemCall(kNewDocumentPlugInReadDirCall, 0, 1, EIO);
+	test_check(ResolveDocumentName(path, fd, "notes", ".txt", name, sizeof(name), &suffix));
+	ReleaseDocumentName(path, "notes", ".txt", suffix, false);
+	SimulateTestFileSystemCall(kNewDocumentPlugInReadDirCall, 0, 0, 0);
+	test_check(ResolveDocumentName(path, fd, "notes", ".txt", name, sizeof(name), &suffix));
+	test_check(suffix == 2);
+	ReleaseDocumentName(path, "notes", ".txt", suffix, false);
+	
+	// The volume is full, or the directory is not writable
+	contents = CFDataCreate(NULL, (const UInt8*)"contents", 8);
+	SimulateTestFileSystemCall(kNewDocumentPlugInWriteCall, 0, 1, ENOSPC);
+	test_check(WriteTemplateContents(contents, "/dev/null", path, fd, "full.txt", &item) == dskFulErr);
+	test_check(StatAt(fd, "full.txt", &info, AT_SYMLINK_NOFOLLOW) != 0);
+	SimulateTestFileSystemCall(kNewDocumentPlugInWriteCall, 0, 0, 0);
+	SimulateTestFileSystemCall(kNewDocumentPlugInOpenCall, 0, 1, EACCES);
+	test_check(WriteTemplateContents(contents, "/dev/null", path, fd, "denied.txt", &item) == permErr);
+	test_check(StatAt(fd, "denied.txt", &info, AT_SYMLINK_NOFOLLOW) != 0);
+	SimulateTestFileSystemCall(kNewDocumentPlugInOpenCall, 0, 0, 0);
+	CFRelease(contents);
+	
+	close(fd);
+	RemoveTestDirectory(path);
+}
+
+/*
+ * TestCloneFallback
+ *
+ * The files of a package template are cloned from the blob store. On volumes
+ * that can't clone (ENOTSUP, or EXDEV across volumes), they are copied
+ * instead, with the same contents; any other clone error fails the creation
+ * and leaves no document behind.
+ */
+static void TestCloneFallback()
+{
+	static const int fallbackErrors[] = { ENOTSUP, EXDEV };
+	char path[PATH_MAX], templatePath[PATH_MAX], itemPath[PATH_MAX], documentPath[PATH_MAX];
+	char blobsPath[PATH_MAX], target[PATH_MAX];
+	CFDictionaryRef knownFiles;
+	CFMutableArrayRef tree;
+	CFURLRef url;
+	SInt64 size = 0, calls;
+	FSRef item;
+	struct stat info;
+	ssize_t length;
+	int fd, i;
+	
+	strlcpy(path, "/tmp/NewDocumentPlugInTests.XXXXXX", sizeof(path));
+	test_check(mkdtemp(path) != NULL);
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	test_check(fd >= 0);
+	if (fd < 0)
+		return;
+	
+	// A package with a file, a directory and a link to the file
+	snprintf(templatePath, sizeof(templatePath), "%s/Template.rtfd", path);
+	snprintf(itemPath, sizeof(itemPath), "%s/Images", templatePath);
+	test_check(mkdir(templatePath, 0755) == 0 && mkdir(itemPath, 0755) == 0);
+	url = CreateTestTemplate(templatePath, "TXT.rtf", kTestTemplateSize, 't');
+	test_check(url != NULL);
+	if (url != NULL)
+		CFRelease(url);
+	url = CreateTestTemplate(itemPath, "Cover.png", 2 * kTestTemplateSize, 'p');
+	test_check(url != NULL);
+	if (url != NULL)
+		CFRelease(url);
+	snprintf(itemPath, sizeof(itemPath), "%s/Images/Text.rtf", templatePath);
+	test_check(symlink("../TXT.rtf", itemPath) == 0);
+	
+	knownFiles = CFDictionaryCreate(NULL, NULL, NULL, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	tree = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+	AppendTemplateTree(templatePath, "", knownFiles, tree, &size);
+	test_check(CFArrayGetCount(tree) == 4 && size == 3 * kTestTemplateSize);
+	
+	// A blob store of its own
+	pthread_once(&gTemplateBlobsOnce, InitTemplateBlobStore);
+	strlcpy(blobsPath, gTemplateBlobsPath, sizeof(blobsPath));
+	snprintf(gTemplateBlobsPath, sizeof(gTemplateBlobsPath), "%s/Blobs", path);
+	test_check(mkdir(gTemplateBlobsPath, 0755) == 0);
+	
+	// The volume can't clone : copies
+	for (i = 0; i < sizeof(fallbackErrors) / sizeof(fallbackErrors[0]); i++) {
+		SimulateTestFileSystemCall(kNewDocumentPlugInCloneCall, 0, 1, fallbackErrors[i]);
+		calls = GetMetric(&gMetrics.fileSystemCalls[kNewDocumentPlugInCloneCall]);
+		snprintf(itemPath, sizeof(itemPath), "Copy %d.rtfd", i);
+		test_check(InstantiateTemplateTree(tree, templatePath, path, fd, itemPath, &item) == noErr);
+		test_check(clonefileat == NULL || GetMetric(&gMetrics.fileSystemCalls[kNewDocumentPlugInCloneCall]) == calls + 2);
+		
+		snprintf(documentPath, sizeof(documentPath), "%s/%s", path, itemPath);
+		snprintf(itemPath, sizeof(itemPath), "%s/TXT.rtf", templatePath);
+		snprintf(target, sizeof(target), "%s/TXT.rtf", documentPath);
+		test_check(CompareTestFiles(itemPath, target));
+		snprintf(itemPath, sizeof(itemPath), "%s/Images/Cover.png", templatePath);
+		snprintf(target, sizeof(target), "%s/Images/Cover.png", documentPath);
+		test_check(CompareTestFiles(itemPath, target));
+		snprintf(itemPath, sizeof(itemPath), "%s/Images/Text.rtf", documentPath);
+		length = readlink(itemPath, target, sizeof(target) - 1);
+		test_check(length == 10 && strncmp(target, "../TXT.rtf", 10) == 0);
+	}
+	
+	// Other errors fail the creation
+	SimulateTestFileSystemCall(kNewDocumentPlugInCloneCall, 0, 1, EIO);
+	test_check(InstantiateTemplateTree(tree, templatePath, path, fd, "Failed.rtfd", &item) == ioErr);
+	test_check(StatAt(fd, "Failed.rtfd", &info, AT_SYMLINK_NOFOLLOW) != 0);
+	
+	// Clones
+	SimulateTestFileSystemCall(kNewDocumentPlugInCloneCall, 0, 0, 0);
+	test_check(InstantiateTemplateTree(tree, templatePath, path, fd, "Clone.rtfd", &item) == noErr);
+	snprintf(itemPath, sizeof(itemPath), "%s/Images/Cover.png", templatePath);
+	snprintf(target, sizeof(target), "%s/Clone.rtfd/Images/Cover.png", path);
+	test_check(CompareTestFiles(itemPath, target));
+	
+	strlcpy(gTemplateBlobsPath, blobsPath, sizeof(gTemplateBlobsPath));
+	CFRelease(tree);
+	CFRelease(knownFiles);
+	close(fd);
+	RemoveTestDirectory(path);
+}
+
+/*
+ * TestSimulatedFileSystemLatency
+ *
+ * Each simulated call waits for its latency, and is counted. Slow stats and
+ * directory reads widen the window between the resolution of a name and the
+ * creation of its document : concurrent creations must still never collide.
+ */
+static void TestSimulatedFileSystemLatency()
+{
+	CFAbsoluteTime startDate;
+	SInt64 calls;
+	
+	SimulateTestFileSystemCall(kNewDocumentPlugInStatCall, 1, 0, 0);
+	SimulateTestFileSystemCall(kNewDocumentPlugInReadDirCall, 2, 0, 0);
+	
+	calls = GetMetric(&gMetrics.fileSystemCalls[kNewDocumentPlugInStatCall]);
+	startDate = CFAbsoluteTimeGetCurrent();
+	test_check(SimulateFileSystemCallIfNeeded(kNewDocumentPlugInStatCall) == 0);
+	test_check(GetElapsedMicroseconds(startDate) >= 1000);
+	test_check(GetMetric(&gMetrics.fileSystemCalls[kNewDocumentPlugInStatCall]) == calls + 1);
+	
+	TestConcurrentNaming();
+	
+	SimulateTestFileSystemCall(kNewDocumentPlugInStatCall, 0, 0, 0);
+	SimulateTestFileSystemCall(kNewDocumentPlugInReadDirCall, 0, 0, 0);
+}
+
+/*
+ * TestHookOverhead
+ *
+ * Benchmark of the post-creation hooks : the time per document taken by
+ * queueing batches of 1 to 1000 documents and running their hooks. The
+ * Finder notification fails in the simulator, so RunPostCreationHooks stands
+ * in for a run of the hooks without the Finder. Queueing never runs the hooks
+ * itself, and a batch is cut in runs of kNewDocumentPlugInHookBatchSize
+ * documents.
+ */
+static void TestHookOverhead()
+{
+	static const int batchSizes[] = { 1, 10, 100, 1000 };
+	CFURLRef directoryURL;
+	CFAbsoluteTime startDate;
+	SInt64 runs, items, elapsed;
+	Boolean ownRunLoop = (gHostRunLoop == NULL);
+	int i, j;
+	
+	if (ownRunLoop)
+		gHostRunLoop = (CFRunLoopRef)CFRetain(CFRunLoopGetCurrent());
+	directoryURL = CFURLCreateWithFileSystemPath(NULL, CFSTR("/tmp"), kCFURLPOSIXPathStyle, true);
+	SimulateTestFileSystemCall(kNewDocumentPlugInNotifyCall, 0, 1, EIO);
+	
+	for (i = 0; i < sizeof(batchSizes) / sizeof(batchSizes[0]); i++) {
+		runs = GetMetric(&gMetrics.hookRuns);
+		items = GetMetric(&gMetrics.hookItems);
+		
+		startDate = CFAbsoluteTimeGetCurrent();
+		for (j = 0; j < batchSizes[i]; j++)
+			QueueHookItem(directoryURL, CFSTR("untitled.txt"), j == 0);
+		test_check(gHookItemsCount == batchSizes[i]);
+		FlushHookItems(NULL, NULL);
+		elapsed = GetElapsedMicroseconds(startDate);
+		
+		test_check(gHookItemsCount == 0 && gHookTimer == NULL);
+		test_check(GetMetric(&gMetrics.hookRuns) - runs == (batchSizes[i] + kNewDocumentPlugInHookBatchSize - 1) / kNewDocumentPlugInHookBatchSize);
+		test_check(GetMetric(&gMetrics.hookItems) - items == batchSizes[i]);
+		printf("NewDocumentPlugInTests : hooks, batches of %d : %.2f us per document\n",
+			   batchSizes[i], (double)elapsed / batchSizes[i]);
+	}
+	
+	SimulateTestFileSystemCall(kNewDocumentPlugInNotifyCall, 0, 0, 0);
+	CFRelease(directoryURL);
+	if (ownRunLoop) {
+		CFRelease(gHostRunLoop);
+		gHostRunLoop = NULL;
+	}
+}
+
+/*
+ * TestStalledCreationExecutor
+ *
+ * While the file system stalls for kTestStallLatency milliseconds on every
+ * directory open, submitting creations still returns at once. Stopping the
+ * executor then cancels them, waits for the stalled threads, and completes
+ * every request : the queues are empty, and no document is created.
+ */
+static void TestStalledCreationExecutor()
+{
+	char templatesPath[PATH_MAX], path[PATH_MAX];
+	CFURLRef directoryURL;
+	CFAbsoluteTime startDate;
+	SInt64 elapsed, longest = 0, creations, failures;
+	UInt32 requestID;
+	int i, lane;
+	
+	strlcpy(path, "/tmp/NewDocumentPlugInTests.XXXXXX", sizeof(path));
+	test_check(mkdtemp(path) != NULL);
+	test_check(InstallTestTemplates(templatesPath, sizeof(templatesPath)));
+	directoryURL = CFURLCreateFromFileSystemRepresentation(NULL, (const UInt8*)path, strlen(path), true);
+	creations = GetMetric(&gMetrics.creations);
+	failures = GetMetric(&gMetrics.creationFailures);
+	
+	SimulateTestFileSystemCall(kNewDocumentPlugInOpenCall, kTestStallLatency, 0, 0);
+	for (i = 0; i < kTestStalledCreations; i++) {
+		startDate = CFAbsoluteTimeGetCurrent();
+		test_check(SubmitCreationRequest(0, directoryURL, kNewDocumentPlugInInteractiveLane, NULL, &requestID) == noErr);
+		elapsed = GetElapsedMicroseconds(startDate);
+		if (elapsed > longest)
+			longest = elapsed;
+	}
+	test_check(longest < kTestStallLatency * 1000 / 100);
+	
+	// Stop once every creation thread is stalled
+	for (i = 0; i < 1000 && CountRunningTestCreations(kNewDocumentPlugInInteractiveLane) < kNewDocumentPlugInCreationThreads; i++)
+		usleep(1000);
+	startDate = CFAbsoluteTimeGetCurrent();
+	StopCreationExecutor();
+	elapsed = GetElapsedMicroseconds(startDate);
+	SimulateTestFileSystemCall(kNewDocumentPlugInOpenCall, 0, 0, 0);
+	test_check(elapsed >= kTestStallLatency * 1000 / 2);
+	
+	test_check(gCompletionSource == NULL && gHostRunLoop == NULL && gCreationThreadsCount == 0);
+	for (lane = 0; lane < kNewDocumentPlugInLanes; lane++)
+		test_check(gPendingCreations[lane].head == NULL && gRunningCreations[lane].head == NULL);
+	test_check(gCompletedCreations.head == NULL);
+	test_check(GetMetric(&gMetrics.creations) == creations + kTestStalledCreations);
+	test_check(GetMetric(&gMetrics.creationFailures) == failures + kTestStalledCreations);
+	test_check(GetTestDocumentSize(path, "note.txt") < 0);
+	
+	printf("NewDocumentPlugInTests : file system stalled for %d ms : submissions in %lld us at most, executor stopped in %.2f s\n",
+		   kTestStallLatency, (long long)longest, elapsed / 1e6);
+	
+	CFRelease(directoryURL);
+	RemoveTestTemplates(templatesPath);
+	RemoveTestDirectory(path);
+}
+
+/*
+ * TestCreationBatches
+ *
+ * While the directory opens stall, no more than
+ * kNewDocumentPlugInMaxBulkCreations bulk creations run, and an interactive
+ * creation still gets a thread. Cancelling a batch only cancels its own
+ * creations : the other batch creates all its documents.
+ */
+static void TestCreationBatches()
+{
+	char templatesPath[PATH_MAX], path[PATH_MAX], directory[PATH_MAX];
+	CFURLRef urls[kTestCancelledBatchSize + kTestBatchSize], directoryURL;
+	CreationBatch cancelledBatch = { kTestCancelledBatchSize, kTestCancelledBatchSize, 0 };
+	CreationBatch batch = { kTestBatchSize, kTestBatchSize, 0 };
+	CreationRequest *completed, *request;
+	UInt32 running, mostRunning = 0, cancelled = 0, created = 0;
+	int i, count = kTestCancelledBatchSize + kTestBatchSize;
+	
+	test_check(InstallTestTemplates(templatesPath, sizeof(templatesPath)));
+	test_check(CreateTestDirectories(path, sizeof(path), count, urls));
+	directoryURL = CFURLCreateFromFileSystemRepresentation(NULL, (const UInt8*)path, strlen(path), true);
+	SimulateTestFileSystemCall(kNewDocumentPlugInOpenCall, kTestBatchLatency, 0, 0);
+	
+	for (i = 0; i < count; i++)
+		test_check(SubmitCreationRequest(0, urls[i], kNewDocumentPlugInBulkLane,
+										 (i < kTestCancelledBatchSize) ? &cancelledBatch : &batch, NULL) == noErr);
+	
+	// Watch the bulk creations for half of the latency
+	for (i = 0; i < kTestBatchLatency / 2; i += 5) {
+		running = CountRunningTestCreations(kNewDocumentPlugInBulkLane);
+		if (running > mostRunning)
+			mostRunning = running;
+		usleep(5000);
+	}
+	test_check(mostRunning == kNewDocumentPlugInMaxBulkCreations);
+	
+	test_check(SubmitCreationRequest(0, directoryURL, kNewDocumentPlugInInteractiveLane, NULL, NULL) == noErr);
+	for (i = 0; i < 1000 && CountRunningTestCreations(kNewDocumentPlugInInteractiveLane) == 0; i++)
+		usleep(1000);
+	test_check(CountRunningTestCreations(kNewDocumentPlugInInteractiveLane) == 1);
+	
+	CancelCreationBatch(&cancelledBatch);
+	completed = WaitForTestCreations(count + 1);
+	for (request = completed; request != NULL; request = request->next) {
+		if (request->batch == &cancelledBatch) {
+			test_check(request->status == userCanceledErr);
+			cancelled++;
+		}
+		else {
+			test_check(request->status == noErr);
+			if (request->batch == &batch)
+				created++;
+		}
+	}
+	FreeTestCreations(completed);
+	SimulateTestFileSystemCall(kNewDocumentPlugInOpenCall, 0, 0, 0);
+	test_check(cancelled == kTestCancelledBatchSize && created == kTestBatchSize);
+	
+	for (i = 0; i < count; i++) {
+		snprintf(directory, sizeof(directory), "%s/%d", path, i);
+		test_check(GetTestDocumentSize(directory, "note.txt") == ((i < kTestCancelledBatchSize) ? -1 : kTestTemplateSize));
+	}
+	
+	StopCreationExecutor();
+	
+	for (i = 0; i < count; i++)
+		CFRelease(urls[i]);
+	CFRelease(directoryURL);
+	RemoveTestTemplates(templatesPath);
+	RemoveTestDirectory(path);
+}
+
+/*
+ * SimulateTestFileSystemCall
+ *
+ * Set the simulated latency (in milliseconds) of a file system call, and the
+ * rate at which it fails with the given errno value.
+ */
+static void SimulateTestFileSystemCall(int call, double latency, double errorRate, int error)
+{
+	gSimulatedFileSystem[call].latency = latency;
+	gSimulatedFileSystem[call].jitter = 0;
+	gSimulatedFileSystem[call].errorRate = errorRate;
+	gSimulatedFileSystem[call].error = error;
+}
+
+/*
+ * CompareTestFiles
+ *
+ * Return true if two files have the same contents.
+ */
+static Boolean CompareTestFiles(const char *path, const char *otherPath)
+{
+	char bytes[4096], otherBytes[4096];
+	ssize_t length, otherLength;
+	Boolean same = false;
+	int fd, otherFd;
+	
+	fd = open(path, O_RDONLY);
+	otherFd = open(otherPath, O_RDONLY);
+	if (fd >= 0 && otherFd >= 0) {
+		do {
+			length = read(fd, bytes, sizeof(bytes));
+			otherLength = read(otherFd, otherBytes, sizeof(otherBytes));
+			same = (length >= 0 && length == otherLength && memcmp(bytes, otherBytes, length) == 0);
+		} while (same && length > 0);
+	}
+	
+	if (fd >= 0)
+		close(fd);
+	if (otherFd >= 0)
+		close(otherFd);
+	
+	return same;
+}
+
+/*
+ * IgnoreSimulatedFileSystemPreference
+ *
+ * Stands for LoadSimulatedFileSystem : the "SimulatedFileSystem" preference
+ * of the user doesn't apply to the tests.
+ */
+static void IgnoreSimulatedFileSystemPreference()
+{
+}
+
+#endif